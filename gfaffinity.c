@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "gflog.h"
+#include "gfaffinity.h"
+
+#define MAX_NODES 64
+#define MPOL_PREFERRED_MODE 1   //MPOL_PREFERRED from linux/mempolicy.h
+
+static const char *cpu_dir = "/sys/devices/system/cpu";
+static const char *node_dir = "/sys/devices/system/node";
+
+
+/**************************/
+/* cpu set functions      */
+/**************************/
+
+int gfaff_parse_cpus(const char *list, cpu_set_t *set) {
+
+    CPU_ZERO(set);
+    const char *pos = list;
+    while (*pos != '\0') {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        if (end == pos || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+        long last = first;
+        if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET((int)cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0' && *end != '\n') {
+            return -1;
+        } else {
+            break;
+        }
+        pos = end;
+    }
+    return (CPU_COUNT(set) > 0) ? 0 : -1;
+}
+
+int gfaff_num_cpus(const cpu_set_t *set) {
+    return CPU_COUNT(set);
+}
+
+int gfaff_cpu_at(const cpu_set_t *set, int i) {
+    int ncpus = CPU_COUNT(set);
+    if (ncpus == 0) {
+        return -1;
+    }
+    i %= ncpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && i-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+int gfaff_pin_thread(pthread_t thd, const cpu_set_t *set) {
+    int rc = pthread_setaffinity_np(thd, sizeof(cpu_set_t), set);
+    if (rc) {
+        gflog_error("when attempting to set thread cpu affinity - %d", rc);
+        return -1;
+    }
+    return 0;
+}
+
+int gfaff_pin_thread_cpu(pthread_t thd, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return gfaff_pin_thread(thd, &set);
+}
+
+
+/**************************/
+/* NUMA functions         */
+/**************************/
+
+int gfaff_num_nodes() {
+    int nnodes = 0;
+    char path[256];
+    for (int node = 0; node < MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "%s/node%d", node_dir, node);
+        if (access(path, F_OK) == 0) {
+            nnodes = node + 1;
+        }
+    }
+    return (nnodes > 0) ? nnodes : 1;
+}
+
+int gfaff_cpu_node(int cpu) {
+
+    /* the cpu directory holds a nodeN link to the node it belongs to */
+    char path[256];
+    snprintf(path, sizeof(path), "%s/cpu%d", cpu_dir, cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) == 0) {
+            node = atoi(&ent->d_name[4]);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+int gfaff_current_node() {
+    int cpu = sched_getcpu();
+    return (cpu < 0) ? 0 : gfaff_cpu_node(cpu);
+}
+
+int gfaff_node_cpus(int node, cpu_set_t *set) {
+    char path[256];
+    char list[4096];
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", node_dir, node);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        /* no NUMA support, all cpus are on node 0 */
+        if (node != 0) {
+            return -1;
+        }
+        return sched_getaffinity(0, sizeof(cpu_set_t), set);
+    }
+    char *line = fgets(list, sizeof(list), file);
+    fclose(file);
+    if (line == NULL) {
+        return -1;
+    }
+    return gfaff_parse_cpus(list, set);
+}
+
+int gfaff_bind_mem(void *addr, size_t len, int node) {
+
+    if (node < 0 || node >= MAX_NODES) {
+        return -1;
+    }
+    unsigned long nodemask = 1UL << node;
+    long ret = syscall(SYS_mbind, addr, len, MPOL_PREFERRED_MODE, &nodemask, (unsigned long)MAX_NODES, 0);
+    if (ret != 0 && errno != ENOSYS) {
+        gflog_error("could not set memory policy of memory segment: %s", strerror(errno));
+        return -1;
+    }
+
+    /* first touch allocates the pages under the new policy */
+    long page_sz = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < len; off += (size_t)page_sz) {
+        ((volatile char *)addr)[off] = 0;
+    }
+    return 0;
+}
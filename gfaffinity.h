@@ -0,0 +1,71 @@
+#ifndef __GFAFFINITY_H__
+#define __GFAFFINITY_H__
+
+/*
+ * gfaffinity collects the helpers used to pin threads to cpus and to
+ * place shared memory on the NUMA node of the threads that use it.
+ * Node topology is read from sysfs and memory policy is set with the
+ * mbind system call, so no NUMA library is required.  On machines
+ * without NUMA support everything behaves as a single node 0.
+ */
+
+/* users of the cpu set macros must define _GNU_SOURCE before any include */
+#include <sched.h>
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Parses a cpu list such as "0-3,8,10-11" into set.  Returns 0 on
+ * success and -1 if the list is malformed or names no cpus.
+ */
+int gfaff_parse_cpus(const char *list, cpu_set_t *set);
+
+/*
+ * Returns the number of cpus in the set.
+ */
+int gfaff_num_cpus(const cpu_set_t *set);
+
+/*
+ * Returns the i-th cpu of the set, wrapping around when i exceeds the
+ * number of cpus, for placing threads round-robin over a set.
+ */
+int gfaff_cpu_at(const cpu_set_t *set, int i);
+
+/*
+ * Pins the thread to the cpus of set.  Returns 0 on success.
+ */
+int gfaff_pin_thread(pthread_t thd, const cpu_set_t *set);
+
+/*
+ * Pins the thread to the single cpu.  Returns 0 on success.
+ */
+int gfaff_pin_thread_cpu(pthread_t thd, int cpu);
+
+/*
+ * Returns the number of NUMA nodes of the machine, at least 1.
+ */
+int gfaff_num_nodes();
+
+/*
+ * Returns the NUMA node of the cpu, 0 if it cannot be determined.
+ */
+int gfaff_cpu_node(int cpu);
+
+/*
+ * Returns the NUMA node of the cpu the calling thread runs on.
+ */
+int gfaff_current_node();
+
+/*
+ * Provides the cpus of the NUMA node in set.  Returns 0 on success.
+ */
+int gfaff_node_cpus(int node, cpu_set_t *set);
+
+/*
+ * Sets the memory policy of the mapped region to prefer the NUMA node
+ * and touches every page so it is allocated there.  Returns 0 on
+ * success.
+ */
+int gfaff_bind_mem(void *addr, size_t len, int node);
+
+#endif
@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "gflog.h"
+#include "steque.h"
+#include "gfasync.h"
+
+#define EVENTS_MAX 64
+#define FREE_STACKS 64
+
+#define TASK_RUNNABLE 0
+#define TASK_WAITING 1
+#define TASK_DONE 2
+
+
+
+/*------------*/
+/* structures */
+
+typedef struct _gfasync_loop_t gfasync_loop_t;
+
+/* registration of one descriptor a coroutine waits on, lives on the
+ * waiting coroutine's stack */
+typedef struct _gfasync_wait_t {
+    struct _gfasync_task_t *task;
+    int idx;                      //index into the task's pollfd array
+    int added;                    //set once registered with epoll
+} gfasync_wait_t;
+
+typedef struct _gfasync_task_t {
+    ucontext_t uctx;
+    char *stack;                  //mapping holding the guard page and the stack
+    void *item;                   //caller's work item
+    int state;                    //TASK_RUNNABLE, TASK_WAITING or TASK_DONE
+    struct pollfd *fds;           //descriptors being waited on
+    gfasync_wait_t *waits;        //their epoll registrations
+    int nfds;
+    int nready;                   //descriptors with events when woken
+    uint64_t wake_us;             //monotonic time a sleep or poll timeout ends
+    int slp_idx;                  //position in the sleepers, -1 if not sleeping
+} gfasync_task_t;
+
+struct _gfasync_loop_t {
+    gfasync_t *as;
+    int iloop;
+    pthread_t thd;
+    int epfd;
+    int evfd;                     //wakes the loop for submitted items
+    ucontext_t sched_uctx;        //context of the scheduler, resumed when a coroutine suspends
+    gfasync_task_t *cur;          //coroutine running, NULL while in the scheduler
+    steque_t runq;                //coroutines ready to run
+    gfasync_task_t **sleepers;    //coroutines with a wake time, unordered
+    int nsleepers;
+    int slp_cap;
+    char *free_stacks[FREE_STACKS];
+    int nfree_stacks;
+    pthread_mutex_t lock;         //protects pending
+    steque_t pending;             //items submitted from other threads
+    int nload;                    //coroutines pending or running on the loop
+};
+
+struct _gfasync_t {
+    gfasync_func_t func;          //handles work items
+    void *arg;                    //argument to func and thd_init
+    gfasync_thd_init_t thd_init;  //optional per thread setup
+    size_t stack_sz;
+    size_t page_sz;
+    int nloops;
+    gfasync_loop_t *loops;
+    int running;                  //cleared by gfasync_destroy
+    int nlive;                    //loop threads still running, the last one frees the loops
+    int ntasks;
+    int peak_tasks;
+    unsigned long nspawned;
+    unsigned long nswitches;
+};
+
+static __thread gfasync_loop_t *tls_loop = NULL;
+
+
+/*************************/
+/* function declarations */
+
+static uint64_t gfasync_now_us();
+static void *gfasync_loop_main(void *arg);
+static void gfasync_task_main();
+static void gfasync_take_pending(gfasync_loop_t *loop);
+static void gfasync_run(gfasync_loop_t *loop, gfasync_task_t *task);
+static void gfasync_suspend(gfasync_loop_t *loop);
+static void gfasync_end_wait(gfasync_loop_t *loop, gfasync_task_t *task);
+static void gfasync_wake(gfasync_loop_t *loop, gfasync_task_t *task);
+static void gfasync_add_sleeper(gfasync_loop_t *loop, gfasync_task_t *task, uint64_t wake_us);
+static void gfasync_del_sleeper(gfasync_loop_t *loop, gfasync_task_t *task);
+static int gfasync_wait_events(gfasync_loop_t *loop, struct epoll_event *evs, int64_t to_us);
+static char *gfasync_stack_alloc(gfasync_loop_t *loop);
+static void gfasync_stack_free(gfasync_loop_t *loop, char *stack);
+static void gfasync_free(gfasync_t *as);
+
+
+/*****************/
+/* API functions */
+
+gfasync_t *gfasync_create(int nloops, size_t stack_sz, gfasync_func_t func, void *arg) {
+
+    if (nloops < 1) {
+        nloops = 1;
+    }
+    if (stack_sz == 0) {
+        stack_sz = GFASYNC_STACK_SZ;
+    }
+
+    gfasync_t *as = malloc(sizeof(gfasync_t));
+    bzero(as, sizeof(*as));
+    as->func = func;
+    as->arg = arg;
+    as->page_sz = (size_t) sysconf(_SC_PAGESIZE);
+    as->stack_sz = (stack_sz + as->page_sz - 1) / as->page_sz * as->page_sz;
+    as->nloops = nloops;
+    as->loops = calloc((size_t) nloops, sizeof(gfasync_loop_t));
+
+    for (int i = 0; i < nloops; i++) {
+        gfasync_loop_t *loop = &as->loops[i];
+        loop->as = as;
+        loop->iloop = i;
+        steque_init(&loop->runq);
+        steque_init(&loop->pending);
+        pthread_mutex_init(&loop->lock, NULL);
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        loop->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (loop->epfd < 0 || loop->evfd < 0 || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->evfd, &ev) != 0) {
+            gflog_error("when attempting to create event loop: %s", strerror(errno));
+            as->nloops = i + 1;
+            gfasync_free(as);
+            return NULL;
+        }
+    }
+    return as;
+}
+
+void gfasync_set_thd_init(gfasync_t *as, gfasync_thd_init_t init) {
+    as->thd_init = init;
+}
+
+int gfasync_start(gfasync_t *as) {
+
+    as->running = 1;
+    for (int i = 0; i < as->nloops; i++) {
+        gfasync_loop_t *loop = &as->loops[i];
+        __atomic_add_fetch(&as->nlive, 1, __ATOMIC_ACQ_REL);
+        int rc = pthread_create(&loop->thd, NULL, gfasync_loop_main, loop);
+        if (rc) {
+            gflog_error("when attempting to create event loop thread %d - %d", i, rc);
+            __atomic_sub_fetch(&as->nlive, 1, __ATOMIC_ACQ_REL);
+            return -1;
+        }
+        pthread_detach(loop->thd);
+    }
+    return 0;
+}
+
+void gfasync_submit(gfasync_t *as, void *item) {
+
+    /* the least loaded loop, the count is only a hint so no lock is taken */
+    gfasync_loop_t *loop = &as->loops[0];
+    int min_load = __atomic_load_n(&loop->nload, __ATOMIC_RELAXED);
+    for (int i = 1; i < as->nloops; i++) {
+        int load = __atomic_load_n(&as->loops[i].nload, __ATOMIC_RELAXED);
+        if (load < min_load) {
+            loop = &as->loops[i];
+            min_load = load;
+        }
+    }
+    __atomic_add_fetch(&loop->nload, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&loop->lock);
+    steque_enqueue(&loop->pending, item);
+    pthread_mutex_unlock(&loop->lock);
+
+    uint64_t one = 1;
+    if (write(loop->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        gflog_error("when attempting to wake event loop: %s", strerror(errno));
+    }
+}
+
+void gfasync_get_stats(gfasync_t *as, gfasync_stats_t *stats) {
+    stats->nloops = as->nloops;
+    stats->ntasks = __atomic_load_n(&as->ntasks, __ATOMIC_RELAXED);
+    stats->peak_tasks = __atomic_load_n(&as->peak_tasks, __ATOMIC_RELAXED);
+    stats->nspawned = __atomic_load_n(&as->nspawned, __ATOMIC_RELAXED);
+    stats->nswitches = __atomic_load_n(&as->nswitches, __ATOMIC_RELAXED);
+}
+
+void gfasync_print_stats(gfasync_t *as, const char *name) {
+    gfasync_stats_t stats;
+    gfasync_get_stats(as, &stats);
+    fprintf(stderr, "[INFO] %s loops: %d, coroutines %d (peak %d), started %lu, switches %lu\n",
+            name, stats.nloops, stats.ntasks, stats.peak_tasks, stats.nspawned, stats.nswitches);
+}
+
+void gfasync_destroy(gfasync_t *as) {
+
+    int was_running = __atomic_exchange_n(&as->running, 0, __ATOMIC_ACQ_REL);
+    if (!was_running) {
+        gfasync_free(as);
+        return;
+    }
+
+    /* loops exit after their current round, the last one frees them */
+    uint64_t one = 1;
+    for (int i = 0; i < as->nloops; i++) {
+        if (write(as->loops[i].evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            gflog_error("when attempting to wake event loop: %s", strerror(errno));
+        }
+    }
+}
+
+int gfasync_in_task() {
+    return tls_loop != NULL && tls_loop->cur != NULL;
+}
+
+int gfasync_poll(struct pollfd *fds, int nfds, int timeout_ms) {
+
+    if (!gfasync_in_task()) {
+        return poll(fds, (nfds_t) nfds, timeout_ms);
+    }
+
+    gfasync_loop_t *loop = tls_loop;
+    gfasync_task_t *task = loop->cur;
+    gfasync_wait_t waits[nfds > 0 ? nfds : 1];
+
+    /* poll and epoll share the event bit values on linux */
+    int nready = 0;
+    for (int i = 0; i < nfds; i++) {
+        fds[i].revents = 0;
+        waits[i].task = task;
+        waits[i].idx = i;
+        waits[i].added = 0;
+        if (fds[i].fd < 0) {
+            continue;
+        }
+        struct epoll_event ev = {.events = (uint32_t) fds[i].events, .data.ptr = &waits[i]};
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) == 0) {
+            waits[i].added = 1;
+        } else if (errno == EPERM) {
+            /* regular files cannot be polled and are always ready */
+            fds[i].revents = fds[i].events & (POLLIN | POLLOUT);
+            nready++;
+        } else {
+            fds[i].revents = POLLNVAL;
+            nready++;
+        }
+    }
+
+    task->fds = fds;
+    task->waits = waits;
+    task->nfds = nfds;
+    task->nready = 0;
+    if (nready == 0) {
+        task->state = TASK_WAITING;
+        if (timeout_ms >= 0) {
+            gfasync_add_sleeper(loop, task, gfasync_now_us() + (uint64_t) timeout_ms * 1000);
+        }
+        gfasync_suspend(loop);
+        return task->nready;
+    }
+
+    /* some descriptor is ready already, undo the registrations */
+    gfasync_end_wait(loop, task);
+    return nready;
+}
+
+void gfasync_sleep_us(unsigned int usec) {
+
+    if (!gfasync_in_task()) {
+        struct timespec ts = {(time_t)(usec / 1000000), (long)(usec % 1000000) * 1000};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+            ;
+        }
+        return;
+    }
+
+    gfasync_loop_t *loop = tls_loop;
+    gfasync_task_t *task = loop->cur;
+    task->nfds = 0;
+    task->state = TASK_WAITING;
+    gfasync_add_sleeper(loop, task, gfasync_now_us() + usec);
+    gfasync_suspend(loop);
+}
+
+void gfasync_yield() {
+    if (!gfasync_in_task()) {
+        return;
+    }
+    gfasync_loop_t *loop = tls_loop;
+    steque_enqueue(&loop->runq, loop->cur);
+    gfasync_suspend(loop);
+}
+
+
+/*********************/
+/* private functions */
+
+uint64_t gfasync_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void *gfasync_loop_main(void *arg) {
+
+    gfasync_loop_t *loop = (gfasync_loop_t *) arg;
+    gfasync_t *as = loop->as;
+    tls_loop = loop;
+    if (as->thd_init != NULL) {
+        as->thd_init(loop->iloop, as->arg);
+    }
+
+    struct epoll_event evs[EVENTS_MAX];
+    while (__atomic_load_n(&as->running, __ATOMIC_ACQUIRE)) {
+
+        gfasync_take_pending(loop);
+
+        /* run the coroutines ready now, ones they make ready run next round */
+        int nrun = steque_size(&loop->runq);
+        while (nrun-- > 0) {
+            gfasync_run(loop, (gfasync_task_t *) steque_pop(&loop->runq));
+        }
+
+        /* wait for descriptors, the nearest sleeper or submitted items */
+        uint64_t now = gfasync_now_us();
+        int64_t to_us = -1;
+        if (!steque_isempty(&loop->runq)) {
+            to_us = 0;
+        } else {
+            for (int i = 0; i < loop->nsleepers; i++) {
+                uint64_t wake = loop->sleepers[i]->wake_us;
+                int64_t left = (wake > now) ? (int64_t)(wake - now) : 0;
+                if (to_us < 0 || left < to_us) {
+                    to_us = left;
+                }
+            }
+        }
+        int nevs = gfasync_wait_events(loop, evs, to_us);
+
+        for (int i = 0; i < nevs; i++) {
+            if (evs[i].data.ptr == NULL) {
+                uint64_t cnt;
+                while (read(loop->evfd, &cnt, sizeof(cnt)) > 0) {
+                    ;
+                }
+                continue;
+            }
+            gfasync_wait_t *wait = (gfasync_wait_t *) evs[i].data.ptr;
+            gfasync_task_t *task = wait->task;
+            if (task->state == TASK_WAITING) {
+                task->fds[wait->idx].revents = (short) evs[i].events;
+                gfasync_wake(loop, task);
+            }
+        }
+
+        now = gfasync_now_us();
+        for (int i = 0; i < loop->nsleepers; ) {
+            gfasync_task_t *task = loop->sleepers[i];
+            if (task->wake_us <= now) {
+                gfasync_wake(loop, task); //moves another sleeper into slot i
+            } else {
+                i++;
+            }
+        }
+    }
+
+    /* coroutines still in flight are dropped */
+    gflog_debug("event loop %d exiting with %d coroutines", loop->iloop, loop->nload);
+    tls_loop = NULL;
+    if (__atomic_sub_fetch(&as->nlive, 1, __ATOMIC_ACQ_REL) == 0) {
+        gfasync_free(as);
+    }
+    return NULL;
+}
+
+void gfasync_task_main() {
+    gfasync_loop_t *loop = tls_loop;
+    gfasync_task_t *task = loop->cur;
+    loop->as->func(task->item, loop->as->arg);
+    task->state = TASK_DONE;
+    /* returning resumes the scheduler through uc_link */
+}
+
+void gfasync_take_pending(gfasync_loop_t *loop) {
+
+    gfasync_t *as = loop->as;
+    pthread_mutex_lock(&loop->lock);
+    while (!steque_isempty(&loop->pending)) {
+        void *item = steque_pop(&loop->pending);
+        pthread_mutex_unlock(&loop->lock);
+
+        gfasync_task_t *task = malloc(sizeof(gfasync_task_t));
+        bzero(task, sizeof(*task));
+        task->item = item;
+        task->slp_idx = -1;
+        task->stack = gfasync_stack_alloc(loop);
+        if (task->stack == NULL || getcontext(&task->uctx) != 0) {
+            gflog_error("could not create coroutine, handling item on the loop thread");
+            if (task->stack != NULL) {
+                gfasync_stack_free(loop, task->stack);
+            }
+            free(task);
+            as->func(item, as->arg);
+            __atomic_sub_fetch(&loop->nload, 1, __ATOMIC_RELAXED);
+        } else {
+            task->uctx.uc_stack.ss_sp = task->stack + as->page_sz;
+            task->uctx.uc_stack.ss_size = as->stack_sz;
+            task->uctx.uc_link = &loop->sched_uctx;
+            makecontext(&task->uctx, gfasync_task_main, 0);
+            steque_enqueue(&loop->runq, task);
+
+            __atomic_add_fetch(&as->nspawned, 1, __ATOMIC_RELAXED);
+            int ntasks = __atomic_add_fetch(&as->ntasks, 1, __ATOMIC_RELAXED);
+            int peak = __atomic_load_n(&as->peak_tasks, __ATOMIC_RELAXED);
+            while (ntasks > peak && !__atomic_compare_exchange_n(&as->peak_tasks, &peak, ntasks, 0,
+                                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                ;
+            }
+        }
+
+        pthread_mutex_lock(&loop->lock);
+    }
+    pthread_mutex_unlock(&loop->lock);
+}
+
+void gfasync_run(gfasync_loop_t *loop, gfasync_task_t *task) {
+
+    task->state = TASK_RUNNABLE;
+    loop->cur = task;
+    __atomic_add_fetch(&loop->as->nswitches, 1, __ATOMIC_RELAXED);
+    swapcontext(&loop->sched_uctx, &task->uctx);
+    loop->cur = NULL;
+
+    if (task->state == TASK_DONE) {
+        gfasync_stack_free(loop, task->stack);
+        free(task);
+        __atomic_sub_fetch(&loop->as->ntasks, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&loop->nload, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void gfasync_suspend(gfasync_loop_t *loop) {
+    gfasync_task_t *task = loop->cur;
+    swapcontext(&task->uctx, &loop->sched_uctx);
+}
+
+/* drops the epoll registrations and timeout of a wait */
+void gfasync_end_wait(gfasync_loop_t *loop, gfasync_task_t *task) {
+
+    task->nready = 0;
+    for (int i = 0; i < task->nfds; i++) {
+        if (task->waits[i].added) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, task->fds[i].fd, NULL);
+            task->waits[i].added = 0;
+        }
+        if (task->fds[i].revents != 0) {
+            task->nready++;
+        }
+    }
+    task->nfds = 0;
+    gfasync_del_sleeper(loop, task);
+}
+
+/* ends the wait of a coroutine and queues it to run */
+void gfasync_wake(gfasync_loop_t *loop, gfasync_task_t *task) {
+    gfasync_end_wait(loop, task);
+    task->state = TASK_RUNNABLE;
+    steque_enqueue(&loop->runq, task);
+}
+
+void gfasync_add_sleeper(gfasync_loop_t *loop, gfasync_task_t *task, uint64_t wake_us) {
+    if (loop->nsleepers == loop->slp_cap) {
+        loop->slp_cap = (loop->slp_cap > 0) ? 2 * loop->slp_cap : 64;
+        loop->sleepers = realloc(loop->sleepers, (size_t) loop->slp_cap * sizeof(gfasync_task_t *));
+    }
+    task->wake_us = wake_us;
+    task->slp_idx = loop->nsleepers;
+    loop->sleepers[loop->nsleepers++] = task;
+}
+
+void gfasync_del_sleeper(gfasync_loop_t *loop, gfasync_task_t *task) {
+    if (task->slp_idx < 0) {
+        return;
+    }
+    gfasync_task_t *last = loop->sleepers[--loop->nsleepers];
+    loop->sleepers[task->slp_idx] = last;
+    last->slp_idx = task->slp_idx;
+    task->slp_idx = -1;
+}
+
+/* waits up to to_us microseconds, or without limit if negative */
+int gfasync_wait_events(gfasync_loop_t *loop, struct epoll_event *evs, int64_t to_us) {
+
+    int nevs;
+    if (to_us < 0) {
+        nevs = epoll_wait(loop->epfd, evs, EVENTS_MAX, -1);
+    } else {
+        /* sleeps are often well under a millisecond, e.g. when polling the
+         * cache, so the timeout is given with microsecond precision */
+        struct timespec ts = {(time_t)(to_us / 1000000), (long)(to_us % 1000000) * 1000};
+        nevs = epoll_pwait2(loop->epfd, evs, EVENTS_MAX, &ts, NULL);
+        if (nevs < 0 && errno == ENOSYS) {
+            nevs = epoll_wait(loop->epfd, evs, EVENTS_MAX, (int)((to_us + 999) / 1000));
+        }
+    }
+    if (nevs < 0) {
+        if (errno != EINTR) {
+            gflog_error("when waiting for events: %s", strerror(errno));
+        }
+        return 0;
+    }
+    return nevs;
+}
+
+char *gfasync_stack_alloc(gfasync_loop_t *loop) {
+
+    if (loop->nfree_stacks > 0) {
+        return loop->free_stacks[--loop->nfree_stacks];
+    }
+
+    /* the lowest page is left inaccessible so an overflow faults instead
+     * of corrupting the neighbouring stack */
+    gfasync_t *as = loop->as;
+    char *stack = mmap(NULL, as->stack_sz + as->page_sz, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        gflog_error("when attempting to allocate coroutine stack: %s", strerror(errno));
+        return NULL;
+    }
+    if (mprotect(stack, as->page_sz, PROT_NONE) != 0) {
+        gflog_error("when attempting to protect coroutine stack: %s", strerror(errno));
+    }
+    return stack;
+}
+
+void gfasync_stack_free(gfasync_loop_t *loop, char *stack) {
+    if (loop->nfree_stacks < FREE_STACKS) {
+        loop->free_stacks[loop->nfree_stacks++] = stack;
+    } else {
+        munmap(stack, loop->as->stack_sz + loop->as->page_sz);
+    }
+}
+
+void gfasync_free(gfasync_t *as) {
+    for (int i = 0; i < as->nloops; i++) {
+        gfasync_loop_t *loop = &as->loops[i];
+        while (loop->nfree_stacks > 0) {
+            munmap(loop->free_stacks[--loop->nfree_stacks], as->stack_sz + as->page_sz);
+        }
+        if (loop->epfd >= 0) close(loop->epfd);
+        if (loop->evfd >= 0) close(loop->evfd);
+        steque_destroy(&loop->runq);
+        steque_destroy(&loop->pending);
+        pthread_mutex_destroy(&loop->lock);
+        free(loop->sleepers);
+    }
+    free(as->loops);
+    free(as);
+}
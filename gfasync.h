@@ -0,0 +1,105 @@
+#ifndef __GFASYNC_H__
+#define __GFASYNC_H__
+
+/*
+ * gfasync runs work items as coroutines on a fixed set of event loop
+ * threads.  Each item gets its own stack and runs until it waits on file
+ * descriptors, sleeps or yields, at which point the loop switches to
+ * another ready coroutine and resumes the waiting one once epoll reports
+ * its descriptors ready or its timeout expires.  One loop thread can so
+ * keep hundreds of blocking style transfers in flight.
+ *
+ * The wait functions may be called from any thread.  Outside of a
+ * coroutine they simply block the calling thread, so code written
+ * against them runs unchanged on plain worker threads.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+
+#define GFASYNC_STACK_SZ (256 * 1024)
+
+/* handles one work item, called on its own coroutine */
+typedef void (*gfasync_func_t)(void *item, void *arg);
+
+/* called by each loop thread before it runs its first coroutine */
+typedef void (*gfasync_thd_init_t)(int iloop, void *arg);
+
+typedef struct _gfasync_t gfasync_t;
+
+typedef struct _gfasync_stats_t {
+    int nloops;                   //event loop threads
+    int ntasks;                   //coroutines started and not yet finished
+    int peak_tasks;               //largest number of coroutines at once
+    unsigned long nspawned;       //coroutines started so far
+    unsigned long nswitches;      //switches into coroutines so far
+} gfasync_stats_t;
+
+/*
+ * Creates nloops event loops that run func for every submitted item on
+ * a coroutine with a stack of stack_sz bytes, 0 for GFASYNC_STACK_SZ.
+ * No threads are started until gfasync_start is called.  Returns NULL
+ * on failure.
+ */
+gfasync_t *gfasync_create(int nloops, size_t stack_sz, gfasync_func_t func, void *arg);
+
+/*
+ * Sets a function run by each loop thread, e.g. to pin it to a cpu.
+ * Must be called before gfasync_start.
+ */
+void gfasync_set_thd_init(gfasync_t *as, gfasync_thd_init_t init);
+
+/*
+ * Starts the loop threads.  Returns 0 on success.
+ */
+int gfasync_start(gfasync_t *as);
+
+/*
+ * Hands an item to the loop with the fewest coroutines.  If no stack can
+ * be allocated the item is handled directly on the loop thread.
+ */
+void gfasync_submit(gfasync_t *as, void *item);
+
+/*
+ * Provides a snapshot of the loop statistics.
+ */
+void gfasync_get_stats(gfasync_t *as, gfasync_stats_t *stats);
+
+/*
+ * Prints the statistics to stderr, prefixed with name.
+ */
+void gfasync_print_stats(gfasync_t *as, const char *name);
+
+/*
+ * Stops the loops after the current round.  Coroutines still in flight
+ * are dropped without being resumed.
+ */
+void gfasync_destroy(gfasync_t *as);
+
+/*
+ * Returns non-zero when called on a coroutine.
+ */
+int gfasync_in_task();
+
+/*
+ * Waits like poll(2) for events on the descriptors, at most timeout_ms
+ * milliseconds, or without limit if negative.  On a coroutine only the
+ * coroutine is suspended.  Returns the number of descriptors with
+ * revents set, 0 on timeout, -1 on error.
+ */
+int gfasync_poll(struct pollfd *fds, int nfds, int timeout_ms);
+
+/*
+ * Sleeps for usec microseconds, suspending only the coroutine if called
+ * on one.
+ */
+void gfasync_sleep_us(unsigned int usec);
+
+/*
+ * Lets the other ready coroutines of the loop run before continuing.
+ * Does nothing outside of a coroutine.
+ */
+void gfasync_yield();
+
+#endif
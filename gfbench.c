@@ -0,0 +1,198 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "gfbench.h"
+
+/* percentiles reported for every latency */
+#define NPCTS 4
+static const double pcts[NPCTS] = {50.0, 90.0, 99.0, 99.9};
+static const char *pct_names[NPCTS] = {"p50", "p90", "p99", "p99.9"};
+static const char *pct_cols[NPCTS] = {"p50", "p90", "p99", "p999"};
+
+static const char *lat_names[GFBENCH_NLATS] = {"connect", "ttfb", "total"};
+static const char *stat_names[GFBENCH_NSTATS] = {"OK", "FILE_NOT_FOUND", "ERROR", "INVALID"};
+static const char *stat_cols[GFBENCH_NSTATS] = {"ok", "file_not_found", "error", "invalid"};
+
+static gfbench_slot_t *g_slots = NULL;
+static int g_nslots = 0;
+static int g_csv_hdr = 0;                   //CSV header row written
+
+
+int gfbench_init(int nslots) {
+    void *slots;
+    if (posix_memalign(&slots, 64, sizeof(gfbench_slot_t) * (size_t) nslots) != 0) {
+        return -1;
+    }
+    g_slots = (gfbench_slot_t *) slots;
+    g_nslots = nslots;
+    gfbench_reset();
+    return 0;
+}
+
+void gfbench_reset() {
+    memset(g_slots, 0, sizeof(gfbench_slot_t) * (size_t) g_nslots);
+}
+
+void gfbench_record(int slot, int status, uint64_t nbytes, uint64_t conn_us, uint64_t ttfb_us, uint64_t total_us) {
+    gfbench_slot_t *s = &g_slots[slot];
+    s->nreqs++;
+    s->nbytes += nbytes;
+    if (status >= 0 && status < GFBENCH_NSTATS) {
+        s->nstats[status]++;
+    }
+    if (conn_us > 0) {
+        gfhist_add(&s->hists[GFBENCH_CONNECT], conn_us);
+    }
+    if (ttfb_us > 0) {
+        gfhist_add(&s->hists[GFBENCH_TTFB], ttfb_us);
+    }
+    gfhist_add(&s->hists[GFBENCH_TOTAL], total_us);
+}
+
+/* writes a string as a JSON string, dropping control characters */
+static void put_json_str(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', out);
+        } else if ((unsigned char) *str < 0x20) {
+            continue;
+        }
+        fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+static void report_text(FILE *out, const gfbench_slot_t *tot, const char *label, double secs) {
+    const char *sep = (label[0] != '\0') ? " " : "";
+    fprintf(out, "[INFO] bench%s%s: %lu requests in %.3f s, %.1f requests/s, %.2f MB/s\n", sep, label,
+            (unsigned long) tot->nreqs, secs, (double) tot->nreqs / secs, (double) tot->nbytes / secs / 1e6);
+    fprintf(out, "[INFO] bench%s%s status:", sep, label);
+    for (int st = 0; st < GFBENCH_NSTATS; st++) {
+        fprintf(out, " %s %lu", stat_names[st], (unsigned long) tot->nstats[st]);
+    }
+    fputc('\n', out);
+    for (int lat = 0; lat < GFBENCH_NLATS; lat++) {
+        const gfhist_t *hist = &tot->hists[lat];
+        fprintf(out, "[INFO] bench%s%s %s latency: avg %lu us", sep, label, lat_names[lat],
+                (unsigned long) gfhist_mean(hist));
+        for (int ipct = 0; ipct < NPCTS; ipct++) {
+            fprintf(out, ", %s %lu us", pct_names[ipct], (unsigned long) gfhist_percentile(hist, pcts[ipct]));
+        }
+        fprintf(out, ", max %lu us\n", (unsigned long) hist->max);
+    }
+}
+
+static void report_json(FILE *out, const gfbench_slot_t *tot, const char *label, double secs) {
+    fprintf(out, "{\"label\":");
+    put_json_str(out, label);
+    fprintf(out, ",\"requests\":%lu,\"seconds\":%.6f,\"requests_per_s\":%.3f,\"bytes\":%lu,\"mb_per_s\":%.3f,\"status\":{",
+            (unsigned long) tot->nreqs, secs, (double) tot->nreqs / secs, (unsigned long) tot->nbytes,
+            (double) tot->nbytes / secs / 1e6);
+    for (int st = 0; st < GFBENCH_NSTATS; st++) {
+        fprintf(out, "%s\"%s\":%lu", (st > 0) ? "," : "", stat_names[st], (unsigned long) tot->nstats[st]);
+    }
+    fprintf(out, "},\"latency_us\":{");
+    for (int lat = 0; lat < GFBENCH_NLATS; lat++) {
+        const gfhist_t *hist = &tot->hists[lat];
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"mean\":%lu", (lat > 0) ? "," : "", lat_names[lat],
+                (unsigned long) hist->nvals, (unsigned long) gfhist_mean(hist));
+        for (int ipct = 0; ipct < NPCTS; ipct++) {
+            fprintf(out, ",\"%s\":%lu", pct_cols[ipct], (unsigned long) gfhist_percentile(hist, pcts[ipct]));
+        }
+        fprintf(out, ",\"max\":%lu}", (unsigned long) hist->max);
+    }
+    fprintf(out, "}}\n");
+}
+
+static void report_csv(FILE *out, const gfbench_slot_t *tot, const char *label, double secs) {
+    if (!g_csv_hdr) {
+        g_csv_hdr = 1;
+        fprintf(out, "label,requests,seconds,requests_per_s,bytes,mb_per_s");
+        for (int st = 0; st < GFBENCH_NSTATS; st++) {
+            fprintf(out, ",%s", stat_cols[st]);
+        }
+        for (int lat = 0; lat < GFBENCH_NLATS; lat++) {
+            fprintf(out, ",%s_mean_us", lat_names[lat]);
+            for (int ipct = 0; ipct < NPCTS; ipct++) {
+                fprintf(out, ",%s_%s_us", lat_names[lat], pct_cols[ipct]);
+            }
+            fprintf(out, ",%s_max_us", lat_names[lat]);
+        }
+        fputc('\n', out);
+    }
+
+    /* labels are option=value pairs, quoted in case a value holds a comma */
+    fputc('"', out);
+    for (const char *c = label; *c != '\0'; c++) {
+        if (*c == '"') {
+            fputc('"', out);
+        }
+        fputc(*c, out);
+    }
+    fprintf(out, "\",%lu,%.6f,%.3f,%lu,%.3f", (unsigned long) tot->nreqs, secs, (double) tot->nreqs / secs,
+            (unsigned long) tot->nbytes, (double) tot->nbytes / secs / 1e6);
+    for (int st = 0; st < GFBENCH_NSTATS; st++) {
+        fprintf(out, ",%lu", (unsigned long) tot->nstats[st]);
+    }
+    for (int lat = 0; lat < GFBENCH_NLATS; lat++) {
+        const gfhist_t *hist = &tot->hists[lat];
+        fprintf(out, ",%lu", (unsigned long) gfhist_mean(hist));
+        for (int ipct = 0; ipct < NPCTS; ipct++) {
+            fprintf(out, ",%lu", (unsigned long) gfhist_percentile(hist, pcts[ipct]));
+        }
+        fprintf(out, ",%lu", (unsigned long) hist->max);
+    }
+    fputc('\n', out);
+}
+
+void gfbench_report(FILE *out, int format, const char *label, double secs) {
+
+    gfbench_slot_t tot_slot;
+    gfbench_slot_t *tot = &tot_slot;
+    memset(tot, 0, sizeof(*tot));
+    for (int slot = 0; slot < g_nslots; slot++) {
+        const gfbench_slot_t *s = &g_slots[slot];
+        tot->nreqs += s->nreqs;
+        tot->nbytes += s->nbytes;
+        for (int st = 0; st < GFBENCH_NSTATS; st++) {
+            tot->nstats[st] += s->nstats[st];
+        }
+        for (int lat = 0; lat < GFBENCH_NLATS; lat++) {
+            gfhist_merge(&tot->hists[lat], &s->hists[lat]);
+        }
+    }
+    if (secs <= 0.0) {
+        secs = 1e-9;
+    }
+
+    switch (format) {
+        case GFBENCH_JSON:
+            report_json(out, tot, label, secs);
+            break;
+        case GFBENCH_CSV:
+            report_csv(out, tot, label, secs);
+            break;
+        default:
+            report_text(out, tot, label, secs);
+            break;
+    }
+    fflush(out);
+}
+
+int gfbench_parse_format(const char *name) {
+    if (strcmp(name, "text") == 0) {
+        return GFBENCH_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        return GFBENCH_JSON;
+    } else if (strcmp(name, "csv") == 0) {
+        return GFBENCH_CSV;
+    }
+    return -1;
+}
+
+void gfbench_cleanup() {
+    free(g_slots);
+    g_slots = NULL;
+    g_nslots = 0;
+}
@@ -0,0 +1,72 @@
+#ifndef __GFBENCH_H__
+#define __GFBENCH_H__
+
+/*
+ * gfbench collects the results of a benchmark run of gfclient_download.
+ * Every client thread records its requests into a slot of its own, with
+ * latency histograms of connecting, the first response byte and the whole
+ * request, and counts of the response statuses.  The slots are merged
+ * when the run is reported, as text, a JSON object per line or CSV rows.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "gfhist.h"
+
+/* report formats */
+#define GFBENCH_TEXT 0
+#define GFBENCH_JSON 1
+#define GFBENCH_CSV 2
+
+/* latencies, in microseconds */
+#define GFBENCH_CONNECT 0        //start of the request until connected
+#define GFBENCH_TTFB 1           //start of the request until the first response byte
+#define GFBENCH_TOTAL 2          //whole request
+#define GFBENCH_NLATS 3
+
+/* response statuses counted, in the order of gfstatus_t */
+#define GFBENCH_NSTATS 4
+
+typedef struct _gfbench_slot_t {
+    uint64_t nreqs;                         //requests recorded
+    uint64_t nbytes;                        //bytes received
+    uint64_t nstats[GFBENCH_NSTATS];        //requests per response status
+    gfhist_t hists[GFBENCH_NLATS];
+} __attribute__((aligned(64))) gfbench_slot_t;
+
+/*
+ * Allocates nslots slots, one per thread recording.  Returns -1 if they
+ * cannot be allocated.
+ */
+int gfbench_init(int nslots);
+
+/*
+ * Clears the slots for a new run.  Not thread safe, call it between runs.
+ */
+void gfbench_reset();
+
+/*
+ * Records a request on a slot, which only the calling thread may write.
+ * Connect and first byte latencies of 0 are taken as not reached and left
+ * out of their histograms.
+ */
+void gfbench_record(int slot, int status, uint64_t nbytes, uint64_t conn_us, uint64_t ttfb_us, uint64_t total_us);
+
+/*
+ * Merges the slots and writes the run, which took secs seconds, to out in
+ * the given format.  label names the run, e.g. the value of a sweep, and
+ * may be empty.  CSV output starts with a header row on the first call.
+ */
+void gfbench_report(FILE *out, int format, const char *label, double secs);
+
+/*
+ * Returns the GFBENCH_* format named text, json or csv, -1 if unknown.
+ */
+int gfbench_parse_format(const char *name);
+
+/*
+ * Frees the slots.
+ */
+void gfbench_cleanup();
+
+#endif
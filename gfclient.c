@@ -1,46 +1,160 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h> 
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <string.h>
 #include <netdb.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <zlib.h>
 
 #include "gfclient.h"
+#include "gflen.h"
+#include "gflog.h"
 
 #define BUFSIZE 4096
-#define SOCKTO 50
-
-static const int dbg = 1;
+#define RCV_BUF_SZ (64 * 1024)                  //default size of the receive buffer
+#define SPLICE_PIPE_SZ (1024 * 1024)            //pipe a body is spliced through on its way to the sink
+
+/* default response deadlines in milliseconds */
+#define HDR_TO_MS 30000
+#define IDLE_TO_MS 15000
+#define XFR_TO_MS 0
+
+/* outcomes of passing received bytes to the response parser */
+#define GFC_MORE 0                              //more of the response is expected
+#define GFC_DONE 1                              //response complete, or ended by its header
+#define GFC_FAIL -1                             //body could not be decoded
+
+/* steps of a transfer driven by a multi handle */
+#define GFC_PH_CONNECT 0
+#define GFC_PH_SEND 1
+#define GFC_PH_RECV 2
+#define GFC_PH_DONE 3
+
+/* resolved server names are kept for this long, in an array of this size */
+#define DNS_TTL_MS 60000
+#define DNS_CACHE_SZ 64
+#define GFC_MAX_ADDRS 4                         //addresses kept per name
+
+#define MULTI_MAX_EVENTS 256                    //events handled per epoll_wait
+#define MULTI_MAX_RECVS 4                       //reads per ready socket before moving on to the next
+#define MULTI_SWEEP_MS 50                       //deadlines of multi transfers are checked this often
 
 /*-----------------*/
 /* local constants */
 
 static const char *scheme = "GETFILE";
 static const char *mthd_get = "GET";
-//static const char *mthd_head = "HEAD";
+static const char *mthd_head = "HEAD";
 static const char *stat_ok = "OK";
 static const char *stat_fnf = "FILE_NOT_FOUND";
 static const char *stat_er = "ERROR";
 static const char *stat_inv= "INVALID";
 static const char *mrkr = "\r\n\r\n";
+static const char *opt_rng = "RANGE=";
+static const char *opt_acpt_enc = "ACCEPT-ENCODING=";
+static const char *opt_enc = "ENCODING=";
+static const char *opt_enc_len = "ENCODED-LENGTH=";
+static const char *enc_gzip = "gzip";
 
 
 /*------------*/
 /* structures */
 
+/* addresses a request may connect to, tried from the preferred one on */
+typedef struct gfc_addrs_t {
+    struct sockaddr_storage addrs[GFC_MAX_ADDRS];
+    socklen_t lens[GFC_MAX_ADDRS];
+    int naddrs;
+    int pref;                                   //index of the address that connected last
+} gfc_addrs_t;
+
+typedef struct dns_entry_t {
+    char host[256];
+    gfc_addrs_t addrs;                          //ports are set per request
+    uint64_t expires_ms;
+    uint64_t used_ms;                           //least recently used entries are replaced first
+} dns_entry_t;
+
 struct gfcrequest_t {
     char *serv_name;                            //name of server to connect to
+    char *unix_path;                            //unix domain socket of a local server, used instead of serv_name if set
     char *file_path;                            //path of file to be requested for download
     unsigned short port;                        //socket port number
+    gfmethod_t method;                          //request method, GET or HEAD
+    int has_rng;                                //non-zero if only a byte range is requested
+    size_t rng_off;                             //offset of first requested byte
+    size_t rng_len;                             //number of requested bytes, 0 through end of file
+    unsigned int hdr_to_ms;                     //deadline for receiving the response header, 0 disables
+    unsigned int idle_to_ms;                    //deadline for progress on the connection, 0 disables
+    unsigned int xfr_to_ms;                     //deadline for the whole request, 0 disables
+    gfsock_opts_t sock_opts;                    //tuning of the connection socket
+    struct sockaddr_storage preset_addr;        //address set with gfc_set_addr
+    socklen_t preset_len;                       //0 unless an address is preset
     void (*hdr_func)(void*, size_t, void*);     //function callback when header is recieved in request
     void *hdr_arg;                              //argument to header callback
     void (*write_func)(void *, size_t, void *);  //function callback for each chunk of data received
     void *write_arg;                            //argument to write function callback
+    char *rcv_buf;                              //buffer set with gfc_set_buffer, NULL for the library's
+    size_t rcv_buf_sz;                          //size of the receive buffer
+    int sink_fd;                                //file the body is written to instead of the write callback, -1 if none
+    off_t sink_off;                             //offset in the sink of the first body byte
     gfstatus_t status;                          //status of the response as returned by the server
     size_t file_len;                            //file length in bytes as returned in header response
-    size_t tot_byts_rec;
+    size_t tot_byts_rec;                        //decoded bytes passed to the write callback
+    int accept_enc;                             //GF_ENC_* encodings to accept
+    int encoding;                               //GF_ENC_* encoding of the response body
+    size_t enc_len;                             //length of the encoded body, file_len if not encoded
+    size_t wire_byts_rec;                       //body bytes received before decoding
+    z_stream *zs;                               //inflate state of a gzip body
+    void *priv;                                 //caller data, see gfc_set_private
+    char *hdr_bfr;                              //response header received so far, NUL terminated
+    size_t hdr_sz;                              //allocated size of hdr_bfr
+    size_t hdr_used;                            //bytes in hdr_bfr
+    int got_hdr;                                //full response header received
+    uint64_t start_us;                          //start of the transfer, for the timings below
+    uint64_t conn_us;                           //microseconds until connected, 0 if not
+    uint64_t ttfb_us;                           //microseconds until the first response byte, 0 if none
+    int hdr_schm_vald;                          //response header starts with the scheme
+    int no_hdr_err;                             //response header has an OK status and a valid length
+    gfcmulti_t *multi;                          //multi handle driving the transfer, NULL for gfc_perform
+    int sockfd;                                 //connection of a multi transfer
+    int phase;                                  //GFC_PH_* step of a multi transfer
+    gfc_addrs_t addrs;                          //addresses of a multi transfer
+    int iaddr;                                  //addresses of a multi transfer tried so far
+    char *req;                                  //request of a multi transfer not fully sent yet
+    size_t req_len;
+    size_t req_sent;
+    uint64_t start_ms;                          //start of a multi transfer
+    uint64_t last_ms;                           //last progress of a multi transfer
+    int result;                                 //what gfc_perform would have returned for a multi transfer
+    gfcrequest_t *prev;                         //neighbours in the running or done list of the multi handle
+    gfcrequest_t *next;
+};
+
+typedef struct gfc_list_t {
+    gfcrequest_t *head;
+    gfcrequest_t *tail;
+} gfc_list_t;
+
+struct gfcmulti_t {
+    int epfd;
+    gfc_list_t running;                         //transfers in progress
+    gfc_list_t done;                            //finished transfers not yet returned by gfc_multi_info_read
+    int nrunning;
+    uint64_t next_sweep_ms;                     //next check of the transfer deadlines
+    char *rcv_buf;                              //receive buffer of transfers without one of their own
 };
 
 
@@ -73,6 +187,15 @@ gfcrequest_t *gfc_create() {
     gfcr->status = GF_OK;
     gfcr->file_len = 0;
     gfcr->port = 0;
+    gfcr->method = GF_METHOD_GET;
+    gfcr->hdr_to_ms = HDR_TO_MS;
+    gfcr->idle_to_ms = IDLE_TO_MS;
+    gfcr->xfr_to_ms = XFR_TO_MS;
+    gfsock_opts_default(&gfcr->sock_opts, 0);
+    gfcr->sock_opts.fastopen = 0;
+    gfcr->sockfd = -1;
+    gfcr->rcv_buf_sz = RCV_BUF_SZ;
+    gfcr->sink_fd = -1;
     return gfcr;
 }
 
@@ -80,6 +203,27 @@ void gfc_set_server(gfcrequest_t *gfr, char* server) {
     gfr->serv_name = strdup(server);
 }
 
+void gfc_set_addr(gfcrequest_t *gfr, const struct sockaddr *addr, socklen_t addr_len) {
+    if (addr_len > sizeof(gfr->preset_addr)) {
+        addr_len = 0;
+    }
+    memcpy(&gfr->preset_addr, addr, addr_len);
+    gfr->preset_len = addr_len;
+}
+
+void gfc_set_unix_path(gfcrequest_t *gfr, char* path) {
+    free(gfr->unix_path);
+    gfr->unix_path = (path != NULL) ? strdup(path) : NULL;
+}
+
+void gfc_set_accept_encoding(gfcrequest_t *gfr, int encodings) {
+    gfr->accept_enc = encodings;
+}
+
+void gfc_set_sockopts(gfcrequest_t *gfr, const gfsock_opts_t *opts) {
+    gfr->sock_opts = *opts;
+}
+
 void gfc_set_path(gfcrequest_t *gfr, char* path) {
     gfr->file_path = strdup(path);
 }
@@ -88,6 +232,32 @@ void gfc_set_port(gfcrequest_t *gfr, unsigned short port) {
     gfr->port = port;
 }
 
+void gfc_set_method(gfcrequest_t *gfr, gfmethod_t method) {
+    gfr->method = method;
+}
+
+void gfc_set_range(gfcrequest_t *gfr, size_t offset, size_t len) {
+    gfr->has_rng = 1;
+    gfr->rng_off = offset;
+    gfr->rng_len = len;
+}
+
+void gfc_set_timeouts(gfcrequest_t *gfr, unsigned int hdr_to_ms, unsigned int idle_to_ms, unsigned int xfr_to_ms) {
+    gfr->hdr_to_ms = hdr_to_ms;
+    gfr->idle_to_ms = idle_to_ms;
+    gfr->xfr_to_ms = xfr_to_ms;
+}
+
+void gfc_set_buffer(gfcrequest_t *gfr, void *buf, size_t len) {
+    gfr->rcv_buf = buf;
+    gfr->rcv_buf_sz = (len > 0) ? len : RCV_BUF_SZ;
+}
+
+void gfc_set_sink(gfcrequest_t *gfr, int fd, off_t offset) {
+    gfr->sink_fd = fd;
+    gfr->sink_off = offset;
+}
+
 void gfc_set_headerfunc(gfcrequest_t *gfr, void (*headerfunc)(void*, size_t, void *)) {
     gfr->hdr_func = headerfunc;
 }
@@ -104,6 +274,14 @@ void gfc_set_writearg(gfcrequest_t *gfr, void *writearg) {
     gfr->write_arg = writearg;
 }
 
+void gfc_set_private(gfcrequest_t *gfr, void *priv) {
+    gfr->priv = priv;
+}
+
+void *gfc_get_private(gfcrequest_t *gfr) {
+    return gfr->priv;
+}
+
 void gfc_set_status(gfcrequest_t *gfr, gfstatus_t status) {
     gfr->status = status;
 }
@@ -116,268 +294,1120 @@ size_t gfc_get_filelen(gfcrequest_t *gfr) {
     return gfr->file_len;
 }
 
+int gfc_get_encoding(gfcrequest_t *gfr) {
+    return gfr->encoding;
+}
+
+size_t gfc_get_encodedlen(gfcrequest_t *gfr) {
+    return gfr->enc_len;
+}
+
 size_t gfc_get_bytesreceived(gfcrequest_t *gfr) {
     return gfr->tot_byts_rec;
 }
 
+uint64_t gfc_get_connect_us(gfcrequest_t *gfr) {
+    return gfr->conn_us;
+}
+
+uint64_t gfc_get_ttfb_us(gfcrequest_t *gfr) {
+    return gfr->ttfb_us;
+}
+
 ssize_t gfc_get_bytesremaining(gfcrequest_t *gfr) {
-    return (gfr->file_len - gfr->tot_byts_rec);
+    return (gfr->enc_len - gfr->wire_byts_rec);
 }
 
 void gfc_cleanup(gfcrequest_t *gfr) {
+    if (gfr->multi != NULL) {
+        gfc_multi_remove(gfr->multi, gfr);
+    }
+    free(gfr->hdr_bfr);
+    free(gfr->req);
     free(gfr->serv_name);
+    free(gfr->unix_path);
     free(gfr->file_path);
+    if (gfr->zs != NULL) {
+        inflateEnd(gfr->zs);
+        free(gfr->zs);
+    }
     free(gfr);
     gfr = NULL;
 }
 
+static uint64_t gfc_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t gfc_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Waits for the socket to become readable within the nearest of the
+ * request deadlines.  Returns 1 when readable, 0 if a deadline expired
+ * and -1 on errors.
+ */
+static int gfc_wait_readable(gfcrequest_t *gfr, int sockfd, int got_hdr, uint64_t start_ms) {
+
+    while (1) {
+        uint64_t now = gfc_now_ms();
+        int64_t wait = -1;
+        const char *reason = NULL;
+        if (gfr->idle_to_ms > 0) {
+            wait = gfr->idle_to_ms;
+            reason = "idle";
+        }
+        if (!got_hdr && gfr->hdr_to_ms > 0) {
+            int64_t left = (int64_t)(start_ms + gfr->hdr_to_ms) - (int64_t)now;
+            if (wait < 0 || left < wait) {
+                wait = (left > 0) ? left : 0;
+                reason = "header read";
+            }
+        }
+        if (gfr->xfr_to_ms > 0) {
+            int64_t left = (int64_t)(start_ms + gfr->xfr_to_ms) - (int64_t)now;
+            if (wait < 0 || left < wait) {
+                wait = (left > 0) ? left : 0;
+                reason = "total transfer";
+            }
+        }
+
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int n = poll(&pfd, 1, (int)wait);
+        if (n > 0) {
+            return 1;
+        } else if (n == 0) {
+            gflog_error("%s deadline expired waiting for server", reason);
+            errno = ETIMEDOUT;
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* names resolved by any request of the process, shared by all threads */
+static dns_entry_t g_dns[DNS_CACHE_SZ];
+static int g_ndns = 0;
+static unsigned int g_dns_ttl_ms = DNS_TTL_MS;
+static pthread_mutex_t g_dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void gfc_global_init() {
 }
 
 void gfc_global_cleanup() {
+    pthread_mutex_lock(&g_dns_lock);
+    g_ndns = 0;
+    pthread_mutex_unlock(&g_dns_lock);
 }
 
-int gfc_perform(gfcrequest_t *gfr) {
+void gfc_set_dns_ttl(unsigned int ttl_ms) {
+    pthread_mutex_lock(&g_dns_lock);
+    g_dns_ttl_ms = ttl_ms;
+    g_ndns = 0;
+    pthread_mutex_unlock(&g_dns_lock);
+}
+
+/* returns the cache entry of host, called with g_dns_lock held */
+static dns_entry_t *gfc_dns_find(const char *host) {
+    for (int ient = 0; ient < g_ndns; ient++) {
+        if (strcmp(g_dns[ient].host, host) == 0) {
+            return &g_dns[ient];
+        }
+    }
+    return NULL;
+}
 
-    /* create socket */
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+/*
+ * Resolves host into addrs, from the cache while its entry has not
+ * expired.  The resolver is called without holding the cache lock, so
+ * threads missing the same name at once may each call it.  Returns -1 if
+ * the name cannot be resolved.
+ */
+static int gfc_dns_lookup(const char *host, unsigned short port, gfc_addrs_t *addrs) {
+
+    uint64_t now = gfc_now_ms();
+    int found = 0;
+    pthread_mutex_lock(&g_dns_lock);
+    dns_entry_t *ent = gfc_dns_find(host);
+    if (ent != NULL && now < ent->expires_ms) {
+        *addrs = ent->addrs;
+        ent->used_ms = now;
+        found = 1;
+    }
+    pthread_mutex_unlock(&g_dns_lock);
+
+    if (!found) {
+        struct addrinfo hints;
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        struct addrinfo *res;
+        int rc = getaddrinfo(host, NULL, &hints, &res);
+        if (rc != 0) {
+            gflog_error("host with provided name cannot be found: %s", gai_strerror(rc));
+            return -1;
+        }
+        bzero(addrs, sizeof(*addrs));
+        for (struct addrinfo *ai = res; ai != NULL && addrs->naddrs < GFC_MAX_ADDRS; ai = ai->ai_next) {
+            if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6)
+                && ai->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+                memcpy(&addrs->addrs[addrs->naddrs], ai->ai_addr, ai->ai_addrlen);
+                addrs->lens[addrs->naddrs++] = ai->ai_addrlen;
+            }
+        }
+        freeaddrinfo(res);
+        if (addrs->naddrs == 0) {
+            gflog_error("host %s has no IPv4 or IPv6 address", host);
+            return -1;
+        }
+
+        /* refresh the entry of the name, or replace the least recently
+         * used one */
+        pthread_mutex_lock(&g_dns_lock);
+        if (g_dns_ttl_ms > 0 && strlen(host) < sizeof(ent->host)) {
+            ent = gfc_dns_find(host);
+            if (ent == NULL && g_ndns < DNS_CACHE_SZ) {
+                ent = &g_dns[g_ndns++];
+            } else if (ent == NULL) {
+                ent = &g_dns[0];
+                for (int ient = 1; ient < g_ndns; ient++) {
+                    if (g_dns[ient].used_ms < ent->used_ms) {
+                        ent = &g_dns[ient];
+                    }
+                }
+            }
+            strcpy(ent->host, host);
+            ent->addrs = *addrs;
+            ent->expires_ms = now + g_dns_ttl_ms;
+            ent->used_ms = now;
+        }
+        pthread_mutex_unlock(&g_dns_lock);
+    }
+
+    for (int iaddr = 0; iaddr < addrs->naddrs; iaddr++) {
+        if (addrs->addrs[iaddr].ss_family == AF_INET) {
+            ((struct sockaddr_in *) &addrs->addrs[iaddr])->sin_port = htons(port);
+        } else {
+            ((struct sockaddr_in6 *) &addrs->addrs[iaddr])->sin6_port = htons(port);
+        }
+    }
+    return 0;
+}
+
+/* makes the address that just connected the first one tried for host */
+static void gfc_dns_prefer(const char *host, const gfc_addrs_t *addrs, int iaddr) {
+    pthread_mutex_lock(&g_dns_lock);
+    dns_entry_t *ent = gfc_dns_find(host);
+    if (ent != NULL && ent->addrs.naddrs == addrs->naddrs) {
+        ent->addrs.pref = iaddr;
+    }
+    pthread_mutex_unlock(&g_dns_lock);
+}
+
+int gfc_resolve(const char *host, unsigned short port, struct sockaddr_storage *addr, socklen_t *addr_len) {
+    gfc_addrs_t addrs;
+    if (gfc_dns_lookup(host, port, &addrs) != 0) {
+        return -1;
+    }
+    memcpy(addr, &addrs.addrs[addrs.pref], addrs.lens[addrs.pref]);
+    *addr_len = addrs.lens[addrs.pref];
+    return 0;
+}
+
+/*
+ * Creates a socket of the address family of the server and applies the
+ * options of the request, flags are or'ed into the socket type.
+ * Returns -1 on errors.
+ */
+static int gfc_open_socket(gfcrequest_t *gfr, int family, int flags) {
+    int sockfd = socket(family, SOCK_STREAM | flags, 0);
     if (sockfd < 0) {
-        perror("[ERROR] opening socket");
-        gfc_set_status(gfr, GF_INVALID);
+        gflog_error("opening socket: %s", strerror(errno));
         return -1;
     }
 
     /* set socket option to reuse addresses */
     int yes = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-        fprintf(stderr, "[ERROR] setting port reuse option in setsockopt.\n");
-        gfc_set_status(gfr, GF_INVALID);
+    if (family != AF_UNIX && setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        gflog_error("setting port reuse option in setsockopt.");
+        close(sockfd);
         return -1;
     }
+    gfsock_apply(sockfd, &gfr->sock_opts, GFSOCK_CONNECT);
+    return sockfd;
+}
 
-    /* set socket timeout options */
-    struct timeval timeout;
-    timeout.tv_sec = SOCKTO;
-    timeout.tv_usec = 0;
-    if (setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,
-                    sizeof(timeout)) < 0) {
-        fprintf(stderr, "[ERROR] setting receive timeout in setsockopt\n");
-        gfc_set_status(gfr, GF_INVALID);
+/*
+ * Fills in the addresses of the server: the unix domain socket of a
+ * local server, the preset address or those its name resolves to.
+ * Returns -1 if there are none.
+ */
+static int gfc_server_addrs(gfcrequest_t *gfr, gfc_addrs_t *addrs) {
+    if (gfr->unix_path != NULL) {
+        bzero(addrs, sizeof(*addrs));
+        struct sockaddr_un *un_addr = (struct sockaddr_un *) &addrs->addrs[0];
+        un_addr->sun_family = AF_UNIX;
+        if (strlen(gfr->unix_path) >= sizeof(un_addr->sun_path)) {
+            gflog_error("unix socket path exceeds %zu characters", sizeof(un_addr->sun_path) - 1);
+            return -1;
+        }
+        strcpy(un_addr->sun_path, gfr->unix_path);
+        addrs->lens[0] = sizeof(struct sockaddr_un);
+        addrs->naddrs = 1;
+        return 0;
+    }
+    if (gfr->preset_len > 0) {
+        bzero(addrs, sizeof(*addrs));
+        memcpy(&addrs->addrs[0], &gfr->preset_addr, gfr->preset_len);
+        addrs->lens[0] = gfr->preset_len;
+        addrs->naddrs = 1;
+        return 0;
+    }
+    if (gfr->serv_name == NULL) {
+        gflog_error("no server set for request");
         return -1;
     }
-    if (setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
-                    sizeof(timeout)) < 0) {
-        fprintf(stderr, "[ERROR] setting send timeout in setsockopt\n");
-        gfc_set_status(gfr, GF_INVALID);
+    return gfc_dns_lookup(gfr->serv_name, gfr->port, addrs);
+}
+
+/* called once the iaddr-th address of the server connected */
+static void gfc_connected(gfcrequest_t *gfr, const gfc_addrs_t *addrs, int iaddr) {
+    gfr->conn_us = gfc_now_us() - gfr->start_us;
+    if (iaddr != addrs->pref && gfr->unix_path == NULL && gfr->preset_len == 0) {
+        gfc_dns_prefer(gfr->serv_name, addrs, iaddr);
+    }
+}
+
+/*
+ * Writes the request line into buffer, which holds BUFSIZE bytes.
+ * Returns the number of bytes to send, including the terminating NUL.
+ */
+static size_t gfc_format_request(gfcrequest_t *gfr, char *buffer) {
+    const char *mthd = (gfr->method == GF_METHOD_HEAD) ? mthd_head : mthd_get;
+    if (gfr->has_rng && gfr->rng_len > 0) {
+        snprintf(buffer, BUFSIZE, "%s %s %s %s%zu-%zu%s", scheme, mthd, gfr->file_path, opt_rng,
+                 gfr->rng_off, gfr->rng_off + gfr->rng_len - 1, mrkr);
+    } else if (gfr->has_rng) {
+        snprintf(buffer, BUFSIZE, "%s %s %s %s%zu-%s", scheme, mthd, gfr->file_path, opt_rng, gfr->rng_off, mrkr);
+    } else if (gfr->method == GF_METHOD_GET && (gfr->accept_enc & GF_ENC_GZIP)) {
+        snprintf(buffer, BUFSIZE, "%s %s %s %s%s%s", scheme, mthd, gfr->file_path, opt_acpt_enc, enc_gzip, mrkr);
+    } else {
+        snprintf(buffer, BUFSIZE, "%s %s %s%s", scheme, mthd, gfr->file_path, mrkr);
+    }
+    return strlen(buffer) + 1;
+}
+
+/* clears what a previous transfer of the request received */
+static void gfc_reset(gfcrequest_t *gfr) {
+    gfr->status = GF_OK;
+    gfr->file_len = 0;
+    gfr->tot_byts_rec = 0;
+    gfr->wire_byts_rec = 0;
+    gfr->encoding = GF_ENC_IDENTITY;
+    gfr->enc_len = 0;
+    if (gfr->zs != NULL) {
+        inflateEnd(gfr->zs);
+        free(gfr->zs);
+        gfr->zs = NULL;
+    }
+    free(gfr->hdr_bfr);
+    gfr->hdr_bfr = NULL;
+    gfr->hdr_sz = 0;
+    gfr->hdr_used = 0;
+    gfr->got_hdr = 0;
+    gfr->start_us = gfc_now_us();
+    gfr->conn_us = 0;
+    gfr->ttfb_us = 0;
+    gfr->hdr_schm_vald = 0;
+    gfr->no_hdr_err = 0;
+}
+
+/*
+ * Parses the fields following the OK status, the file length and for
+ * encoded bodies the encoding and the encoded length.  Returns -1 if they
+ * are malformed or the encoding is unknown.
+ */
+static int gfc_parse_length(gfcrequest_t *gfr, const char *fields, size_t len) {
+    char buf[BUFSIZE];
+    if (len >= sizeof(buf)) {
         return -1;
     }
-    /* get server information from hostname provided during command call */
-    struct hostent *server = gethostbyname(gfr->serv_name);
-    if (server == NULL) {
-        fprintf(stderr, "[ERROR], host with provided name cannot be found: %i\n", h_errno);
+    memcpy(buf, fields, len);
+    buf[len] = '\0';
+
+    char *saveptr;
+    char *tok = strtok_r(buf, " ", &saveptr);
+    if (tok == NULL) {
+        return -1;
+    }
+    if (gflen_parse(tok, NULL, &gfr->file_len) != 0) {
+        return -1;
+    }
+    gfr->enc_len = gfr->file_len;
+    gfr->encoding = GF_ENC_IDENTITY;
+    while ((tok = strtok_r(NULL, " ", &saveptr)) != NULL) {
+        if (strncmp(tok, opt_enc, strlen(opt_enc)) == 0) {
+            if (strcmp(tok + strlen(opt_enc), enc_gzip) != 0) {
+                return -1;
+            }
+            gfr->encoding = GF_ENC_GZIP;
+        } else if (strncmp(tok, opt_enc_len, strlen(opt_enc_len)) == 0) {
+            if (gflen_parse(tok + strlen(opt_enc_len), NULL, &gfr->enc_len) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    /* 16 added to the window bits expects the gzip wrapper */
+    if (gfr->encoding == GF_ENC_GZIP) {
+        gfr->zs = calloc(1, sizeof(z_stream));
+        if (inflateInit2(gfr->zs, 15 + 16) != Z_OK) {
+            free(gfr->zs);
+            gfr->zs = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Hands decoded body bytes to the sink, or to the write callback if
+ * there is none.  Returns -1 if the sink cannot be written.
+ */
+static int gfc_emit(gfcrequest_t *gfr, void *data, size_t len) {
+    if (gfr->sink_fd < 0) {
+        gfr->tot_byts_rec += len;
+        gfr->write_func(data, len, gfr->write_arg);
+        return 0;
+    }
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(gfr->sink_fd, (char *) data + written, len - written,
+                           gfr->sink_off + (off_t)(gfr->tot_byts_rec + written));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            gflog_error("writing body to sink: %s", strerror(errno));
+            return -1;
+        }
+        written += (size_t) n;
+    }
+    gfr->tot_byts_rec += len;
+    return 0;
+}
+
+/*
+ * Passes body bytes received from the server on to gfc_emit, inflating
+ * them first if the body is gzip encoded.  Returns -1 if the encoded body
+ * is corrupt or cannot be written.
+ */
+static int gfc_deliver(gfcrequest_t *gfr, void *data, size_t len) {
+    gfr->wire_byts_rec += len;
+    if (gfr->encoding == GF_ENC_IDENTITY) {
+        return gfc_emit(gfr, data, len);
+    }
+
+    unsigned char out[4 * BUFSIZE];
+    gfr->zs->next_in = data;
+    gfr->zs->avail_in = (uInt) len;
+    do {
+        gfr->zs->next_out = out;
+        gfr->zs->avail_out = sizeof(out);
+        int rc = inflate(gfr->zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            gflog_error("corrupt gzip body: %s", (gfr->zs->msg != NULL) ? gfr->zs->msg : "unknown error");
+            return -1;
+        }
+        size_t have = sizeof(out) - gfr->zs->avail_out;
+        if (have > 0 && gfc_emit(gfr, out, have) != 0) {
+            return -1;
+        }
+        if (rc == Z_STREAM_END) {
+            break;
+        }
+    } while (gfr->zs->avail_out == 0);
+    return 0;
+}
+
+/*
+ * Passes bytes received from the server to the response parser, which
+ * collects the header, checks it and hands the body to gfc_deliver.
+ * Returns GFC_DONE once nothing more is expected, also when the header
+ * reports an error, GFC_MORE while it is and GFC_FAIL if the body cannot
+ * be decoded.
+ */
+static int gfc_feed(gfcrequest_t *gfr, char *data, size_t len) {
+
+    if (gfr->got_hdr) {
+
+        /* only pass on the bytes of the file remaining */
+        ssize_t byts_rem = gfc_get_bytesremaining(gfr);
+        size_t byts_to_rd = (byts_rem < (ssize_t) len) ? (size_t) byts_rem : len;
+        if (gfc_deliver(gfr, data, byts_to_rd) != 0) {
+            return GFC_FAIL;
+        }
+        return (gfc_get_bytesremaining(gfr) <= 0) ? GFC_DONE : GFC_MORE;
+    }
+
+    if (gfr->hdr_used == 0) {
+        gfr->ttfb_us = gfc_now_us() - gfr->start_us;
+    }
+
+    /* keep storing bytes in the header buffer until the marker is found,
+     * the terminating NUL lets it be searched with strstr */
+    if (gfr->hdr_sz - gfr->hdr_used < len + 1) {
+        gfr->hdr_sz = gfr->hdr_used + len + 1 + BUFSIZE;
+        gfr->hdr_bfr = realloc(gfr->hdr_bfr, gfr->hdr_sz);
+    }
+    memcpy(&gfr->hdr_bfr[gfr->hdr_used], data, len);
+    gfr->hdr_used += len;
+    gfr->hdr_bfr[gfr->hdr_used] = '\0';
+
+    char *hdr_stuff = gfr->hdr_bfr;
+    char *hdr_end = strstr(hdr_stuff, mrkr);
+    if (hdr_end == NULL) {
+        return GFC_MORE;
+    }
+    gfr->got_hdr = 1;
+
+    /* check that first 7 chars provide scheme */
+    if (memcmp(&hdr_stuff[0], scheme, strlen(scheme)) != 0) {
+        gfc_set_status(gfr, GF_INVALID);
+        return GFC_DONE;
+    }
+    gfr->hdr_schm_vald = 1;
+
+    /* place buffer start location after scheme */
+    size_t npos = 1 + strlen(scheme); //1 accounts for whitespace between scheme and status
+
+    /* check status for errors */
+    char *cstat = gfc_strstatus(GF_ERROR);
+    if (memcmp(&hdr_stuff[npos], cstat, strlen(cstat)) == 0) {
+        gfc_set_status(gfr, GF_ERROR);
+        return GFC_DONE;
+    }
+
+    cstat = gfc_strstatus(GF_FILE_NOT_FOUND);
+    if (memcmp(&hdr_stuff[npos], cstat, strlen(cstat)) == 0) {
+        gfc_set_status(gfr, GF_FILE_NOT_FOUND);
+        return GFC_DONE;
+    }
+
+    /* no expected errors, status must be OK */
+    cstat = gfc_strstatus(GF_OK);
+    if (memcmp(&hdr_stuff[npos], cstat, strlen(cstat)) != 0) {
+        gflog_error("status received from server is unknown, expected OK");
+        gfc_set_status(gfr, GF_ERROR);
+        return GFC_DONE;
+    }
+
+    /* valid header with no errors, get file length and encoding */
+    npos += (1 + strlen(cstat));
+    if (gfc_parse_length(gfr, &hdr_stuff[npos], (size_t)(hdr_end - &hdr_stuff[npos])) != 0) {
+        gflog_error("malformed file length or unknown encoding in header");
+        gfc_set_status(gfr, GF_INVALID);
+        return GFC_DONE;
+    }
+    gfr->no_hdr_err = 1;
+
+    /* reserve the space of the file up front so it is laid out in one
+     * piece, the file size still grows only as the body is written */
+    if (gfr->sink_fd >= 0 && gfr->method == GF_METHOD_GET && gfr->file_len > 0
+        && fallocate(gfr->sink_fd, FALLOC_FL_KEEP_SIZE, gfr->sink_off, (off_t) gfr->file_len) != 0) {
+        gflog_debug("preallocating %zu bytes of the sink: %s", gfr->file_len, strerror(errno));
+    }
+
+    /* provide header to header callback */
+    size_t hdr_len = (size_t)(hdr_end - hdr_stuff) + strlen(mrkr);
+    if (gfr->hdr_func != NULL)
+        gfr->hdr_func(hdr_stuff, hdr_len, gfr->hdr_arg);
+
+    /* no file contents follow the header of a head response */
+    if (gfr->method == GF_METHOD_HEAD)
+        return GFC_DONE;
+
+    /* anything left in hdr is file contents, provide to write callback */
+    int rc = GFC_MORE;
+    if (gfr->hdr_used > hdr_len) {
+        gflog_debug("writing any additional data bytes after parsing header");
+        rc = gfc_feed(gfr, &hdr_stuff[hdr_len], gfr->hdr_used - hdr_len);
+    } else if (gfc_get_bytesremaining(gfr) <= 0) {
+        rc = GFC_DONE;
+    }
+
+    /* the header is no longer needed, a multi handle may hold many */
+    free(gfr->hdr_bfr);
+    gfr->hdr_bfr = NULL;
+    gfr->hdr_sz = 0;
+    gfr->hdr_used = 0;
+    return rc;
+}
+
+/*
+ * Checks what the transfer received once the connection is done with,
+ * failed being non-zero if receiving ended abnormally.  Returns the
+ * result of gfc_perform.
+ */
+static int gfc_conclude(gfcrequest_t *gfr, int failed) {
+
+    /* check all expected file bytes been received */
+    int got_data = 0;
+    if (gfr->tot_byts_rec == gfr->file_len || gfr->method == GF_METHOD_HEAD) {
+        got_data = 1;
+    }
+
+    int cnct_stat;
+    if (failed) {
+        gflog_error("abnormally occurred in receiving response from server: %s", strerror(errno));
+        gfc_set_status(gfr, GF_INVALID); //didn't have a chance to set this above
+        cnct_stat = -1;
+    } else {
+        /* check that connection terminated gracefully but haven't fully received the header and data file */
+        if (!gfr->got_hdr) {
+            gflog_error("connection terminated normally BUT header was not fully received");
+            gfc_set_status(gfr, GF_INVALID); //didn't have a chance to set this above
+            cnct_stat = -1;
+        } else if (!gfr->hdr_schm_vald) {
+            gflog_error("connection terminated normally BUT header scheme does not match GETFILE");
+            cnct_stat = -1;
+        } else if (!gfr->no_hdr_err) {
+            gflog_error("connection terminated normally BUT header contains error report, status: %s", gfc_strstatus(gfr->status));
+            cnct_stat = 0;
+        } else if (!got_data) {
+            gflog_error("connection terminated normally BUT data was not fully received");
+            cnct_stat = -1;
+        } else {
+            gflog_debug("connection terminated normally AND data successfully transferred");
+            cnct_stat = 0;
+        }
+    }
+
+    free(gfr->hdr_bfr);
+    gfr->hdr_bfr = NULL;
+    return cnct_stat;
+}
+
+/* passes the len bytes waiting in a pipe on to gfc_deliver */
+static int gfc_drain_pipe(gfcrequest_t *gfr, int pipefd, size_t len) {
+    char buffer[BUFSIZE];
+    while (len > 0) {
+        ssize_t n = read(pipefd, buffer, (len < sizeof(buffer)) ? len : sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || gfc_deliver(gfr, buffer, (size_t) n) != 0) {
+            return -1;
+        }
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/*
+ * Moves the rest of an unencoded body from the socket into the sink
+ * through a pipe with splice, so it is never copied through user space.
+ * Returns GFC_DONE when the body is complete or the server closed the
+ * connection, GFC_MORE if the sink does not take spliced data and the
+ * body has to be received as usual, and GFC_FAIL on errors and expired
+ * deadlines.
+ */
+static int gfc_splice_body(gfcrequest_t *gfr, int sockfd, uint64_t start_ms) {
+
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC) != 0) {
+        return GFC_MORE;
+    }
+    fcntl(pfd[1], F_SETPIPE_SZ, SPLICE_PIPE_SZ);
+
+    int rc = GFC_DONE;
+    while (gfc_get_bytesremaining(gfr) > 0) {
+        int rdy = gfc_wait_readable(gfr, sockfd, 1, start_ms);
+        if (rdy <= 0) {
+            rc = GFC_FAIL;
+            break;
+        }
+        ssize_t n = splice(sockfd, NULL, pfd[1], NULL, (size_t) gfc_get_bytesremaining(gfr),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            rc = (n < 0) ? GFC_FAIL : GFC_DONE;
+            break;
+        }
+
+        size_t left = (size_t) n;
+        while (left > 0) {
+            off_t pos = gfr->sink_off + (off_t) gfr->tot_byts_rec;
+            ssize_t m = splice(pfd[0], NULL, gfr->sink_fd, &pos, left, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                break;
+            }
+            gfr->wire_byts_rec += (size_t) m;
+            gfr->tot_byts_rec += (size_t) m;
+            left -= (size_t) m;
+        }
+        if (left > 0) {
+
+            /* some file systems do not take spliced data, copy what the
+             * pipe holds and carry on without */
+            int err = errno;
+            if (err == EINVAL && gfc_drain_pipe(gfr, pfd[0], left) == 0) {
+                gflog_debug("sink does not support splice, receiving the body through the buffer");
+                rc = GFC_MORE;
+            } else {
+                gflog_error("splicing body into sink: %s", strerror(err));
+                rc = GFC_FAIL;
+            }
+            break;
+        }
+    }
+
+    close(pfd[0]);
+    close(pfd[1]);
+    return rc;
+}
+
+int gfc_perform(gfcrequest_t *gfr) {
+
+    gfc_reset(gfr);
+
+    uint64_t start_ms = gfc_now_ms();
+    gfc_addrs_t addrs;
+    if (gfc_server_addrs(gfr, &addrs) != 0) {
         gfc_set_status(gfr, GF_INVALID);
         return -1;
     }
 
-    /* prepare server address structure */
-    struct sockaddr_in serv_addr;
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr, (char *) &serv_addr.sin_addr.s_addr, server->h_length);
-    serv_addr.sin_port = htons(gfr->port);
+    /* connect to the first address of the server that accepts, starting
+     * with the one that did last time */
+    int sockfd = -1;
+    for (int itry = 0; itry < addrs.naddrs && sockfd < 0; itry++) {
+        int iaddr = (addrs.pref + itry) % addrs.naddrs;
+        struct sockaddr *serv_addr = (struct sockaddr *) &addrs.addrs[iaddr];
+
+        /* create socket */
+        sockfd = gfc_open_socket(gfr, serv_addr->sa_family, 0);
+        if (sockfd < 0) {
+            continue;
+        }
+
+        /* bound connecting and sending the request by the idle deadline */
+        if (gfr->idle_to_ms > 0) {
+            struct timeval timeout;
+            timeout.tv_sec = gfr->idle_to_ms / 1000;
+            timeout.tv_usec = (gfr->idle_to_ms % 1000) * 1000;
+            if (setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
+                            sizeof(timeout)) < 0) {
+                gflog_error("setting send timeout in setsockopt");
+                close(sockfd);
+                gfc_set_status(gfr, GF_INVALID);
+                return -1;
+            }
+        }
 
-    /* connect to the server */
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        perror("[ERROR] connecting to server");
+        if (connect(sockfd, serv_addr, addrs.lens[iaddr]) < 0) {
+            if (itry + 1 < addrs.naddrs) {
+                gflog_debug("connecting to server: %s, trying its next address", strerror(errno));
+            } else {
+                gflog_error("connecting to server%s: %s", (gfr->unix_path != NULL) ? " over unix socket" : "", strerror(errno));
+            }
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        gfc_connected(gfr, &addrs, iaddr);
+    }
+    if (sockfd < 0) {
         gfc_set_status(gfr, GF_INVALID);
         return -1;
     }
 
     ssize_t bytes_recv, bytes_sent;
-    char buffer[BUFSIZE];
+    char req[BUFSIZE];
 
     /* send request for file transfer */
-    fprintf(stderr, "[INFO] sending request to server\n");
-    bzero(buffer, sizeof(buffer));
-    sprintf(buffer, "%s %s %s%s", scheme, mthd_get, gfr->file_path, mrkr);
-    bytes_sent = send(sockfd, buffer, strlen(buffer) + 1, 0);
+    gflog_debug("sending request to server");
+    size_t req_len = gfc_format_request(gfr, req);
+    bytes_sent = send(sockfd, req, req_len, 0);
     if (bytes_sent < 0) {
-        perror("[ERROR] sending transfer request to server");
+        gflog_error("sending transfer request to server: %s", strerror(errno));
+        close(sockfd);
         gfc_set_status(gfr, GF_INVALID);
         return -1;
     }
 
     /* read response from server and possibly perform transfer */
-    size_t npos = 0;
-    int got_hdr = 0;
-    int hdr_schm_vald = 0;
-    int no_hdr_err = 0;
-    int got_data = 0;
-
-    bzero(buffer, BUFSIZE);
+    char *buffer = gfr->rcv_buf;
+    char *own_buf = NULL;
+    if (buffer == NULL) {
+        buffer = own_buf = malloc(gfr->rcv_buf_sz);
+    }
+    int failed = 0;
+    int spliced = 0;
+    gflog_debug("getting response from server");
+    while (1) {
+
+        /* enforce the request deadlines before each receive */
+        int rdy = gfc_wait_readable(gfr, sockfd, gfr->got_hdr, start_ms);
+        if (rdy <= 0) {
+            failed = 1;
+            break;
+        }
+        if ((bytes_recv = recv(sockfd, buffer, gfr->rcv_buf_sz, 0)) <= 0) {
+            failed = (bytes_recv < 0);
+            break;
+        }
 
-    char *hdr_stuff = calloc(BUFSIZE, sizeof(char));
-    size_t hdr_stuff_sz = BUFSIZE;
-    size_t hdr_stuff_usd = 0;
-    char *hdr_end = hdr_stuff;
+        int rc = gfc_feed(gfr, buffer, (size_t) bytes_recv);
 
-    char *cstat;
-    char cfilelen[32];
-    bzero(cfilelen, sizeof(cfilelen));
+        /* once the header is in, an unencoded body bound for a sink
+         * bypasses the buffer */
+        if (rc == GFC_MORE && gfr->got_hdr && gfr->sink_fd >= 0 && gfr->encoding == GF_ENC_IDENTITY && !spliced) {
+            spliced = 1;
+            rc = gfc_splice_body(gfr, sockfd, start_ms);
+        }
+        if (rc != GFC_MORE) {
+            failed = (rc == GFC_FAIL);
+            break;
+        }
+    }
 
-    gfr->tot_byts_rec = 0;
+    gflog_debug("done receiving data");
+    free(own_buf);
+    close(sockfd);
+    return gfc_conclude(gfr, failed);
+}
 
-    //int n_rds = 0;
 
-    fprintf(stderr, "[INFO] getting response from server\n");
-    while ((bytes_recv = recv(sockfd, buffer, BUFSIZE, 0)) > 0) {
+/*----------------*/
+/* multi transfers */
 
-        if (!got_hdr) {
+static void gfc_list_push(gfc_list_t *list, gfcrequest_t *gfr) {
+    gfr->next = NULL;
+    gfr->prev = list->tail;
+    if (list->tail != NULL) {
+        list->tail->next = gfr;
+    } else {
+        list->head = gfr;
+    }
+    list->tail = gfr;
+}
 
-            //keep reading bytes and storing in header buffer until
-            // marker is found.
+static void gfc_list_unlink(gfc_list_t *list, gfcrequest_t *gfr) {
+    if (gfr->prev != NULL) {
+        gfr->prev->next = gfr->next;
+    } else {
+        list->head = gfr->next;
+    }
+    if (gfr->next != NULL) {
+        gfr->next->prev = gfr->prev;
+    } else {
+        list->tail = gfr->prev;
+    }
+    gfr->prev = gfr->next = NULL;
+}
 
-            if ((hdr_stuff_sz - hdr_stuff_usd) < bytes_recv) {
-                hdr_stuff_sz += BUFSIZE;
-                hdr_stuff = realloc(hdr_stuff, hdr_stuff_sz);
-            }
-            memcpy(&hdr_stuff[hdr_stuff_usd], buffer, (size_t) bytes_recv);
-            hdr_stuff_usd += bytes_recv;
+/*
+ * Ends a running transfer, closes its connection and moves it to the
+ * done list.  result is what gfc_perform would have returned.
+ */
+static void gfc_multi_finish(gfcmulti_t *multi, gfcrequest_t *gfr, int result) {
+    if (gfr->sockfd >= 0) {
+        epoll_ctl(multi->epfd, EPOLL_CTL_DEL, gfr->sockfd, NULL);
+        close(gfr->sockfd);
+        gfr->sockfd = -1;
+    }
+    free(gfr->req);
+    gfr->req = NULL;
+    gfr->result = result;
+    gfr->phase = GFC_PH_DONE;
+    gfc_list_unlink(&multi->running, gfr);
+    gfc_list_push(&multi->done, gfr);
+    multi->nrunning--;
+}
 
-            hdr_end = strstr(hdr_stuff, mrkr);
-            if (hdr_end != NULL) { /* received full header */
+/* ends a transfer that failed before a response could be received */
+static void gfc_multi_fail(gfcmulti_t *multi, gfcrequest_t *gfr) {
+    gfc_set_status(gfr, GF_INVALID);
+    gfc_multi_finish(multi, gfr, -1);
+}
 
-                got_hdr = 1;
+/* sends what is left of the request, then waits for the response */
+static void gfc_multi_send(gfcmulti_t *multi, gfcrequest_t *gfr) {
+    while (gfr->req_sent < gfr->req_len) {
+        ssize_t n = send(gfr->sockfd, gfr->req + gfr->req_sent, gfr->req_len - gfr->req_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n < 0) {
+            gflog_error("sending transfer request to server: %s", strerror(errno));
+            gfc_multi_fail(multi, gfr);
+            return;
+        }
+        gfr->req_sent += (size_t) n;
+    }
 
-                /* check that first 7 chars provide scheme */
-                if (memcmp(&hdr_stuff[0], scheme, strlen(scheme)) != 0) {
-                    gfc_set_status(gfr, GF_INVALID);
-                    break;
-                }
-                hdr_schm_vald = 1;
+    free(gfr->req);
+    gfr->req = NULL;
+    gfr->phase = GFC_PH_RECV;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = gfr};
+    if (epoll_ctl(multi->epfd, EPOLL_CTL_MOD, gfr->sockfd, &ev) != 0) {
+        gflog_error("waiting for the response: %s", strerror(errno));
+        gfc_multi_fail(multi, gfr);
+    }
+}
 
-                /* place buffer start location after scheme */
-                npos = 1 + strlen(scheme); //1 accounts for whitespace between scheme and status
+/* reads a few chunks of the response, leaving the rest to the next round
+ * so one fast connection cannot hold up the others */
+static void gfc_multi_recv(gfcmulti_t *multi, gfcrequest_t *gfr) {
+    char *buffer = (gfr->rcv_buf != NULL) ? gfr->rcv_buf : multi->rcv_buf;
+    size_t buf_sz = (gfr->rcv_buf != NULL) ? gfr->rcv_buf_sz : RCV_BUF_SZ;
+    for (int ircv = 0; ircv < MULTI_MAX_RECVS; ircv++) {
+        ssize_t bytes_recv = recv(gfr->sockfd, buffer, buf_sz, 0);
+        if (bytes_recv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytes_recv <= 0) {
+            gfc_multi_finish(multi, gfr, gfc_conclude(gfr, bytes_recv < 0));
+            return;
+        }
+        int rc = gfc_feed(gfr, buffer, (size_t) bytes_recv);
+        if (rc != GFC_MORE) {
+            gfc_multi_finish(multi, gfr, gfc_conclude(gfr, rc == GFC_FAIL));
+            return;
+        }
+    }
+}
 
-                /* check status for errors */
-                cstat = gfc_strstatus(GF_ERROR);
-                if (memcmp(&hdr_stuff[npos], cstat, strlen(cstat)) == 0) {
-                    gfc_set_status(gfr, GF_ERROR);
-                    break;
-                }
+static void gfc_multi_connect_failed(gfcmulti_t *multi, gfcrequest_t *gfr, int err);
+
+/*
+ * Starts connecting to the next address of the server not tried yet, the
+ * request goes out once the socket is writable.  Fails the transfer when
+ * no address is left.
+ */
+static void gfc_multi_connect(gfcmulti_t *multi, gfcrequest_t *gfr) {
+    for (; gfr->iaddr < gfr->addrs.naddrs; gfr->iaddr++) {
+        int iaddr = (gfr->addrs.pref + gfr->iaddr) % gfr->addrs.naddrs;
+        struct sockaddr *serv_addr = (struct sockaddr *) &gfr->addrs.addrs[iaddr];
+        gfr->sockfd = gfc_open_socket(gfr, serv_addr->sa_family, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (gfr->sockfd < 0) {
+            continue;
+        }
 
-                cstat = gfc_strstatus(GF_FILE_NOT_FOUND);
-                if (memcmp(&hdr_stuff[npos], cstat, strlen(cstat)) == 0) {
-                    gfc_set_status(gfr, GF_FILE_NOT_FOUND);
-                    break;
-                }
+        if (connect(gfr->sockfd, serv_addr, gfr->addrs.lens[iaddr]) == 0) {
+            gfr->phase = GFC_PH_SEND;
+            gfc_connected(gfr, &gfr->addrs, iaddr);
+        } else if (errno == EINPROGRESS) {
+            gfr->phase = GFC_PH_CONNECT;
+        } else {
+            int err = errno;
+            close(gfr->sockfd);
+            gfr->sockfd = -1;
+            gfc_multi_connect_failed(multi, gfr, err);
+            return;
+        }
 
-                /* no expected errors, status must be OK */
-                cstat = gfc_strstatus(GF_OK);
-                if (memcmp(&hdr_stuff[npos], cstat, strlen(cstat)) != 0) {
-                    fprintf(stderr, "[ERROR] status received from server is unknown, expected OK\n");
-                    gfc_set_status(gfr, GF_ERROR);
-                    break;
-                }
+        struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = gfr};
+        if (epoll_ctl(multi->epfd, EPOLL_CTL_ADD, gfr->sockfd, &ev) != 0) {
+            gflog_error("adding transfer to epoll instance: %s", strerror(errno));
+            gfc_multi_fail(multi, gfr);
+        }
+        return;
+    }
+    gfc_multi_fail(multi, gfr);
+}
 
-                /* valid header with no errors, get file length */
-                no_hdr_err = 1;
-                npos += (1 + strlen(cstat));
-                memcpy(cfilelen, &hdr_stuff[npos], (hdr_end - &hdr_stuff[npos]));
-                gfr->file_len = (size_t) atoi(cfilelen);
-
-                /* get full header length */
-                hdr_end += 3;
-                ptrdiff_t hdr_len = hdr_end - hdr_stuff + 1;
-
-                /* provide header to header callback */
-                if (gfr->hdr_func != NULL)
-                    gfr->hdr_func(hdr_stuff, (size_t)hdr_len, gfr->hdr_arg);
-
-                /* anything left in hdr is file contents, provide to write callback */
-                size_t byts_lft = hdr_stuff_usd - hdr_len;
-                /*determine how many bytes are left to be read and only read from buffer any file bytes remaining */
-                size_t byts_to_rd = 0;
-                ssize_t byts_rem = gfr->file_len;
-                if (byts_rem < byts_lft) {
-                    byts_to_rd = (size_t)byts_rem;
-                } else {
-                    byts_to_rd = (size_t)byts_lft;
-                }
+/* moves on to the next address after connecting failed with err */
+static void gfc_multi_connect_failed(gfcmulti_t *multi, gfcrequest_t *gfr, int err) {
+    if (gfr->iaddr + 1 >= gfr->addrs.naddrs) {
+        gflog_error("connecting to server%s: %s", (gfr->unix_path != NULL) ? " over unix socket" : "", strerror(err));
+        gfc_multi_fail(multi, gfr);
+        return;
+    }
+    gflog_debug("connecting to server: %s, trying its next address", strerror(err));
+    gfr->iaddr++;
+    gfc_multi_connect(multi, gfr);
+}
 
-                if (byts_lft) {
-                    if (dbg) fprintf(stderr, "[INFO] writing any additional data bytes after parsing header\n");
-                    gfr->tot_byts_rec += byts_to_rd;
-                    gfr->write_func(hdr_end+1, (size_t) byts_to_rd, gfr->write_arg);
-                }
+/* moves a transfer on after epoll reported its socket ready */
+static void gfc_multi_progress(gfcmulti_t *multi, gfcrequest_t *gfr, uint64_t now) {
+    gfr->last_ms = now;
+    if (gfr->phase == GFC_PH_CONNECT) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(gfr->sockfd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            epoll_ctl(multi->epfd, EPOLL_CTL_DEL, gfr->sockfd, NULL);
+            close(gfr->sockfd);
+            gfr->sockfd = -1;
+            gfc_multi_connect_failed(multi, gfr, err);
+            return;
+        }
+        gfr->phase = GFC_PH_SEND;
+        gfc_connected(gfr, &gfr->addrs, (gfr->addrs.pref + gfr->iaddr) % gfr->addrs.naddrs);
+    }
+    if (gfr->phase == GFC_PH_SEND) {
+        gfc_multi_send(multi, gfr);
+    } else if (gfr->phase == GFC_PH_RECV) {
+        gfc_multi_recv(multi, gfr);
+    }
+}
 
-                /* if  received all file bytes stop reading data */
-                if (gfc_get_bytesremaining(gfr) <= 0)
-                    break;
+/* ends the transfers past one of their deadlines */
+static void gfc_multi_sweep(gfcmulti_t *multi, uint64_t now) {
+    gfcrequest_t *next;
+    for (gfcrequest_t *gfr = multi->running.head; gfr != NULL; gfr = next) {
+        next = gfr->next;
+        const char *reason = NULL;
+        if (gfr->idle_to_ms > 0 && now >= gfr->last_ms + gfr->idle_to_ms) {
+            reason = "idle";
+        } else if (!gfr->got_hdr && gfr->hdr_to_ms > 0 && now >= gfr->start_ms + gfr->hdr_to_ms) {
+            reason = "header read";
+        } else if (gfr->xfr_to_ms > 0 && now >= gfr->start_ms + gfr->xfr_to_ms) {
+            reason = "total transfer";
+        }
+        if (reason == NULL) {
+            continue;
+        }
+        gflog_error("%s deadline expired waiting for server", reason);
+        errno = ETIMEDOUT;
+        if (gfr->phase == GFC_PH_RECV) {
+            gfc_multi_finish(multi, gfr, gfc_conclude(gfr, 1));
+        } else {
+            gfc_multi_fail(multi, gfr);
+        }
+    }
+}
 
-            } //end check for receiving full header
+gfcmulti_t *gfc_multi_create() {
+    gfcmulti_t *multi = malloc(sizeof(gfcmulti_t));
+    bzero(multi, sizeof(*multi));
+    multi->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (multi->epfd < 0) {
+        gflog_error("creating epoll instance: %s", strerror(errno));
+        free(multi);
+        return NULL;
+    }
+    multi->rcv_buf = malloc(RCV_BUF_SZ);
+    return multi;
+}
 
-        } else {
+int gfc_multi_add(gfcmulti_t *multi, gfcrequest_t *gfr) {
 
-            //if (n_rds < 100) {
-            //    fprintf(stderr, "[INFO] reading data file bytes: %i\n", n_rds);
-            //    n_rds++;
-            //}
+    if (gfr->multi != NULL) {
+        return -1;
+    }
+    gfc_reset(gfr);
+    gfr->multi = multi;
+    gfr->result = 0;
+    gfr->start_ms = gfr->last_ms = gfc_now_ms();
+    gfr->phase = GFC_PH_CONNECT;
+    gfc_list_push(&multi->running, gfr);
+    multi->nrunning++;
+
+    /* failures to start are reported through gfc_multi_info_read like
+     * any other */
+    if (gfc_server_addrs(gfr, &gfr->addrs) != 0) {
+        gfc_multi_fail(multi, gfr);
+        return 0;
+    }
+    gfr->iaddr = 0;
+    gfr->req = malloc(BUFSIZE);
+    gfr->req_len = gfc_format_request(gfr, gfr->req);
+    gfr->req_sent = 0;
+    gfc_multi_connect(multi, gfr);
+    return 0;
+}
 
-            /* determine how many bytes are left to be read and only read from buffer any file bytes reamining */
-            size_t byts_to_rd = 0;
-            ssize_t byts_rem = gfc_get_bytesremaining(gfr);
-            if (byts_rem < bytes_recv) {
-                byts_to_rd = (size_t)byts_rem;
-            } else {
-                byts_to_rd = (size_t)bytes_recv;
-            }
+int gfc_multi_perform(gfcmulti_t *multi, int timeout_ms, int *nrunning) {
 
-            /* receiving data, send bytes to write call back */
-            gfr->tot_byts_rec += byts_to_rd;
-            gfr->write_func(buffer, (size_t) byts_to_rd, gfr->write_arg);
+    int nevs = 0;
+    struct epoll_event evs[MULTI_MAX_EVENTS];
+    if (multi->nrunning > 0) {
 
-            /* if  received all file bytes stop reading data */
-            if (gfc_get_bytesremaining(gfr) <= 0)
-                break;
+        /* wake up in time to check the deadlines */
+        uint64_t now = gfc_now_ms();
+        int sweep_in = (multi->next_sweep_ms > now) ? (int)(multi->next_sweep_ms - now) : 0;
+        if (timeout_ms < 0 || timeout_ms > sweep_in) {
+            timeout_ms = sweep_in;
+        }
+        nevs = epoll_wait(multi->epfd, evs, MULTI_MAX_EVENTS, timeout_ms);
+        if (nevs < 0 && errno != EINTR) {
+            gflog_error("waiting for transfers: %s", strerror(errno));
+            return -1;
         }
     }
 
-    if (dbg) fprintf(stderr, "[INFO] done receiving data\n");
-    close(sockfd);
-    free(hdr_stuff);
+    uint64_t now = gfc_now_ms();
+    for (int iev = 0; iev < nevs; iev++) {
+        gfc_multi_progress(multi, (gfcrequest_t *) evs[iev].data.ptr, now);
+    }
+    if (now >= multi->next_sweep_ms) {
+        gfc_multi_sweep(multi, now);
+        multi->next_sweep_ms = now + MULTI_SWEEP_MS;
+    }
 
-    /* check all expected file bytes been received */
-    if (gfr->tot_byts_rec == gfr->file_len) {
-        got_data = 1;
+    if (nrunning != NULL) {
+        *nrunning = multi->nrunning;
     }
+    return 0;
+}
 
-    int cnct_stat;
-    if (bytes_recv == -1) {
-        perror("[ERROR] abnormally occurred in receiving response from server");
-        gfc_set_status(gfr, GF_INVALID); //didn't have a chance to set this above
-        cnct_stat = -1;
-    } else {
-        /* check that connection terminated gracefully but haven't fully received the header and data file */
-        if (!got_hdr) {
-            fprintf(stderr, "[ERROR] connection terminated normally BUT header was not fully received\n");
-            gfc_set_status(gfr, GF_INVALID); //didn't have a chance to set this above
-            cnct_stat = -1;
-        } else if (got_hdr && !hdr_schm_vald) {
-            fprintf(stderr, "[ERROR] connection terminated normally BUT header scheme does not match GETFILE\n");
-            cnct_stat = -1;
-        } else if (got_hdr && hdr_schm_vald && !no_hdr_err) {
-            fprintf(stderr, "[ERROR] connection terminated normally BUT header contains error report, status: %s\n", gfc_strstatus(gfr->status));
-            cnct_stat = 0;
-        } else if (got_hdr && hdr_schm_vald && no_hdr_err && !got_data) {
-            fprintf(stderr, "[ERROR] connection terminated normally BUT data was not fully received\n");
-            cnct_stat = -1;
-        } else {
-            if (dbg) fprintf(stderr, "[INFO] connection terminated normally AND data successfully transferred\n");
-            cnct_stat = 0;
-        }
+gfcrequest_t *gfc_multi_info_read(gfcmulti_t *multi, int *result) {
+    gfcrequest_t *gfr = multi->done.head;
+    if (gfr == NULL) {
+        return NULL;
+    }
+    gfc_list_unlink(&multi->done, gfr);
+    gfr->multi = NULL;
+    if (result != NULL) {
+        *result = gfr->result;
     }
+    return gfr;
+}
 
-    return cnct_stat;
+int gfc_multi_remove(gfcmulti_t *multi, gfcrequest_t *gfr) {
+    if (gfr->multi != multi) {
+        return -1;
+    }
+    if (gfr->phase != GFC_PH_DONE) {
+        gfc_set_status(gfr, GF_INVALID);
+        gfc_multi_finish(multi, gfr, -1);
+    }
+    gfc_list_unlink(&multi->done, gfr);
+    gfr->multi = NULL;
+    return 0;
+}
 
-}
\ No newline at end of file
+void gfc_multi_cleanup(gfcmulti_t *multi) {
+    while (multi->running.head != NULL) {
+        gfc_multi_remove(multi, multi->running.head);
+    }
+    while (multi->done.head != NULL) {
+        gfc_multi_remove(multi, multi->done.head);
+    }
+    close(multi->epfd);
+    free(multi->rcv_buf);
+    free(multi);
+}
@@ -4,9 +4,15 @@
 /*
  * gfclient is a client library for transferring files using the GETFILE
  * protocol.  The interface is inspired by libcurl's "easy" interface. 
+ * Many transfers can also be driven from a single thread through a multi
+ * handle, inspired by libcurl's "multi" interface, see gfc_multi_create.
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "gfsock.h"
 
 typedef enum {
   GF_OK,
@@ -15,9 +21,21 @@ typedef enum {
   GF_INVALID
 } gfstatus_t;
 
+typedef enum {
+  GF_METHOD_GET,
+  GF_METHOD_HEAD
+} gfmethod_t;
+
+/* content encodings, accepted encodings are or'ed together */
+#define GF_ENC_IDENTITY 0
+#define GF_ENC_GZIP 1
+
 /*struct for a getfile request*/
 typedef struct gfcrequest_t gfcrequest_t;
 
+/*struct for a set of requests transferred concurrently*/
+typedef struct gfcmulti_t gfcmulti_t;
+
 /*
  * Returns the string associated with the input status
  */
@@ -32,10 +50,47 @@ char* gfc_strstatus(gfstatus_t status);
 gfcrequest_t *gfc_create();
 
 /*
- * Sets the server to which the request will be sent.
+ * Sets the server to which the request will be sent, by name or as an
+ * IPv4 or IPv6 address.  Names are resolved once and cached for all
+ * requests of the process, see gfc_set_dns_ttl.  When a name has several
+ * addresses they are tried in turn, starting with the one that last
+ * accepted a connection.
  */
 void gfc_set_server(gfcrequest_t *gfr, char* server);
 
+/*
+ * Connects to the given address instead of resolving the server name,
+ * e.g. one returned by gfc_resolve.  The port is that of the address,
+ * gfc_set_port then has no effect.
+ */
+void gfc_set_addr(gfcrequest_t *gfr, const struct sockaddr *addr, socklen_t addr_len);
+
+/*
+ * Resolves host and fills in the address a request to it on port would
+ * connect to first.  Returns -1 if the name cannot be resolved.
+ */
+int gfc_resolve(const char *host, unsigned short port, struct sockaddr_storage *addr, socklen_t *addr_len);
+
+/*
+ * Sets how long resolved names are cached, 0 resolves a name for every
+ * request, and empties the cache (Default: 60000).
+ */
+void gfc_set_dns_ttl(unsigned int ttl_ms);
+
+/*
+ * Connects to a server on the same host over the unix domain socket at
+ * path instead of over TCP, the server name and port are then ignored.
+ * NULL switches back to TCP.
+ */
+void gfc_set_unix_path(gfcrequest_t *gfr, char* path);
+
+/*
+ * Sets the socket options applied before connecting.  Defaults to
+ * gfsock_opts_default for a segment size of 0 with Fast Open off, since
+ * it only pays off against servers that enable it.
+ */
+void gfc_set_sockopts(gfcrequest_t *gfr, const gfsock_opts_t *opts);
+
 /*
  * Sets the path of the file that will be requested.
  */
@@ -46,6 +101,65 @@ void gfc_set_path(gfcrequest_t *gfr, char* path);
  */
 void gfc_set_port(gfcrequest_t *gfr, unsigned short port);
 
+/*
+ * Sets the method of the request (Default: GF_METHOD_GET).  A
+ * GF_METHOD_HEAD request only receives the response header, which
+ * is enough to learn whether the file exists and its length via
+ * gfc_get_status and gfc_get_filelen.  The write callback is never
+ * called for a head request.
+ */
+void gfc_set_method(gfcrequest_t *gfr, gfmethod_t method);
+
+/*
+ * Requests only len bytes of the file starting at byte offset.  A len
+ * of 0 requests the remainder of the file.  On an OK response,
+ * gfc_get_filelen returns the length of the range that is sent, which
+ * is clamped to the end of the file.  Use a head request to learn the
+ * full length of a file before splitting it into ranges.
+ */
+void gfc_set_range(gfcrequest_t *gfr, size_t offset, size_t len);
+
+/*
+ * Sets the encodings the server may send the file in, as GF_ENC_*
+ * flags or'ed together (Default: GF_ENC_IDENTITY).  Encoded bodies are
+ * decoded as they arrive, so the write callback always receives the file
+ * as is and gfc_get_filelen and gfc_get_bytesreceived count decoded
+ * bytes.  Only whole file GET requests are sent encoded.
+ */
+void gfc_set_accept_encoding(gfcrequest_t *gfr, int encodings);
+
+/*
+ * Sets the response deadlines in milliseconds, a value of 0 disables
+ * the deadline.  The header deadline bounds the time until the full
+ * response header is received, the idle deadline bounds the time
+ * without receiving any data (and connecting and sending the request),
+ * and the transfer deadline bounds the time for the whole request.
+ * gfc_perform fails when a deadline expires.
+ * (Defaults: header 30000, idle 15000, transfer 0)
+ */
+void gfc_set_timeouts(gfcrequest_t *gfr, unsigned int hdr_to_ms, unsigned int idle_to_ms, unsigned int xfr_to_ms);
+
+/*
+ * Receives the response into the len bytes at buf, which must stay valid
+ * until the transfer is done, instead of a buffer of the library's.  With
+ * a NULL buf the library allocates len bytes for each gfc_perform.
+ * Larger buffers take fewer receive calls and give the write callback
+ * larger chunks.  Transfers of a multi handle without a buffer of their
+ * own share one of the default size. (Default: 65536 bytes)
+ */
+void gfc_set_buffer(gfcrequest_t *gfr, void *buf, size_t len);
+
+/*
+ * Writes the body into the file fd, its first byte at offset, instead of
+ * passing it to the write callback.  Once the response header gives the
+ * length, the space it needs is reserved with fallocate.  gfc_perform
+ * then moves unencoded bodies from the socket into the file with splice,
+ * so they are not copied through user space, encoded bodies and multi
+ * transfers are written with pwrite.  An fd of -1 switches back to the
+ * write callback.
+ */
+void gfc_set_sink(gfcrequest_t *gfr, int fd, off_t offset);
+
 /*
  * Sets the callback for received header.  The registered callback
  * will receive a pointer the header of the response, the length 
@@ -84,6 +198,17 @@ void gfc_set_writefunc(gfcrequest_t *gfr, void (*writefunc)(void*, size_t, void
  */
 void gfc_set_writearg(gfcrequest_t *gfr, void *writearg);
 
+/*
+ * Sets a pointer for the caller's own use, returned by gfc_get_private.
+ * Handy to find the state of a transfer returned by gfc_multi_info_read.
+ */
+void gfc_set_private(gfcrequest_t *gfr, void *priv);
+
+/*
+ * Returns the pointer set with gfc_set_private, or NULL.
+ */
+void *gfc_get_private(gfcrequest_t *gfr);
+
 /*
  * Returns the status of the response.
  */
@@ -95,6 +220,17 @@ gfstatus_t gfc_get_status(gfcrequest_t *gfr);
  */
 size_t gfc_get_filelen(gfcrequest_t *gfr);
 
+/*
+ * Returns the GF_ENC_* encoding the server sent the file in.
+ */
+int gfc_get_encoding(gfcrequest_t *gfr);
+
+/*
+ * Returns the number of bytes of the body as sent by the server, which
+ * is less than gfc_get_filelen for compressed bodies.
+ */
+size_t gfc_get_encodedlen(gfcrequest_t *gfr);
+
 /*
  * Returns actual number of bytes received before the connection is closed.
  * This may be distinct from the result of gfc_get_filelen when the response 
@@ -103,7 +239,16 @@ size_t gfc_get_filelen(gfcrequest_t *gfr);
 size_t gfc_get_bytesreceived(gfcrequest_t *gfr);
 
 /*
- * Frees memory associated with the request.  
+ * Return the microseconds from the start of the last transfer until it
+ * was connected and until the first byte of the response arrived, 0 if
+ * it did not get that far.
+ */
+uint64_t gfc_get_connect_us(gfcrequest_t *gfr);
+uint64_t gfc_get_ttfb_us(gfcrequest_t *gfr);
+
+/*
+ * Frees memory associated with the request.  A request still added to a
+ * multi handle is removed from it first.
  */
 void gfc_cleanup(gfcrequest_t *gfr);
 
@@ -132,4 +277,52 @@ void gfc_global_cleanup();
  */
 int gfc_perform(gfcrequest_t *gfr);
 
+/*
+ * Creates a multi handle, which transfers any number of requests at once
+ * over non-blocking sockets waited on with epoll, so no thread is needed
+ * per transfer.  A multi handle and the requests added to it must only
+ * be used by one thread at a time, use one handle per thread to spread
+ * transfers over a few threads.  Returns NULL on errors.
+ */
+gfcmulti_t *gfc_multi_create();
+
+/*
+ * Starts the transfer of a request set up as for gfc_perform.  Its
+ * callbacks are called from gfc_multi_perform as the response arrives.
+ * Connecting may fail right away, the request is then reported done by
+ * gfc_multi_info_read like any other.  Returns -1 if the request is
+ * already added to a multi handle.
+ */
+int gfc_multi_add(gfcmulti_t *multi, gfcrequest_t *gfr);
+
+/*
+ * Waits up to timeout_ms milliseconds, or until a socket is ready if
+ * negative, and moves the transfers that are ready on.  The wait is cut
+ * short to check the deadlines set with gfc_set_timeouts, which are thus
+ * enforced with a granularity of some tens of milliseconds.  Returns
+ * right away when no transfer is running.  The number of transfers still
+ * running is stored in nrunning if not NULL.  Returns -1 on errors.
+ */
+int gfc_multi_perform(gfcmulti_t *multi, int timeout_ms, int *nrunning);
+
+/*
+ * Returns a request whose transfer finished since the last call, or NULL
+ * if there is none.  result receives what gfc_perform would have
+ * returned for it.  The request is no longer part of the multi handle
+ * and may be cleaned up or added again.
+ */
+gfcrequest_t *gfc_multi_info_read(gfcmulti_t *multi, int *result);
+
+/*
+ * Removes a request from the multi handle, aborting its transfer if it
+ * is still running.  Returns -1 if the request is not part of it.
+ */
+int gfc_multi_remove(gfcmulti_t *multi, gfcrequest_t *gfr);
+
+/*
+ * Removes all requests, without cleaning them up, and frees the multi
+ * handle.
+ */
+void gfc_multi_cleanup(gfcmulti_t *multi);
+
 #endif 
\ No newline at end of file
@@ -1,15 +1,24 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "workload.h"
+#include "gfbench.h"
 #include "gfclient.h"
+#include "gfhash.h"
+#include "gflog.h"
 #include "steque.h"
 
 #define USAGE                                                                 \
@@ -19,11 +28,71 @@
 "  -s [server_addr]    Server address (Default: 0.0.0.0)\n"                   \
 "  -p [server_port]    Server port (Default: 8888)\n"                         \
 "  -w [workload_path]  Path to workload file (Default: workload.txt)\n"       \
+"  --workload-mode [mode]  How paths are picked from the workload: seq, random,\n"\
+"                      zipf[:alpha] with the first path most popular, weighted by the\n"\
+"                      weight after each path, or trace[:scale] to replay the times\n"\
+"                      before each path scaled by scale (Default: seq)\n"\
+"  --seed [n]          Seed of random workloads and poisson arrivals (Default: 1)\n"\
 "  -t [nthreads]       Number of threads (Default 1)\n"                       \
 "  -n [num_requests]   Requests download per thread (Default: 1)\n"           \
+"  -H                  Only probe file existence and size with HEAD requests\n"\
+"  -S [num_segments]   Download each file as concurrent byte ranges (Default: 1)\n"\
+"  -u [socket_path]    Connect over the server's unix domain socket instead of TCP\n"\
+"  --compare-unix      Alternate requests between TCP and the unix socket given with -u\n"\
+"                      and compare their latencies\n"\
+"  --hdr-timeout [ms]  Deadline for receiving a response header (Default: 30000)\n"\
+"  --idle-timeout [ms] Deadline for progress on a connection (Default: 15000)\n"\
+"  --xfer-timeout [ms] Deadline for a whole request, 0 for none (Default: 0)\n"\
+"  --gzip              Accept gzip compressed responses, decoded before being written\n"\
+"  --multi [n]         Drive up to n downloads per thread from one multi handle instead\n"\
+"                      of one download at a time (Default: 0, off)\n"\
+"  --recv-buf [bytes]  Receive buffer size, 0 for the library default (Default: 0)\n"\
+"  --stdio             Write files with fwrite from the write callback instead of\n"\
+"                      splicing them from the socket\n"\
+"  --discard           Count the bytes received without writing any files\n"\
+"  --verify [manifest] Check the XXH64 digest of every file received against the\n"\
+"                      manifest, lines of a hex digest and a request path as written\n"\
+"                      by xxhsum -H1, and exit with 1 if any does not match\n"\
+"  --nodelay [0|1]          Disable Nagle's algorithm (Default: 1)\n"\
+"  --sndbuf [bytes]         Socket send buffer size, 0 autotunes (Default: 0)\n"\
+"  --rcvbuf [bytes]         Socket receive buffer size, 0 autotunes (Default: 0)\n"\
+"  --notsent-lowat [bytes]  Unsent bytes queued on the socket, 0 unlimited (Default: 16384)\n"\
+"  --fastopen [0|1]         Send requests with TCP Fast Open (Default: 0)\n"\
+"  --busy-poll [us]         Busy poll the device queue on reads, 0 disables (Default: 0)\n"\
+"  --sweep [name=v1,v2,..]  Run the workload once per value of a socket option above\n"\
+"                           and report latencies and throughput of each run\n"\
+"  --log-level [level]      Log error, warn, info or debug messages (Default: info)\n"\
+"  --bench [format]    Report throughput, statuses and connect, first byte and total\n"\
+"                      latency percentiles of each run as text, json or csv\n"\
+"  --bench-out [path]  File the benchmark results are appended to (Default: stdout)\n"\
+"  --rate [r|lo:hi:step]  Issue requests open loop at r per second instead of back to\n"\
+"                      back, timing them from when they were due.  lo:hi:step runs\n"\
+"                      the workload at rising rates until the server falls behind\n"\
+"  --arrivals [type]   Spacing of open loop requests, fixed or poisson (Default: fixed)\n"\
 "  -h                  Show this help message\n"                              \
 
-static const int dbg = 1;
+/* long only options */
+enum {
+    OPT_HDR_TO = 256,
+    OPT_IDLE_TO,
+    OPT_XFR_TO,
+    OPT_CMP_UNIX,
+    OPT_SOCKOPT,
+    OPT_SWEEP,
+    OPT_GZIP,
+    OPT_LOG_LEVEL,
+    OPT_MULTI,
+    OPT_RCV_BUF,
+    OPT_STDIO,
+    OPT_BENCH,
+    OPT_BENCH_OUT,
+    OPT_RATE,
+    OPT_ARRIVALS,
+    OPT_WL_MODE,
+    OPT_SEED,
+    OPT_DISCARD,
+    OPT_VERIFY
+};
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
@@ -32,6 +101,33 @@ static struct option gLongOptions[] = {
         {"workload-path", required_argument,      NULL,           'w'},
         {"nthreads",      required_argument,      NULL,           't'},
         {"nrequests",     required_argument,      NULL,           'n'},
+        {"head",          no_argument,            NULL,           'H'},
+        {"segments",      required_argument,      NULL,           'S'},
+        {"unix-path",     required_argument,      NULL,           'u'},
+        {"compare-unix",  no_argument,            NULL,           OPT_CMP_UNIX},
+        {"hdr-timeout",   required_argument,      NULL,           OPT_HDR_TO},
+        {"idle-timeout",  required_argument,      NULL,           OPT_IDLE_TO},
+        {"xfer-timeout",  required_argument,      NULL,           OPT_XFR_TO},
+        {"nodelay",       required_argument,      NULL,           OPT_SOCKOPT},
+        {"sndbuf",        required_argument,      NULL,           OPT_SOCKOPT},
+        {"rcvbuf",        required_argument,      NULL,           OPT_SOCKOPT},
+        {"notsent-lowat", required_argument,      NULL,           OPT_SOCKOPT},
+        {"fastopen",      required_argument,      NULL,           OPT_SOCKOPT},
+        {"busy-poll",     required_argument,      NULL,           OPT_SOCKOPT},
+        {"sweep",         required_argument,      NULL,           OPT_SWEEP},
+        {"gzip",          no_argument,            NULL,           OPT_GZIP},
+        {"log-level",     required_argument,      NULL,           OPT_LOG_LEVEL},
+        {"multi",         required_argument,      NULL,           OPT_MULTI},
+        {"recv-buf",      required_argument,      NULL,           OPT_RCV_BUF},
+        {"stdio",         no_argument,            NULL,           OPT_STDIO},
+        {"bench",         required_argument,      NULL,           OPT_BENCH},
+        {"bench-out",     required_argument,      NULL,           OPT_BENCH_OUT},
+        {"rate",          required_argument,      NULL,           OPT_RATE},
+        {"arrivals",      required_argument,      NULL,           OPT_ARRIVALS},
+        {"workload-mode", required_argument,      NULL,           OPT_WL_MODE},
+        {"seed",          required_argument,      NULL,           OPT_SEED},
+        {"discard",       no_argument,            NULL,           OPT_DISCARD},
+        {"verify",        required_argument,      NULL,           OPT_VERIFY},
         {"help",          no_argument,            NULL,           'h'},
         {NULL,            0,                      NULL,             0}
 };
@@ -42,6 +138,79 @@ static pthread_mutex_t rqst_lock;
 static pthread_cond_t rqst_rdy;
 static int rqst_cnt = 0;
 static int g_nthds = 0;
+static int g_head = 0;
+static int g_nsegs = 1;
+static unsigned int g_hdr_to_ms = 30000;
+static unsigned int g_idle_to_ms = 15000;
+static unsigned int g_xfr_to_ms = 0;
+static char *g_unix_path = NULL;
+static int g_cmp_unix = 0;
+static gfsock_opts_t g_sock_opts;
+static int g_accept_enc = GF_ENC_IDENTITY;
+static int g_multi = 0;
+static size_t g_rcv_buf_sz = 0;
+static int g_stdio = 0;
+static int g_discard = 0;
+static int g_bench = -1;                   //GFBENCH_* format of the results, -1 when not benchmarking
+static FILE *g_bench_out = NULL;
+static double g_rate = 0;                  //requests per second of an open loop run, 0 for closed loop
+static int g_poisson = 0;                  //open loop requests arrive as a poisson process
+static int g_trace = 0;                    //requests are replayed at the times of a trace
+static int g_open = 0;                     //requests are queued when due, by rate or trace
+static unsigned long g_seed = 1;
+static struct timespec g_last_pick;        //when the last request of the run was picked up
+
+/* expected digests of --verify, sorted by path, and what checking found */
+typedef struct manifest_entry {
+    char *path;
+    uint64_t digest;
+} manifest_entry;
+static manifest_entry *g_manifest = NULL;
+static size_t g_nmanifest = 0;
+static uint64_t g_nmatched;
+static uint64_t g_nmismatched;
+static uint64_t g_nunlisted;
+
+/* request latencies in microseconds per transport, reported at the end */
+#define XPRT_TCP 0
+#define XPRT_UNIX 1
+static const char *xprt_names[2] = {"tcp", "unix"};
+static uint64_t *g_lat_us[2];
+static int g_nlat[2];
+static uint64_t g_nbytes;                  //bytes received in the current run
+static uint64_t g_nsaved;                  //bytes of the run not sent thanks to compression
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int tls_xprt = XPRT_TCP;   //transport of the request the thread is performing
+
+/* outcome of the request the thread finished last, for the benchmark results */
+static __thread int tls_tid;                //benchmark slot of the thread
+static __thread int tls_stat;               //gfstatus_t of the response
+static __thread uint64_t tls_conn_us;       //connect latency, 0 if not connected
+static __thread uint64_t tls_ttfb_us;       //first byte latency, 0 if nothing arrived
+static __thread uint64_t tls_lag_us;        //open loop, time the request waited past when it was due
+
+/* files are only split into segments of at least this many bytes and a
+ * segment is re-requested from its last received byte up to this many times */
+#define SEG_MIN_SZ (256 * 1024)
+#define SEG_RETRIES 3
+
+/* a rate ramp stops at the first rate whose last request was picked up
+ * later than this fraction of the time it was due after the start */
+#define RAMP_KNEE 0.9
+
+/* open loop multi threads check for due requests this often */
+#define OPEN_POLL_MS 1
+
+typedef struct seg_xfer {
+    char *server;
+    unsigned short port;
+    char *req_path;
+    int fd;             //destination file, shared by all segments
+    size_t off;         //offset of the segment in the file
+    size_t len;         //length of the segment
+    size_t byts_rcv;    //bytes of the segment written so far
+    int xprt;           //transport of the download the segment belongs to
+} seg_xfer;
 
 typedef struct que_item {
     char *server;
@@ -49,16 +218,43 @@ typedef struct que_item {
     char *filepath;
     void* arg;
     int id;
+    int has_due;            //open loop, the request was due at due
+    struct timespec due;
 } que_item;
 
+/* where the body of a whole file download goes */
+typedef struct xfer_dst {
+    FILE *file;             //local file, NULL when discarding
+    char local_path[512];
+    int hashing;            //the body is hashed to be verified
+    gfhash_t hash;
+} xfer_dst;
+
+/* a download in flight on a thread's multi handle */
+typedef struct multi_xfer {
+    que_item *qi;
+    xfer_dst dst;
+    int xprt;
+    struct timespec start;
+    uint64_t lag_us;
+} multi_xfer;
+
 /* forward declarations */
-static que_item *create_que_item(char *server, unsigned short port, char *filepath, int qid, void *arg);
+static que_item *create_que_item(char *server, unsigned short port, char *filepath, int qid, const struct timespec *due, void *arg);
 static void destroy_que_item(que_item *item);
-static void enqueue_rqst(char *server, unsigned short port, char *filepath, int qid, void* arg);
+static void enqueue_rqst(char *server, unsigned short port, char *filepath, int qid, const struct timespec *due, void* arg);
 static void *dequeue_rqsts(void *arg);
+static void *dequeue_rqsts_multi(void *arg);
+static que_item *pop_rqst(int tid, int block);
 static size_t perform_xfer(char *server, unsigned short port, char *req_path);
+static gfcrequest_t *start_xfer(char *server, unsigned short port, char *req_path, xfer_dst *dst);
+static size_t finish_xfer(gfcrequest_t *gfr, int returncode, char *req_path, xfer_dst *dst);
+static size_t perform_probe(char *server, unsigned short port, char *req_path);
+static size_t perform_seg_xfer(char *server, unsigned short port, char *req_path);
 static void _init_global_def();
 static void _clean_global_def();
+static void print_latencies();
+static int run_workload(char *server, unsigned short port, int nthreads, int nrequests, const char *label, int *saturated);
 
 static void Usage() {
     fprintf(stdout, "%s", USAGE);
@@ -67,7 +263,7 @@ static void Usage() {
 static void localPath(char *req_path, char *local_path){
     static int counter = 0;
 
-    sprintf(local_path, "%s-%06d", &req_path[1], counter++);
+    sprintf(local_path, "%s-%06d", &req_path[1], __sync_fetch_and_add(&counter, 1));
 }
 
 static FILE* openFile(char *path){
@@ -81,7 +277,7 @@ static FILE* openFile(char *path){
 
         if (0 > mkdir(&path[0], S_IRWXU)){
             if (errno != EEXIST){
-                perror("Unable to create directory");
+                gflog_error("Unable to create directory: %s", strerror(errno));
                 exit(1);
             }
         }
@@ -90,18 +286,135 @@ static FILE* openFile(char *path){
         prev = cur;
     }
 
-    if( NULL == (ans = fopen(&path[0], "w"))){
-        perror("Unable to open file");
+    if( NULL == (ans = fopen(&path[0], "w+"))){
+        gflog_error("Unable to open file: %s", strerror(errno));
         exit(1);
     }
 
     return ans;
 }
 
+/* creates a request with the options common to all transfers */
+static gfcrequest_t *create_request(char *server, unsigned short port, char *req_path) {
+    gfcrequest_t *gfr = gfc_create();
+    gfc_set_server(gfr, server);
+    gfc_set_path(gfr, req_path);
+    gfc_set_port(gfr, port);
+    gfc_set_timeouts(gfr, g_hdr_to_ms, g_idle_to_ms, g_xfr_to_ms);
+    gfc_set_sockopts(gfr, &g_sock_opts);
+    gfc_set_accept_encoding(gfr, g_accept_enc);
+    if (g_rcv_buf_sz > 0) {
+        gfc_set_buffer(gfr, NULL, g_rcv_buf_sz);
+    }
+    if (tls_xprt == XPRT_UNIX) {
+        gfc_set_unix_path(gfr, g_unix_path);
+    }
+    return gfr;
+}
+
+static int cmp_manifest(const void *a, const void *b) {
+    return strcmp(((const manifest_entry *) a)->path, ((const manifest_entry *) b)->path);
+}
+
+/* reads the digests files are verified against, returns -1 if the
+ * manifest cannot be read or is malformed */
+static int load_manifest(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    char line[1024];
+    size_t nalloc = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *end;
+        uint64_t digest = strtoull(line, &end, 16);
+        if (end == line && (*line == '\n' || *line == '#')) {
+            continue;
+        }
+        char *req_path = end + strspn(end, " \t");
+        req_path[strcspn(req_path, "\r\n")] = '\0';
+        if (end == line || end == req_path || req_path[0] != '/') {
+            fclose(file);
+            return -1;
+        }
+        if (g_nmanifest == nalloc) {
+            nalloc = (nalloc == 0) ? 64 : nalloc * 2;
+            g_manifest = realloc(g_manifest, nalloc * sizeof(manifest_entry));
+        }
+        g_manifest[g_nmanifest].path = strdup(req_path);
+        g_manifest[g_nmanifest].digest = digest;
+        g_nmanifest++;
+    }
+    fclose(file);
+    qsort(g_manifest, g_nmanifest, sizeof(manifest_entry), cmp_manifest);
+    return 0;
+}
+
+/* checks the digest of a downloaded file against the manifest, returns
+ * -1 if they differ.  Files the manifest does not list pass unchecked */
+static int verify_digest(char *req_path, uint64_t digest) {
+    manifest_entry key = {.path = req_path};
+    manifest_entry *ent = bsearch(&key, g_manifest, g_nmanifest, sizeof(manifest_entry), cmp_manifest);
+    if (ent == NULL) {
+        __sync_fetch_and_add(&g_nunlisted, 1);
+        return 0;
+    }
+    if (ent->digest != digest) {
+        gflog_error("%s received with digest %016lx, the manifest has %016lx", req_path,
+                    (unsigned long) digest, (unsigned long) ent->digest);
+        __sync_fetch_and_add(&g_nmismatched, 1);
+        return -1;
+    }
+    __sync_fetch_and_add(&g_nmatched, 1);
+    return 0;
+}
+
+/* verifies the file_len bytes of a segmented download written to fd */
+static int verify_file(int fd, size_t file_len, char *req_path) {
+    char buf[65536];
+    gfhash_t hash;
+    gfhash_init(&hash, 0);
+    for (size_t off = 0; off < file_len; ) {
+        ssize_t n = pread(fd, buf, sizeof(buf), (off_t) off);
+        if (n <= 0) {
+            gflog_error("Unable to read back %s to verify it: %s", req_path, strerror(errno));
+            return -1;
+        }
+        gfhash_update(&hash, buf, (size_t) n);
+        off += (size_t) n;
+    }
+    return verify_digest(req_path, gfhash_digest(&hash));
+}
+
 /* Callbacks */
 static void writecb(void* data, size_t data_len, void *arg){
-    FILE *file = (FILE*) arg;
-    fwrite(data, 1, data_len, file);
+    xfer_dst *dst = (xfer_dst*) arg;
+    if (dst->file != NULL) {
+        fwrite(data, 1, data_len, dst->file);
+    }
+    if (dst->hashing) {
+        gfhash_update(&dst->hash, data, data_len);
+    }
+}
+
+static void countcb(void* data, size_t data_len, void *arg){
+    seg_xfer *sx = (seg_xfer*) arg;
+    sx->byts_rcv += data_len;
+}
+
+static void pwritecb(void* data, size_t data_len, void *arg){
+    seg_xfer *sx = (seg_xfer*) arg;
+    size_t written = 0;
+    while (written < data_len) {
+        ssize_t n = pwrite(sx->fd, (char *)data + written, data_len - written, sx->off + sx->byts_rcv + written);
+        if (n < 0) {
+            gflog_error("Unable to write segment: %s", strerror(errno));
+            exit(1);
+        }
+        written += n;
+    }
+    sx->byts_rcv += data_len;
 }
 
 /* Main */
@@ -114,9 +427,21 @@ int main(int argc, char **argv) {
     int option_char = 0;
     int nrequests = 1;
     int nthreads = 1;
+    int long_idx = 0;
+    char sweep_name[32] = "";
+    char *sweep_vals = NULL;
+    int log_level = GFLOG_INFO;
+    double rate_lo = 0, rate_hi = 0, rate_step = 0;
+    int wl_mode = WORKLOAD_SEQ;
+    double wl_param = 0;
+
+    /* the client only sends small requests, so the defaults are those
+     * for the smallest segments, and Fast Open is left to be asked for */
+    gfsock_opts_default(&g_sock_opts, 0);
+    g_sock_opts.fastopen = 0;
 
     // Parse and set command line arguments
-    while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:h", gLongOptions, NULL)) != -1) {
+    while ((option_char = getopt_long(argc, argv, "s:p:w:n:t:HS:u:h", gLongOptions, &long_idx)) != -1) {
         switch (option_char) {
             case 's': // server
                 server = optarg;
@@ -133,6 +458,115 @@ int main(int argc, char **argv) {
             case 't': // nthreads
                 nthreads = atoi(optarg);
                 break;
+            case 'H': // head
+                g_head = 1;
+                break;
+            case 'S': // segments
+                g_nsegs = atoi(optarg);
+                break;
+            case 'u': // unix-path
+                g_unix_path = optarg;
+                break;
+            case OPT_CMP_UNIX:
+                g_cmp_unix = 1;
+                break;
+            case OPT_HDR_TO:
+                g_hdr_to_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_IDLE_TO:
+                g_idle_to_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_XFR_TO:
+                g_xfr_to_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_GZIP:
+                g_accept_enc |= GF_ENC_GZIP;
+                break;
+            case OPT_SOCKOPT:
+                gfsock_opts_set(&g_sock_opts, gLongOptions[long_idx].name, atol(optarg));
+                break;
+            case OPT_SWEEP:
+                if (sscanf(optarg, "%31[^=]=", sweep_name) != 1 || strchr(optarg, '=') == NULL
+                    || gfsock_opts_set(&g_sock_opts, sweep_name, 0) != 0) {
+                    fprintf(stderr, "--sweep expects a socket option and values, e.g. rcvbuf=65536,262144\n");
+                    exit(1);
+                }
+                sweep_vals = strchr(optarg, '=') + 1;
+                break;
+            case OPT_MULTI:
+                g_multi = atoi(optarg);
+                break;
+            case OPT_RCV_BUF:
+                g_rcv_buf_sz = (size_t) atol(optarg);
+                break;
+            case OPT_STDIO:
+                g_stdio = 1;
+                break;
+            case OPT_BENCH:
+                if ((g_bench = gfbench_parse_format(optarg)) < 0) {
+                    fprintf(stderr, "--bench expects text, json or csv\n");
+                    exit(1);
+                }
+                break;
+            case OPT_RATE: {
+                int nvals = sscanf(optarg, "%lf:%lf:%lf", &rate_lo, &rate_hi, &rate_step);
+                if (nvals == 1) {
+                    rate_hi = rate_lo;
+                    rate_step = 0;
+                }
+                if ((nvals != 1 && nvals != 3) || rate_lo <= 0 || rate_hi < rate_lo || rate_step < 0
+                    || (nvals == 3 && rate_step == 0)) {
+                    fprintf(stderr, "--rate expects requests per second or lo:hi:step, e.g. 100:1000:100\n");
+                    exit(1);
+                }
+                break;
+            }
+            case OPT_ARRIVALS:
+                if (strcmp(optarg, "fixed") == 0) {
+                    g_poisson = 0;
+                } else if (strcmp(optarg, "poisson") == 0) {
+                    g_poisson = 1;
+                } else {
+                    fprintf(stderr, "--arrivals expects fixed or poisson\n");
+                    exit(1);
+                }
+                break;
+            case OPT_WL_MODE: {
+                static const char *modes[] = {"seq", "random", "zipf", "weighted", "trace"};
+                char name[16] = "";
+                int nvals = sscanf(optarg, "%15[^:]:%lf", name, &wl_param);
+                for (wl_mode = WORKLOAD_TRACE; wl_mode >= 0 && strcmp(name, modes[wl_mode]) != 0; wl_mode--);
+                if (wl_mode < 0 || (nvals == 2 && wl_mode != WORKLOAD_ZIPF && wl_mode != WORKLOAD_TRACE)
+                    || (nvals == 2 && wl_param <= 0) || (nvals < 2 && strchr(optarg, ':') != NULL)) {
+                    fprintf(stderr, "--workload-mode expects seq, random, zipf[:alpha], weighted or trace[:scale]\n");
+                    exit(1);
+                }
+                break;
+            }
+            case OPT_SEED:
+                g_seed = strtoul(optarg, NULL, 10);
+                break;
+            case OPT_DISCARD:
+                g_discard = 1;
+                break;
+            case OPT_VERIFY:
+                if (load_manifest(optarg) != 0) {
+                    fprintf(stderr, "Unable to read manifest %s, expected lines of a hex digest and a path.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case OPT_BENCH_OUT:
+                if ((g_bench_out = fopen(optarg, "a")) == NULL) {
+                    fprintf(stderr, "Unable to open benchmark results file %s: %s\n", optarg, strerror(errno));
+                    exit(1);
+                }
+                break;
+            case OPT_LOG_LEVEL:
+                if ((log_level = gflog_parse_level(optarg)) < 0) {
+                    fprintf(stderr, "--log-level expects error, warn, info or debug\n");
+                    exit(1);
+                }
+                break;
             case 'h': // help
                 Usage();
                 exit(0);
@@ -143,64 +577,263 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (g_cmp_unix && g_unix_path == NULL) {
+        fprintf(stderr, "--compare-unix requires the socket path given with -u.\n");
+        exit(1);
+    }
+
+    if (rate_lo > 0 && sweep_vals != NULL) {
+        fprintf(stderr, "--rate and --sweep cannot be combined.\n");
+        exit(1);
+    }
+
+    g_trace = (wl_mode == WORKLOAD_TRACE);
+    if (g_trace && rate_lo > 0) {
+        fprintf(stderr, "--rate cannot be combined with replaying a trace, which has its own times.\n");
+        exit(1);
+    }
+
+    if (g_multi > 0 && (g_head || g_nsegs > 1)) {
+        fprintf(stderr, "--multi only drives whole file downloads, not -H or -S.\n");
+        exit(1);
+    }
+
     if( 0 != workload_init(workload_path)){
         fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
         exit(1);
     }
+    workload_set_seed(g_seed);
+    if (wl_mode == WORKLOAD_ZIPF && wl_param > 0) {
+        workload_set_zipf_alpha(wl_param);
+    } else if (wl_mode == WORKLOAD_TRACE && wl_param > 0) {
+        workload_set_trace_scale(wl_param);
+    }
+    if (workload_set_mode(wl_mode) != 0) {
+        fprintf(stderr, "Workload file %s does not fit the workload mode, a trace needs a time on every line.\n",
+                workload_path);
+        exit(1);
+    }
+    g_open = (rate_lo > 0 || g_trace);
 
-    if (dbg) fprintf(stderr, "[INFO] Threads requested: %i\n", nthreads);
+    gflog_start(log_level);
+    gflog_debug("Threads requested: %i", nthreads);
     if (nthreads < 1) {
         nthreads = 1;
     }
     g_nthds = nthreads;
 
+    /* every download in flight holds a socket and a file open */
+    if (g_multi > 0) {
+        struct rlimit rl;
+        rlim_t need = (rlim_t) nthreads * g_multi * 2 + 64;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < need) {
+            rl.rlim_cur = (rl.rlim_max < need) ? rl.rlim_max : need;
+            setrlimit(RLIMIT_NOFILE, &rl);
+            if (rl.rlim_cur < need) {
+                gflog_warn("open file limit %lu is below the %lu needed for --multi %d on %d threads",
+                           (unsigned long) rl.rlim_cur, (unsigned long) need, g_multi, nthreads);
+            }
+        }
+    }
+
+    if (g_bench_out != NULL && g_bench < 0) {
+        g_bench = GFBENCH_TEXT;
+    }
+    if (g_bench >= 0) {
+        if (g_bench_out == NULL) {
+            g_bench_out = stdout;
+        }
+        if (gfbench_init(nthreads) != 0) {
+            fprintf(stderr, "Unable to allocate the benchmark results.\n");
+            exit(1);
+        }
+    }
+
     _init_global_def();
     gfc_global_init();
+    g_lat_us[XPRT_TCP] = calloc((size_t) nrequests * nthreads + 1, sizeof(uint64_t));
+    g_lat_us[XPRT_UNIX] = calloc((size_t) nrequests * nthreads + 1, sizeof(uint64_t));
+
+    if (rate_step > 0) {
+
+        /* raise the offered rate until the requests no longer start when
+         * they are due, the last rate run is past the knee */
+        for (double rate = rate_lo; rate <= rate_hi * (1 + 1e-9); rate += rate_step) {
+            char label[64];
+            snprintf(label, sizeof(label), "rate=%g", rate);
+            g_rate = rate;
+            if (g_bench < 0) {
+                fprintf(stdout, "[INFO] open loop %s\n", label);
+            }
+            int saturated;
+            if (run_workload(server, port, nthreads, nrequests, label, &saturated) != 0) {
+                return 1;
+            }
+            if (saturated) {
+                gflog_info("server fell behind at %g requests/s, the knee is below it", rate);
+                break;
+            }
+        }
+    } else if (sweep_vals == NULL) {
+        g_rate = rate_lo;
+        if (run_workload(server, port, nthreads, nrequests, "", NULL) != 0) {
+            return 1;
+        }
+    } else {
+
+        /* rerun the same workload for every value, the option being swept
+         * is the only thing that changes between runs */
+        char *save = NULL;
+        for (char *val = strtok_r(sweep_vals, ",", &save); val != NULL; val = strtok_r(NULL, ",", &save)) {
+            char label[64];
+            snprintf(label, sizeof(label), "%s=%s", sweep_name, val);
+            gfsock_opts_set(&g_sock_opts, sweep_name, atol(val));
+            if (g_bench < 0) {
+                fprintf(stdout, "[INFO] sweep %s\n", label);
+            }
+            if (run_workload(server, port, nthreads, nrequests, label, NULL) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    steque_destroy(rqst_que);
+    gfc_global_cleanup();
+    _clean_global_def();
+
+    if (g_manifest != NULL) {
+        gflog_info("verify: %lu files matched the manifest, %lu did not, %lu were not listed",
+                   (unsigned long) g_nmatched, (unsigned long) g_nmismatched, (unsigned long) g_nunlisted);
+        for (size_t i = 0; i < g_nmanifest; i++) {
+            free(g_manifest[i].path);
+        }
+        free(g_manifest);
+        if (g_nmismatched > 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* returns the microseconds from from to to, 0 if to is earlier */
+static uint64_t elapsed_us(const struct timespec *from, const struct timespec *to) {
+    int64_t us = (int64_t)(to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+    return (us > 0) ? (uint64_t) us : 0;
+}
+
+/* moves due on to the arrival of the next open loop request */
+static void next_arrival(struct timespec *due, unsigned short *seed) {
+    double gap = 1.0 / g_rate;
+    if (g_poisson) {
+        gap = -log(1.0 - erand48(seed)) / g_rate;
+    }
+    long ns = due->tv_nsec + (long)(gap * 1e9);
+    due->tv_sec += ns / 1000000000;
+    due->tv_nsec = ns % 1000000000;
+}
+
+/* sets due to secs seconds after start */
+static void add_secs(struct timespec *due, const struct timespec *start, double secs) {
+    long ns = start->tv_nsec + (long)((secs - (double)(long) secs) * 1e9);
+    due->tv_sec = start->tv_sec + (long) secs + ns / 1000000000;
+    due->tv_nsec = ns % 1000000000;
+}
+
+/* runs nrequests per thread on nthreads threads and reports the latencies
+ * and throughput of the run, named label in the benchmark results.  Open
+ * loop runs set saturated if given when the requests fell behind */
+static int run_workload(char *server, unsigned short port, int nthreads, int nrequests, const char *label, int *saturated) {
+
     rqst_cnt = nrequests * nthreads;
+    g_nlat[XPRT_TCP] = g_nlat[XPRT_UNIX] = 0;
+    g_nbytes = 0;
+    g_nsaved = 0;
+    if (g_bench >= 0) {
+        gfbench_reset();
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     /* start worker threads */
-    if (dbg) fprintf(stderr, "[INFO] creating threads ... \n");
+    gflog_debug("creating threads ...");
     pthread_t thrds[nthreads];
     for (int ithd = 0; ithd < nthreads; ithd++) {
-        if (dbg) fprintf(stderr, "[INFO] creating thread %i ... \n", ithd);
-        int rc = pthread_create(&thrds[ithd], NULL, dequeue_rqsts, &ithd);
+        gflog_debug("creating thread %i ...", ithd);
+        int rc = pthread_create(&thrds[ithd], NULL, (g_multi > 0) ? dequeue_rqsts_multi : dequeue_rqsts,
+                                (void *)(intptr_t)ithd);
         if (rc) {
-            fprintf(stderr, "ERROR when attempting to create thread %i\n - %d", ithd, rc);
+            gflog_error("when attempting to create thread %i - %d", ithd, rc);
             return 1;
         }
     }
 
-    /* perform requests */
+    /* perform requests, closed loop they are queued all at once, open loop
+     * each when it is due whether or not earlier ones are done.  All paths
+     * are picked here from the one seeded workload generator, and arrivals
+     * are seeded the same every run, so runs can be compared.  A trace is
+     * replayed from where the last run left off */
     char *req_path;
+    struct timespec due = start, last_due = start;
+    unsigned short seed[3] = {0x330e, (unsigned short) g_seed, (unsigned short)(g_seed >> 16)};
+    double trace_at, trace_start = -1;
     for(int i = 0; i < nrequests * nthreads; i++){
-        req_path = workload_get_path();
-        enqueue_rqst(server, port, req_path, i, NULL);
+        req_path = workload_get_timed_path(&trace_at);
+        if (g_trace) {
+            if (trace_start < 0) {
+                trace_start = trace_at;
+            }
+            add_secs(&due, &start, trace_at - trace_start);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+            enqueue_rqst(server, port, req_path, i, &due, NULL);
+            last_due = due;
+        } else if (g_rate > 0) {
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+            enqueue_rqst(server, port, req_path, i, &due, NULL);
+            last_due = due;
+            next_arrival(&due, seed);
+        } else {
+            enqueue_rqst(server, port, req_path, i, NULL, NULL);
+        }
     }
 
     for (int ithd = 0; ithd < nthreads; ithd++) {
         int rc = pthread_join(thrds[ithd], NULL);
         if (rc) {
-            fprintf(stderr, "ERROR when trying to join thread %i\n - %d", ithd, rc);
+            gflog_error("when trying to join thread %i - %d", ithd, rc);
             return 1;
         }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    if (dbg) fprintf(stderr, "INFO all threads complete\n");
-    steque_destroy(rqst_que);
-    gfc_global_cleanup();
-    _clean_global_def();
-
+    gflog_debug("all threads complete");
+    if (saturated != NULL) {
+        *saturated = (elapsed_us(&start, &g_last_pick) * RAMP_KNEE > elapsed_us(&start, &last_due));
+    }
+    double secs = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (g_bench >= 0) {
+        gfbench_report(g_bench_out, g_bench, label, secs);
+        return 0;
+    }
+    print_latencies();
+    fprintf(stdout, "[INFO] throughput: %d requests in %.3f s, %.1f requests/s, %.2f MB/s, %.2f MB/s on the wire\n",
+            nrequests * nthreads, secs, (nrequests * nthreads) / secs, (double) g_nbytes / secs / 1e6,
+            (double)(g_nbytes - g_nsaved) / secs / 1e6);
     return 0;
 }
 
-static que_item *create_que_item(char *server, unsigned short port, char *filepath, int qid, void *arg) {
+static que_item *create_que_item(char *server, unsigned short port, char *filepath, int qid, const struct timespec *due, void *arg) {
     que_item *new_item = malloc(sizeof(que_item));
-    bzero(new_item, sizeof(&new_item));
+    bzero(new_item, sizeof(*new_item));
     new_item->server = strdup(server);
     new_item->port = port;
     new_item->filepath = strdup(filepath);
     new_item->arg = arg;
     new_item->id = qid;
+    if (due != NULL) {
+        new_item->has_due = 1;
+        new_item->due = *due;
+    }
     return new_item;
 }
 
@@ -211,124 +844,465 @@ static void destroy_que_item(que_item *item) {
     item = NULL;
 }
 
-static void enqueue_rqst(char *server, unsigned short port, char *filepath, int qid, void* arg) {
-    /* create package to add onto queue */
-    usleep(100 * (random() % g_nthds));
-    fprintf(stderr, "[INFO] Adding request %i to queue, filpath: %s\n", qid, filepath); fflush(stderr);
-    que_item *qi = create_que_item(server, port, filepath, qid, arg);
+static void enqueue_rqst(char *server, unsigned short port, char *filepath, int qid, const struct timespec *due, void* arg) {
+    /* create package to add onto queue, open loop requests go out on
+     * their own schedule */
+    if (due == NULL) {
+        usleep(100 * (random() % g_nthds));
+    }
+    gflog_debug("Adding request %i to queue, filpath: %s", qid, filepath);
+    que_item *qi = create_que_item(server, port, filepath, qid, due, arg);
     pthread_mutex_lock(&rqst_lock);
     steque_enqueue(rqst_que, qi);
     pthread_cond_signal(&rqst_rdy);
     pthread_mutex_unlock(&rqst_lock);
 }
 
-static void *dequeue_rqsts(void *arg) {
-
-    int tid = *((int*)(arg));
-    if (dbg) fprintf(stderr, "[INFO] Thread %i is now handling request queue ...\n", tid);
+/*
+ * Pops the next request off the queue.  Returns NULL once all requests
+ * are taken, or without waiting if block is zero and none is queued.
+ */
+static que_item *pop_rqst(int tid, int block) {
 
     /* setup thread time out for waiting */
     struct timespec waittime;
     struct timeval now;
     int ret;
 
+    que_item *qi = NULL;
+    pthread_mutex_lock(&rqst_lock);
+    while (block && steque_isempty(rqst_que) && rqst_cnt != 0) {
+
+        /* set absolute time to wait until */
+        gettimeofday(&now,NULL);
+        waittime.tv_sec = now.tv_sec + 1;
+        waittime.tv_nsec = 0;
+        ret = pthread_cond_timedwait(&rqst_rdy, &rqst_lock, &waittime);
+        if (ret == ETIMEDOUT && !g_open) {
+            gflog_warn("Thread %i waiting timed out, this shouldn't occur", tid);
+        }
+    }
+
+    if (!steque_isempty(rqst_que)) {
+        qi = (que_item *) steque_pop(rqst_que);
+        rqst_cnt --;
+        if (rqst_cnt == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &g_last_pick);
+        }
+    }
+    pthread_cond_broadcast(&rqst_rdy);
+    pthread_mutex_unlock(&rqst_lock);
+    return qi;
+}
+
+/* when comparing, the transport is picked by a hash of the request id
+ * rather than its parity, so workloads cycling through an even number of
+ * files still give both the same mix */
+static int pick_xprt(que_item *qi) {
+    if (g_cmp_unix) {
+        return ((((unsigned int) qi->id * 2654435761u) >> 16) & 1) ? XPRT_UNIX : XPRT_TCP;
+    }
+    return (g_unix_path != NULL) ? XPRT_UNIX : XPRT_TCP;
+}
+
+/*
+ * Starts the clock of a request.  Open loop it runs from when the request
+ * was due, so time spent queued behind a slow server counts towards its
+ * latency instead of being hidden by the server slowing the requests down.
+ */
+static void start_clock(que_item *qi, struct timespec *start) {
+    clock_gettime(CLOCK_MONOTONIC, start);
+    tls_lag_us = 0;
+    if (qi->has_due) {
+        tls_lag_us = elapsed_us(&qi->due, start);
+        *start = qi->due;
+    }
+}
+
+/* adds the latency of a request started at start and its bytes to the
+ * run, and its outcome left in tls_stat and the timings to the benchmark */
+static void record_xfer(int xprt, struct timespec *start, size_t byts_xfr) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t lat_us = elapsed_us(start, &end);
+    if (g_bench >= 0) {
+        uint64_t conn_us = (tls_conn_us > 0) ? tls_conn_us + tls_lag_us : 0;
+        uint64_t ttfb_us = (tls_ttfb_us > 0) ? tls_ttfb_us + tls_lag_us : 0;
+        gfbench_record(tls_tid, tls_stat, (uint64_t) byts_xfr, conn_us, ttfb_us, lat_us);
+    }
+    pthread_mutex_lock(&lat_lock);
+    g_lat_us[xprt][g_nlat[xprt]++] = lat_us;
+    g_nbytes += (uint64_t) byts_xfr;
+    pthread_mutex_unlock(&lat_lock);
+}
+
+static void *dequeue_rqsts(void *arg) {
+
+    int tid = (int)(intptr_t)arg;
+    tls_tid = tid;
+    gflog_debug("Thread %i is now handling request queue ...", tid);
+
     que_item *qi = NULL;
     int done = 0;
 
     while (!done) {
-        usleep(100 * (random() % g_nthds));
+        if (!g_open) {
+            usleep(100 * (random() % g_nthds));
+        }
 
-        pthread_mutex_lock(&rqst_lock);
-        while (steque_isempty(rqst_que) && rqst_cnt != 0) {
+        qi = pop_rqst(tid, 1);
+        done = (qi == NULL);
 
-            /* set absolute time to wait until */
-            gettimeofday(&now,NULL);
-            waittime.tv_sec = now.tv_sec + 1;
-            waittime.tv_nsec = 0;
-            ret = pthread_cond_timedwait(&rqst_rdy, &rqst_lock, &waittime);
-            if (ret == ETIMEDOUT) {
-                fprintf(stderr, "[WARN] Thread %i waiting timed out, this shouldn't occur\n", tid);
+        if (!done) {
+            gflog_debug("Thread %i handling request id %i, filepath: %s", tid, qi->id, qi->filepath);
+
+            tls_xprt = pick_xprt(qi);
+            struct timespec start;
+            start_clock(qi, &start);
+
+            ssize_t byts_xfr;
+            if (g_head) {
+                byts_xfr = perform_probe(qi->server, qi->port, qi->filepath);
+            } else if (g_nsegs > 1) {
+                byts_xfr = perform_seg_xfer(qi->server, qi->port, qi->filepath);
+            } else {
+                byts_xfr = perform_xfer(qi->server, qi->port, qi->filepath);
             }
+            record_xfer(tls_xprt, &start, (size_t) byts_xfr);
+
+            destroy_que_item(qi);
+            gflog_debug("Number of requests is now: %i", rqst_cnt);
+            gflog_debug("Thread %i transferred %zu bytes", (int) tid, (size_t) byts_xfr);
         }
 
-        if (steque_isempty(rqst_que)) {
-            done = 1;
-        } else {
-            qi = (que_item *) steque_pop(rqst_que);
-            rqst_cnt --;
+    }
+
+    return NULL;
+
+}
+
+/*
+ * Keeps up to g_multi downloads in flight on one multi handle, topping
+ * it up from the queue as downloads finish.
+ */
+static void *dequeue_rqsts_multi(void *arg) {
+
+    int tid = (int)(intptr_t)arg;
+    tls_tid = tid;
+    gflog_debug("Thread %i is now handling request queue with up to %i downloads", tid, g_multi);
+
+    gfcmulti_t *multi = gfc_multi_create();
+    if (multi == NULL) {
+        exit(1);
+    }
+
+    int nactive = 0;
+    int done = 0;
+    while (!done || nactive > 0) {
+
+        /* only wait for requests when no download needs driving */
+        while (!done && nactive < g_multi) {
+            que_item *qi = pop_rqst(tid, nactive == 0);
+            if (qi == NULL) {
+                done = (nactive == 0);
+                break;
+            }
+            gflog_debug("Thread %i handling request id %i, filepath: %s", tid, qi->id, qi->filepath);
+
+            multi_xfer *mx = malloc(sizeof(multi_xfer));
+            mx->qi = qi;
+            mx->xprt = tls_xprt = pick_xprt(qi);
+            start_clock(qi, &mx->start);
+            mx->lag_us = tls_lag_us;
+            gfcrequest_t *gfr = start_xfer(qi->server, qi->port, qi->filepath, &mx->dst);
+            gfc_set_private(gfr, mx);
+            gfc_multi_add(multi, gfr);
+            nactive++;
         }
-        pthread_cond_broadcast(&rqst_rdy);
-        pthread_mutex_unlock(&rqst_lock);
 
-        if (!done) {
-            fprintf(stderr, "[INFO] Thread %i handling request id %i, filepath: %s\n", tid, qi->id, qi->filepath);
-            fflush(stderr);
-            ssize_t byts_xfr = perform_xfer(qi->server, qi->port, qi->filepath);
-            destroy_que_item(qi);
-            fprintf(stderr, "[INFO] Number of requests is now: %i\n", rqst_cnt);
-            fflush(stderr);
-            fprintf(stderr, "[INFO] Thread %i transferred %zu bytes\n", (int) tid, (size_t) byts_xfr);
-            fflush(stderr);
+        if (gfc_multi_perform(multi, g_open ? OPEN_POLL_MS : 100, NULL) != 0) {
+            exit(1);
         }
 
+        int returncode;
+        gfcrequest_t *gfr;
+        while ((gfr = gfc_multi_info_read(multi, &returncode)) != NULL) {
+            multi_xfer *mx = (multi_xfer *) gfc_get_private(gfr);
+            size_t byts_xfr = finish_xfer(gfr, returncode, mx->qi->filepath, &mx->dst);
+            tls_lag_us = mx->lag_us;
+            record_xfer(mx->xprt, &mx->start, byts_xfr);
+            gflog_debug("Thread %i transferred %zu bytes", tid, byts_xfr);
+            destroy_que_item(mx->qi);
+            free(mx);
+            nactive--;
+        }
     }
 
+    gfc_multi_cleanup(multi);
     return NULL;
-
 }
 
 static size_t perform_xfer(char *server, unsigned short port, char *req_path) {
 
-    int returncode;
+    xfer_dst dst;
 
-    FILE *file;
-    char local_path[512];
+    gfcrequest_t *gfr = start_xfer(server, port, req_path, &dst);
+    int returncode = gfc_perform(gfr);
+    return finish_xfer(gfr, returncode, req_path, &dst);
+}
+
+/* opens the local file of a download unless discarding and sets up its
+ * request */
+static gfcrequest_t *start_xfer(char *server, unsigned short port, char *req_path, xfer_dst *dst) {
 
     if(strlen(req_path) > 256){
-        fprintf(stderr, "[ERROR] Request path exceeded maximum of 256 characters\n.");
+        gflog_error("Request path exceeded maximum of 256 characters");
         exit(1);
     }
 
-    localPath(req_path, local_path);
+    dst->file = NULL;
+    if (!g_discard) {
+        localPath(req_path, dst->local_path);
+        dst->file = openFile(dst->local_path);
+    }
+    dst->hashing = (g_manifest != NULL);
+    if (dst->hashing) {
+        gfhash_init(&dst->hash, 0);
+    }
 
-    file = openFile(local_path);
+    /* the body goes straight from the socket into the file unless stdio
+     * is asked for or it is discarded or verified, which need to see it */
+    gfcrequest_t *gfr;
+    gfr = create_request(server, port, req_path);
+    if (g_stdio || dst->file == NULL || dst->hashing) {
+        gfc_set_writefunc(gfr, writecb);
+        gfc_set_writearg(gfr, dst);
+    } else {
+        gfc_set_sink(gfr, fileno(dst->file), 0);
+    }
+
+    gflog_debug("Requesting %s%s", server, req_path);
+    return gfr;
+}
+
+/* verifies a finished download if asked, closes its local file, removing
+ * it unless the file was received and matched, and cleans up the request.
+ * Returns the bytes received */
+static size_t finish_xfer(gfcrequest_t *gfr, int returncode, char *req_path, xfer_dst *dst) {
+
+    if ( 0 > returncode) {
+        gflog_error("gfc_perform returned an error %d", returncode);
+    }
+
+    tls_stat = gfc_get_status(gfr);
+    tls_conn_us = gfc_get_connect_us(gfr);
+    tls_ttfb_us = gfc_get_ttfb_us(gfr);
+
+    size_t byts_rcv = gfc_get_bytesreceived(gfr);
+    size_t file_len = gfc_get_filelen(gfr);
+    if (dst->hashing && returncode >= 0 && tls_stat == GF_OK && byts_rcv == file_len
+        && verify_digest(req_path, gfhash_digest(&dst->hash)) != 0) {
+        tls_stat = GF_ERROR;
+    }
+
+    if (dst->file != NULL) {
+        fclose(dst->file);
+        if (0 > returncode || tls_stat != GF_OK) {
+            if ( 0 > unlink(dst->local_path))
+                gflog_error("unlink failed on %s", dst->local_path);
+        }
+    }
+    size_t enc_len = gfc_get_encodedlen(gfr);
+    int enc = gfc_get_encoding(gfr);
+    char *stat = strdup( gfc_strstatus(gfc_get_status(gfr)));
+    if (enc != GF_ENC_IDENTITY && byts_rcv == file_len) {
+        __sync_fetch_and_add(&g_nsaved, (uint64_t)(file_len - enc_len));
+    }
+
+    gfc_cleanup(gfr);
+
+    gflog_debug("gfclient - status: %s", stat);
+    gflog_debug("gfclient - received %zu of %zu bytes", byts_rcv, file_len);
+    if (enc != GF_ENC_IDENTITY) {
+        gflog_debug("gfclient - gzip encoded as %zu bytes", enc_len);
+    }
+    free(stat);
+    return byts_rcv;
+}
+
+static size_t perform_probe(char *server, unsigned short port, char *req_path) {
+
+    int returncode;
 
     gfcrequest_t *gfr;
-    gfr = gfc_create();
-    gfc_set_server(gfr, server);
-    gfc_set_path(gfr, req_path);
-    gfc_set_port(gfr, port);
-    gfc_set_writefunc(gfr, writecb);
-    gfc_set_writearg(gfr, file);
+    gfr = create_request(server, port, req_path);
+    gfc_set_method(gfr, GF_METHOD_HEAD);
 
-    if (dbg) fprintf(stderr, "[INFO] Requesting %s%s\n", server, req_path);
+    gflog_debug("Probing %s%s", server, req_path);
 
     if ( 0 > (returncode = gfc_perform(gfr))) {
-        fprintf(stderr, "[ERROR] gfc_perform returned an error %d\n", returncode);
-        fclose(file);
-        if (0 > unlink(local_path)) {
-            fprintf(stderr, "[ERROR] unlink failed on %s\n", local_path);
+        gflog_error("gfc_perform returned an error %d", returncode);
+    }
+
+    tls_stat = gfc_get_status(gfr);
+    tls_conn_us = gfc_get_connect_us(gfr);
+    tls_ttfb_us = gfc_get_ttfb_us(gfr);
+
+    size_t file_len = gfc_get_filelen(gfr);
+    if (g_bench < 0) {
+        fprintf(stdout, "[INFO] gfclient - %s status: %s length: %zu\n", req_path,
+                gfc_strstatus(gfc_get_status(gfr)), file_len);
+    }
+
+    gfc_cleanup(gfr);
+    return 0;
+}
+
+static void *perform_seg_range(void *arg) {
+
+    seg_xfer *sx = (seg_xfer *) arg;
+    tls_xprt = sx->xprt;
+
+    /* on failure resume the range from the last byte received */
+    for (int attempt = 0; attempt < SEG_RETRIES && sx->byts_rcv < sx->len; attempt++) {
+        gfcrequest_t *gfr = create_request(sx->server, sx->port, sx->req_path);
+        gfc_set_range(gfr, sx->off + sx->byts_rcv, sx->len - sx->byts_rcv);
+        int sink = (sx->fd >= 0 && !g_stdio);
+        if (sx->fd < 0) {
+            gfc_set_writefunc(gfr, countcb);
+            gfc_set_writearg(gfr, sx);
+        } else if (g_stdio) {
+            gfc_set_writefunc(gfr, pwritecb);
+            gfc_set_writearg(gfr, sx);
+        } else {
+            gfc_set_sink(gfr, sx->fd, (off_t)(sx->off + sx->byts_rcv));
+        }
+
+        int returncode = gfc_perform(gfr);
+        if (sink) {
+            sx->byts_rcv += gfc_get_bytesreceived(gfr);
+        }
+        gfstatus_t stat = gfc_get_status(gfr);
+        gfc_cleanup(gfr);
+        if (returncode < 0) {
+            gflog_error("segment at offset %zu failed after %zu of %zu bytes", sx->off, sx->byts_rcv, sx->len);
+        } else if (stat != GF_OK) {
+            gflog_error("segment at offset %zu returned status %s", sx->off, gfc_strstatus(stat));
+            break;
         }
-    } else {
-        fclose(file);
     }
+    return NULL;
+}
 
-    if ( gfc_get_status(gfr) != GF_OK){
-        if ( 0 > unlink(local_path))
-            fprintf(stderr, "[ERROR] unlink failed on %s\n", local_path);
+static size_t perform_seg_xfer(char *server, unsigned short port, char *req_path) {
+
+    char local_path[512];
+
+    if(strlen(req_path) > 256){
+        gflog_error("Request path exceeded maximum of 256 characters");
+        exit(1);
     }
 
-    size_t byts_rcv = gfc_get_bytesreceived(gfr);
+    /* learn the file length before splitting it into ranges */
+    gfcrequest_t *gfr = create_request(server, port, req_path);
+    gfc_set_method(gfr, GF_METHOD_HEAD);
+    int returncode = gfc_perform(gfr);
+    gfstatus_t stat = gfc_get_status(gfr);
     size_t file_len = gfc_get_filelen(gfr);
-    char *stat = strdup( gfc_strstatus(gfc_get_status(gfr)));
 
+    /* the download is timed by its probe up to the first byte */
+    tls_stat = stat;
+    tls_conn_us = gfc_get_connect_us(gfr);
+    tls_ttfb_us = gfc_get_ttfb_us(gfr);
     gfc_cleanup(gfr);
+    if (returncode < 0 || stat != GF_OK) {
+        if (g_bench < 0) {
+            fprintf(stdout, "[INFO] gfclient - status: %s\n", gfc_strstatus(stat));
+        }
+        return 0;
+    }
 
-    if(dbg) {
-        fprintf(stdout, "[INFO] gfclient - status: %s\n", stat);
-        fprintf(stdout, "[INFO] gfclient - received %zu of %zu bytes\n", byts_rcv, file_len);
+    int nsegs = g_nsegs;
+    if (file_len / SEG_MIN_SZ < (size_t)nsegs) {
+        nsegs = (int)(file_len / SEG_MIN_SZ);
     }
-    free(stat);
+    if (nsegs < 1) {
+        nsegs = 1;
+    }
+
+    /* segments are written in place into the local file, or when
+     * discarding into memory only if the file is to be verified */
+    FILE *file = NULL;
+    int fd = -1;
+    if (!g_discard) {
+        localPath(req_path, local_path);
+        file = openFile(local_path);
+        fd = fileno(file);
+    } else if (g_manifest != NULL) {
+        fd = memfd_create("gfclient-seg", MFD_CLOEXEC);
+        if (fd < 0) {
+            gflog_error("Unable to create memory file: %s", strerror(errno));
+            exit(1);
+        }
+    }
+    if (fd >= 0 && ftruncate(fd, (off_t)file_len) != 0) {
+        gflog_error("Unable to size file: %s", strerror(errno));
+        exit(1);
+    }
+
+    gflog_debug("Requesting %s%s in %d segments", server, req_path, nsegs);
+
+    /* fetch all ranges concurrently, each written in place */
+    seg_xfer sxs[nsegs];
+    pthread_t thrds[nsegs];
+    size_t seg_len = file_len / nsegs;
+    for (int iseg = 0; iseg < nsegs; iseg++) {
+        sxs[iseg].server = server;
+        sxs[iseg].port = port;
+        sxs[iseg].req_path = req_path;
+        sxs[iseg].fd = fd;
+        sxs[iseg].off = iseg * seg_len;
+        sxs[iseg].len = (iseg == nsegs - 1) ? file_len - sxs[iseg].off : seg_len;
+        sxs[iseg].byts_rcv = 0;
+        sxs[iseg].xprt = tls_xprt;
+        int rc = pthread_create(&thrds[iseg], NULL, perform_seg_range, &sxs[iseg]);
+        if (rc) {
+            gflog_error("when attempting to create segment thread %i - %d", iseg, rc);
+            exit(1);
+        }
+    }
+
+    size_t byts_rcv = 0;
+    int complete = 1;
+    for (int iseg = 0; iseg < nsegs; iseg++) {
+        pthread_join(thrds[iseg], NULL);
+        byts_rcv += sxs[iseg].byts_rcv;
+        if (sxs[iseg].byts_rcv != sxs[iseg].len) {
+            complete = 0;
+        }
+    }
+    /* the segments are only whole once all are in, so the file is hashed
+     * from where they were written */
+    if (complete && g_manifest != NULL && verify_file(fd, file_len, req_path) != 0) {
+        tls_stat = GF_ERROR;
+    }
+
+    if (file != NULL) {
+        fclose(file);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (!complete) {
+        tls_stat = GF_ERROR;
+        gflog_error("segmented download of %s incomplete", req_path);
+    }
+    if (tls_stat != GF_OK && file != NULL && 0 > unlink(local_path)) {
+        gflog_error("unlink failed on %s", local_path);
+    }
+
+    gflog_debug("gfclient - status: %s", complete ? gfc_strstatus(GF_OK) : gfc_strstatus(GF_ERROR));
+    gflog_debug("gfclient - received %zu of %zu bytes", byts_rcv, file_len);
     return byts_rcv;
 }
 
@@ -340,25 +1314,57 @@ static void _init_global_def() {
     int ret = 0;
     ret = pthread_mutex_init(&rqst_lock, NULL);
     if (ret) {
-        fprintf(stderr, "[ERROR] when attempting to create mutex\n");
+        gflog_error("when attempting to create mutex");
         exit(1);
     }
     ret = pthread_cond_init(&rqst_rdy, NULL);
     if (ret) {
-        fprintf(stderr, "[ERROR] when attempting to create add thread condition variable\n");
+        gflog_error("when attempting to create add thread condition variable");
         exit(1);
     }
     ret = pthread_cond_init(&rqst_rdy, NULL);
     if (ret) {
-        fprintf(stderr, "[ERROR] when attempting to create thread condition variable\n");
+        gflog_error("when attempting to create thread condition variable");
         exit(1);
     }
 }
 
+static int cmp_lat(const void *a, const void *b) {
+    uint64_t la = *(const uint64_t *) a, lb = *(const uint64_t *) b;
+    return (la > lb) - (la < lb);
+}
+
+/* prints the latency distribution of the requests of each transport used */
+static void print_latencies() {
+    for (int xprt = XPRT_TCP; xprt <= XPRT_UNIX; xprt++) {
+        int n = g_nlat[xprt];
+        if (n == 0) {
+            continue;
+        }
+        uint64_t *lat = g_lat_us[xprt];
+        qsort(lat, (size_t) n, sizeof(uint64_t), cmp_lat);
+        uint64_t tot = 0;
+        for (int i = 0; i < n; i++) {
+            tot += lat[i];
+        }
+        fprintf(stdout, "[INFO] %s latency: requests %d, avg %lu us, p50 %lu us, p99 %lu us, max %lu us\n",
+                xprt_names[xprt], n, (unsigned long)(tot / n), (unsigned long) lat[n / 2],
+                (unsigned long) lat[(n * 99) / 100], (unsigned long) lat[n - 1]);
+    }
+}
+
 static void _clean_global_def() {
     /* free and clean up global resources, ex: request queue, mutexes, condition vars */
     steque_destroy(rqst_que);
     free(rqst_que);
     pthread_mutex_destroy(&rqst_lock);
     pthread_cond_destroy(&rqst_rdy);
+    free(g_lat_us[XPRT_TCP]);
+    free(g_lat_us[XPRT_UNIX]);
+    if (g_bench >= 0) {
+        gfbench_cleanup();
+        if (g_bench_out != stdout) {
+            fclose(g_bench_out);
+        }
+    }
 }
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include <string.h>
+
+#include "gfhash.h"
+
+#define PRIME64_1 0x9e3779b185ebca87ull
+#define PRIME64_2 0xc2b2ae3d27d4eb4full
+#define PRIME64_3 0x165667b19e3779f9ull
+#define PRIME64_4 0x85ebca77c2b2ae63ull
+#define PRIME64_5 0x27d4eb2f165667c5ull
+
+static inline uint64_t rotl64(uint64_t val, int bits) {
+    return (val << bits) | (val >> (64 - bits));
+}
+
+/* unaligned little endian reads, the hosts this runs on are little endian */
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t hash, uint64_t acc) {
+    hash ^= round64(0, acc);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+/* runs the four lanes over whole 32 byte stripes, returns the bytes used */
+static size_t consume_stripes(uint64_t *acc, const unsigned char *p, size_t len) {
+    const unsigned char *start = p;
+    const unsigned char *limit = p + len - (len % 32);
+    uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    for (; p < limit; p += 32) {
+        a0 = round64(a0, read64(p));
+        a1 = round64(a1, read64(p + 8));
+        a2 = round64(a2, read64(p + 16));
+        a3 = round64(a3, read64(p + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    return (size_t)(p - start);
+}
+
+void gfhash_init(gfhash_t *hash, uint64_t seed) {
+    hash->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    hash->acc[1] = seed + PRIME64_2;
+    hash->acc[2] = seed;
+    hash->acc[3] = seed - PRIME64_1;
+    hash->tot_len = 0;
+    hash->buf_len = 0;
+}
+
+void gfhash_update(gfhash_t *hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    hash->tot_len += len;
+
+    /* top up a partial stripe left by the last call first */
+    if (hash->buf_len > 0) {
+        size_t fill = 32 - hash->buf_len;
+        if (fill > len) {
+            fill = len;
+        }
+        memcpy(hash->buf + hash->buf_len, p, fill);
+        hash->buf_len += fill;
+        p += fill;
+        len -= fill;
+        if (hash->buf_len < 32) {
+            return;
+        }
+        consume_stripes(hash->acc, hash->buf, 32);
+        hash->buf_len = 0;
+    }
+
+    size_t used = consume_stripes(hash->acc, p, len);
+    memcpy(hash->buf, p + used, len - used);
+    hash->buf_len = len - used;
+}
+
+uint64_t gfhash_digest(const gfhash_t *hash) {
+    uint64_t h;
+    if (hash->tot_len >= 32) {
+        const uint64_t *acc = hash->acc;
+        h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        h = merge64(h, acc[0]);
+        h = merge64(h, acc[1]);
+        h = merge64(h, acc[2]);
+        h = merge64(h, acc[3]);
+    } else {
+        /* acc[2] still holds the seed */
+        h = hash->acc[2] + PRIME64_5;
+    }
+    h += hash->tot_len;
+
+    const unsigned char *p = hash->buf;
+    const unsigned char *end = hash->buf + hash->buf_len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (uint64_t)(*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t gfhash_xxh64(const void *data, size_t len, uint64_t seed) {
+    gfhash_t hash;
+    gfhash_init(&hash, seed);
+    gfhash_update(&hash, data, len);
+    return gfhash_digest(&hash);
+}
@@ -0,0 +1,40 @@
+#ifndef __GFHASH_H__
+#define __GFHASH_H__
+
+/*
+ * gfhash computes XXH64 digests of file bodies, in one call or streamed
+ * over the chunks of a download as they arrive.  Digests match those of
+ * the xxhsum tool with -H1, so manifests can be made with it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _gfhash_t {
+    uint64_t acc[4];              //lane accumulators
+    uint64_t tot_len;             //bytes hashed so far
+    unsigned char buf[32];        //bytes not yet making up a full stripe
+    size_t buf_len;
+} gfhash_t;
+
+/*
+ * Starts a digest.
+ */
+void gfhash_init(gfhash_t *hash, uint64_t seed);
+
+/*
+ * Adds len bytes at data to the digest.
+ */
+void gfhash_update(gfhash_t *hash, const void *data, size_t len);
+
+/*
+ * Returns the digest of the bytes added so far, more may still be added.
+ */
+uint64_t gfhash_digest(const gfhash_t *hash);
+
+/*
+ * Returns the digest of len bytes at data.
+ */
+uint64_t gfhash_xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif
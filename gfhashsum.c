@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gfhash.h"
+
+#define BUFSIZE (1024 * 1024)
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfhashsum [options] file...\n"                                             \
+"options:\n"                                                                  \
+"  -h                  Show this help message\n"                              \
+"Prints the XXH64 digest of each file followed by its path, the manifest\n"  \
+"format of gfclient_download --verify once paths are made request paths.\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+        {"help",          no_argument,            NULL,           'h'},
+        {NULL,            0,                      NULL,             0}
+};
+
+static void Usage() {
+    fprintf(stdout, "%s", USAGE);
+}
+
+/*
+ * Hashes the file at path into digest, returns -1 if it cannot be read.
+ */
+static int hash_file(const char *path, unsigned char *buf, uint64_t *digest) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    gfhash_t hash;
+    gfhash_init(&hash, 0);
+    ssize_t nread;
+    while ((nread = read(fd, buf, BUFSIZE)) != 0) {
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        gfhash_update(&hash, buf, (size_t) nread);
+    }
+    close(fd);
+    *digest = gfhash_digest(&hash);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int option_char;
+
+    while ((option_char = getopt_long(argc, argv, "h", gLongOptions, NULL)) != -1) {
+        switch (option_char) {
+            case 'h':
+                Usage();
+                exit(0);
+            default:
+                Usage();
+                exit(1);
+        }
+    }
+    if (optind == argc) {
+        Usage();
+        exit(1);
+    }
+
+    unsigned char *buf = malloc(BUFSIZE);
+    int ret = 0;
+    for (int iarg = optind; iarg < argc; iarg++) {
+        uint64_t digest;
+        if (hash_file(argv[iarg], buf, &digest) != 0) {
+            fprintf(stderr, "[ERROR] cannot read %s: %s\n", argv[iarg], strerror(errno));
+            ret = 1;
+            continue;
+        }
+        fprintf(stdout, "%016lx  %s\n", (unsigned long) digest, argv[iarg]);
+    }
+    free(buf);
+    return ret;
+}
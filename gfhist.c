@@ -0,0 +1,79 @@
+#include <string.h>
+
+#include "gfhist.h"
+
+
+int gfhist_bucket(uint64_t val) {
+
+    if (val < GFHIST_SUB) {
+        return (int) val;
+    }
+    if (val >> GFHIST_MAX_BITS) {
+        return GFHIST_NBUCKETS - 1;
+    }
+
+    /* the top GFHIST_SUB_BITS + 1 bits of the value pick the bucket
+     * within its power of two */
+    int exp = (63 - __builtin_clzll(val)) - GFHIST_SUB_BITS;
+    return exp * GFHIST_SUB + (int)(val >> exp);
+}
+
+uint64_t gfhist_bucket_max(int bkt) {
+    if (bkt < 2 * GFHIST_SUB) {
+        return (uint64_t) bkt;
+    }
+    int exp = bkt / GFHIST_SUB - 1;
+    uint64_t mant = (uint64_t)(bkt % GFHIST_SUB + GFHIST_SUB);
+    return ((mant + 1) << exp) - 1;
+}
+
+void gfhist_add(gfhist_t *hist, uint64_t val) {
+    hist->counts[gfhist_bucket(val)]++;
+    hist->nvals++;
+    hist->sum += val;
+    if (val > hist->max) {
+        hist->max = val;
+    }
+}
+
+void gfhist_merge(gfhist_t *dst, const gfhist_t *src) {
+    for (int bkt = 0; bkt < GFHIST_NBUCKETS; bkt++) {
+        dst->counts[bkt] += src->counts[bkt];
+    }
+    dst->nvals += src->nvals;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+uint64_t gfhist_percentile(const gfhist_t *hist, double pct) {
+
+    /* count the buckets rather than trusting nvals, histograms read while
+     * being written may be a few values apart */
+    uint64_t nvals = 0;
+    for (int bkt = 0; bkt < GFHIST_NBUCKETS; bkt++) {
+        nvals += hist->counts[bkt];
+    }
+    if (nvals == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)((pct / 100.0) * (double) nvals + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int bkt = 0; bkt < GFHIST_NBUCKETS; bkt++) {
+        seen += hist->counts[bkt];
+        if (seen >= rank) {
+            uint64_t val = gfhist_bucket_max(bkt);
+            return (val < hist->max) ? val : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+uint64_t gfhist_mean(const gfhist_t *hist) {
+    return (hist->nvals > 0) ? hist->sum / hist->nvals : 0;
+}
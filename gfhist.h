@@ -0,0 +1,60 @@
+#ifndef __GFHIST_H__
+#define __GFHIST_H__
+
+/*
+ * gfhist is a fixed size log-linear latency histogram in the style of
+ * HdrHistogram.  Values below 2^GFHIST_SUB_BITS are counted exactly,
+ * above that every power of two is split into 2^GFHIST_SUB_BITS buckets,
+ * so a recorded value is known to within about 6%.  Values at or above
+ * 2^GFHIST_MAX_BITS land in the last bucket.  The histogram holds no
+ * pointers and can live in shared memory.
+ */
+
+#include <stdint.h>
+
+#define GFHIST_SUB_BITS 4
+#define GFHIST_MAX_BITS 40
+#define GFHIST_SUB (1 << GFHIST_SUB_BITS)
+#define GFHIST_NBUCKETS (GFHIST_SUB * (GFHIST_MAX_BITS - GFHIST_SUB_BITS + 1))
+
+typedef struct _gfhist_t {
+    uint64_t nvals;                        //values recorded
+    uint64_t sum;                          //sum of the values recorded
+    uint64_t max;                          //largest value recorded
+    uint64_t counts[GFHIST_NBUCKETS];      //values recorded per bucket
+} gfhist_t;
+
+/*
+ * Returns the bucket a value is counted in.
+ */
+int gfhist_bucket(uint64_t val);
+
+/*
+ * Returns the largest value counted in a bucket.
+ */
+uint64_t gfhist_bucket_max(int bkt);
+
+/*
+ * Records a value.  Not thread safe, each writer needs its own histogram
+ * or outside locking, see gfstats for per thread histograms.
+ */
+void gfhist_add(gfhist_t *hist, uint64_t val);
+
+/*
+ * Adds the counts of src to dst.
+ */
+void gfhist_merge(gfhist_t *dst, const gfhist_t *src);
+
+/*
+ * Returns the value below which the fraction pct (0 to 100) of the
+ * recorded values fall, reported as the largest value of its bucket and
+ * never more than the largest value recorded.  0 if nothing was recorded.
+ */
+uint64_t gfhist_percentile(const gfhist_t *hist, double pct);
+
+/*
+ * Returns the mean of the recorded values, 0 if nothing was recorded.
+ */
+uint64_t gfhist_mean(const gfhist_t *hist);
+
+#endif
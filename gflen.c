@@ -0,0 +1,26 @@
+#include <stdint.h>
+
+#include "gflen.h"
+
+int gflen_parse(const char *str, const char **end, size_t *len) {
+
+    /* strtoull would take signs and blanks, and wrap negative values */
+    const char *cur = str;
+    uint64_t val = 0;
+    while (*cur >= '0' && *cur <= '9') {
+        uint64_t digit = (uint64_t)(*cur - '0');
+        if (val > ((uint64_t) INT64_MAX - digit) / 10) {
+            return -1;
+        }
+        val = val * 10 + digit;
+        cur++;
+    }
+    if (cur == str || (end == NULL && *cur != '\0')) {
+        return -1;
+    }
+    if (end != NULL) {
+        *end = cur;
+    }
+    *len = (size_t) val;
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef __GFLEN_H__
+#define __GFLEN_H__
+
+/*
+ * gflen parses the byte counts carried by GETFILE headers and ranges.
+ * Lengths and offsets travel as size_t and off_t through gfserver,
+ * gfclient and the shm channel, so files beyond 4GB need both to be 64
+ * bits wide.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+_Static_assert(sizeof(size_t) >= 8 && sizeof(off_t) >= 8, "GETFILE lengths need a 64-bit size_t and off_t");
+
+/*
+ * Parses the decimal number at str into len.  Only digits are accepted,
+ * no sign or leading blanks, and the value has to fit an off_t so it can
+ * be used as a file offset.  If end is NULL the number must make up the
+ * whole string, otherwise end receives the first character after it.
+ * Returns -1 for malformed or out of range numbers.
+ */
+int gflen_parse(const char *str, const char **end, size_t *len);
+
+#endif
@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gflog.h"
+
+#define DRAIN_BFR_SZ (16 * 1024)
+#define IDLE_MIN_US 500              //first sleep of the writer once the ring is empty
+#define IDLE_MAX_US 20000            //longest sleep of the writer
+
+typedef struct _gflog_slot_t {
+    uint64_t seq;                    //position the slot is free or filled for
+    uint32_t len;
+    char msg[GFLOG_MSG_SZ];
+} gflog_slot_t;
+
+int gflog_level = GFLOG_INFO;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+static gflog_slot_t g_slots[GFLOG_NSLOTS];
+static uint64_t g_enq_pos = 0;
+static uint64_t g_deq_pos = 0;
+static uint64_t g_ndropped = 0;
+static int g_started = 0;
+static volatile int g_stop = 0;
+static pthread_t g_writer;
+static pthread_mutex_t g_drain_lock = PTHREAD_MUTEX_INITIALIZER;   //writer and gflog_flush take turns
+
+/* forward declarations */
+static void *gflog_writer(void *arg);
+static size_t gflog_drain();
+static void gflog_stop();
+static uint64_t gflog_now_ms();
+static int gflog_let_through(gflog_site_t *site, uint32_t *nsuppressed);
+static void gflog_write_all(const char *buf, size_t len);
+
+
+int gflog_start(int level) {
+    gflog_level = level;
+    if (g_started) {
+        return 0;
+    }
+    for (uint64_t islot = 0; islot < GFLOG_NSLOTS; islot++) {
+        g_slots[islot].seq = islot;
+    }
+    if (pthread_create(&g_writer, NULL, gflog_writer, NULL) != 0) {
+        fprintf(stderr, "[ERROR] cannot start the log writer, logging synchronously\n");
+        return -1;
+    }
+    __atomic_store_n(&g_started, 1, __ATOMIC_RELEASE);
+    atexit(gflog_stop);
+    return 0;
+}
+
+int gflog_parse_level(const char *name) {
+    for (int level = GFLOG_ERROR; level <= GFLOG_DEBUG; level++) {
+        if (strcasecmp(name, level_names[level]) == 0) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+void gflog_flush() {
+    if (__atomic_load_n(&g_started, __ATOMIC_ACQUIRE)) {
+        while (gflog_drain() > 0);
+    }
+}
+
+void gflog_write(gflog_site_t *site, int level, const char *fmt, ...) {
+
+    uint32_t nsuppressed = 0;
+    if (level <= GFLOG_WARN && !gflog_let_through(site, &nsuppressed)) {
+        return;
+    }
+
+    /* not started yet, a single write keeps the message in one piece */
+    char line[GFLOG_MSG_SZ];
+    char *msg = line;
+    gflog_slot_t *slot = NULL;
+    uint64_t pos = 0;
+    if (__atomic_load_n(&g_started, __ATOMIC_ACQUIRE)) {
+
+        /* claim the next slot, a slot still holding a message means the
+         * ring is full */
+        pos = __atomic_load_n(&g_enq_pos, __ATOMIC_RELAXED);
+        while (1) {
+            slot = &g_slots[pos & (GFLOG_NSLOTS - 1)];
+            int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+            if (diff == 0) {
+                if (__atomic_compare_exchange_n(&g_enq_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                __atomic_fetch_add(&g_ndropped, 1, __ATOMIC_RELAXED);
+                return;
+            } else {
+                pos = __atomic_load_n(&g_enq_pos, __ATOMIC_RELAXED);
+            }
+        }
+        msg = slot->msg;
+    }
+
+    int len = snprintf(msg, GFLOG_MSG_SZ, "[%s] ", level_names[level]);
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(msg + len, GFLOG_MSG_SZ - (size_t) len, fmt, args);
+    va_end(args);
+    len = (n < 0) ? len : len + n;
+    if (nsuppressed > 0 && len < GFLOG_MSG_SZ) {
+        len += snprintf(msg + len, GFLOG_MSG_SZ - (size_t) len, " (%u similar messages suppressed)", nsuppressed);
+    }
+    if (len > GFLOG_MSG_SZ - 2) {
+        len = GFLOG_MSG_SZ - 2;
+    }
+    msg[len++] = '\n';
+
+    if (slot == NULL) {
+        gflog_write_all(msg, (size_t) len);
+        return;
+    }
+    slot->len = (uint32_t) len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+/*********************/
+/* private functions */
+/*********************/
+
+void *gflog_writer(void *arg) {
+    unsigned int idle_us = IDLE_MIN_US;
+    while (!g_stop) {
+        if (gflog_drain() > 0) {
+            idle_us = IDLE_MIN_US;
+            continue;
+        }
+        usleep(idle_us);
+        if (idle_us < IDLE_MAX_US) {
+            idle_us *= 2;
+        }
+    }
+    return NULL;
+}
+
+/* writes out the messages buffered so far, returns how many */
+size_t gflog_drain() {
+
+    char bfr[DRAIN_BFR_SZ];
+    size_t len = 0;
+    size_t nmsgs = 0;
+
+    pthread_mutex_lock(&g_drain_lock);
+    uint64_t ndropped = __atomic_exchange_n(&g_ndropped, 0, __ATOMIC_RELAXED);
+    if (ndropped > 0) {
+        len += (size_t) snprintf(bfr, sizeof(bfr), "[WARN] %lu log messages dropped, log buffer full\n", (unsigned long) ndropped);
+    }
+    while (1) {
+        gflog_slot_t *slot = &g_slots[g_deq_pos & (GFLOG_NSLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != g_deq_pos + 1) {
+            break;
+        }
+        if (len + slot->len > sizeof(bfr)) {
+            gflog_write_all(bfr, len);
+            len = 0;
+        }
+        memcpy(bfr + len, slot->msg, slot->len);
+        len += slot->len;
+        nmsgs++;
+
+        /* hand the slot back to writers for the next round of the ring */
+        __atomic_store_n(&slot->seq, g_deq_pos + GFLOG_NSLOTS, __ATOMIC_RELEASE);
+        g_deq_pos++;
+    }
+    if (len > 0) {
+        gflog_write_all(bfr, len);
+    }
+    pthread_mutex_unlock(&g_drain_lock);
+    return nmsgs;
+}
+
+void gflog_stop() {
+    g_stop = 1;
+    gflog_flush();
+}
+
+uint64_t gflog_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/* counts a message of a call site, returns 0 if it is over the rate */
+int gflog_let_through(gflog_site_t *site, uint32_t *nsuppressed) {
+    uint64_t now = gflog_now_ms();
+    uint64_t win_start = __atomic_load_n(&site->win_start_ms, __ATOMIC_RELAXED);
+    if (now - win_start >= 1000
+        && __atomic_compare_exchange_n(&site->win_start_ms, &win_start, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&site->nwin, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&site->nwin, 1, __ATOMIC_RELAXED) > GFLOG_BURST) {
+        __atomic_add_fetch(&site->nsuppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *nsuppressed = __atomic_exchange_n(&site->nsuppressed, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void gflog_write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+}
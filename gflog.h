@@ -0,0 +1,78 @@
+#ifndef __GFLOG_H__
+#define __GFLOG_H__
+
+/*
+ * gflog writes leveled log messages to stderr from a background thread.
+ * Callers format their message straight into a slot of a lock-free ring
+ * and return, the thread drains the ring with one write per batch, so
+ * request threads never wait on the stderr lock or the terminal.  When
+ * the ring is full messages are dropped and counted.  Errors and
+ * warnings of a call site beyond GFLOG_BURST a second are suppressed,
+ * their number is reported with the next one let through.
+ *
+ * Levels above the runtime level cost a load and a compare, levels above
+ * GFLOG_MAX_LEVEL, e.g. -DGFLOG_MAX_LEVEL=GFLOG_INFO, are compiled out.
+ * Before gflog_start messages are written synchronously.
+ */
+
+#include <stdint.h>
+
+#define GFLOG_ERROR 0
+#define GFLOG_WARN 1
+#define GFLOG_INFO 2
+#define GFLOG_DEBUG 3
+
+#ifndef GFLOG_MAX_LEVEL
+#define GFLOG_MAX_LEVEL GFLOG_DEBUG
+#endif
+
+#define GFLOG_MSG_SZ 256             //longer messages are truncated
+#define GFLOG_NSLOTS 1024            //messages buffered, a power of two
+#define GFLOG_BURST 10               //errors and warnings per call site and second
+
+/* rate limit state of a call site */
+typedef struct _gflog_site_t {
+    uint64_t win_start_ms;           //start of the current one second window
+    uint32_t nwin;                   //messages in the window
+    uint32_t nsuppressed;            //messages suppressed since the last one written
+} gflog_site_t;
+
+extern int gflog_level;
+
+#define GFLOG_AT(lvl, ...)                                                    \
+    do {                                                                      \
+        if ((lvl) <= GFLOG_MAX_LEVEL && (lvl) <= gflog_level) {               \
+            static gflog_site_t _gflog_site;                                  \
+            gflog_write(&_gflog_site, (lvl), __VA_ARGS__);                    \
+        }                                                                     \
+    } while (0)
+
+#define gflog_error(...) GFLOG_AT(GFLOG_ERROR, __VA_ARGS__)
+#define gflog_warn(...) GFLOG_AT(GFLOG_WARN, __VA_ARGS__)
+#define gflog_info(...) GFLOG_AT(GFLOG_INFO, __VA_ARGS__)
+#define gflog_debug(...) GFLOG_AT(GFLOG_DEBUG, __VA_ARGS__)
+
+/*
+ * Sets the runtime level and starts the background writer.  Buffered
+ * messages are flushed when the process exits.  Returns -1 if the thread
+ * cannot be started, messages are then written synchronously.
+ */
+int gflog_start(int level);
+
+/*
+ * Returns the level named error, warn, info or debug, or -1.
+ */
+int gflog_parse_level(const char *name);
+
+/*
+ * Writes out all buffered messages before returning.
+ */
+void gflog_flush();
+
+/*
+ * Formats and queues a message, use the gflog_* macros instead.  A
+ * newline is appended.
+ */
+void gflog_write(gflog_site_t *site, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#endif
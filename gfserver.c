@@ -1,19 +1,35 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
-#include <sys/time.h>
-#include <asm/errno.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 
+#include "gfaffinity.h"
+#include "gflen.h"
+#include "gflog.h"
 #include "gfserver.h"
 
 #define BUFSIZE 4096
-#define SOCKTO 50
+#define SEND_CHUNK (64 * 1024)
 
-static const int dbg = 1;
+/* default connection deadlines in milliseconds */
+#define HDR_TO_MS 5000
+#define IDLE_TO_MS 15000
+#define XFR_TO_MS 600000
+#define TIMER_TICK_MS 10
+
+/* client accounting */
+#define CLIENT_BUCKETS 1024
+#define CLIENT_EXPIRE_US (60 * 1000000ULL)
 
 
 /***********************/
@@ -26,26 +42,75 @@ static const char *stat_ok = "OK";
 static const char *stat_fnf = "FILE_NOT_FOUND";
 static const char *stat_er = "ERROR";
 static const char *mrkr = "\r\n\r\n";
+static const char *opt_rng = "RANGE=";
+static const char *opt_acpt_enc = "ACCEPT-ENCODING=";
+static const char *opt_enc = "ENCODING=";
+static const char *opt_enc_len = "ENCODED-LENGTH=";
+static const char *enc_gzip = "gzip";
 
 
 /****************/
 /* thread stuff */
 /****************/
-static steque_t *rqst_que;
-static pthread_mutex_t rqst_lock;
-static pthread_cond_t rqst_rdy;
-static int g_nthds = 0;
+static wrkpool_t *g_pool = NULL;
+static gfasync_t *g_async = NULL;
+
+/* token buckets and counters per client address, entries stay while the
+ * client has open connections and are dropped a while after */
+typedef struct _gfs_client_t {
+    in_addr_t addr;                 //client IPv4 address, network order
+    double rqst_tkns;               //requests the client may still start
+    double byte_tkns;               //bytes that may still be sent, negative while paying off a send
+    uint64_t last_us;               //time tokens were last refilled
+    int nconns;                     //open connections referencing the entry
+    unsigned long nrqsts;           //connections accepted
+    unsigned long nrejected;        //connections rejected by the request rate limit
+    unsigned long nthrottled;       //sends delayed by the byte rate limit
+    uint64_t nbytes;                //bytes sent
+    struct _gfs_client_t *next;     //next client in hash bucket
+} gfs_client_t;
+
+static gfs_client_t *g_clients[CLIENT_BUCKETS];
+static pthread_mutex_t g_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static gftimer_wheel_t *g_tw = NULL;
+static cpu_set_t g_acc_cpus;        //cpus the accepting thread is pinned to
+static cpu_set_t g_wrkr_cpus;       //cpus the worker threads are spread over
+static int g_pin_acc = 0;
+static int g_pin_wrkr = 0;
+static pthread_mutex_t g_serve_lock = PTHREAD_MUTEX_INITIALIZER;   //held by the acceptor while it hands off a connection
+static int g_stopping = 0;          //set by gfserver_stop, the acceptor hands off no more connections
 
 
 /*************************/
 /* function declarations */
 /*************************/
-static void handler_enqueue_rqst(gfcontext_t *ctx);
-static void *handler_dequeue_rqsts(void *arg);
-static int gfs_handle_requests(gfcontext_t *ctx);
+static void handler_handle_rqst(void *item, void *arg);
+static void handler_init_thd(int ithd, void *arg);
+static void handler_async_rqst(void *item, void *arg);
+static gfs_client_t *gfs_client_acquire(gfserver_t *gfs, in_addr_t addr, int *admit);
+static void gfs_client_release(gfs_client_t *cli);
+static void gfs_client_throttle(gfcontext_t *ctx, size_t len);
+static int gfs_read_request(gfcontext_t *ctx);
+static int gfs_serve_request(gfcontext_t *ctx);
+static ssize_t gfs_recv_some(gfcontext_t *ctx, void *buf, size_t len);
+static ssize_t gfs_send_some(gfcontext_t *ctx, const void *buf, size_t len);
 static gfcontext_t* gfcontext_create(gfserver_t *gfs, struct sockaddr_in* cli_addr, socklen_t cli_addr_len, int sockfd);
+void gfcontext_cleanup(gfcontext_t* ctx);
+void gfs_create_not_ok_header(char *hdr, gfstatus_t status);
+void gfs_create_encoded_header(char *hdr, size_t file_len, const char *enc, size_t enc_len);
 static void gfs_init();
+static unsigned int gfs_deadline_expired(void *arg);
+static void gfs_arm_deadlines(gfcontext_t *ctx);
+static void gfs_disarm_deadlines(gfcontext_t *ctx);
+static void gfs_touch(gfcontext_t *ctx);
 static void gfs_cleanup();
+static void gfs_fatal();
+static void gfs_park();
+static int gfs_parse_range(gfcontext_t *ctx, const char *val);
+static void gfs_parse_accept_encoding(gfcontext_t *ctx, char *val);
+static int gfs_parse_options(gfcontext_t *ctx, char *opts, size_t opts_len);
+static int gfs_listen_tcp(gfserver_t *gfs);
+static int gfs_listen_unix(gfserver_t *gfs);
 
 
 /**************************/
@@ -58,7 +123,18 @@ void gfserver_init(gfserver_t *gfs, unsigned short nwrkr_thds) {
     } else {
         gfs->nwrkr_thds = 1;
     }
-    g_nthds = nwrkr_thds;
+    gfs->min_wrkr_thds = 1;
+    gfs->nloops = 0;
+    gfs->unix_path = NULL;
+    gfs->stack_sz = 0;
+    gfs->nlanes = 1;
+    gfs->clsfy_func = NULL;
+    gfs->grow_wait_ms = WRKPOOL_WAIT_TARGET_MS;
+    gfs->idle_retire_ms = WRKPOOL_IDLE_TO_MS;
+    gfs->hdr_to_ms = HDR_TO_MS;
+    gfs->idle_to_ms = IDLE_TO_MS;
+    gfs->xfr_to_ms = XFR_TO_MS;
+    gfsock_opts_default(&gfs->sock_opts, 0);
     gfs_init();
 }
 
@@ -70,6 +146,95 @@ void gfserver_set_maxpending(gfserver_t *gfs, int max_npending) {
     gfs->max_pend = max_npending;
 }
 
+void gfserver_set_unix_path(gfserver_t *gfs, const char *path) {
+    free(gfs->unix_path);
+    gfs->unix_path = (path != NULL) ? strdup(path) : NULL;
+}
+
+void gfserver_set_sockopts(gfserver_t *gfs, const gfsock_opts_t *opts) {
+    gfs->sock_opts = *opts;
+}
+
+void gfserver_set_timeouts(gfserver_t *gfs, unsigned int hdr_to_ms, unsigned int idle_to_ms, unsigned int xfr_to_ms) {
+    gfs->hdr_to_ms = hdr_to_ms;
+    gfs->idle_to_ms = idle_to_ms;
+    gfs->xfr_to_ms = xfr_to_ms;
+}
+
+void gfserver_set_pool(gfserver_t *gfs, unsigned short min_wrkr_thds, unsigned int grow_wait_ms, unsigned int idle_retire_ms) {
+    gfs->min_wrkr_thds = min_wrkr_thds;
+    gfs->grow_wait_ms = grow_wait_ms;
+    gfs->idle_retire_ms = idle_retire_ms;
+}
+
+int gfserver_set_lanes(gfserver_t *gfs, int nlanes, const unsigned int *weights,
+                       int (*classifier)(gfcontext_t *, char *, void *)) {
+    if (nlanes < 1 || nlanes > WRKPOOL_MAX_LANES) {
+        gflog_error("number of lanes must be between 1 and %d", WRKPOOL_MAX_LANES);
+        return -1;
+    }
+    gfs->nlanes = nlanes;
+    for (int i = 0; i < nlanes; i++) {
+        gfs->lane_wts[i] = weights[i];
+    }
+    gfs->clsfy_func = classifier;
+    return 0;
+}
+
+int gfs_get_lane(gfcontext_t *ctx) {
+    return ctx->lane;
+}
+
+void gfserver_set_client_limits(gfserver_t *gfs, unsigned int rqsts_per_sec, size_t bytes_per_sec) {
+    gfs->cli_rps = rqsts_per_sec;
+    gfs->cli_bps = bytes_per_sec;
+}
+
+void gfserver_set_async(gfserver_t *gfs, int nloops, size_t stack_sz) {
+    gfs->nloops = nloops;
+    gfs->stack_sz = stack_sz;
+}
+
+void gfserver_print_stats(gfserver_t *gfs) {
+    if (g_pool != NULL) {
+        wrkpool_print_stats(g_pool, "gfserver worker");
+    }
+    if (g_async != NULL) {
+        gfasync_print_stats(g_async, "gfserver event");
+    }
+
+    pthread_mutex_lock(&g_clients_lock);
+    for (int bkt = 0; bkt < CLIENT_BUCKETS; bkt++) {
+        for (gfs_client_t *cli = g_clients[bkt]; cli != NULL; cli = cli->next) {
+            char addr[INET_ADDRSTRLEN] = "unix";
+            if (cli->addr != INADDR_ANY) {
+                inet_ntop(AF_INET, &cli->addr, addr, sizeof(addr));
+            }
+            fprintf(stderr, "[INFO] client %s: connections %lu (open %d, rejected %lu), bytes sent %lu (throttled %lu sends)\n",
+                    addr, cli->nrqsts, cli->nconns, cli->nrejected, (unsigned long) cli->nbytes, cli->nthrottled);
+        }
+    }
+    pthread_mutex_unlock(&g_clients_lock);
+}
+
+int gfserver_set_cpus(gfserver_t *gfs, const char *acceptor_cpus, const char *worker_cpus) {
+    if (acceptor_cpus != NULL) {
+        if (gfaff_parse_cpus(acceptor_cpus, &g_acc_cpus) != 0) {
+            gflog_error("invalid acceptor cpu list: %s", acceptor_cpus);
+            return -1;
+        }
+        g_pin_acc = 1;
+    }
+    if (worker_cpus != NULL) {
+        if (gfaff_parse_cpus(worker_cpus, &g_wrkr_cpus) != 0) {
+            gflog_error("invalid worker cpu list: %s", worker_cpus);
+            return -1;
+        }
+        g_pin_wrkr = 1;
+    }
+    return 0;
+}
+
 void gfserver_set_handler(gfserver_t *gfs, ssize_t (*handler)(gfcontext_t *, char *, void*)) {
     gfs->hndlr_func = handler;
 }
@@ -80,79 +245,124 @@ void gfserver_set_handlerarg(gfserver_t *gfs, void *arg) {
 
 void gfserver_serve(gfserver_t *gfs) {
 
-    /* start worker threads */
-    if (dbg) fprintf(stderr, "[INFO] creating threads ... \n");
-    pthread_t thrds[gfs->nwrkr_thds];
-    for (int ithd = 0; ithd < gfs->nwrkr_thds; ithd++) {
-        int rc = pthread_create(&thrds[ithd], NULL, handler_dequeue_rqsts, (void *) &ithd);
-        if (rc) {
-            fprintf(stderr, "[ERROR] when attempting to create thread %i\n - %d", ithd, rc);
-            raise(SIGTERM);
-        }
-    }
+    if (gfs->nloops > 0) {
 
-    /* create socket */
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("[ERROR] opening socket");
-        raise(SIGTERM);
-    }
+        /* every request becomes a coroutine on one of the event loops */
+        gflog_debug("creating event loops ...");
+        g_async = gfasync_create(gfs->nloops, gfs->stack_sz, handler_async_rqst, NULL);
+        if (g_async == NULL) {
+            gfs_fatal();
+        }
+        gfasync_set_thd_init(g_async, handler_init_thd);
+        if (gfasync_start(g_async) != 0) {
+            gfs_fatal();
+        }
 
-    /* set socket option to reuse addresses */
-    int yes = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-        perror("[ERROR] setting port reuse option in setsockopt.\n");
-        raise(SIGTERM);
-    }
+    } else {
 
-    /* set socket timeout options */
-    struct timeval timeout;
-    timeout.tv_sec = SOCKTO;
-    timeout.tv_usec = 0;
-    if (setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,
-                    sizeof(timeout)) < 0) {
-        perror("[ERROR] setting receive timeout in setsockopt\n");
-        raise(SIGTERM);
+        /* start the worker pool, it grows from the minimum up to nwrkr_thds
+         * threads as requests queue up */
+        gflog_debug("creating threads ...");
+        g_pool = wrkpool_create(gfs->min_wrkr_thds, gfs->nwrkr_thds, handler_handle_rqst, NULL);
+        if (g_pool == NULL) {
+            gfs_fatal();
+        }
+        wrkpool_set_targets(g_pool, gfs->grow_wait_ms, gfs->idle_retire_ms);
+        wrkpool_set_thd_init(g_pool, handler_init_thd);
+        if (gfs->nlanes > 1) {
+            wrkpool_set_lanes(g_pool, gfs->nlanes, gfs->lane_wts);
+        }
+        if (wrkpool_start(g_pool) != 0) {
+            gfs_fatal();
+        }
     }
 
-    if (setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
-                    sizeof(timeout)) < 0) {
-        perror("[ERROR] setting send timeout in setsockopt\n");
-        raise(SIGTERM);
+    /* the calling thread becomes the acceptor */
+    if (g_pin_acc && gfaff_pin_thread(pthread_self(), &g_acc_cpus) != 0) {
+        gfs_fatal();
     }
 
-    /* initialize socket address structure */
-    struct sockaddr_in serv_addr;
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(gfs->port);
-
-    /* bind the socket to the host address */
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("[ERROR] binding socket to host address\n");
-        raise(SIGTERM);
+    /* listen on the tcp port and, for clients on this host, on the unix socket */
+    struct pollfd lsns[2];
+    int nlsns = 0;
+    lsns[nlsns].fd = gfs_listen_tcp(gfs);
+    lsns[nlsns++].events = POLLIN;
+    if (gfs->unix_path != NULL) {
+        lsns[nlsns].fd = gfs_listen_unix(gfs);
+        lsns[nlsns++].events = POLLIN;
     }
 
     /* start accepting requests */
+    struct sockaddr_storage acc_addr;
     struct sockaddr_in cli_addr;
     socklen_t clilen;
     int newsockfd;
-    listen(sockfd, gfs->max_pend);
+    int ilsn = 0;
     while (1) {
 
-        /* wait for new request */
-        clilen = sizeof(cli_addr);
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
+        /* wait for new request, taking turns between the listeners */
+        if (nlsns > 1) {
+            if (poll(lsns, (nfds_t) nlsns, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                gflog_error("when waiting for client requests: %s", strerror(errno));
+                gfs_fatal();
+            }
+            ilsn = (lsns[(ilsn + 1) % nlsns].revents & POLLIN) ? (ilsn + 1) % nlsns : ilsn;
+        }
+        clilen = sizeof(acc_addr);
+        newsockfd = accept(lsns[ilsn].fd, (struct sockaddr *) &acc_addr, &clilen);
         if (newsockfd < 0) {
-            perror("[ERROR] when accepting client request\n");
-            raise(SIGTERM);
+            if (errno == EINTR) {
+                continue;
+            }
+            gflog_error("when accepting client request: %s", strerror(errno));
+            gfs_fatal();
+        }
+
+        /* once stopping, the workers may be gone, so the connection is
+         * dropped and the acceptor waits for the process to exit */
+        pthread_mutex_lock(&g_serve_lock);
+        if (g_stopping) {
+            pthread_mutex_unlock(&g_serve_lock);
+            close(newsockfd);
+            gfs_park();
+        }
+        uint64_t acc_us = gfstats_now_us();
+        gfstats_count(GFSTAT_CONNS, 1);
+
+        /* clients on the unix socket have no address, they are all
+         * accounted as one client with address 0.0.0.0 */
+        bzero(&cli_addr, sizeof(cli_addr));
+        if (acc_addr.ss_family == AF_INET) {
+            memcpy(&cli_addr, &acc_addr, sizeof(cli_addr));
+        } else {
+            cli_addr.sin_family = AF_INET;
+            cli_addr.sin_addr.s_addr = INADDR_ANY;
+            clilen = sizeof(cli_addr);
         }
 
         /* create new connection context */
-        if (dbg) fprintf(stderr, "[INFO] creating new context\n");
+        gflog_debug("creating new context");
         gfcontext_t *ctx = gfcontext_create(gfs, &cli_addr, clilen, newsockfd);
 
+        /* clients over their request rate are turned away right here so
+         * they never take a worker */
+        int admit;
+        ctx->cli = gfs_client_acquire(gfs, cli_addr.sin_addr.s_addr, &admit);
+        if (!admit) {
+            gflog_debug("client over request rate limit, rejecting connection");
+            gfstats_count(GFSTAT_REJECTED, 1);
+            char hdr[64];
+            gfs_create_not_ok_header(hdr, GF_ERROR);
+            send(newsockfd, hdr, strlen(hdr), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(newsockfd);
+            gfcontext_cleanup(ctx);
+            pthread_mutex_unlock(&g_serve_lock);
+            continue;
+        }
+
         /* handle requests for this connection */
         //int stat = gfs_handle_requests(gfs, ctx);
         //if (stat < 0) {
@@ -160,7 +370,16 @@ void gfserver_serve(gfserver_t *gfs) {
         //            "client request on socket fd %i\n", newsockfd);
         //}
         /* add request to queue for worker threads to handle */
-        handler_enqueue_rqst(ctx);
+        ctx->queued_us = gfstats_now_us();
+        gfstats_record(GFSTAT_ACCEPT, ctx->queued_us - acc_us);
+        ctx->trace_id = gftrace_new_id();
+        gftrace_span(ctx->trace_id, GFTRACE_ACCEPT, acc_us, 0);
+        if (g_async != NULL) {
+            gfasync_submit(g_async, ctx);
+        } else {
+            wrkpool_submit_flow(g_pool, ctx, 0, cli_addr.sin_addr.s_addr, 1);
+        }
+        pthread_mutex_unlock(&g_serve_lock);
         //gfs_handle_requests(ctx);
 
     }
@@ -169,11 +388,81 @@ void gfserver_serve(gfserver_t *gfs) {
 
 void gfserver_stop(gfserver_t *gfs) {
 
+    pthread_mutex_lock(&g_serve_lock);
+    g_stopping = 1;
+    pthread_mutex_unlock(&g_serve_lock);
+
+    if (gfs->unix_path != NULL) {
+        unlink(gfs->unix_path);
+    }
+
     //clean up threads and clean up request queue
     gfs_cleanup();
 }
 
 
+/* creates the tcp listening socket on the server port */
+int gfs_listen_tcp(gfserver_t *gfs) {
+
+    /* create socket */
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        gflog_error("opening socket: %s", strerror(errno));
+        gfs_fatal();
+    }
+
+    /* set socket option to reuse addresses */
+    int yes = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        gflog_error("setting port reuse option in setsockopt: %s", strerror(errno));
+        gfs_fatal();
+    }
+    gfsock_apply(sockfd, &gfs->sock_opts, GFSOCK_LISTEN);
+
+    /* initialize socket address structure */
+    struct sockaddr_in serv_addr;
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(gfs->port);
+
+    /* bind the socket to the host address */
+    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        gflog_error("binding socket to host address: %s", strerror(errno));
+        gfs_fatal();
+    }
+    listen(sockfd, gfs->max_pend);
+    return sockfd;
+}
+
+/* creates the unix domain listening socket, replacing a stale socket file */
+int gfs_listen_unix(gfserver_t *gfs) {
+
+    struct sockaddr_un serv_addr;
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    if (strlen(gfs->unix_path) >= sizeof(serv_addr.sun_path)) {
+        gflog_error("unix socket path exceeds %zu characters", sizeof(serv_addr.sun_path) - 1);
+        gfs_fatal();
+    }
+    strcpy(serv_addr.sun_path, gfs->unix_path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        gflog_error("opening unix socket: %s", strerror(errno));
+        gfs_fatal();
+    }
+    gfsock_apply(sockfd, &gfs->sock_opts, GFSOCK_LISTEN);
+    unlink(gfs->unix_path);
+    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        gflog_error("binding unix socket to path: %s", strerror(errno));
+        gfs_fatal();
+    }
+    listen(sockfd, gfs->max_pend);
+    return sockfd;
+}
+
+
 /***********************/
 /* gfcontext functions */
 /***********************/
@@ -183,8 +472,9 @@ gfcontext_t* gfcontext_create(gfserver_t *gfs, struct sockaddr_in* cli_addr, soc
     bzero(ctx, sizeof(*ctx));
     ctx->sockfd = sockfd;
     ctx->stat = GF_OK;
+    ctx->mthd = GF_MTHD_GET;
     ctx->cli_addr_len = cli_addr_len;
-    ctx->cli_addr = cli_addr;
+    ctx->cli_addr = *cli_addr;
     ctx->gfs = gfs;
     return ctx;
 }
@@ -195,6 +485,9 @@ void gfcontext_set_status(gfcontext_t* ctx, gfstatus_t stat) {
 
 void gfcontext_cleanup(gfcontext_t* ctx) {
     //fprintf(stderr, "INFO gfcontext_cleanup called\n"); fflush(stderr);
+    if (ctx->cli != NULL) {
+        gfs_client_release(ctx->cli);
+    }
     free(ctx);
     ctx = NULL;
 }
@@ -208,6 +501,10 @@ void gfs_create_ok_header(char *hdr, size_t file_len) {
     sprintf(hdr, "%s %s %zu%s", scheme, stat_ok, file_len, mrkr);
 }
 
+void gfs_create_encoded_header(char *hdr, size_t file_len, const char *enc, size_t enc_len) {
+    sprintf(hdr, "%s %s %zu %s%s %s%zu%s", scheme, stat_ok, file_len, opt_enc, enc, opt_enc_len, enc_len, mrkr);
+}
+
 void gfs_create_not_ok_header(char *hdr, gfstatus_t status) {
     if (status == GF_FILE_NOT_FOUND) {
         sprintf(hdr, "%s %s%s", scheme, stat_fnf, mrkr);
@@ -230,35 +527,146 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len) {
         case GF_FILE_NOT_FOUND:
             gfcontext_set_status(ctx, GF_FILE_NOT_FOUND);
             gfs_create_not_ok_header(hdr, status);
+            gfstats_count(GFSTAT_NOT_FOUND, 1);
             break;
         default: /* including GF_ERROR */
             gfcontext_set_status(ctx, GF_ERROR);
             gfs_create_not_ok_header(hdr, status);
+            gfstats_count(GFSTAT_ERRORS, 1);
+            ctx->err_counted = 1;
             break;
     }
 
-    bytes_sent = send(ctx->sockfd, hdr, strlen(hdr), 0);  //don't send null terminator
+    bytes_sent = gfs_send_some(ctx, hdr, strlen(hdr));  //don't send null terminator
+    gfs_touch(ctx);
     if (bytes_sent <= 0) {
-        perror("[ERROR] sending header info to client\n");
+        gflog_error("sending header info to client: %s", strerror(errno));
         ctx->stat = GF_ERROR;
         return -1;
     } else {
+        ctx->hdr_sent = 1;
         return bytes_sent;
     }
 
 }
 
-ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t len) {
+ssize_t gfs_sendheader_encoded(gfcontext_t *ctx, size_t file_len, int encoding, size_t enc_len) {
+
+    if (encoding == GF_ENC_IDENTITY) {
+        return gfs_sendheader(ctx, GF_OK, file_len);
+    }
 
-    ssize_t bytes_sent = send(ctx->sockfd, data, len, 0);  //don't send null terminator
+    char hdr[BUFSIZE];
+    gfcontext_set_status(ctx, GF_OK);
+    gfs_create_encoded_header(hdr, file_len, enc_gzip, enc_len);
+    ssize_t bytes_sent = gfs_send_some(ctx, hdr, strlen(hdr));
+    gfs_touch(ctx);
     if (bytes_sent <= 0) {
-        perror("[ERROR] sending info to client\n");
+        gflog_error("sending header info to client: %s", strerror(errno));
         ctx->stat = GF_ERROR;
         return -1;
-    } else {
-        return bytes_sent;
     }
+    ctx->hdr_sent = 1;
+    return bytes_sent;
+}
+
+int gfs_get_accept_encoding(gfcontext_t *ctx) {
+    return ctx->accept_enc;
+}
+
+gfmethod_t gfs_get_method(gfcontext_t *ctx) {
+    return ctx->mthd;
+}
+
+int gfs_get_range(gfcontext_t *ctx, size_t *offset, size_t *len) {
+    if (offset != NULL) *offset = ctx->rng_off;
+    if (len != NULL) *len = ctx->rng_len;
+    return ctx->has_rng;
+}
+
+ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t len) {
+
+    /* no file contents are sent in response to a head request */
+    if (ctx->mthd == GF_MTHD_HEAD) {
+        return (ssize_t)len;
+    }
+
+    /* send in bounded chunks so progress on slow connections is seen
+     * by the idle deadline */
+    uint64_t start_us = gfstats_now_us();
+    size_t tot_sent = 0;
+    while (tot_sent < len) {
+        size_t chunk = len - tot_sent;
+        if (chunk > SEND_CHUNK) {
+            chunk = SEND_CHUNK;
+        }
+        if (ctx->gfs->cli_bps > 0) {
+            /* keep throttled waits short so they never trip the idle deadline */
+            size_t max_chunk = ctx->gfs->cli_bps / 4 + 1;
+            if (chunk > max_chunk) {
+                chunk = max_chunk;
+            }
+            gfs_client_throttle(ctx, chunk);
+        }
+        ssize_t bytes_sent = gfs_send_some(ctx, (char *)data + tot_sent, chunk);
+        if (bytes_sent <= 0) {
+            gflog_error("sending info to client: %s", strerror(errno));
+            ctx->stat = GF_ERROR;
+            return -1;
+        }
+        gfs_touch(ctx);
+        if (ctx->cli != NULL) {
+            __sync_fetch_and_add(&ctx->cli->nbytes, (uint64_t) bytes_sent);
+        }
+        tot_sent += bytes_sent;
+    }
+    gfstats_record_since(GFSTAT_SEND, start_us);
+    gfstats_count(GFSTAT_BYTES, tot_sent);
+    return (ssize_t)tot_sent;
+
+}
+
+int gfs_poll(gfcontext_t *ctx, struct pollfd *fds, int nfds, int timeout_ms) {
+    return gfasync_poll(fds, nfds, timeout_ms);
+}
 
+void gfs_sleep_us(gfcontext_t *ctx, unsigned int usec) {
+    gfasync_sleep_us(usec);
+}
+
+/*
+ * recv and send on the client socket.  Sockets of async servers are non
+ * blocking, when they are not ready the request waits for them, letting
+ * its loop run other requests.
+ */
+ssize_t gfs_recv_some(gfcontext_t *ctx, void *buf, size_t len) {
+    while (1) {
+        ssize_t n = recv(ctx->sockfd, buf, len, 0);
+        if (n >= 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return n;
+        }
+        if (errno != EINTR) {
+            struct pollfd pfd = {.fd = ctx->sockfd, .events = POLLIN};
+            if (gfasync_poll(&pfd, 1, -1) < 0) {
+                return -1;
+            }
+        }
+    }
+}
+
+ssize_t gfs_send_some(gfcontext_t *ctx, const void *buf, size_t len) {
+    while (1) {
+        ssize_t n = send(ctx->sockfd, buf, len, MSG_NOSIGNAL);
+        if (n >= 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return n;
+        }
+        if (errno != EINTR) {
+            struct pollfd pfd = {.fd = ctx->sockfd, .events = POLLOUT};
+            if (gfasync_poll(&pfd, 1, -1) < 0) {
+                return -1;
+            }
+        }
+    }
 }
 
 void gfs_abort(gfcontext_t *ctx) {
@@ -269,203 +677,472 @@ void gfs_abort(gfcontext_t *ctx) {
 //    gfcontext_cleanup(ctx);
 }
 
-void gfs_init() {
-    /* Initialize global resources, ex: request queue, mutexes, condition vars, shm_channel */
+/*
+ * Parses a range value of the form <first>-<last> or <first>- where
+ * last is the inclusive byte position of the range.
+ */
+int gfs_parse_range(gfcontext_t *ctx, const char *val) {
+    const char *end;
+    size_t first;
+    if (gflen_parse(val, &end, &first) != 0 || *end != '-') {
+        return -1;
+    }
+    val = end + 1;
+    ctx->rng_off = first;
+    ctx->rng_len = 0; //through the end of the file
+    if (*val != '\0') {
+        size_t last;
+        if (gflen_parse(val, NULL, &last) != 0 || last < first) {
+            return -1;
+        }
+        ctx->rng_len = last - first + 1;
+    }
+    ctx->has_rng = 1;
+    return 0;
+}
 
-    int ret = 0;
+/*
+ * Parses a comma separated list of accepted encodings, encodings the
+ * server does not know are skipped.
+ */
+void gfs_parse_accept_encoding(gfcontext_t *ctx, char *val) {
+    char *saveptr;
+    for (char *enc = strtok_r(val, ",", &saveptr); enc != NULL; enc = strtok_r(NULL, ",", &saveptr)) {
+        if (strcmp(enc, enc_gzip) == 0) {
+            ctx->accept_enc |= GF_ENC_GZIP;
+        }
+    }
+}
 
-    ret = pthread_mutex_init(&rqst_lock, NULL);
-    if (ret) {
-        fprintf(stderr, "[ERROR] when attempting to create mutex\n");
-        exit(1);
+int gfs_parse_options(gfcontext_t *ctx, char *opts, size_t opts_len) {
+
+    char buffer[BUFSIZE];
+    if (opts_len >= sizeof(buffer)) {
+        return -1;
     }
+    memcpy(buffer, opts, opts_len);
+    buffer[opts_len] = '\0';
+
+    /* unknown fields are ignored so clients can send newer options */
+    char *saveptr;
+    for (char *tok = strtok_r(buffer, " ", &saveptr); tok != NULL; tok = strtok_r(NULL, " ", &saveptr)) {
+        if (strncmp(tok, opt_rng, strlen(opt_rng)) == 0) {
+            if (gfs_parse_range(ctx, tok + strlen(opt_rng)) != 0) {
+                return -1;
+            }
+        } else if (strncmp(tok, opt_acpt_enc, strlen(opt_acpt_enc)) == 0) {
+            gfs_parse_accept_encoding(ctx, tok + strlen(opt_acpt_enc));
+        }
+    }
+    return 0;
+}
 
-    ret = pthread_cond_init(&rqst_rdy, NULL);
-    if (ret) {
-        fprintf(stderr, "[ERROR] when attempting to create thread condition variable\n");
-        pthread_mutex_destroy(&rqst_lock);
-        exit(1);
+/*
+ * Deadline timer callback, runs on the timer wheel thread.  Shutting
+ * the socket down wakes a worker blocked sending or receiving on it so
+ * the handler fails its transfer and cleans up as for any other error.
+ */
+unsigned int gfs_deadline_expired(void *arg) {
+
+    gfcontext_t *ctx = (gfcontext_t *) arg;
+    gfserver_t *gfs = ctx->gfs;
+    uint64_t now = gftimer_now_ms();
+    uint64_t last_active = __atomic_load_n(&ctx->last_active, __ATOMIC_ACQUIRE);
+    int got_hdr = __atomic_load_n(&ctx->got_hdr, __ATOMIC_ACQUIRE);
+
+    const char *reason = NULL;
+    uint64_t next = UINT64_MAX;
+    if (!got_hdr && gfs->hdr_to_ms > 0) {
+        if (now >= ctx->hdr_deadline) reason = "header read";
+        else if (ctx->hdr_deadline < next) next = ctx->hdr_deadline;
+    }
+    if (gfs->xfr_to_ms > 0) {
+        if (now >= ctx->xfr_deadline) reason = "total transfer";
+        else if (ctx->xfr_deadline < next) next = ctx->xfr_deadline;
+    }
+    if (gfs->idle_to_ms > 0) {
+        if (now >= last_active + gfs->idle_to_ms) reason = "idle";
+        else if (last_active + gfs->idle_to_ms < next) next = last_active + gfs->idle_to_ms;
     }
 
-    /* setup request queue for worker threads */
-    rqst_que = (steque_t *)malloc(sizeof(steque_t));
-    bzero(rqst_que, sizeof(*rqst_que));
-    steque_init(rqst_que);
+    if (reason != NULL) {
+        gflog_error("%s deadline expired, closing connection on socket fd %d", reason, ctx->sockfd);
+        __atomic_store_n(&ctx->timed_out, 1, __ATOMIC_RELEASE);
+        gfstats_count(GFSTAT_TIMEOUTS, 1);
+        shutdown(ctx->sockfd, SHUT_RDWR);
+        return 0;
+    }
+    if (next == UINT64_MAX) {
+        return 0;
+    }
+    return (unsigned int)(next - now);
 }
 
-void gfs_cleanup() {
-    steque_destroy(rqst_que);
-    free(rqst_que);
-    pthread_mutex_destroy(&rqst_lock);
-    pthread_cond_destroy(&rqst_rdy);
+void gfs_arm_deadlines(gfcontext_t *ctx) {
+    gfserver_t *gfs = ctx->gfs;
+    uint64_t now = gftimer_now_ms();
+    ctx->last_active = now;
+    ctx->hdr_deadline = now + gfs->hdr_to_ms;
+    ctx->xfr_deadline = now + gfs->xfr_to_ms;
+
+    /* first expiry is the nearest deadline, idle is re-checked lazily */
+    unsigned int first = 0;
+    unsigned int tos[3] = {gfs->hdr_to_ms, gfs->idle_to_ms, gfs->xfr_to_ms};
+    for (int i = 0; i < 3; i++) {
+        if (tos[i] > 0 && (first == 0 || tos[i] < first)) {
+            first = tos[i];
+        }
+    }
+    gftimer_init(&ctx->tmr, gfs_deadline_expired, ctx);
+    if (first > 0) {
+        gftimer_add(g_tw, &ctx->tmr, first);
+    }
 }
 
+void gfs_disarm_deadlines(gfcontext_t *ctx) {
+    gftimer_cancel(g_tw, &ctx->tmr);
+}
 
-/****************************/
-/* request queue management */
-/****************************/
-//TODO: don't need a queue item for a single pointer
-typedef struct que_item {
-    gfcontext_t *ctx;
-} que_item;
-
-que_item *create_que_item(gfcontext_t *ctx) {
-    que_item *new_item = malloc(sizeof(que_item));
-    bzero(new_item, sizeof(*new_item));
-    new_item->ctx = ctx;
-    return new_item;
+void gfs_touch(gfcontext_t *ctx) {
+    __atomic_store_n(&ctx->last_active, gftimer_now_ms(), __ATOMIC_RELEASE);
 }
 
-void destroy_que_item(que_item *item) {
-    free(item);
-    item = NULL;
+int gfs_timed_out(gfcontext_t *ctx) {
+    return __atomic_load_n(&ctx->timed_out, __ATOMIC_ACQUIRE);
 }
 
-void handler_enqueue_rqst(gfcontext_t *ctx) {
-    /* create package to add onto queue */
-    usleep(100 * (random() % g_nthds));
-    if (dbg) fprintf(stderr, "[INFO] Added request to queue\n");
-    que_item *qi = create_que_item(ctx);
-    pthread_mutex_lock(&rqst_lock);
-    steque_enqueue(rqst_que, qi);
-    pthread_cond_signal(&rqst_rdy);
-    pthread_mutex_unlock(&rqst_lock);
+void gfs_init() {
+    /* Initialize global resources, ex: request queue, mutexes, condition vars, shm_channel */
+
+    /* timer wheel enforcing connection deadlines */
+    g_tw = gftimer_wheel_create(TIMER_TICK_MS);
+    if (g_tw == NULL) {
+        gflog_error("when attempting to create deadline timer wheel");
+        exit(1);
+    }
 }
 
-void *handler_dequeue_rqsts(void *arg) {
+/* ends the server on an error it cannot go on from.  SIGTERM is sent to
+ * the process rather than raised in the calling thread, as the program
+ * may take it on another thread, so the caller waits there to exit */
+void gfs_fatal() {
+    kill(getpid(), SIGTERM);
+    gfs_park();
+}
 
-    int tid = *((int*)(arg));
-    if (dbg) fprintf(stderr, "[INFO] Thread %i is now handling request queue ...\n", tid);
+/* blocks the calling thread until the process exits */
+void gfs_park() {
+    for (;;) {
+        pause();
+    }
+}
 
-    /* setup thread time out for waiting */
-    struct timespec waittime;
-    struct timeval now;
-    int ret;
+void gfs_cleanup() {
+    if (g_pool != NULL) {
+        wrkpool_destroy(g_pool);
+        g_pool = NULL;
+    }
+    if (g_async != NULL) {
+        gfasync_destroy(g_async);
+        g_async = NULL;
+    }
+    gftimer_wheel_destroy(g_tw);
+    g_tw = NULL;
+}
 
-    while (1) {
-        usleep(100 * (random() % g_nthds));
 
-        pthread_mutex_lock(&rqst_lock);
-        while (steque_isempty(rqst_que)) {
+/*********************/
+/* client accounting */
+/*********************/
 
-            /* set absolute time to wait until */
-            gettimeofday(&now,NULL);
-            waittime.tv_sec = now.tv_sec + 1;
-            waittime.tv_nsec = 0;
+static uint64_t gfs_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
 
-            ret = pthread_cond_timedwait(&rqst_rdy, &rqst_lock, &waittime);
-            if (ret == ETIMEDOUT) {
-                if (dbg) fprintf(stderr, "[INFO] Thread %i waiting timed out waiting for queued requests\n", tid);
-            }
+/* adds the tokens earned since the last refill, capped at one second's
+ * worth, must be called with the clients locked */
+static void gfs_client_refill(gfserver_t *gfs, gfs_client_t *cli, uint64_t now) {
+    double secs = (double)(now - cli->last_us) / 1000000.0;
+    cli->last_us = now;
+    if (gfs->cli_rps > 0) {
+        cli->rqst_tkns += secs * gfs->cli_rps;
+        if (cli->rqst_tkns > gfs->cli_rps) {
+            cli->rqst_tkns = gfs->cli_rps;
+        }
+    }
+    if (gfs->cli_bps > 0) {
+        cli->byte_tkns += secs * (double)gfs->cli_bps;
+        if (cli->byte_tkns > (double)gfs->cli_bps) {
+            cli->byte_tkns = (double)gfs->cli_bps;
+        }
+    }
+}
 
+/*
+ * Looks up, or creates, the entry of the client address and takes a
+ * reference for the new connection.  admit is cleared if the client is
+ * over its request rate.  Idle entries met in the bucket are dropped.
+ */
+gfs_client_t *gfs_client_acquire(gfserver_t *gfs, in_addr_t addr, int *admit) {
+
+    uint64_t now = gfs_now_us();
+    unsigned int bkt = (addr * 2654435761u) % CLIENT_BUCKETS;
+    gfs_client_t *found = NULL;
+
+    pthread_mutex_lock(&g_clients_lock);
+    gfs_client_t **pcli = &g_clients[bkt];
+    while (*pcli != NULL) {
+        gfs_client_t *cli = *pcli;
+        if (cli->addr == addr) {
+            found = cli;
+        } else if (cli->nconns == 0 && now - cli->last_us > CLIENT_EXPIRE_US) {
+            *pcli = cli->next;
+            free(cli);
+            continue;
         }
-        if (dbg) fprintf(stderr, "[INFO] Thread %i dequeued request\n", tid);
-        que_item *qi = (que_item *) steque_pop(rqst_que);
-        pthread_cond_broadcast(&rqst_rdy);
-        pthread_mutex_unlock(&rqst_lock);
+        pcli = &cli->next;
+    }
+    if (found == NULL) {
+        found = malloc(sizeof(gfs_client_t));
+        bzero(found, sizeof(*found));
+        found->addr = addr;
+        found->rqst_tkns = gfs->cli_rps;
+        found->byte_tkns = (double)gfs->cli_bps;
+        found->last_us = now;
+        found->next = g_clients[bkt];
+        g_clients[bkt] = found;
+    }
 
-        ssize_t byts_xfr = gfs_handle_requests(qi->ctx);
-        if (byts_xfr != -1) {
-            if (dbg) fprintf(stderr, "[INFO] Thread %i transferred %zu bytes\n", tid, (size_t) byts_xfr);
+    gfs_client_refill(gfs, found, now);
+    *admit = 1;
+    if (gfs->cli_rps > 0) {
+        if (found->rqst_tkns >= 1.0) {
+            found->rqst_tkns -= 1.0;
         } else {
-            if (dbg) fprintf(stderr, "[ERROR] Thread %i encountered error in handle_file_request\n", tid);
+            found->nrejected++;
+            *admit = 0;
         }
-        destroy_que_item(qi);
-
     }
-    return NULL; //never gets here but for completeness
+    if (*admit) {
+        found->nrqsts++;
+    }
+    found->nconns++;
+    pthread_mutex_unlock(&g_clients_lock);
+    return found;
 }
 
-int gfs_handle_requests(gfcontext_t *ctx) {
+void gfs_client_release(gfs_client_t *cli) {
+    pthread_mutex_lock(&g_clients_lock);
+    cli->nconns--;
+    pthread_mutex_unlock(&g_clients_lock);
+}
 
-    size_t npos = 0;
-    ssize_t bytes_recv;
-    int got_hdr = 0;
+/*
+ * Takes len bytes from the client's byte bucket, sleeping until the
+ * bucket has paid off any deficit.  The bucket may go negative so one
+ * send never waits for more tokens than the bucket can hold.
+ */
+void gfs_client_throttle(gfcontext_t *ctx, size_t len) {
+
+    gfs_client_t *cli = ctx->cli;
+    gfserver_t *gfs = ctx->gfs;
+
+    pthread_mutex_lock(&g_clients_lock);
+    gfs_client_refill(gfs, cli, gfs_now_us());
+    cli->byte_tkns -= (double)len;
+    double owed = -cli->byte_tkns;
+    if (owed > 0) {
+        cli->nthrottled++;
+    }
+    pthread_mutex_unlock(&g_clients_lock);
 
-    char buffer[BUFSIZE];
-    bzero(buffer, BUFSIZE);
-    char hdr_stuff[BUFSIZE];
-    char *hdr_end = hdr_stuff;
+    if (owed > 0) {
+        gfasync_sleep_us((unsigned int)(owed * 1000000.0 / (double)gfs->cli_bps));
+        gfs_touch(ctx);
+    }
+}
 
-    char filepath[512];
-    bzero(filepath,sizeof(filepath));
 
-    /* get next request and parse content */
-    while((bytes_recv = recv(ctx->sockfd, buffer, BUFSIZE, 0)) > 0) {
+/****************************/
+/* request queue management */
+/****************************/
+void handler_init_thd(int ithd, void *arg) {
+    gflog_debug("Thread %i is now handling request queue ...", ithd);
 
-        if (bytes_recv == -1) {
-            fprintf(stderr, "[ERROR] connection terminated abnormally\n"); fflush(stderr);
-            ctx->stat = GF_ERROR;
-            break;
+    /* workers are pinned one cpu each, round-robin over the worker set */
+    if (g_pin_wrkr) {
+        gfaff_pin_thread_cpu(pthread_self(), gfaff_cpu_at(&g_wrkr_cpus, ithd));
+    }
+}
+
+void handler_handle_rqst(void *item, void *arg) {
+    gfcontext_t *ctx = (gfcontext_t *) item;
+    gfstats_record_since(GFSTAT_QUEUE, ctx->queued_us);
+
+    /* new connections are queued on lane 0, once the header is read the
+     * request is queued again on the lane chosen by the classifier */
+    if (!ctx->got_hdr) {
+        ctx->start_us = gfstats_now_us();
+        gfs_arm_deadlines(ctx);
+        if (gfs_read_request(ctx) == 0 && ctx->gfs->clsfy_func != NULL) {
+            ctx->lane = ctx->gfs->clsfy_func(ctx, ctx->path, ctx->gfs->hndlr_arg);
+            ctx->queued_us = gfstats_now_us();
+            wrkpool_submit_flow(g_pool, ctx, ctx->lane, ctx->cli_addr.sin_addr.s_addr, 1);
+            return;
         }
+    }
+
+    ssize_t byts_xfr = gfs_serve_request(ctx);
+    if (byts_xfr != -1) {
+        gflog_debug("Thread transferred %zu bytes", (size_t) byts_xfr);
+    } else {
+        gflog_debug("Thread encountered error in handle_file_request");
+    }
+}
 
-        if (!got_hdr) {
+void handler_async_rqst(void *item, void *arg) {
+    gfcontext_t *ctx = (gfcontext_t *) item;
+    gfstats_record_since(GFSTAT_QUEUE, ctx->queued_us);
+    ctx->start_us = gfstats_now_us();
 
-            //fprintf(stderr, "INFO haven't got header, got byte count %zu\n", bytes_recv); fflush(stderr);
+    /* the coroutine waits for the socket instead of blocking its loop */
+    int flags = fcntl(ctx->sockfd, F_GETFL, 0);
+    fcntl(ctx->sockfd, F_SETFL, flags | O_NONBLOCK);
 
-            if (bytes_recv == 0) {
-                fprintf(stderr, "[ERROR] connection terminated normally but header was not fully received\n"); fflush(stderr);
+    gfs_arm_deadlines(ctx);
+    if (gfs_read_request(ctx) == 0 && ctx->gfs->clsfy_func != NULL) {
+        ctx->lane = ctx->gfs->clsfy_func(ctx, ctx->path, ctx->gfs->hndlr_arg);
+    }
+    ssize_t byts_xfr = gfs_serve_request(ctx);
+    if (byts_xfr != -1) {
+        gflog_debug("Coroutine transferred %zu bytes", (size_t) byts_xfr);
+    } else {
+        gflog_debug("Coroutine encountered error in handle_file_request");
+    }
+}
+
+/* reads and parses the request header into ctx, returns 0 if the request is valid */
+int gfs_read_request(gfcontext_t *ctx) {
+
+    uint64_t start_us = gfstats_now_us();
+    size_t npos = 0;
+    ssize_t bytes_recv = 0;
+    int got_hdr = 0;
+
+    char hdr_stuff[BUFSIZE];
+    bzero(hdr_stuff, BUFSIZE);
+    size_t hdr_used = 0;
+    char *hdr_end = NULL;
+
+    char *filepath = ctx->path;
+    size_t filepath_sz = sizeof(ctx->path);
+
+    /* get next request and parse content, keep reading bytes and storing
+     * in header buffer until marker is found */
+    while (!got_hdr && (bytes_recv = gfs_recv_some(ctx, &hdr_stuff[hdr_used], BUFSIZE - 1 - hdr_used)) > 0) {
+
+        gfs_touch(ctx);
+        hdr_used += bytes_recv;
+        hdr_end = strstr(hdr_stuff, mrkr);
+        if (hdr_end == NULL) {
+            if (hdr_used == BUFSIZE - 1) {
+                gflog_error("request header exceeds %d bytes", BUFSIZE - 1);
                 ctx->stat = GF_ERROR;
                 break;
             }
+            continue;
+        }
 
-            /* keep reading bytes and storing in header buffer until
-             * marker is found.  Also any remaining bytes need to be stored b/c
-             *  these may be the file contents */
-            memcpy(hdr_end, buffer, (size_t)bytes_recv);
-            hdr_end += bytes_recv;
-
-            hdr_end = strstr(hdr_stuff, mrkr);
-            if (hdr_end != NULL) { /* received full header, found marker */
-
-                got_hdr = 1;
+        /* received full header, found marker */
+        got_hdr = 1;
 
-                /* check that first 7 chars provide scheme */
-                if (memcmp( &hdr_stuff[0], scheme, strlen(scheme)) != 0) {
-                    fprintf(stderr, "[ERROR] invalid scheme specified\n"); fflush(stderr);
-                    ctx->stat = GF_FILE_NOT_FOUND;
-                    break;
-                }
+        /* check that first 7 chars provide scheme */
+        if (memcmp( &hdr_stuff[0], scheme, strlen(scheme)) != 0) {
+            gflog_error("invalid scheme specified");
+            ctx->stat = GF_FILE_NOT_FOUND;
+            break;
+        }
 
-                /* place buffer start location after scheme */
-                npos = 1 + strlen(scheme); //1 accounts for whitespace or whatever delimiter, between scheme and status
+        /* place buffer start location after scheme */
+        npos = 1 + strlen(scheme); //1 accounts for whitespace or whatever delimiter, between scheme and status
+
+        /* check that method is GET or HEAD */
+        const char *mthd;
+        if (memcmp( &hdr_stuff[npos], mthd_head, strlen(mthd_head)) == 0) {
+            ctx->mthd = GF_MTHD_HEAD;
+            mthd = mthd_head;
+        } else if (memcmp( &hdr_stuff[npos], mthd_get, strlen(mthd_get)) == 0) {
+            ctx->mthd = GF_MTHD_GET;
+            mthd = mthd_get;
+        } else {
+            gflog_error("method received from client is unknown");
+            ctx->stat = GF_FILE_NOT_FOUND;
+            break;
+        }
 
-                /* check for future but yet unsupported head method */
-                if (memcmp( &hdr_stuff[npos], mthd_head, strlen(mthd_head)) == 0) {
-                    fprintf(stderr, "[ERROR] head method not yet supported\n"); fflush(stderr);
-                    ctx->stat = GF_FILE_NOT_FOUND;
-                    break;
-                }
+        /* get file path and check for validity, path ends at the
+         * first whitespace when optional fields follow it */
+        npos += (1+strlen(mthd)); //1 accounts for whitespace or whatever delimiter, between method and file path
+        char *path_end = memchr(&hdr_stuff[npos], ' ', (size_t)(hdr_end-&hdr_stuff[npos]));
+        if (path_end == NULL) {
+            path_end = hdr_end;
+        }
+        if ((size_t)(path_end-&hdr_stuff[npos]) >= filepath_sz) {
+            gflog_error("file path exceeds %zu characters", filepath_sz - 1);
+            ctx->stat = GF_FILE_NOT_FOUND;
+            break;
+        }
+        memcpy(filepath, &hdr_stuff[npos], (path_end-&hdr_stuff[npos]));
 
-                /* check that method is GET */
-                if (memcmp( &hdr_stuff[npos], mthd_get, strlen(mthd_get)) != 0) {
-                    fprintf(stderr, "[ERROR] method received from client is unknown\n"); fflush(stderr);
-                    ctx->stat = GF_FILE_NOT_FOUND;
-                    break;
-                }
+        /* parse optional fields following the path */
+        if (gfs_parse_options(ctx, path_end, (size_t)(hdr_end-path_end)) != 0) {
+            gflog_error("invalid optional field in request");
+            ctx->stat = GF_ERROR;
+            break;
+        }
 
-                /* get file path and check for validity */
-                npos += (1+strlen(mthd_get)); //1 accounts for whitespace or whatever delimiter, between status and file path
-                memcpy(filepath, &hdr_stuff[npos], (hdr_end-&hdr_stuff[npos]));
-                /* check that file path starts with forward slash */
-                if (strncmp(filepath, "/", 1) != 0) {
-                    fprintf(stderr, "[ERROR] file path does not start with forward slash (/) : %s\n", filepath); fflush(stderr);
-                    ctx->stat = GF_FILE_NOT_FOUND;
-                }
-                break;
+        /* check that file path starts with forward slash */
+        if (strncmp(filepath, "/", 1) != 0) {
+            gflog_error("file path does not start with forward slash (/) : %s", filepath);
+            ctx->stat = GF_FILE_NOT_FOUND;
+        }
+        break;
+    }
 
-            }
+    if (!got_hdr && ctx->stat == GF_OK) {
+        if (bytes_recv < 0) {
+            gflog_error("connection terminated abnormally");
+        } else {
+            gflog_error("connection terminated normally but header was not fully received");
         }
+        ctx->stat = GF_ERROR;
     }
+    __atomic_store_n(&ctx->got_hdr, 1, __ATOMIC_RELEASE);
+    if (ctx->stat == GF_OK) {
+        gflog_debug("request is %s", hdr_stuff);
+    }
+    if (ctx->stat == GF_OK) {
+        gfstats_record_since(GFSTAT_HEADER, start_us);
+    }
+    gftrace_span(ctx->trace_id, GFTRACE_PARSE, start_us, (uint64_t) ctx->stat);
+
+    return (ctx->stat == GF_OK) ? 0 : -1;
+}
+
+/* responds to a request read by gfs_read_request and closes the connection */
+int gfs_serve_request(gfcontext_t *ctx) {
 
     int stat;
+    ssize_t n = 0;
     if (ctx->stat == GF_OK) {
 
         /* call handler for responding to request */
-        if (dbg) fprintf(stderr, "[INFO] request is %s\n", hdr_stuff);
-        ssize_t n = ctx->gfs->hndlr_func(ctx, filepath, ctx->gfs->hndlr_arg);
+        gfs_touch(ctx);
+        n = ctx->gfs->hndlr_func(ctx, ctx->path, ctx->gfs->hndlr_arg);
         if (n < 0) {
-            fprintf(stderr, "[ERROR] in handler when responding to request\n");
+            gflog_error("in handler when responding to request");
             stat = -1;
         } else { // all is well or handler took care of error handling
             stat = 0;
@@ -476,7 +1153,16 @@ int gfs_handle_requests(gfcontext_t *ctx) {
         stat = -1;
     }
 
+    gfs_disarm_deadlines(ctx);
     close(ctx->sockfd);
+    gfstats_count(GFSTAT_REQUESTS, 1);
+    /* error headers are counted as they are sent, whether or not the
+     * handler reports the failure, this counts the remaining failures */
+    if (stat != 0 && ctx->stat != GF_FILE_NOT_FOUND && !ctx->err_counted) {
+        gfstats_count(GFSTAT_ERRORS, 1);
+    }
+    gfstats_record_since(GFSTAT_REQUEST, ctx->start_us);
+    gftrace_finish(ctx->trace_id, ctx->start_us, (n > 0) ? (uint64_t) n : 0);
     gfcontext_cleanup(ctx);
     return stat;
 
@@ -2,13 +2,29 @@
 #define __GETFILE_SERVER_H__
 
 #include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
 #include "steque.h"
+#include "gftimer.h"
+#include "wrkpool.h"
+#include "gfasync.h"
+#include "gfsock.h"
+#include "gfstats.h"
+#include "gftrace.h"
 
 #define  GF_OK 200
 #define  GF_FILE_NOT_FOUND 404
 #define  GF_ERROR 500
 
+#define  GF_MTHD_GET 0
+#define  GF_MTHD_HEAD 1
+
+/* content encodings, accepted encodings are or'ed together */
+#define  GF_ENC_IDENTITY 0
+#define  GF_ENC_GZIP 1
+
 typedef int gfstatus_t;
+typedef int gfmethod_t;
 
 /**************/
 /* structures */
@@ -16,18 +32,52 @@ typedef int gfstatus_t;
 typedef struct _gfcontext_t gfcontext_t;
 typedef struct _gfserver_t {
     unsigned short port;                                //socket port number
+    char *unix_path;                                    //path of the unix domain socket, NULL for none
     int max_pend;                                       //maximum number of pending connections
     ssize_t (*hndlr_func)(gfcontext_t*, char*, void*);  //function callback for handling the data the be sent
     void *hndlr_arg;                                    //argument to handler function callback
-    unsigned short nwrkr_thds;
+    unsigned short nwrkr_thds;                          //maximum number of worker threads
+    unsigned short min_wrkr_thds;                       //worker threads kept when idle
+    unsigned int grow_wait_ms;                          //queue wait above which workers are added
+    unsigned int idle_retire_ms;                        //idle time after which extra workers retire
+    int nlanes;                                         //number of scheduling lanes
+    unsigned int lane_wts[WRKPOOL_MAX_LANES];           //requests served from each lane per round
+    int (*clsfy_func)(gfcontext_t*, char*, void*);      //picks the lane of a request, called with hndlr_arg
+    int nloops;                                         //event loops running handlers as coroutines, 0 uses the worker pool
+    size_t stack_sz;                                    //coroutine stack size
+    unsigned int cli_rps;                               //connections per second per client address, 0 unlimited
+    size_t cli_bps;                                     //bytes per second sent per client address, 0 unlimited
+    unsigned int hdr_to_ms;                             //deadline for receiving the request header, 0 disables
+    unsigned int idle_to_ms;                            //deadline for progress on the connection, 0 disables
+    unsigned int xfr_to_ms;                             //deadline for the whole request, 0 disables
+    gfsock_opts_t sock_opts;                            //tuning of the listening and accepted sockets
 } gfserver_t;
 
 typedef struct _gfcontext_t {
     int sockfd;                    //socket file descriptor
     gfstatus_t stat;               //current error status of context
-    struct sockaddr_in* cli_addr;  //socket address of the connected client
+    gfmethod_t mthd;               //request method, GF_MTHD_GET or GF_MTHD_HEAD
+    int has_rng;                   //non-zero if the request is for a byte range of the file
+    size_t rng_off;                //offset of the first requested byte
+    size_t rng_len;                //number of requested bytes, 0 for through the end of the file
+    int accept_enc;                //GF_ENC_* encodings the client accepts
+    struct sockaddr_in cli_addr;   //socket address of the connected client
     socklen_t cli_addr_len;        //socket address length of connected client
+    struct _gfs_client_t *cli;     //rate limits and counters of the client's address
     gfserver_t *gfs;               //pointer to gfserver structure required for calling request handler with arguments
+    char path[512];                //requested file path
+    int lane;                      //scheduling lane chosen by the classifier
+    gftimer_t tmr;                 //deadline timer of the connection
+    int got_hdr;                   //set once the request header has been read
+    int hdr_sent;                  //set once the response header has been sent
+    int err_counted;               //set once the request is counted as an error
+    int timed_out;                 //set when a deadline expired and the connection was shut down
+    uint64_t last_active;          //monotonic time in ms of the last progress on the connection
+    uint64_t hdr_deadline;         //monotonic time in ms the header must be read by
+    uint64_t xfr_deadline;         //monotonic time in ms the request must be completed by
+    uint64_t queued_us;            //monotonic time in us the connection was last queued
+    uint64_t start_us;             //monotonic time in us a worker first picked up the connection
+    uint64_t trace_id;             //id the events of the request are traced under
 } gfcontext_t;
 
 /* 
@@ -50,12 +100,94 @@ void gfserver_set_port(gfserver_t *gfs, unsigned short port);
  */
 void gfserver_set_maxpending(gfserver_t *gfs, int max_npending);
 
+/*
+ * Makes the server also listen on a unix domain stream socket at path,
+ * for clients on the same host.  A stale socket file at path is
+ * replaced, gfserver_stop removes it.  These clients are accounted as a
+ * single client with address 0.0.0.0.
+ */
+void gfserver_set_unix_path(gfserver_t *gfs, const char *path);
+
+/*
+ * Sets the socket options of the listening sockets, which accepted
+ * connections inherit.  Must be called before gfserver_serve.  Defaults
+ * to gfsock_opts_default for a segment size of 0.
+ */
+void gfserver_set_sockopts(gfserver_t *gfs, const gfsock_opts_t *opts);
+
+/*
+ * Configures the elastic worker pool.  The server starts min_wrkr_thds
+ * workers and adds more, up to the count given to gfserver_init, while
+ * accepted connections wait longer than grow_wait_ms for a worker.
+ * Workers above the minimum retire after idle_retire_ms without work.
+ */
+void gfserver_set_pool(gfserver_t *gfs, unsigned short min_wrkr_thds, unsigned int grow_wait_ms, unsigned int idle_retire_ms);
+
+/*
+ * Splits requests over nlanes scheduling lanes.  Once a request header is
+ * read the classifier is called with the path and the handler argument
+ * and returns the lane for the request, e.g. by its expected size.
+ * Workers serve the lanes by weighted round-robin, taking up to
+ * weights[i] requests from lane i before moving on.  New connections
+ * wait on lane 0 for their header to be read.  Returns -1 if nlanes is
+ * out of range.
+ */
+int gfserver_set_lanes(gfserver_t *gfs, int nlanes, const unsigned int *weights,
+                       int (*classifier)(gfcontext_t *, char *, void *));
+
+/*
+ * Limits each client address to rqsts_per_sec new connections and
+ * bytes_per_sec of response data, each with a burst of one second's
+ * worth.  Connections over the request rate are answered with an error
+ * as they are accepted, sends over the byte rate are delayed.  0 leaves
+ * the rate unlimited.  Requests queued for workers are served
+ * round-robin across client addresses regardless of the limits.
+ */
+void gfserver_set_client_limits(gfserver_t *gfs, unsigned int rqsts_per_sec, size_t bytes_per_sec);
+
+/*
+ * Runs each request on its own coroutine, spread over nloops event loop
+ * threads, instead of on the worker pool.  A request only holds its loop
+ * while it runs, whenever it waits in gfs_send, gfs_poll or gfs_sleep_us
+ * the loop switches to other requests.  Handlers must wait only through
+ * these, or functions built on gfasync, and need stacks of stack_sz
+ * bytes, 0 for GFASYNC_STACK_SZ.  The pool settings and lane weights do
+ * not apply, the classifier still picks the lane of each request.
+ */
+void gfserver_set_async(gfserver_t *gfs, int nloops, size_t stack_sz);
+
+/*
+ * Prints the worker pool or event loop statistics and per client
+ * counters to stderr.  Takes the locks of the server, so it must not be
+ * called from a signal handler.
+ */
+void gfserver_print_stats(gfserver_t *gfs);
+
+/*
+ * Pins the thread calling gfserver_serve, which accepts connections, to
+ * the cpus of acceptor_cpus and the worker threads round-robin, one cpu
+ * each, to the cpus of worker_cpus.  Lists are of the form "0-3,8"; NULL
+ * leaves the threads unpinned.  Returns -1 if a list is malformed.
+ */
+int gfserver_set_cpus(gfserver_t *gfs, const char *acceptor_cpus, const char *worker_cpus);
+
 /*
  * Sets the number of worker threads to be used for concurrently
  * handling requests.
  */
 void gfservers_set_num_threads(gfserver_t *gfs, int n_wrkr_thds);
 
+/*
+ * Sets the connection deadlines in milliseconds, a value of 0 disables
+ * the deadline.  The header deadline bounds the time a worker waits for
+ * the request header, the idle deadline bounds the time without any
+ * progress sending or receiving, and the transfer deadline bounds the
+ * time to complete the whole request.  Deadlines are counted from when
+ * a worker starts handling the connection.  When one expires the
+ * connection is shut down, which fails any gfs_send in progress.
+ */
+void gfserver_set_timeouts(gfserver_t *gfs, unsigned int hdr_to_ms, unsigned int idle_to_ms, unsigned int xfr_to_ms);
+
 /*
  * Sets the handler callback, a function that will be called for each each
  * request.  As arguments, this function receives:
@@ -73,12 +205,14 @@ void gfserver_set_handler(gfserver_t *gfs, ssize_t (*handler)(gfcontext_t *, cha
 void gfserver_set_handlerarg(gfserver_t *gfs, void* arg);
 
 /*
- * Starts the server.  Does not return.
+ * Starts the server.  Does not return.  On errors it cannot go on from
+ * it sends SIGTERM to the process and waits for it to exit.
  */
 void gfserver_serve(gfserver_t *gfs);
 
 /*
- * Stops the server and cleans up
+ * Stops the server and cleans up.  Called from another thread than the
+ * one serving, which hands off no more connections from then on.
  */
 void gfserver_stop(gfserver_t *gfs);
 
@@ -90,14 +224,73 @@ void gfserver_stop(gfserver_t *gfs);
  */
 ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
 
+/*
+ * Returns the method of the request being handled, GF_MTHD_GET or
+ * GF_MTHD_HEAD.  For HEAD requests the handler only needs to call
+ * gfs_sendheader with the status and length of the file, no file
+ * contents are sent to the client.
+ */
+gfmethod_t gfs_get_method(gfcontext_t *ctx);
+
+/*
+ * Returns non-zero if the request is for a byte range of the file
+ * and, if so, provides the offset of the first requested byte and
+ * the number of bytes requested (0 if the range extends to the end
+ * of the file).  The handler should send a header with the length
+ * of the range, clamped to the end of the file, followed by only
+ * those bytes.
+ */
+int gfs_get_range(gfcontext_t *ctx, size_t *offset, size_t *len);
+
+/*
+ * Returns the encodings the client accepts as GF_ENC_* flags or'ed
+ * together, GF_ENC_IDENTITY if it only accepts the file as is.
+ */
+int gfs_get_accept_encoding(gfcontext_t *ctx);
+
+/*
+ * Sends an OK header for a file sent in an encoding the client accepts.
+ * file_len is the length of the file once decoded and enc_len the
+ * number of encoded bytes that follow, which the handler then sends
+ * with gfs_send.  With GF_ENC_IDENTITY this is gfs_sendheader.
+ */
+ssize_t gfs_sendheader_encoded(gfcontext_t *ctx, size_t file_len, int encoding, size_t enc_len);
+
+/*
+ * Returns the scheduling lane the classifier chose for the request, 0
+ * when no lanes are configured.
+ */
+int gfs_get_lane(gfcontext_t *ctx);
+
 /*
  * Sends size bytes starting at the pointer data to the client 
  * This function should only be called from within a callback registered 
  * with gfserver_set_handler.  It returns once the data has been
- * sent.
+ * sent.  For HEAD requests the data is discarded and size is returned.
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size);
 
+/*
+ * Waits like poll(2) for events on the descriptors, at most timeout_ms
+ * milliseconds or without limit if negative.  Handlers must use this
+ * instead of blocking calls so that async servers can run other requests
+ * meanwhile, on worker threads it blocks.  Returns the number of ready
+ * descriptors, 0 on timeout, -1 on error.
+ */
+int gfs_poll(gfcontext_t *ctx, struct pollfd *fds, int nfds, int timeout_ms);
+
+/*
+ * Sleeps for usec microseconds, letting async servers run other requests
+ * meanwhile.
+ */
+void gfs_sleep_us(gfcontext_t *ctx, unsigned int usec);
+
+/*
+ * Returns non-zero if a deadline of the connection expired.  Handlers
+ * may check this to stop work on a request that can no longer be sent.
+ */
+int gfs_timed_out(gfcontext_t *ctx);
+
 /*
  * Aborts the connection to the client associated with the input
  * gfcontext_t.
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "gflog.h"
+#include "gfsock.h"
+
+/* bounds of the default unsent data limit */
+#define LOWAT_MIN (16 * 1024)
+#define LOWAT_MAX (4 * 1024 * 1024)
+#define FASTOPEN_QLEN 16
+
+
+void gfsock_opts_default(gfsock_opts_t *opts, size_t seg_sz) {
+
+    bzero(opts, sizeof(*opts));
+    opts->nodelay = 1;
+
+    /* two chunks keep the pipe full while one is being produced */
+    size_t lowat = 2 * seg_sz;
+    if (lowat < LOWAT_MIN) {
+        lowat = LOWAT_MIN;
+    } else if (lowat > LOWAT_MAX) {
+        lowat = LOWAT_MAX;
+    }
+    opts->notsent_lowat = (int) lowat;
+    opts->fastopen = FASTOPEN_QLEN;
+}
+
+int gfsock_opts_set(gfsock_opts_t *opts, const char *name, long val) {
+    if (strcmp(name, "nodelay") == 0) {
+        opts->nodelay = (int) val;
+    } else if (strcmp(name, "sndbuf") == 0) {
+        opts->sndbuf = (int) val;
+    } else if (strcmp(name, "rcvbuf") == 0) {
+        opts->rcvbuf = (int) val;
+    } else if (strcmp(name, "notsent-lowat") == 0) {
+        opts->notsent_lowat = (int) val;
+    } else if (strcmp(name, "fastopen") == 0) {
+        opts->fastopen = (int) val;
+    } else if (strcmp(name, "busy-poll") == 0) {
+        opts->busy_poll_us = (int) val;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int gfsock_setopt(int sockfd, int level, int opt, int val, const char *name) {
+    if (setsockopt(sockfd, level, opt, &val, sizeof(val)) != 0) {
+        gflog_warn("setting %s to %d in setsockopt: %s", name, val, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int gfsock_apply(int sockfd, const gfsock_opts_t *opts, int role) {
+
+    int domain = AF_INET;
+    socklen_t len = sizeof(domain);
+    getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    int tcp = (domain == AF_INET || domain == AF_INET6);
+    int nfail = 0;
+
+    /* buffer sizes must be known before the handshake to pick the
+     * window scale */
+    if (opts->sndbuf > 0) {
+        nfail += gfsock_setopt(sockfd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, "SO_SNDBUF");
+    }
+    if (opts->rcvbuf > 0) {
+        nfail += gfsock_setopt(sockfd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, "SO_RCVBUF");
+    }
+    if (!tcp) {
+        return nfail;
+    }
+
+    if (opts->fastopen > 0) {
+#ifdef TCP_FASTOPEN
+        if (role == GFSOCK_LISTEN) {
+            nfail += gfsock_setopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN, opts->fastopen, "TCP_FASTOPEN");
+        }
+#endif
+#ifdef TCP_FASTOPEN_CONNECT
+        /* connect returns right away and the request rides on the SYN */
+        if (role == GFSOCK_CONNECT) {
+            nfail += gfsock_setopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, "TCP_FASTOPEN_CONNECT");
+        }
+#endif
+    }
+    nfail += gfsock_setopt(sockfd, IPPROTO_TCP, TCP_NODELAY, opts->nodelay ? 1 : 0, "TCP_NODELAY");
+#ifdef TCP_NOTSENT_LOWAT
+    if (opts->notsent_lowat > 0) {
+        nfail += gfsock_setopt(sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts->notsent_lowat, "TCP_NOTSENT_LOWAT");
+    }
+#endif
+#ifdef SO_BUSY_POLL
+    if (opts->busy_poll_us > 0) {
+        nfail += gfsock_setopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll_us, "SO_BUSY_POLL");
+    }
+#endif
+    return nfail;
+}
+
+void gfsock_print(const gfsock_opts_t *opts, const char *name) {
+    fprintf(stderr, "[INFO] %s socket options: nodelay %d, sndbuf %d, rcvbuf %d, notsent-lowat %d, fastopen %d, busy-poll %d us\n",
+            name, opts->nodelay, opts->sndbuf, opts->rcvbuf, opts->notsent_lowat, opts->fastopen, opts->busy_poll_us);
+}
@@ -0,0 +1,54 @@
+#ifndef __GFSOCK_H__
+#define __GFSOCK_H__
+
+/*
+ * gfsock holds the socket tuning shared by gfserver and gfclient.  A
+ * value of 0 leaves the option at the system default, except for
+ * nodelay where 0 turns Nagle's algorithm back on.
+ */
+
+#include <stddef.h>
+
+/* roles a socket is tuned for */
+#define GFSOCK_LISTEN 0
+#define GFSOCK_CONNECT 1
+
+typedef struct _gfsock_opts_t {
+    int nodelay;                  //TCP_NODELAY, sends small headers right away
+    int sndbuf;                   //SO_SNDBUF in bytes, setting it turns off autotuning
+    int rcvbuf;                   //SO_RCVBUF in bytes, setting it turns off autotuning
+    int notsent_lowat;            //TCP_NOTSENT_LOWAT, unsent bytes queued before a send blocks
+    int fastopen;                 //TCP_FASTOPEN, listen queue length on servers, non-zero enables it on clients
+    int busy_poll_us;             //SO_BUSY_POLL, microseconds to busy poll the device queue on reads
+} gfsock_opts_t;
+
+/*
+ * Fills in defaults for transfers in chunks of seg_sz bytes: no Nagle
+ * delay, autotuned buffers, unsent data bounded to a few chunks so
+ * queued bytes do not add latency, a fast open queue on servers and no
+ * busy polling.
+ */
+void gfsock_opts_default(gfsock_opts_t *opts, size_t seg_sz);
+
+/*
+ * Sets the option given by its command line name (nodelay, sndbuf,
+ * rcvbuf, notsent-lowat, fastopen, busy-poll).  Returns -1 if the name
+ * is unknown.
+ */
+int gfsock_opts_set(gfsock_opts_t *opts, const char *name, long val);
+
+/*
+ * Applies the options to a listening socket before listen, or to a
+ * client socket before connect.  Accepted sockets inherit the options
+ * of their listening socket, so they need no calls of their own.  TCP
+ * options are skipped on unix domain sockets.  Failures are reported but
+ * not fatal, returns the number of options that could not be set.
+ */
+int gfsock_apply(int sockfd, const gfsock_opts_t *opts, int role);
+
+/*
+ * Prints the options to stderr, prefixed with name.
+ */
+void gfsock_print(const gfsock_opts_t *opts, const char *name);
+
+#endif
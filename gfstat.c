@@ -0,0 +1,132 @@
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gfstats.h"
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  gfstat [options]\n"                                                        \
+"options:\n"                                                                  \
+"  -n [name]           Stats page to read, the --stats-name of the process (Default: webproxy)\n"\
+"  -i [seconds]        Interval between samples (Default: 1)\n"             \
+"  -c [count]          Number of samples, 0 runs until interrupted (Default: 0)\n"\
+"  -1                  Print the totals once and exit\n"                      \
+"  -h                  Show this help message\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+        {"name",          required_argument,      NULL,           'n'},
+        {"interval",      required_argument,      NULL,           'i'},
+        {"count",         required_argument,      NULL,           'c'},
+        {"once",          no_argument,            NULL,           '1'},
+        {"help",          no_argument,            NULL,           'h'},
+        {NULL,            0,                      NULL,             0}
+};
+
+static void Usage() {
+    fprintf(stdout, "%s", USAGE);
+}
+
+/*
+ * Prints the counters with their rate over the last interval and the
+ * latency distribution of every stage that recorded anything.
+ */
+static void print_sample(const gfstats_page_t *page, const gfstats_slot_t *cur,
+                         const gfstats_slot_t *prev, double secs) {
+
+    double uptime = (double)(gfstats_now_us() - page->start_us) / 1e6;
+    fprintf(stdout, "gfstat %s (pid %d), up %.1f s\n", page->name, page->pid, uptime);
+    fprintf(stdout, "%-14s %16s %14s\n", "counter", "total", "per second");
+    for (int ctr = 0; ctr < GFSTAT_NCTRS; ctr++) {
+        uint64_t delta = cur->ctrs[ctr] - ((prev != NULL) ? prev->ctrs[ctr] : 0);
+        fprintf(stdout, "%-14s %16lu %14.1f\n", gfstats_ctr_name(ctr),
+                (unsigned long) cur->ctrs[ctr], (secs > 0) ? (double) delta / secs : 0.0);
+    }
+
+    fprintf(stdout, "%-14s %12s %10s %10s %10s %10s %10s %10s\n",
+            "stage (us)", "count", "avg", "p50", "p90", "p99", "p99.9", "max");
+    for (int stage = 0; stage < GFSTAT_NSTAGES; stage++) {
+        const gfhist_t *hist = &cur->hists[stage];
+        if (hist->nvals == 0) {
+            continue;
+        }
+        fprintf(stdout, "%-14s %12lu %10lu %10lu %10lu %10lu %10lu %10lu\n", gfstats_stage_name(stage),
+                (unsigned long) hist->nvals, (unsigned long) gfhist_mean(hist),
+                (unsigned long) gfhist_percentile(hist, 50), (unsigned long) gfhist_percentile(hist, 90),
+                (unsigned long) gfhist_percentile(hist, 99), (unsigned long) gfhist_percentile(hist, 99.9),
+                (unsigned long) hist->max);
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    char *name = "webproxy";
+    unsigned int interval = 1;
+    int count = 0;
+    int once = 0;
+    int option_char;
+
+    while ((option_char = getopt_long(argc, argv, "n:i:c:1h", gLongOptions, NULL)) != -1) {
+        switch (option_char) {
+            case 'n':
+                name = optarg;
+                break;
+            case 'i':
+                interval = (unsigned int) atoi(optarg);
+                break;
+            case 'c':
+                count = atoi(optarg);
+                break;
+            case '1':
+                once = 1;
+                break;
+            case 'h':
+                Usage();
+                exit(0);
+                break;
+            default:
+                Usage();
+                exit(1);
+        }
+    }
+    if (interval == 0) {
+        interval = 1;
+    }
+
+    const gfstats_page_t *page = gfstats_attach(name);
+    if (page == NULL) {
+        fprintf(stderr, "[ERROR] no stats published under the name %s\n", name);
+        exit(1);
+    }
+
+    /* both are large, keep them off the stack */
+    gfstats_slot_t *cur = malloc(sizeof(gfstats_slot_t));
+    gfstats_slot_t *prev = malloc(sizeof(gfstats_slot_t));
+
+    /* the first sample shows rates since the process started */
+    gfstats_sum(page, cur);
+    print_sample(page, cur, NULL, (double)(gfstats_now_us() - page->start_us) / 1e6);
+    for (int isample = 1; !once && (count == 0 || isample < count); isample++) {
+        gfstats_slot_t *tmp = prev;
+        prev = cur;
+        cur = tmp;
+        sleep(interval);
+
+        /* the process may have exited and a new one replaced the page,
+         * its pid may even have been reused */
+        if (!gfstats_alive(page)) {
+            fprintf(stderr, "[INFO] process %d publishing %s exited\n", page->pid, name);
+            break;
+        }
+        gfstats_sum(page, cur);
+        print_sample(page, cur, prev, (double) interval);
+    }
+
+    free(cur);
+    free(prev);
+    return 0;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gfstats.h"
+
+#define SHM_PREFIX "/gfstats-"
+
+static const char *ctr_names[GFSTAT_NCTRS] = {
+    "conns", "requests", "bytes", "hits", "misses",
+    "not_found", "errors", "origin", "rejected", "timeouts"
+};
+
+static const char *stage_names[GFSTAT_NSTAGES] = {
+    "accept", "queue", "header", "seg_wait", "cache_ipc",
+    "origin_fetch", "send", "ack_wait", "request"
+};
+
+static gfstats_page_t *g_page = NULL;
+static char g_shm_name[GFSTATS_NAME_LEN + sizeof(SHM_PREFIX)];
+static pthread_once_t g_private_once = PTHREAD_ONCE_INIT;
+
+/* slots given back by exited threads, reused before new ones */
+static pthread_mutex_t g_free_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t g_free_slots[GFSTATS_MAX_SLOTS];
+static int g_nfree = 0;
+static pthread_key_t g_slot_key;
+
+static __thread gfstats_slot_t *tls_slot = NULL;
+static __thread int tls_shared = 0;     //the thread writes to the shared slot 0
+
+/* forward declarations */
+static void gfstats_init_page(gfstats_page_t *page, const char *name);
+static uint64_t gfstats_pid_start(int pid);
+static void gfstats_init_private();
+static void gfstats_release_slot(void *arg);
+static gfstats_slot_t *gfstats_slot();
+
+
+uint64_t gfstats_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+int gfstats_open(const char *name) {
+
+    /* the page of an earlier process is unlinked instead of truncated,
+     * a reader still mapping it would fault on the pages cut off */
+    snprintf(g_shm_name, sizeof(g_shm_name), "%s%s", SHM_PREFIX, name);
+    shm_unlink(g_shm_name);
+    int fd = shm_open(g_shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("[ERROR] creating the stats shared memory");
+        return -1;
+    }
+
+    /* the object only ever grows to the page size, readers map no more */
+    if (ftruncate(fd, sizeof(gfstats_page_t)) != 0) {
+        perror("[ERROR] sizing the stats shared memory");
+        close(fd);
+        shm_unlink(g_shm_name);
+        return -1;
+    }
+    gfstats_page_t *page = mmap(NULL, sizeof(gfstats_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("[ERROR] mapping the stats shared memory");
+        shm_unlink(g_shm_name);
+        return -1;
+    }
+    gfstats_init_page(page, name);
+    g_page = page;
+    return 0;
+}
+
+void gfstats_close() {
+    if (g_shm_name[0] != '\0') {
+        shm_unlink(g_shm_name);
+        g_shm_name[0] = '\0';
+    }
+}
+
+void gfstats_count(int ctr, uint64_t n) {
+    gfstats_slot_t *slot = gfstats_slot();
+    if (tls_shared) {
+        __atomic_fetch_add(&slot->ctrs[ctr], n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(&slot->ctrs[ctr], slot->ctrs[ctr] + n, __ATOMIC_RELAXED);
+    }
+}
+
+void gfstats_record(int stage, uint64_t usec) {
+    gfstats_slot_t *slot = gfstats_slot();
+    gfhist_t *hist = &slot->hists[stage];
+    if (tls_shared) {
+        __atomic_fetch_add(&hist->counts[gfhist_bucket(usec)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hist->nvals, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hist->sum, usec, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+        while (usec > max && !__atomic_compare_exchange_n(&hist->max, &max, usec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    } else {
+        gfhist_add(hist, usec);
+    }
+}
+
+void gfstats_record_since(int stage, uint64_t start_us) {
+    uint64_t now = gfstats_now_us();
+    gfstats_record(stage, (now > start_us) ? now - start_us : 0);
+}
+
+const gfstats_page_t *gfstats_attach(const char *name) {
+
+    char shm_name[GFSTATS_NAME_LEN + sizeof(SHM_PREFIX)];
+    snprintf(shm_name, sizeof(shm_name), "%s%s", SHM_PREFIX, name);
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(gfstats_page_t)) {
+        close(fd);
+        return NULL;
+    }
+    const gfstats_page_t *page = mmap(NULL, sizeof(gfstats_page_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        return NULL;
+    }
+    if (page->magic != GFSTATS_MAGIC || page->version != GFSTATS_VERSION) {
+        munmap((void *) page, sizeof(gfstats_page_t));
+        return NULL;
+    }
+    return page;
+}
+
+int gfstats_alive(const gfstats_page_t *page) {
+    if (kill(page->pid, 0) != 0 && errno != EPERM) {
+        return 0;
+    }
+    return gfstats_pid_start(page->pid) == page->pid_start;
+}
+
+void gfstats_sum(const gfstats_page_t *page, gfstats_slot_t *tot) {
+    memset(tot, 0, sizeof(*tot));
+    uint32_t nslots = __atomic_load_n(&page->nslots, __ATOMIC_ACQUIRE);
+    if (nslots > GFSTATS_MAX_SLOTS) {
+        nslots = GFSTATS_MAX_SLOTS;
+    }
+    for (uint32_t islot = 0; islot < nslots; islot++) {
+        const gfstats_slot_t *slot = &page->slots[islot];
+        for (int ctr = 0; ctr < GFSTAT_NCTRS; ctr++) {
+            tot->ctrs[ctr] += slot->ctrs[ctr];
+        }
+        for (int stage = 0; stage < GFSTAT_NSTAGES; stage++) {
+            gfhist_merge(&tot->hists[stage], &slot->hists[stage]);
+        }
+    }
+}
+
+const char *gfstats_ctr_name(int ctr) {
+    return (ctr >= 0 && ctr < GFSTAT_NCTRS) ? ctr_names[ctr] : "unknown";
+}
+
+const char *gfstats_stage_name(int stage) {
+    return (stage >= 0 && stage < GFSTAT_NSTAGES) ? stage_names[stage] : "unknown";
+}
+
+
+/*********************/
+/* private functions */
+/*********************/
+
+void gfstats_init_page(gfstats_page_t *page, const char *name) {
+    page->version = GFSTATS_VERSION;
+    page->pid = (int) getpid();
+    page->pid_start = gfstats_pid_start(page->pid);
+    snprintf(page->name, sizeof(page->name), "%s", name);
+    page->start_us = gfstats_now_us();
+    page->nslots = 1;
+    pthread_key_create(&g_slot_key, gfstats_release_slot);
+
+    /* readers check the magic last, once everything else is in place */
+    __atomic_store_n(&page->magic, GFSTATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* the start time of a process in clock ticks after boot, field 22 of
+ * /proc/<pid>/stat, or 0 if it cannot be read */
+uint64_t gfstats_pid_start(int pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = '\0';
+
+    /* the command name may hold blanks, fields are counted after it */
+    char *pos = strrchr(buf, ')');
+    if (pos == NULL) {
+        return 0;
+    }
+    for (int field = 2; field < 22 && pos != NULL; field++) {
+        pos = strchr(pos + 1, ' ');
+    }
+    return (pos != NULL) ? strtoull(pos + 1, NULL, 10) : 0;
+}
+
+void gfstats_init_private() {
+    if (g_page == NULL) {
+        gfstats_page_t *page = calloc(1, sizeof(gfstats_page_t));
+        gfstats_init_page(page, "private");
+        g_page = page;
+    }
+}
+
+/* runs as a thread exits, its slot and counts pass to the next thread */
+void gfstats_release_slot(void *arg) {
+    uint32_t islot = (uint32_t)(uintptr_t) arg;
+    pthread_mutex_lock(&g_free_lock);
+    g_free_slots[g_nfree++] = islot;
+    pthread_mutex_unlock(&g_free_lock);
+}
+
+gfstats_slot_t *gfstats_slot() {
+
+    if (tls_slot != NULL) {
+        return tls_slot;
+    }
+    if (g_page == NULL) {
+        pthread_once(&g_private_once, gfstats_init_private);
+    }
+
+    uint32_t islot = 0;
+    pthread_mutex_lock(&g_free_lock);
+    if (g_nfree > 0) {
+        islot = g_free_slots[--g_nfree];
+    } else if (g_page->nslots < GFSTATS_MAX_SLOTS) {
+        islot = g_page->nslots;
+        __atomic_store_n(&g_page->nslots, islot + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_free_lock);
+
+    if (islot == 0) {
+        tls_shared = 1;
+    } else {
+        pthread_setspecific(g_slot_key, (void *)(uintptr_t) islot);
+    }
+    tls_slot = &g_page->slots[islot];
+    return tls_slot;
+}
@@ -0,0 +1,119 @@
+#ifndef __GFSTATS_H__
+#define __GFSTATS_H__
+
+/*
+ * gfstats keeps counters and per stage latency histograms of a process in
+ * a named shared memory page, so gfstat can read them live from outside.
+ * Each thread writes to a slot of its own without locks or atomic
+ * instructions, readers add the slots up.  Slots of exited threads are
+ * handed to new threads with their counts kept.  Threads beyond
+ * GFSTATS_MAX_SLOTS share one slot updated with atomic adds.
+ */
+
+#include <stdint.h>
+#include "gfhist.h"
+
+#define GFSTATS_MAGIC 0x47465354
+#define GFSTATS_VERSION 2
+#define GFSTATS_MAX_SLOTS 64
+#define GFSTATS_NAME_LEN 32
+
+/* counters */
+#define GFSTAT_CONNS 0           //connections accepted
+#define GFSTAT_REQUESTS 1        //requests handled
+#define GFSTAT_BYTES 2           //bytes of file data served
+#define GFSTAT_HITS 3            //requests served from the cache
+#define GFSTAT_MISSES 4          //requests the cache did not have
+#define GFSTAT_NOT_FOUND 5       //requests answered with FILE_NOT_FOUND
+#define GFSTAT_ERRORS 6          //requests answered with or failed by an error
+#define GFSTAT_ORIGIN 7          //requests fetched from the origin server
+#define GFSTAT_REJECTED 8        //connections turned away by rate limits
+#define GFSTAT_TIMEOUTS 9        //connections closed by a deadline
+#define GFSTAT_NCTRS 10
+
+/* stages, latencies in microseconds */
+#define GFSTAT_ACCEPT 0          //accept returning to the connection being queued
+#define GFSTAT_QUEUE 1           //queued until a worker or event loop picks it up
+#define GFSTAT_HEADER 2          //reading the request header
+#define GFSTAT_SEG_WAIT 3        //waiting for a free shared memory segment
+#define GFSTAT_CACHE_IPC 4       //cache request until its response arrives
+#define GFSTAT_ORIGIN_FETCH 5    //whole transfer from the origin server
+#define GFSTAT_SEND 6            //one gfs_send call to the client
+#define GFSTAT_ACK_WAIT 7        //cache waiting for a chunk to be acknowledged
+#define GFSTAT_REQUEST 8         //whole request, from pickup to completion
+#define GFSTAT_NSTAGES 9
+
+typedef struct _gfstats_slot_t {
+    uint64_t ctrs[GFSTAT_NCTRS];
+    gfhist_t hists[GFSTAT_NSTAGES];
+} __attribute__((aligned(64))) gfstats_slot_t;
+
+typedef struct _gfstats_page_t {
+    uint32_t magic;                     //GFSTATS_MAGIC once the page is set up
+    uint32_t version;                   //GFSTATS_VERSION of the layout
+    int pid;                            //process writing the page
+    uint64_t pid_start;                 //its start time in clock ticks after boot, tells a reused pid apart
+    char name[GFSTATS_NAME_LEN];        //name the page was opened with
+    uint64_t start_us;                  //monotonic time the page was opened
+    uint32_t nslots;                    //slots handed out so far, slot 0 is shared
+    gfstats_slot_t slots[GFSTATS_MAX_SLOTS];
+} gfstats_page_t;
+
+/*
+ * Publishes the statistics of the process in the shared memory object
+ * /gfstats-<name>, replacing one left by an earlier process.  The earlier
+ * object is unlinked rather than reused, so readers still attached to it
+ * keep a whole page.  Must be called before any thread records
+ * statistics; without it they are kept in private memory.  Returns -1 if
+ * the page cannot be created.
+ */
+int gfstats_open(const char *name);
+
+/*
+ * Removes the shared memory object.  The page stays mapped so threads
+ * still running can keep recording.
+ */
+void gfstats_close();
+
+/*
+ * Returns the monotonic time in microseconds, for timing stages.
+ */
+uint64_t gfstats_now_us();
+
+/*
+ * Adds n to a counter.
+ */
+void gfstats_count(int ctr, uint64_t n);
+
+/*
+ * Records a stage latency in microseconds.
+ */
+void gfstats_record(int stage, uint64_t usec);
+
+/*
+ * Records the time since start_us, taken with gfstats_now_us, as a stage
+ * latency.
+ */
+void gfstats_record_since(int stage, uint64_t start_us);
+
+/*
+ * Maps the page published under name read only.  Returns NULL if there
+ * is none or its layout differs.
+ */
+const gfstats_page_t *gfstats_attach(const char *name);
+
+/*
+ * Returns 1 if the process that published the page still runs, 0 once it
+ * has exited, even if its pid has been given to another process.
+ */
+int gfstats_alive(const gfstats_page_t *page);
+
+/*
+ * Adds up the slots of a page into tot.
+ */
+void gfstats_sum(const gfstats_page_t *page, gfstats_slot_t *tot);
+
+const char *gfstats_ctr_name(int ctr);
+const char *gfstats_stage_name(int stage);
+
+#endif
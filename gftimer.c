@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+#include "gflog.h"
+#include "gftimer.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_TICKS ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+
+/*------------*/
+/* structures */
+
+typedef struct _gftimer_slot_t {
+    gftimer_t head;               //sentinel of circular list of timers
+} gftimer_slot_t;
+
+struct _gftimer_wheel_t {
+    gftimer_slot_t slots[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t cur_tick;            //next tick to be processed
+    uint64_t start_ms;            //monotonic time of tick 0
+    unsigned int tick_ms;         //wheel resolution
+    int tfd;                      //timerfd driving the wheel
+    int running;                  //cleared to stop the wheel thread
+    pthread_t thd;
+    pthread_mutex_t lock;
+};
+
+
+/*************************/
+/* function declarations */
+
+static void *gftimer_wheel_run(void *arg);
+static void gftimer_link(gftimer_wheel_t *tw, gftimer_t *t);
+static void gftimer_unlink(gftimer_t *t);
+static void gftimer_cascade(gftimer_wheel_t *tw, int level, int idx);
+static void gftimer_advance(gftimer_wheel_t *tw, uint64_t target_tick);
+
+
+/*******************/
+/* wheel functions */
+
+uint64_t gftimer_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+gftimer_wheel_t *gftimer_wheel_create(unsigned int tick_ms) {
+
+    gftimer_wheel_t *tw = malloc(sizeof(gftimer_wheel_t));
+    bzero(tw, sizeof(*tw));
+    tw->tick_ms = (tick_ms > 0) ? tick_ms : 1;
+    for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        for (int idx = 0; idx < WHEEL_SIZE; idx++) {
+            gftimer_t *head = &tw->slots[lvl][idx].head;
+            head->next = head;
+            head->prev = head;
+        }
+    }
+
+    /* periodic timerfd wakes the wheel thread once per tick */
+    tw->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tw->tfd < 0) {
+        gflog_error("creating timer wheel timerfd: %s", strerror(errno));
+        free(tw);
+        return NULL;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = tw->tick_ms / 1000;
+    its.it_interval.tv_nsec = (long)(tw->tick_ms % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(tw->tfd, 0, &its, NULL) != 0) {
+        gflog_error("arming timer wheel timerfd: %s", strerror(errno));
+        close(tw->tfd);
+        free(tw);
+        return NULL;
+    }
+
+    pthread_mutex_init(&tw->lock, NULL);
+    tw->start_ms = gftimer_now_ms();
+    tw->running = 1;
+    int rc = pthread_create(&tw->thd, NULL, gftimer_wheel_run, tw);
+    if (rc) {
+        gflog_error("when attempting to create timer wheel thread - %d", rc);
+        pthread_mutex_destroy(&tw->lock);
+        close(tw->tfd);
+        free(tw);
+        return NULL;
+    }
+    return tw;
+}
+
+void gftimer_wheel_destroy(gftimer_wheel_t *tw) {
+    if (tw == NULL) {
+        return;
+    }
+    __atomic_store_n(&tw->running, 0, __ATOMIC_RELEASE);
+    pthread_join(tw->thd, NULL);
+    close(tw->tfd);
+    pthread_mutex_destroy(&tw->lock);
+    free(tw);
+}
+
+void gftimer_init(gftimer_t *t, gftimer_func_t func, void *arg) {
+    bzero(t, sizeof(*t));
+    t->func = func;
+    t->arg = arg;
+}
+
+void gftimer_add(gftimer_wheel_t *tw, gftimer_t *t, unsigned int timeout_ms) {
+    uint64_t ticks = (timeout_ms + tw->tick_ms - 1) / tw->tick_ms;
+    pthread_mutex_lock(&tw->lock);
+    if (t->pending) {
+        gftimer_unlink(t);
+    }
+    t->expires = tw->cur_tick + ((ticks > 0) ? ticks : 1);
+    gftimer_link(tw, t);
+    pthread_mutex_unlock(&tw->lock);
+}
+
+int gftimer_cancel(gftimer_wheel_t *tw, gftimer_t *t) {
+    pthread_mutex_lock(&tw->lock);
+    int was_pending = t->pending;
+    if (t->pending) {
+        gftimer_unlink(t);
+    }
+    pthread_mutex_unlock(&tw->lock);
+    return was_pending;
+}
+
+
+/*********************/
+/* private functions */
+
+/* must be called with the wheel locked */
+void gftimer_link(gftimer_wheel_t *tw, gftimer_t *t) {
+
+    /* pick the level whose slots span the remaining ticks */
+    uint64_t expires = t->expires;
+    uint64_t delta = (expires > tw->cur_tick) ? expires - tw->cur_tick : 0;
+    if (delta > WHEEL_MAX_TICKS) {
+        delta = WHEEL_MAX_TICKS;
+        expires = tw->cur_tick + delta;
+        t->expires = expires;
+    }
+
+    int lvl = 0;
+    if (delta == 0) {
+        expires = tw->cur_tick;
+    } else {
+        while (lvl < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (lvl + 1)))) {
+            lvl++;
+        }
+    }
+    int idx = (int)((expires >> (WHEEL_BITS * lvl)) & WHEEL_MASK);
+
+    gftimer_t *head = &tw->slots[lvl][idx].head;
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    t->pending = 1;
+}
+
+/* must be called with the wheel locked */
+void gftimer_unlink(gftimer_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+    t->pending = 0;
+}
+
+/* moves all timers of a higher level slot down to the levels below */
+void gftimer_cascade(gftimer_wheel_t *tw, int level, int idx) {
+    gftimer_t *head = &tw->slots[level][idx].head;
+    gftimer_t *t = head->next;
+    head->next = head;
+    head->prev = head;
+    while (t != head) {
+        gftimer_t *next = t->next;
+        gftimer_link(tw, t);
+        t = next;
+    }
+}
+
+/* processes all ticks up to and including target_tick, must be called with the wheel locked */
+void gftimer_advance(gftimer_wheel_t *tw, uint64_t target_tick) {
+
+    while (tw->cur_tick <= target_tick) {
+
+        /* at the start of each rotation pull the timers of the next
+         * slot of the level above into the lower levels */
+        uint64_t tick = tw->cur_tick;
+        for (int lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+            if (((tick >> (WHEEL_BITS * (lvl - 1))) & WHEEL_MASK) != 0) {
+                break;
+            }
+            gftimer_cascade(tw, lvl, (int)((tick >> (WHEEL_BITS * lvl)) & WHEEL_MASK));
+        }
+
+        /* detach the expiring slot before running callbacks so re-armed
+         * timers are not picked up again on this tick */
+        gftimer_t *head = &tw->slots[0][tick & WHEEL_MASK].head;
+        gftimer_t expired;
+        if (head->next == head) {
+            tw->cur_tick++;
+            continue;
+        }
+        expired.next = head->next;
+        expired.prev = head->prev;
+        expired.next->prev = &expired;
+        expired.prev->next = &expired;
+        head->next = head;
+        head->prev = head;
+
+        tw->cur_tick++;
+        while (expired.next != &expired) {
+            gftimer_t *t = expired.next;
+            gftimer_unlink(t);
+            unsigned int rearm_ms = t->func(t->arg);
+            if (rearm_ms > 0) {
+                uint64_t ticks = (rearm_ms + tw->tick_ms - 1) / tw->tick_ms;
+                t->expires = tw->cur_tick + ((ticks > 0) ? ticks - 1 : 0);
+                gftimer_link(tw, t);
+            }
+        }
+    }
+}
+
+void *gftimer_wheel_run(void *arg) {
+
+    gftimer_wheel_t *tw = (gftimer_wheel_t *) arg;
+    uint64_t nexp;
+
+    while (__atomic_load_n(&tw->running, __ATOMIC_ACQUIRE)) {
+        ssize_t n = read(tw->tfd, &nexp, sizeof(nexp));
+        if (n != sizeof(nexp)) {
+            if (n < 0 && errno != EINTR && errno != EAGAIN) {
+                gflog_error("reading timer wheel timerfd: %s", strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        /* catch up on ticks from the clock rather than the expiration
+         * count so a delayed thread never lets the wheel fall behind */
+        uint64_t target_tick = (gftimer_now_ms() - tw->start_ms) / tw->tick_ms;
+        pthread_mutex_lock(&tw->lock);
+        if (target_tick >= tw->cur_tick) {
+            gftimer_advance(tw, target_tick);
+        }
+        pthread_mutex_unlock(&tw->lock);
+    }
+    return NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef __GFTIMER_H__
+#define __GFTIMER_H__
+
+/*
+ * gftimer is a hierarchical timer wheel for tracking large numbers of
+ * connection deadlines.  Adding, re-arming and cancelling a timer are
+ * O(1) operations.  The wheel is advanced by its own thread driven by a
+ * timerfd that ticks every tick_ms milliseconds, so timers expire with a
+ * resolution of one tick.
+ */
+
+#include <stdint.h>
+
+/*
+ * Callback invoked when a timer expires.  It is called from the wheel
+ * thread with the wheel locked, so it must be short and must not call
+ * any of the gftimer functions.  Returning a non-zero number of
+ * milliseconds re-arms the timer to expire again after that timeout,
+ * returning 0 leaves it disarmed.
+ */
+typedef unsigned int (*gftimer_func_t)(void *arg);
+
+typedef struct _gftimer_t {
+    struct _gftimer_t *next;      //next timer in wheel slot
+    struct _gftimer_t *prev;      //previous timer in wheel slot
+    uint64_t expires;             //tick on which the timer expires
+    gftimer_func_t func;          //expiry callback
+    void *arg;                    //argument to expiry callback
+    int pending;                  //non-zero while the timer is armed
+} gftimer_t;
+
+typedef struct _gftimer_wheel_t gftimer_wheel_t;
+
+/*
+ * Creates a timer wheel with the given tick resolution and starts the
+ * thread that advances it.  Returns NULL on failure.
+ */
+gftimer_wheel_t *gftimer_wheel_create(unsigned int tick_ms);
+
+/*
+ * Stops the wheel thread and frees the wheel.  Pending timers are
+ * dropped without calling their callbacks.
+ */
+void gftimer_wheel_destroy(gftimer_wheel_t *tw);
+
+/*
+ * Initializes a timer with its expiry callback and argument.  Must be
+ * called before the timer is first armed.
+ */
+void gftimer_init(gftimer_t *t, gftimer_func_t func, void *arg);
+
+/*
+ * Arms the timer to expire after timeout_ms milliseconds, re-arming it
+ * if it is already pending.
+ */
+void gftimer_add(gftimer_wheel_t *tw, gftimer_t *t, unsigned int timeout_ms);
+
+/*
+ * Disarms the timer.  Once this returns the callback is guaranteed not
+ * to be running or to run, so the memory holding the timer may be
+ * freed.  Returns 1 if the timer was pending, 0 otherwise.
+ */
+int gftimer_cancel(gftimer_wheel_t *tw, gftimer_t *t);
+
+/*
+ * Returns the current value of the monotonic clock in milliseconds.
+ */
+uint64_t gftimer_now_ms();
+
+#endif
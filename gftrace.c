@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "gflog.h"
+#include "gfstats.h"
+#include "gftrace.h"
+
+#define DUMP_BFR_SZ 4096
+#define DUMP_MIN_GAP_US 1000000      //slow request dumps are at least this far apart
+
+typedef struct _gftrace_event_t {
+    uint64_t trace_id;
+    uint64_t ts_us;
+    uint64_t dur_us;
+    uint64_t arg;
+    uint32_t ev;
+    uint32_t instant;                //non-zero for instant events, dur_us is unused
+} gftrace_event_t;
+
+typedef struct _gftrace_ring_t {
+    uint64_t claimed;                //events whose slot a writer started to fill
+    uint64_t head;                   //events completely written
+    int tid;                         //thread currently writing the ring
+    gftrace_event_t evs[GFTRACE_RING_SZ];
+} gftrace_ring_t;
+
+typedef struct _dump_bfr_t {
+    int fd;
+    size_t len;
+    int err;
+    char data[DUMP_BFR_SZ];
+} dump_bfr_t;
+
+static const char *ev_names[GFTRACE_NEVENTS] = {
+    "accept", "parse", "seg_wait", "rspns", "rdy", "ack", "curl_hdr", "done"
+};
+
+static gftrace_ring_t *g_rings[GFTRACE_MAX_RINGS];
+static uint32_t g_nrings = 0;
+static uint64_t g_next_id = 0;
+static uint64_t g_slow_us = 0;
+static uint64_t g_last_dump_us = 0;
+static char g_dir[256] = ".";
+
+/* rings of exited threads, reused before new ones */
+static pthread_mutex_t g_free_lock = PTHREAD_MUTEX_INITIALIZER;
+static gftrace_ring_t *g_free_rings[GFTRACE_MAX_RINGS];
+static int g_nfree = 0;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ring_key;
+
+static __thread gftrace_ring_t *tls_ring = NULL;
+static __thread int tls_no_ring = 0;     //all rings are taken, the thread records nothing
+
+/* forward declarations */
+static void gftrace_put(uint64_t trace_id, int ev, uint64_t ts_us, uint64_t dur_us, uint64_t arg, int instant);
+static gftrace_ring_t *gftrace_ring();
+static void gftrace_init_key();
+static void gftrace_release_ring(void *arg);
+static void dump_append(dump_bfr_t *bfr, const char *str, size_t len);
+static void dump_flush(dump_bfr_t *bfr);
+
+
+uint64_t gftrace_new_id() {
+    uint64_t seq = __atomic_add_fetch(&g_next_id, 1, __ATOMIC_RELAXED);
+    return ((uint64_t) getpid() << 32) | (seq & 0xffffffff);
+}
+
+void gftrace_event(uint64_t trace_id, int ev, uint64_t arg) {
+    gftrace_put(trace_id, ev, gfstats_now_us(), 0, arg, 1);
+}
+
+void gftrace_span(uint64_t trace_id, int ev, uint64_t start_us, uint64_t arg) {
+    uint64_t now = gfstats_now_us();
+    gftrace_put(trace_id, ev, start_us, (now > start_us) ? now - start_us : 0, arg, 0);
+}
+
+void gftrace_set_slow(uint64_t slow_us, const char *dir) {
+    g_slow_us = slow_us;
+    if (dir != NULL) {
+        snprintf(g_dir, sizeof(g_dir), "%s", dir);
+    }
+}
+
+void gftrace_finish(uint64_t trace_id, uint64_t start_us, uint64_t arg) {
+    uint64_t now = gfstats_now_us();
+    uint64_t dur = (now > start_us) ? now - start_us : 0;
+    gftrace_put(trace_id, GFTRACE_DONE, start_us, dur, arg, 0);
+
+    if (g_slow_us == 0 || dur < g_slow_us) {
+        return;
+    }
+
+    /* a burst of slow requests would otherwise spend its time dumping */
+    uint64_t last = __atomic_load_n(&g_last_dump_us, __ATOMIC_RELAXED);
+    if (last != 0 && now - last < DUMP_MIN_GAP_US) {
+        return;
+    }
+    if (!__atomic_compare_exchange_n(&g_last_dump_us, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (gftrace_dump(trace_id) == 0) {
+        gflog_info("request %016lx took %lu us, trace dumped to %s",
+                   (unsigned long) trace_id, (unsigned long) dur, g_dir);
+    }
+}
+
+int gftrace_dump(uint64_t trace_id) {
+
+    char path[sizeof(g_dir) + 64];
+    if (trace_id != 0) {
+        snprintf(path, sizeof(path), "%s/gftrace-%d-%016lx.json", g_dir, (int) getpid(), (unsigned long) trace_id);
+    } else {
+        snprintf(path, sizeof(path), "%s/gftrace-%d-all.json", g_dir, (int) getpid());
+    }
+    dump_bfr_t bfr;
+    bfr.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (bfr.fd < 0) {
+        return -1;
+    }
+    bfr.len = 0;
+    bfr.err = 0;
+
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+            "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+            (int) getpid(), program_invocation_short_name);
+    dump_append(&bfr, line, (size_t) len);
+
+    uint32_t nrings = __atomic_load_n(&g_nrings, __ATOMIC_ACQUIRE);
+    for (uint32_t iring = 0; iring < nrings; iring++) {
+        gftrace_ring_t *ring = g_rings[iring];
+        int tid = ring->tid;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = (head > GFTRACE_RING_SZ) ? head - GFTRACE_RING_SZ : 0;
+        for (uint64_t iev = first; iev < head; iev++) {
+
+            /* copy the event, then check the writer has not started on
+             * its slot again meanwhile */
+            gftrace_event_t ev = ring->evs[iev & (GFTRACE_RING_SZ - 1)];
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (iev + GFTRACE_RING_SZ < __atomic_load_n(&ring->claimed, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            if (trace_id != 0 && ev.trace_id != trace_id) {
+                continue;
+            }
+            if (ev.ev >= GFTRACE_NEVENTS) {
+                continue;
+            }
+
+            if (ev.instant) {
+                len = snprintf(line, sizeof(line),
+                        ",\n{\"name\":\"%s\",\"cat\":\"gf\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"trace_id\":\"%016lx\",\"arg\":%lu}}",
+                        ev_names[ev.ev], (unsigned long) ev.ts_us, (int) getpid(), tid,
+                        (unsigned long) ev.trace_id, (unsigned long) ev.arg);
+            } else {
+                len = snprintf(line, sizeof(line),
+                        ",\n{\"name\":\"%s\",\"cat\":\"gf\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":%d,\"tid\":%d,"
+                        "\"args\":{\"trace_id\":\"%016lx\",\"arg\":%lu}}",
+                        ev_names[ev.ev], (unsigned long) ev.ts_us, (unsigned long) ev.dur_us, (int) getpid(), tid,
+                        (unsigned long) ev.trace_id, (unsigned long) ev.arg);
+            }
+            dump_append(&bfr, line, (size_t) len);
+        }
+    }
+
+    dump_append(&bfr, "\n],\"displayTimeUnit\":\"ms\"}\n", 27);
+    dump_flush(&bfr);
+    close(bfr.fd);
+    return bfr.err ? -1 : 0;
+}
+
+
+/*********************/
+/* private functions */
+/*********************/
+
+void gftrace_put(uint64_t trace_id, int ev, uint64_t ts_us, uint64_t dur_us, uint64_t arg, int instant) {
+
+    gftrace_ring_t *ring = gftrace_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    /* claim the slot before writing it so readers can tell it changed */
+    uint64_t head = ring->head;
+    __atomic_store_n(&ring->claimed, head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    gftrace_event_t *slot = &ring->evs[head & (GFTRACE_RING_SZ - 1)];
+    slot->trace_id = trace_id;
+    slot->ts_us = ts_us;
+    slot->dur_us = dur_us;
+    slot->arg = arg;
+    slot->ev = (uint32_t) ev;
+    slot->instant = (uint32_t) instant;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+gftrace_ring_t *gftrace_ring() {
+
+    if (tls_ring != NULL || tls_no_ring) {
+        return tls_ring;
+    }
+    pthread_once(&g_key_once, gftrace_init_key);
+
+    gftrace_ring_t *ring = NULL;
+    pthread_mutex_lock(&g_free_lock);
+    if (g_nfree > 0) {
+        ring = g_free_rings[--g_nfree];
+    } else if (g_nrings < GFTRACE_MAX_RINGS) {
+        ring = calloc(1, sizeof(gftrace_ring_t));
+        if (ring != NULL) {
+            g_rings[g_nrings] = ring;
+            __atomic_store_n(&g_nrings, g_nrings + 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&g_free_lock);
+
+    if (ring == NULL) {
+        tls_no_ring = 1;
+        return NULL;
+    }
+    ring->tid = (int) syscall(SYS_gettid);
+    pthread_setspecific(g_ring_key, ring);
+    tls_ring = ring;
+    return ring;
+}
+
+void gftrace_init_key() {
+    pthread_key_create(&g_ring_key, gftrace_release_ring);
+}
+
+/* runs as a thread exits, its events stay in the ring until overwritten */
+void gftrace_release_ring(void *arg) {
+    pthread_mutex_lock(&g_free_lock);
+    g_free_rings[g_nfree++] = (gftrace_ring_t *) arg;
+    pthread_mutex_unlock(&g_free_lock);
+}
+
+void dump_append(dump_bfr_t *bfr, const char *str, size_t len) {
+    if (len > sizeof(bfr->data) - bfr->len) {
+        dump_flush(bfr);
+    }
+    memcpy(bfr->data + bfr->len, str, len);
+    bfr->len += len;
+}
+
+void dump_flush(dump_bfr_t *bfr) {
+    size_t off = 0;
+    while (off < bfr->len && !bfr->err) {
+        ssize_t n = write(bfr->fd, bfr->data + off, bfr->len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            bfr->err = 1;
+            break;
+        }
+        off += (size_t) n;
+    }
+    bfr->len = 0;
+}
@@ -0,0 +1,69 @@
+#ifndef __GFTRACE_H__
+#define __GFTRACE_H__
+
+/*
+ * gftrace records timestamped request events into a ring buffer per
+ * thread, so the last moments of every thread can be dumped as Chrome
+ * trace JSON (chrome://tracing, ui.perfetto.dev) when something was slow.
+ * Writers never lock, a dump copies the rings while they keep being
+ * written and drops events overwritten meanwhile.  Events carry the
+ * trace id of their request, which webproxy passes on to simplecached so
+ * the dumps of both processes can be lined up; both use the monotonic
+ * clock as time base.
+ */
+
+#include <stdint.h>
+
+#define GFTRACE_RING_SZ 8192         //events kept per thread, a power of two
+#define GFTRACE_MAX_RINGS 256
+
+/* events */
+#define GFTRACE_ACCEPT 0             //accept returning to the connection being queued
+#define GFTRACE_PARSE 1              //request header read and parsed
+#define GFTRACE_SEG 2                //waiting for a shared memory segment
+#define GFTRACE_RSPNS 3              //cache request until its response arrives, arg is the file size
+#define GFTRACE_RDY 4                //a chunk is ready in the segment, arg is its size
+#define GFTRACE_ACK 5                //a chunk is acknowledged
+#define GFTRACE_CURL_HDR 6           //origin response headers arrived, arg is the content length
+#define GFTRACE_DONE 7               //whole request, arg is the bytes transferred
+#define GFTRACE_NEVENTS 8
+
+/*
+ * Returns a new trace id, unique across processes of the host.
+ */
+uint64_t gftrace_new_id();
+
+/*
+ * Records an instant event.
+ */
+void gftrace_event(uint64_t trace_id, int ev, uint64_t arg);
+
+/*
+ * Records an event lasting from start_us, taken with gfstats_now_us,
+ * until now.
+ */
+void gftrace_span(uint64_t trace_id, int ev, uint64_t start_us, uint64_t arg);
+
+/*
+ * Requests taking longer than slow_us have their events dumped into
+ * dir/gftrace-<pid>-<trace id>.json, at most one a second.  0 disables
+ * slow request dumps.
+ */
+void gftrace_set_slow(uint64_t slow_us, const char *dir);
+
+/*
+ * Records the GFTRACE_DONE event of a request started at start_us and
+ * dumps its events if it was slow.
+ */
+void gftrace_finish(uint64_t trace_id, uint64_t start_us, uint64_t arg);
+
+/*
+ * Dumps the events of a request, or of all requests for a trace_id of 0
+ * into dir/gftrace-<pid>-all.json.  Events are formatted with snprintf,
+ * so it must not be called from a signal handler; webproxy and
+ * simplecached dump on SIGUSR1 from their signal thread.  Returns -1 if
+ * the file cannot be written.
+ */
+int gftrace_dump(uint64_t trace_id);
+
+#endif
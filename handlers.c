@@ -1,18 +1,32 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <curl/curl.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <asm/errno.h>
 
+#include "gfaffinity.h"
+#include "gfasync.h"
+#include "gflen.h"
+#include "gflog.h"
 #include "gfserver.h"
 #include "shm_channel.h"
 #include "steque.h"
 
-static int dbg = 1;
+/* bounds of the backoff of coroutines polling for cache messages and free segments */
+#define YIELD_MIN_US 20
+#define YIELD_MAX_US 2000
+
+/* longest wait for curl sockets before curl's timers are checked */
+#define CURL_POLL_MS 100
+#define CURL_MAX_SOCKS 4
 
 static ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg);
 static ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg);
+static void handler_note_size(const char *path, size_t size);
 
 /*********************************/
 /* request handler main function */
@@ -24,24 +38,27 @@ extern ssize_t handle_request(gfcontext_t *ctx, char *path, void* arg) {
     /* first try to get file from cache */
     ctx->stat = GF_ERROR; //start with assuming error, handler has to change to OK
     byts_xfrd = handle_with_cache(ctx, path, arg);
-    if (byts_xfrd < 0) {
+    if (byts_xfrd < 0 && !ctx->hdr_sent && !gfs_timed_out(ctx)) {
 
-        if (dbg) fprintf(stderr, "[ERROR] file not found when attempting to transfer file using cahce.  Trying http server.\n");
+        gflog_debug("file not found when attempting to transfer file using cahce.  Trying http server.");
 
         /* if file not found or error occurred when requesting from cache,
          *  try to get file from server using curl
          */
         byts_xfrd = 0;
         ctx->stat = GF_ERROR; //start with assuming error, handler has to change to OK
+        uint64_t start_us = gfstats_now_us();
+        gfstats_count(GFSTAT_ORIGIN, 1);
         byts_xfrd = handle_with_curl(ctx, path, arg);
+        gfstats_record_since(GFSTAT_ORIGIN_FETCH, start_us);
         if (byts_xfrd < 0) {
             switch(ctx->stat) {
                 case GF_FILE_NOT_FOUND:
-                    if (dbg) fprintf(stderr, "[ERROR] file not found when attempting to transfer file using curl.\n");
+                    gflog_debug("file not found when attempting to transfer file using curl.");
                     gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
                     break;
                 default:
-                    if (dbg) fprintf(stderr, "[ERROR] unknown error occurred when attempting to transfer file curl.\n");
+                    gflog_debug("unknown error occurred when attempting to transfer file curl.");
                     gfs_sendheader(ctx, GF_ERROR, 0);
                     break;
             }
@@ -60,24 +77,44 @@ extern ssize_t handle_request(gfcontext_t *ctx, char *path, void* arg) {
 /* cache file transfer specific stuff */
 /**************************************/
 
-extern steque_t *mem_seg_que;
+extern steque_t *mem_seg_que;     //one queue of free segments per NUMA node
+extern int mem_seg_nnodes;
 extern pthread_mutex_t mem_seg_lock;
 extern pthread_cond_t mem_seg_rdy;
 
 void handler_enq_mem_seg(int *mem_seg_id);
-int *handler_deq_mem_seg();
+int *handler_deq_mem_seg(int lane);
+int handler_shm_yield(unsigned int nwaits);
+
+static int mem_seg_nfree = 0;        //free segments over all node queues
+static int mem_seg_small_rsrv = 0;   //free segments only small lane requests may take
+
+/*
+ * Stops a cache transfer that can no longer be sent to the client.  If
+ * bytes remain the cache is already filling the next chunk, so that
+ * chunk is taken and answered with an abort instead of an acknowledge,
+ * leaving the segment free for the next request.
+ */
+static void cache_abort_xfer(shm_context_t *shm_ctx, size_t byts_left) {
+    if (byts_left > 0 && shm_client_wait_for_ready(shm_ctx) == 0) {
+        shm_client_send_abort(shm_ctx);
+    }
+}
 
 ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg) {
 
     //char *server = (char *)arg;  //server url
-    int ret = 0;
+    ssize_t ret = 0;
 
     /* attempt to claim a free memory segment */
-    int *mem_seg_id = handler_deq_mem_seg();
+    uint64_t start_us = gfstats_now_us();
+    int *mem_seg_id = handler_deq_mem_seg(gfs_get_lane(ctx));
+    gfstats_record_since(GFSTAT_SEG_WAIT, start_us);
+    gftrace_span(ctx->trace_id, GFTRACE_SEG, start_us, (uint64_t) *mem_seg_id);
     void *mem_addr = shm_attach_mem_seg(*mem_seg_id);
     if (mem_addr == NULL) {
         //unknown error occurred when trying to send file
-        fprintf(stderr, "[ERROR] cache client - could not attach shared memory segment w id: %d.\n", *mem_seg_id);
+        gflog_error("cache client - could not attach shared memory segment w id: %d.", *mem_seg_id);
         //gfs_sendheader(ctx, GF_ERROR, 0);
         ctx->stat  = GF_ERROR;
         handler_enq_mem_seg(mem_seg_id); //make message segment available for others
@@ -86,56 +123,111 @@ ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg) {
 
     /* submit request for file to cache daemon */
     shm_context_t *shm_ctx = shm_context_create(path, *mem_seg_id);
+    shm_context_set_seg_node(shm_ctx, shm_get_mem_seg_node(*mem_seg_id));
+    shm_context_set_trace_id(shm_ctx, ctx->trace_id);
+    if (gfs_get_method(ctx) == GF_MTHD_HEAD) {
+        shm_context_set_method(shm_ctx, SHM_MTHD_HEAD);
+    }
+    size_t rng_off, rng_len;
+    if (gfs_get_range(ctx, &rng_off, &rng_len)) {
+        shm_context_set_range(shm_ctx, rng_off, rng_len);
+    }
+    if (gfs_get_accept_encoding(ctx) & GF_ENC_GZIP) {
+        shm_context_set_accept_encoding(shm_ctx, SHM_ENC_GZIP);
+    }
+    start_us = gfstats_now_us();
     ret = shm_client_send_file_request(shm_ctx);
+    gfstats_record_since(GFSTAT_CACHE_IPC, start_us);
+    gftrace_span(ctx->trace_id, GFTRACE_RSPNS, start_us, shm_context_get_file_size(shm_ctx));
     if (ret == -1) {
         //unknown error occurred when trying to send file
-        fprintf(stderr, "[ERROR] cache client - unknown error occurred when trying to send file request, err code: %d\n", shm_context_get_error(shm_ctx));
+        gflog_error("cache client - unknown error occurred when trying to send file request, err code: %d", shm_context_get_error(shm_ctx));
         //gfs_sendheader(ctx, GF_ERROR, 0);
         ctx->stat  = GF_ERROR;
         ret = -1;
     } else if (shm_context_get_error(shm_ctx) == 404) {
         /* file doesn't exist in cache, send file not found */
-        fprintf(stderr, "[ERROR] cache returned 404 (file not found) error.\n");
+        gflog_debug("cache returned 404 (file not found)");
+        gfstats_count(GFSTAT_MISSES, 1);
         //gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
         ctx->stat  = GF_FILE_NOT_FOUND;
         ret = -1;
+    } else if (shm_context_get_error(shm_ctx) != SHM_STAT_OK) {
+        gflog_error("cache returned %d error.", shm_context_get_error(shm_ctx));
+        ctx->stat  = GF_ERROR;
+        ret = -1;
+    } else if (gfs_get_method(ctx) == GF_MTHD_HEAD) {
+
+        /* cache only replies with the file length for head requests */
+        gfstats_count(GFSTAT_HITS, 1);
+        size_t file_len = shm_context_get_file_size(shm_ctx);
+        handler_note_size(path, file_len);
+        if (gfs_sendheader(ctx, GF_OK, file_len) < 0) {
+            ret = -1;
+        } else {
+            ret = 0;
+        }
+
     } else {
 
-        /* all is well send file length information via gf protocol */
+        /* all is well send file length information via gf protocol, the
+         * cache may send a precompressed variant, which is passed on as is */
+        gfstats_count(GFSTAT_HITS, 1);
         size_t file_len = shm_context_get_file_size(shm_ctx);
-        gfs_sendheader(ctx, GF_OK, file_len);
+        size_t dec_len;
+        int enc = (shm_context_get_encoding(shm_ctx, &dec_len) == SHM_ENC_GZIP) ? GF_ENC_GZIP : GF_ENC_IDENTITY;
+        if (!gfs_get_range(ctx, NULL, NULL)) {
+            handler_note_size(path, dec_len);
+        }
+        if (gfs_sendheader_encoded(ctx, dec_len, enc, file_len) < 0) {
+            cache_abort_xfer(shm_ctx, file_len);
+            ret = -1;
+        }
 
         /* send the data */
         size_t mem_seg_sz = shm_context_get_seg_tot_sz(shm_ctx);
-        char buffer[mem_seg_sz];
-        ssize_t bytes_transferred = 0;
+        char *buffer = malloc(mem_seg_sz); //not on the stack, coroutine stacks are small
+        size_t bytes_transferred = 0;
         ssize_t read_len, write_len;
-        while (bytes_transferred < file_len) {
+        while (ret != -1 && bytes_transferred < file_len) {
 
-            shm_client_wait_for_ready(shm_ctx);
+            uint64_t rdy_us = gfstats_now_us();
+            if (shm_client_wait_for_ready(shm_ctx) != 0) {
+                gflog_error("cache client - never received ready from cache");
+                ret = -1;
+                break;
+            }
+            gftrace_span(ctx->trace_id, GFTRACE_RDY, rdy_us, shm_context_get_seg_used_sz(shm_ctx));
 
             /* read from shared mem */
             read_len = shm_read_mem_seg(mem_addr, buffer, shm_context_get_seg_used_sz(shm_ctx));
             if (read_len <= 0){
-                fprintf(stderr, "[ERROR] client - handle_with_cache mem seg read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-                return -1;
-                //TODO: send error and resend request to server
+                gflog_error("client - handle_with_cache mem seg read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
+                shm_client_send_abort(shm_ctx);
+                ret = -1;
+                break;
             }
 
             /* read was successful, acknowledge server */
             shm_client_send_acknowledge(shm_ctx);
+            gftrace_event(ctx->trace_id, GFTRACE_ACK, (uint64_t) read_len);
 
             /* send contents via gf protocol */
             write_len = gfs_send(ctx, buffer, (size_t)read_len);
             if (write_len != read_len){
-                fprintf(stderr, "[ERROR] cache client - handle_with_cache gf_send error");
-                return -1;
+                gflog_error("cache client - handle_with_cache gf_send error");
+                cache_abort_xfer(shm_ctx, file_len - bytes_transferred - read_len);
+                ret = -1;
+                break;
             }
             bytes_transferred += write_len;
         }
 
-        ret = bytes_transferred;
-        if (dbg) fprintf(stderr, "[INFO] cahce client - success transferring file!!!\n");
+        if (ret != -1) {
+            ret = (ssize_t) bytes_transferred;
+            gflog_debug("cahce client - success transferring file!!!");
+        }
+        free(buffer);
     }
 
     /* clean up */
@@ -150,29 +242,156 @@ ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg) {
 
 /* shared memory queue handlers */
 
+static unsigned int handler_backoff_us(unsigned int nwaits) {
+    unsigned int us = YIELD_MIN_US << (nwaits < 7 ? nwaits : 7);
+    return (us < YIELD_MAX_US) ? us : YIELD_MAX_US;
+}
+
+/*
+ * Yield function for the shared memory channel.  Coroutines poll for
+ * cache messages with a growing backoff, leaving their event loop to other
+ * requests meanwhile.  Worker threads block in the message queue.
+ */
+int handler_shm_yield(unsigned int nwaits) {
+    if (!gfasync_in_task()) {
+        return -1;
+    }
+    gfasync_sleep_us(handler_backoff_us(nwaits));
+    return 0;
+}
+
 void handler_enq_mem_seg(int *mem_seg_id) {
-    usleep(100 * (random() % 10));
+    gfasync_sleep_us(100 * (random() % 10));
+    int node = shm_get_mem_seg_node(*mem_seg_id);
     pthread_mutex_lock(&mem_seg_lock);
-    steque_enqueue(mem_seg_que, mem_seg_id);
-    pthread_cond_signal(&mem_seg_rdy);
+    steque_enqueue(&mem_seg_que[node], mem_seg_id);
+    mem_seg_nfree++;
+    pthread_cond_broadcast(&mem_seg_rdy); //waiters of both lanes may be able to proceed
     pthread_mutex_unlock(&mem_seg_lock);
-    if (dbg) fprintf(stderr, "[INFO] Added mem segment back onto queue: %d\n", *mem_seg_id);
+    gflog_debug("Added mem segment back onto queue: %d", *mem_seg_id);
+}
+
+/* returns the queue to take a segment from, preferring the local node, or NULL if all are empty */
+static steque_t *handler_pick_mem_seg_que(int local_node) {
+    for (int i = 0; i < mem_seg_nnodes; i++) {
+        steque_t *que = &mem_seg_que[(local_node + i) % mem_seg_nnodes];
+        if (!steque_isempty(que)) {
+            return que;
+        }
+    }
+    return NULL;
 }
 
-int *handler_deq_mem_seg() {
-    usleep(100 * (random() % 10));
+int *handler_deq_mem_seg(int lane) {
+    gfasync_sleep_us(100 * (random() % 10));
+
+    /* large lane requests leave the reserved segments to small ones */
+    int rsrv = (lane > 0) ? mem_seg_small_rsrv : 0;
+
+    /* segments on the node this thread runs on avoid cross node copies,
+     * others are only taken when the local node has none left */
+    int local_node = (mem_seg_nnodes > 1) ? gfaff_current_node() % mem_seg_nnodes : 0;
+    steque_t *que;
+    unsigned int nwaits = 0;
     pthread_mutex_lock(&mem_seg_lock);
-    while (steque_isempty(mem_seg_que)) {
-        pthread_cond_wait(&mem_seg_rdy, &mem_seg_lock);
+    while (mem_seg_nfree <= rsrv || (que = handler_pick_mem_seg_que(local_node)) == NULL) {
+        if (gfasync_in_task()) {
+            /* a coroutine must not block its loop on the condition */
+            pthread_mutex_unlock(&mem_seg_lock);
+            gfasync_sleep_us(handler_backoff_us(nwaits++));
+            pthread_mutex_lock(&mem_seg_lock);
+        } else {
+            pthread_cond_wait(&mem_seg_rdy, &mem_seg_lock);
+        }
     }
-    int *mem_seg_id = (int *)steque_pop(mem_seg_que);
+    int *mem_seg_id = (int *)steque_pop(que);
+    mem_seg_nfree--;
     pthread_cond_broadcast(&mem_seg_rdy);
     pthread_mutex_unlock(&mem_seg_lock);
-    if (dbg) fprintf(stderr, "[INFO] Removed mem seg from queue: %d\n", *mem_seg_id);
+    gflog_debug("Removed mem seg from queue: %d", *mem_seg_id);
     return mem_seg_id;
 }
 
 
+/***************************************/
+/* size aware scheduling of requests   */
+/***************************************/
+
+#define SIZE_TBL_SZ 4096
+
+/* direct mapped table of recently seen file sizes, a path colliding with
+ * another simply replaces it */
+typedef struct size_entry {
+    char *path;
+    size_t size;
+} size_entry;
+
+static size_entry size_tbl[SIZE_TBL_SZ];
+static pthread_mutex_t size_tbl_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t lane_threshold = 0;    //sizes above go on the large lane, 0 disables lanes
+
+static unsigned long handler_hash_path(const char *path) {
+    unsigned long hash = 5381;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char)*c;
+    }
+    return hash % SIZE_TBL_SZ;
+}
+
+void handler_note_size(const char *path, size_t size) {
+    if (lane_threshold == 0) {
+        return;
+    }
+    size_entry *ent = &size_tbl[handler_hash_path(path)];
+    pthread_mutex_lock(&size_tbl_lock);
+    if (ent->path == NULL || strcmp(ent->path, path) != 0) {
+        free(ent->path);
+        ent->path = strdup(path);
+    }
+    ent->size = size;
+    pthread_mutex_unlock(&size_tbl_lock);
+}
+
+/* returns 0 and provides the size if the path was seen recently */
+static int handler_lookup_size(const char *path, size_t *size) {
+    size_entry *ent = &size_tbl[handler_hash_path(path)];
+    int found = 0;
+    pthread_mutex_lock(&size_tbl_lock);
+    if (ent->path != NULL && strcmp(ent->path, path) == 0) {
+        *size = ent->size;
+        found = 1;
+    }
+    pthread_mutex_unlock(&size_tbl_lock);
+    return found ? 0 : -1;
+}
+
+void handler_set_lanes(size_t threshold, int small_rsrv) {
+    lane_threshold = threshold;
+    mem_seg_small_rsrv = small_rsrv;
+}
+
+/*
+ * Classifier for gfserver lanes: lane 1 for requests expected to transfer
+ * more than the threshold, lane 0 for the rest.  Sizes of paths not seen
+ * before are unknown and go on the small lane.
+ */
+int handler_classify(gfcontext_t *ctx, char *path, void *arg) {
+
+    if (gfs_get_method(ctx) == GF_MTHD_HEAD) {
+        return 0;
+    }
+    size_t size, rng_off, rng_len;
+    if (gfs_get_range(ctx, &rng_off, &rng_len) && rng_len > 0) {
+        size = rng_len;
+    } else if (handler_lookup_size(path, &size) == 0) {
+        size = (rng_off < size) ? size - rng_off : 0;
+    } else {
+        return 0;
+    }
+    return (size > lane_threshold) ? 1 : 0;
+}
+
+
 /******************************************/
 /* http/curl file transfer specific stuff */
 /******************************************/
@@ -181,48 +400,124 @@ typedef struct curl_data {
     gfcontext_t *ctx;
     size_t tot_bytes_sent;
     int err_stat;
+    long http_code;         //status code of the last http status line received
+    size_t skip_bytes;      //leading body bytes to drop when the server ignored a range request
+    size_t bytes_left;      //body bytes still to be sent to the client
+    int done;               //set once all requested bytes have been sent
+    curl_socket_t socks[CURL_MAX_SOCKS];    //sockets curl wants watched
+    short sock_evts[CURL_MAX_SOCKS];        //poll events wanted on each socket
+    int nsocks;
+    long timeout_ms;        //time until curl's next timer, -1 for none
 } curl_data;
 
-size_t curl_hdr_cb(char *buffer, size_t size, size_t nmemb, void *userdata) {
+static pthread_once_t curl_once = PTHREAD_ONCE_INIT;
+
+static void curl_init_once() {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+/* curl multi socket callback, keeps track of the sockets to poll */
+static int curl_sock_cb(CURL *easy, curl_socket_t sock, int what, void *userp, void *socketp) {
+    curl_data *cd = (curl_data *) userp;
+    int i;
+    for (i = 0; i < cd->nsocks && cd->socks[i] != sock; i++) {
+        ;
+    }
+    if (what == CURL_POLL_REMOVE) {
+        if (i < cd->nsocks) {
+            cd->socks[i] = cd->socks[cd->nsocks - 1];
+            cd->sock_evts[i] = cd->sock_evts[cd->nsocks - 1];
+            cd->nsocks--;
+        }
+        return 0;
+    }
+    if (i == cd->nsocks) {
+        if (cd->nsocks == CURL_MAX_SOCKS) {
+            gflog_error("curl wants more than %d sockets watched", CURL_MAX_SOCKS);
+            return -1;
+        }
+        cd->socks[cd->nsocks++] = sock;
+    }
+    cd->sock_evts[i] = (short)(((what & CURL_POLL_IN) ? POLLIN : 0) | ((what & CURL_POLL_OUT) ? POLLOUT : 0));
+    return 0;
+}
 
-    char *lclbuffer = malloc(nmemb + 1);
-    bzero(lclbuffer, nmemb + 1);
-    strcpy(lclbuffer, buffer);
+/* curl multi timer callback */
+static int curl_timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+    ((curl_data *) userp)->timeout_ms = timeout_ms;
+    return 0;
+}
+
+size_t curl_hdr_cb(char *buffer, size_t size, size_t nmemb, void *userdata) {
 
     size_t recv_size = size*nmemb;
     size_t ret_stat = recv_size;
 
+    char *lclbuffer = malloc(recv_size + 1);
+    memcpy(lclbuffer, buffer, recv_size);
+    lclbuffer[recv_size] = '\0';
+
     curl_data *cd = (curl_data *) userdata;
 
     //parse the next incoming header line and look for content length string
     char *src_cnt_lng = "content-length:";
-    char *src_fbd = "403";
-    char *src_nfd = "404";
-    char *src_ok = "200";
-    char *lngth;
+    char *src_stat = "HTTP/";
     if (strncasecmp(lclbuffer, src_cnt_lng, 15) == 0) {
-        //found content length string
-        lngth = strtok(lclbuffer, ":");
-        lngth = strtok(NULL, ":");
-        if (lngth == NULL) {
-            if (dbg) fprintf(stderr, "ERROR: found content-length string but no size.\n");
+        //found content length string, the value may be surrounded by blanks
+        const char *lngth = lclbuffer + 15;
+        lngth += strspn(lngth, " \t");
+        const char *end;
+        size_t cnt_lng;
+        if (gflen_parse(lngth, &end, &cnt_lng) != 0 || end[strspn(end, " \t\r\n")] != '\0') {
+            gflog_debug("found content-length string but no valid size.");
             cd->err_stat = 1;
+            free(lclbuffer);
             return 0;
         }
         //fprintf(stderr, "INFO: Thread %s found content length!!!\n", thd_id);
         cd->err_stat = 0;
-        gfs_sendheader(cd->ctx, GF_OK, (size_t) atol(lngth));
-    } else if (strstr(lclbuffer, src_ok) != 0) {
-        if (dbg) fprintf(stderr, "INFO: Server replied with OK.\n");
-        cd->err_stat = 200;
-    } else if (strstr(lclbuffer, src_fbd) != 0) {
-        if (dbg) fprintf(stderr, "ERROR: Server replied with forbidden response.\n");
-        cd->err_stat = 403;
-        ret_stat = 0;
-    } else if (strstr(lclbuffer, src_nfd) != 0) {
-        if (dbg) fprintf(stderr, "ERROR: Server replied with not found response.\n");
-        cd->err_stat = 404;
-        ret_stat = 0;
+        size_t rng_off, rng_len;
+        if (cd->http_code == 200 && !gfs_get_range(cd->ctx, NULL, NULL)) {
+            handler_note_size(cd->ctx->path, cnt_lng);
+        }
+        if (cd->http_code == 200 && gfs_get_range(cd->ctx, &rng_off, &rng_len)) {
+            /* server ignored the range and is sending the whole file, only
+             * forward the requested bytes to the client */
+            if (rng_off > cnt_lng) {
+                gflog_debug("requested range starts past the end of file.");
+                cd->err_stat = 416;
+                free(lclbuffer);
+                return 0;
+            }
+            cd->skip_bytes = rng_off;
+            cnt_lng -= rng_off;
+            if (rng_len > 0 && rng_len < cnt_lng) {
+                cnt_lng = rng_len;
+            }
+        }
+        cd->bytes_left = cnt_lng;
+        gftrace_event(cd->ctx->trace_id, GFTRACE_CURL_HDR, cnt_lng);
+        gfs_sendheader(cd->ctx, GF_OK, cnt_lng);
+    } else if (strncmp(lclbuffer, src_stat, strlen(src_stat)) == 0) {
+        /* status line, e.g. HTTP/1.1 200 OK */
+        char *code = strchr(lclbuffer, ' ');
+        cd->http_code = (code != NULL) ? strtol(code, NULL, 10) : 0;
+        if (cd->http_code == 200 || cd->http_code == 206) {
+            gflog_debug("Server replied with OK.");
+            cd->err_stat = 200;
+        } else if (cd->http_code == 403) {
+            gflog_debug("Server replied with forbidden response.");
+            cd->err_stat = 403;
+            ret_stat = 0;
+        } else if (cd->http_code == 404) {
+            gflog_debug("Server replied with not found response.");
+            cd->err_stat = 404;
+            ret_stat = 0;
+        } else if (cd->http_code == 416) {
+            gflog_debug("Server replied with range not satisfiable response.");
+            cd->err_stat = 416;
+            ret_stat = 0;
+        }
     }
     free(lclbuffer);
     return ret_stat;
@@ -230,52 +525,134 @@ size_t curl_hdr_cb(char *buffer, size_t size, size_t nmemb, void *userdata) {
 
 size_t curl_writ_cb(char *ptr, size_t size, size_t nmemb, void *userdata) {
 
-    size_t bytes_transferred = 0;
     size_t recv_size = size*nmemb;
 
     curl_data *cd = (curl_data *)userdata;
     /* check that file length was extracted from header */
     if (cd->err_stat != 0) {
-        if (dbg) fprintf(stderr, "[ERROR] header not properly parsed before receiving data.  Shouldn't have gotten here.\n");
+        gflog_debug("header not properly parsed before receiving data.  Shouldn't have gotten here.");
         return 0;
     }
 
+    /* drop bytes preceding a range the server did not honor */
+    size_t skip = (cd->skip_bytes < recv_size) ? cd->skip_bytes : recv_size;
+    cd->skip_bytes -= skip;
+    char *data = ptr + skip;
+    size_t data_len = recv_size - skip;
+    if (data_len > cd->bytes_left) {
+        data_len = cd->bytes_left;
+    }
+
     /* Sending the data contents chunk by chunk. */
-    bytes_transferred = 0;
+    size_t bytes_transferred = 0;
     ssize_t write_len;
-    while(bytes_transferred < recv_size){
-        write_len = gfs_send(cd->ctx, ptr, recv_size);
-        if (write_len != recv_size){
-            fprintf(stderr, "[ERROR] unable to send enter data fragment via gf_send.\n");
+    while(bytes_transferred < data_len){
+        write_len = gfs_send(cd->ctx, data + bytes_transferred, data_len - bytes_transferred);
+        if (write_len <= 0){
+            gflog_error("unable to send enter data fragment via gf_send.");
             cd->err_stat = 1;
             return 0;
         }
         cd->tot_bytes_sent += write_len;
         bytes_transferred += write_len;
     }
+    cd->bytes_left -= data_len;
+
+    /* stop the transfer once the requested range has been sent */
+    if (cd->bytes_left == 0 && skip + data_len < recv_size) {
+        cd->done = 1;
+        return 0;
+    }
 
-    return bytes_transferred;
+    return recv_size;
 
 }
 
-int perf_curl(CURL *curl, char *url) {
-    CURLcode res;
-    long curl_res_code;
+/*
+ * Performs the transfer with the curl multi socket interface, waiting
+ * for curl's sockets through gfs_poll so that an async server runs other
+ * requests meanwhile.  Callbacks, and the gfs_send calls in them, run on
+ * the request's own stack.
+ */
+int perf_curl(CURL *curl, char *url, curl_data *cd) {
+    CURLcode res = CURLE_OK;
+    long curl_res_code = 0;
     /* set URL to send request */
     curl_easy_setopt(curl, CURLOPT_URL, url);
-    if (dbg) fprintf(stderr, "[INFO] Request is: %s\n", url);
-    res = curl_easy_perform(curl);
+    gflog_debug("Request is: %s", url);
+
+    CURLM *multi = curl_multi_init();
+    if (multi == NULL) {
+        return CURLE_OUT_OF_MEMORY;
+    }
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, cd);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, cd);
+    cd->nsocks = 0;
+    cd->timeout_ms = -1;
+    curl_multi_add_handle(multi, curl);
+
+    int running = 1;
+    curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+    while (running) {
+
+        if (gfs_timed_out(cd->ctx)) {
+            res = CURLE_OPERATION_TIMEDOUT;
+            break;
+        }
+
+        struct pollfd fds[CURL_MAX_SOCKS];
+        int nfds = cd->nsocks;
+        for (int i = 0; i < nfds; i++) {
+            fds[i].fd = cd->socks[i];
+            fds[i].events = cd->sock_evts[i];
+        }
+        int wait_ms = (cd->timeout_ms < 0 || cd->timeout_ms > CURL_POLL_MS) ? CURL_POLL_MS : (int) cd->timeout_ms;
+        int timer_due = (cd->timeout_ms >= 0 && cd->timeout_ms <= CURL_POLL_MS);
+        int nready = (wait_ms > 0) ? gfs_poll(cd->ctx, fds, nfds, wait_ms) : 0;
+        if (nready < 0) {
+            res = CURLE_RECV_ERROR;
+            break;
+        }
+
+        if (nready == 0) {
+            if (timer_due) {
+                cd->timeout_ms = -1;
+                curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+            }
+            continue;
+        }
+        for (int i = 0; i < nfds && running; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            int mask = ((fds[i].revents & POLLIN) ? CURL_CSELECT_IN : 0)
+                     | ((fds[i].revents & POLLOUT) ? CURL_CSELECT_OUT : 0)
+                     | ((fds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) ? CURL_CSELECT_ERR : 0);
+            curl_multi_socket_action(multi, fds[i].fd, mask, &running);
+        }
+    }
+
+    int nmsgs;
+    CURLMsg *msg;
+    while ((msg = curl_multi_info_read(multi, &nmsgs)) != NULL) {
+        if (msg->msg == CURLMSG_DONE) {
+            res = msg->data.result;
+        }
+    }
+    curl_multi_remove_handle(multi, curl);
+    curl_multi_cleanup(multi);
+
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &curl_res_code);
     if(CURLE_OK != res) {
-        if (dbg) fprintf(stderr, "[ERROR] encountered libcurl specific error: %d\n", res);
-        if (dbg) fprintf(stderr, "       server response code is: %ld\n", curl_res_code);
+        gflog_debug("encountered libcurl specific error: %d, server response code is: %ld", res, curl_res_code);
     }
     return res;
 }
 
 void cleanup_curl(CURL *curl) {
     curl_easy_cleanup(curl);
-    curl_global_cleanup();
 }
 
 ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg) {
@@ -293,34 +670,68 @@ ssize_t handle_with_curl(gfcontext_t *ctx, char *path, void* arg) {
     cd.ctx = ctx;
     cd.tot_bytes_sent = 0;
     cd.err_stat = 1; //has to be set to zero from header function
+    cd.http_code = 0;
+    cd.skip_bytes = 0;
+    cd.bytes_left = 0;
+    cd.done = 0;
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+    /* global init is not thread safe and must only run once */
+    pthread_once(&curl_once, curl_init_once);
     curl = curl_easy_init();
     if (curl) {
 
         /* Switch on full protocol/debug output */
         //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 
+        /* no signals for timeouts, they cannot be used from several threads */
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
         /* callback and custom args */
         curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_hdr_cb);
         curl_easy_setopt(curl, CURLOPT_HEADERDATA, &cd);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_writ_cb);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &cd);
 
+        /* only request the headers from the server for head requests */
+        if (gfs_get_method(ctx) == GF_MTHD_HEAD) {
+            curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        }
+
+        /* request only the byte range asked for by the client */
+        size_t rng_off, rng_len;
+        if (gfs_get_range(ctx, &rng_off, &rng_len)) {
+            char rng[64];
+            if (rng_len > 0) {
+                snprintf(rng, sizeof(rng), "%zu-%zu", rng_off, rng_off + rng_len - 1);
+            } else {
+                snprintf(rng, sizeof(rng), "%zu-", rng_off);
+            }
+            curl_easy_setopt(curl, CURLOPT_RANGE, rng);
+        }
+
     } else {
         gfs_sendheader(ctx, GF_ERROR, 0);
         return EXIT_FAILURE;
     }
 
-    int res = perf_curl(curl, path_src);
+    int res = perf_curl(curl, path_src, &cd);
     cleanup_curl(curl);
+    if (res != 0 && cd.done) {
+        /* transfer was stopped after sending the requested range */
+        res = 0;
+    }
     if (res !=0 && cd.err_stat == 404) {
         /* If 404 received from proxy, then send FILE_NOT_FOUND code */
-        fprintf(stderr, "[ERROR] http returned 404 error\n");
+        gflog_debug("http returned 404 error");
         gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
         return EXIT_FAILURE;
     } else if (res !=0) {
-        fprintf(stderr, "[ERROR] http returned other error, code: %d\n", cd.err_stat);
+        gflog_error("http returned other error, code: %d", cd.err_stat);
+        gfs_sendheader(ctx, GF_ERROR, 0);
+        return EXIT_FAILURE;
+    } else if (ctx->stat != GF_OK) {
+        /* server replied without a content length, header was never sent */
+        gflog_error("http response did not provide a content length");
         gfs_sendheader(ctx, GF_ERROR, 0);
         return EXIT_FAILURE;
     }
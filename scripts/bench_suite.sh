@@ -0,0 +1,213 @@
+#!/bin/bash
+#
+# Benchmarks the whole stack.  Starts a local http server standing in for
+# the origin, then simplecached and webproxy for every combination of
+# thread count, segment count and segment size.  Each combination is
+# driven with gfclient_download at every hit ratio.  Throughput and
+# latency go into a results table that is compared against a stored
+# baseline.
+#
+# usage: scripts/bench_suite.sh [binary dir]   (run from the source directory)
+#
+# THREADS      webproxy and simplecached thread counts (Default: 1 4 8)
+# SEGMENTS     webproxy segment counts (Default: 1 8)
+# SEGSIZES     webproxy segment sizes in bytes (Default: 8192 65536)
+# HIT_RATIOS   fraction of requests the cache can serve (Default: 0 0.5 1)
+# FILE_SIZES   sizes of the synthetic files (Default: 4096 65536 1048576)
+# CLIENT_THREADS, REQUESTS  client threads and requests per thread (Default: 8, 50)
+# RESULTS      results table written (Default: bench-results.csv)
+# BASELINE     results compared against (Default: bench-baseline.csv)
+# UPDATE_BASELINE=1  store the results as the baseline instead
+# TOLERANCE    percent throughput may drop or p99 latency may rise
+#              before a point counts as a regression (Default: 10)
+# PROXY_PORT, ORIGIN_PORT ports of the stand-ins (Default: 18888, 18080)
+#
+# Exits with 1 if any point regressed against the baseline.  Release
+# builds give meaningful numbers, debug builds run under ASan.
+
+set -u
+
+BIN_DIR=$(cd "${1:-.}" && pwd)
+SRC_DIR=$(pwd)
+THREADS=${THREADS:-1 4 8}
+SEGMENTS=${SEGMENTS:-1 8}
+SEGSIZES=${SEGSIZES:-8192 65536}
+HIT_RATIOS=${HIT_RATIOS:-0 0.5 1}
+FILE_SIZES=${FILE_SIZES:-4096 65536 1048576}
+CLIENT_THREADS=${CLIENT_THREADS:-8}
+REQUESTS=${REQUESTS:-50}
+RESULTS=${RESULTS:-bench-results.csv}
+BASELINE=${BASELINE:-bench-baseline.csv}
+UPDATE_BASELINE=${UPDATE_BASELINE:-0}
+TOLERANCE=${TOLERANCE:-10}
+PROXY_PORT=${PROXY_PORT:-18888}
+ORIGIN_PORT=${ORIGIN_PORT:-18080}
+
+for bin in webproxy simplecached gfclient_download; do
+    if [ ! -x "$BIN_DIR/$bin" ]; then
+        echo "[ERROR] $BIN_DIR/$bin not found, build first" >&2
+        exit 1
+    fi
+done
+if [ ! -f locals.txt ] || [ ! -d cached_files ]; then
+    echo "[ERROR] run from the source directory, locals.txt and cached_files not found" >&2
+    exit 1
+fi
+if ! command -v python3 >/dev/null; then
+    echo "[ERROR] python3 is needed for the origin server stand-in and the results table" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+PIDS=()
+KEEP_LOGS=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -TERM "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    if [ "$KEEP_LOGS" = 0 ]; then
+        rm -rf "$WORK_DIR"
+    fi
+}
+trap cleanup EXIT
+
+# The origin serves every file.  The cache holds the hit set: the entries
+# of locals.txt whose files exist and the synthetic /bench/hit files.  The
+# miss set mirrors it under /bench/miss, so hits and misses have the same
+# sizes and only the ratio between them changes from point to point.
+mkdir -p "$WORK_DIR/origin/bench/hit" "$WORK_DIR/origin/bench/miss" "$WORK_DIR/out"
+: > "$WORK_DIR/locals.txt"
+: > "$WORK_DIR/hits.txt"
+while read -r path file; do
+    [ -f "$file" ] || continue
+    mkdir -p "$WORK_DIR/origin$(dirname "$path")"
+    ln -sf "$SRC_DIR/$file" "$WORK_DIR/origin$path"
+    ln -sf "$SRC_DIR/$file" "$WORK_DIR/origin/bench/miss/$(basename "$file")"
+    echo "$path $SRC_DIR/$file" >> "$WORK_DIR/locals.txt"
+    echo "$path /bench/miss/$(basename "$file")" >> "$WORK_DIR/hits.txt"
+done < locals.txt
+for size in $FILE_SIZES; do
+    for i in 0 1 2 3; do
+        name="$size-$i"
+        head -c "$size" /dev/urandom > "$WORK_DIR/origin/bench/hit/$name"
+        ln -sf "../hit/$name" "$WORK_DIR/origin/bench/miss/$name"
+        echo "/bench/hit/$name $WORK_DIR/origin/bench/hit/$name" >> "$WORK_DIR/locals.txt"
+        echo "/bench/hit/$name /bench/miss/$name" >> "$WORK_DIR/hits.txt"
+    done
+done
+NPATHS=$(wc -l < "$WORK_DIR/hits.txt")
+
+# one weighted workload per hit ratio, hits and misses each picked
+# uniformly within their set
+for ratio in $HIT_RATIOS; do
+    awk -v r="$ratio" -v n="$NPATHS" \
+        '{ printf "%s %.9f\n%s %.9f\n", $1, r / n, $2, (1 - r) / n }' \
+        "$WORK_DIR/hits.txt" > "$WORK_DIR/workload-$ratio.txt"
+done
+
+(cd "$WORK_DIR/origin" && exec python3 -m http.server "$ORIGIN_PORT" --bind 127.0.0.1 >/dev/null 2>&1) &
+PIDS+=($!)
+
+: > "$WORK_DIR/points.csv"
+
+# runs every hit ratio against a fresh cache and proxy with the given
+# thread count, segment count and segment size
+run_config() {
+    local threads=$1 segs=$2 segsize=$3
+    "$BIN_DIR/simplecached" -c "$WORK_DIR/locals.txt" -t "$threads" \
+        --stats-name bench-cache >>"$WORK_DIR/simplecached.log" 2>&1 &
+    local cache_pid=$!
+    sleep 0.5
+    "$BIN_DIR/webproxy" -p "$PROXY_PORT" -t "$threads" -n "$segs" -z "$segsize" \
+        -s "127.0.0.1:$ORIGIN_PORT" --stats-name bench-proxy --log-level error \
+        >>"$WORK_DIR/webproxy.log" 2>&1 &
+    local proxy_pid=$!
+    sleep 0.5
+    if ! kill -0 "$cache_pid" 2>/dev/null || ! kill -0 "$proxy_pid" 2>/dev/null; then
+        echo "[ERROR] stand-ins did not start, see the logs in $WORK_DIR" >&2
+        KEEP_LOGS=1
+        kill -TERM "$cache_pid" "$proxy_pid" 2>/dev/null
+        exit 1
+    fi
+
+    for ratio in $HIT_RATIOS; do
+        local label="threads=$threads segments=$segs segsize=$segsize hit=$ratio"
+        echo "[INFO] bench $label"
+        (cd "$WORK_DIR/out" && "$BIN_DIR/gfclient_download" -p "$PROXY_PORT" \
+            -w "$WORK_DIR/workload-$ratio.txt" --workload-mode weighted --seed 1 \
+            -t "$CLIENT_THREADS" -n "$REQUESTS" --discard --bench csv \
+            --bench-out "$WORK_DIR/point.csv" >/dev/null 2>>"$WORK_DIR/client.log")
+        # the client writes a header and one row, the row is kept with
+        # the point it measured
+        tail -n 1 "$WORK_DIR/point.csv" | sed "s/^\"[^\"]*\"/$threads,$segs,$segsize,$ratio/" \
+            >> "$WORK_DIR/points.csv"
+        [ -s "$WORK_DIR/header.csv" ] || head -n 1 "$WORK_DIR/point.csv" \
+            | sed 's/^label/threads,segments,segsize,hit_ratio/' > "$WORK_DIR/header.csv"
+        rm -f "$WORK_DIR/point.csv"
+    done
+
+    kill -TERM "$proxy_pid" "$cache_pid" 2>/dev/null
+    wait "$proxy_pid" "$cache_pid" 2>/dev/null
+}
+
+for threads in $THREADS; do
+    for segs in $SEGMENTS; do
+        for segsize in $SEGSIZES; do
+            run_config "$threads" "$segs" "$segsize"
+        done
+    done
+done
+
+cat "$WORK_DIR/header.csv" "$WORK_DIR/points.csv" > "$RESULTS"
+echo "[INFO] results written to $RESULTS"
+
+if [ "$UPDATE_BASELINE" = 1 ] || [ ! -f "$BASELINE" ]; then
+    cp "$RESULTS" "$BASELINE"
+    echo "[INFO] baseline $BASELINE updated"
+    COMPARE=""
+else
+    COMPARE="$BASELINE"
+fi
+
+# prints the results as a table, against the baseline when there is one
+python3 - "$RESULTS" "$COMPARE" "$TOLERANCE" <<'EOF'
+import csv, sys
+
+results, baseline, tolerance = sys.argv[1], sys.argv[2], float(sys.argv[3])
+KEY = ("threads", "segments", "segsize", "hit_ratio")
+
+def load(path):
+    with open(path, newline="") as f:
+        return {tuple(row[k] for k in KEY): row for row in csv.DictReader(f)}
+
+def delta(new, old):
+    return (new - old) / old * 100.0 if old > 0 else 0.0
+
+cur = load(results)
+base = load(baseline) if baseline else {}
+print("%7s %8s %8s %5s %10s %9s %9s %9s %6s %9s %9s" % (
+    "threads", "segments", "segsize", "hit", "req/s", "MB/s", "p50 us", "p99 us", "errors",
+    "d req/s", "d p99"))
+regressed = 0
+for key, row in cur.items():
+    rps = float(row["requests_per_s"])
+    p99 = float(row["total_p99_us"])
+    errors = int(row["requests"]) - int(row["ok"]) - int(row["file_not_found"])
+    line = "%7s %8s %8s %5s %10.1f %9.2f %9s %9s %6d" % (
+        key + (rps, float(row["mb_per_s"]), row["total_p50_us"], row["total_p99_us"], errors))
+    old = base.get(key)
+    if old is not None:
+        d_rps = delta(rps, float(old["requests_per_s"]))
+        d_p99 = delta(p99, float(old["total_p99_us"]))
+        line += " %+8.1f%% %+8.1f%%" % (d_rps, d_p99)
+        if d_rps < -tolerance or d_p99 > tolerance:
+            line += "  REGRESSED"
+            regressed += 1
+    print(line)
+if baseline:
+    print("[INFO] %d of %d points regressed more than %g%% against %s" % (
+        regressed, len(cur), tolerance, baseline))
+sys.exit(1 if regressed else 0)
+EOF
@@ -0,0 +1,101 @@
+#!/bin/bash
+#
+# Streams an object larger than 4GB through simplecached and webproxy.
+# The object is a sparse file with marker bytes at the start, across the
+# 4GB boundary and at the end.  gfclient_download fetches it once whole
+# and once in segments, and checks the length and the XXH64 digest of
+# what arrived against a manifest made with gfhashsum.
+#
+# usage: scripts/large_object_test.sh [binary dir]   (run from the source directory)
+#
+# SIZE         object size in bytes (Default: 4831838208, 4.5GB)
+# SEGMENTS     segments of the second download (Default: 4)
+# PROXY_PORT   port of webproxy (Default: 18889)
+#
+# The whole download is only hashed, the segmented one is written to a
+# scratch directory and needs SIZE bytes of free disk.  Exits with 1 if
+# either download fails or does not match.
+
+set -u
+
+BIN_DIR=$(cd "${1:-.}" && pwd)
+SIZE=${SIZE:-4831838208}
+SEGMENTS=${SEGMENTS:-4}
+PROXY_PORT=${PROXY_PORT:-18889}
+REQ_PATH=/large/object.bin
+
+for bin in webproxy simplecached gfclient_download gfhashsum; do
+    if [ ! -x "$BIN_DIR/$bin" ]; then
+        echo "[ERROR] $BIN_DIR/$bin not found, build first" >&2
+        exit 1
+    fi
+done
+
+WORK_DIR=$(mktemp -d)
+PIDS=()
+KEEP_LOGS=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -TERM "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    if [ "$KEEP_LOGS" = 0 ]; then
+        rm -rf "$WORK_DIR"
+    fi
+}
+trap cleanup EXIT
+
+fail() {
+    echo "[ERROR] $1, see the logs in $WORK_DIR" >&2
+    KEEP_LOGS=1
+    exit 1
+}
+
+# the markers make a download that drops, repeats or truncates a range
+# at a 32 bit offset differ from the original
+OBJECT="$WORK_DIR/object.bin"
+truncate -s "$SIZE" "$OBJECT"
+for off in 0 $((4294967296 - 4096)) $((SIZE - 8192)); do
+    head -c 8192 /dev/urandom | dd of="$OBJECT" bs=4096 seek=$((off / 4096)) \
+        conv=notrunc status=none
+done
+
+echo "$REQ_PATH $OBJECT" > "$WORK_DIR/locals.txt"
+echo "$REQ_PATH" > "$WORK_DIR/workload.txt"
+"$BIN_DIR/gfhashsum" "$OBJECT" | awk -v p="$REQ_PATH" '{ print $1, p }' \
+    > "$WORK_DIR/manifest.txt" || fail "cannot hash the object"
+
+# every request is a cache hit, the origin is never asked.  There is a
+# cache thread and a shared memory segment for every download segment so
+# none of them waits out the client's idle deadline behind the others
+"$BIN_DIR/simplecached" -c "$WORK_DIR/locals.txt" -t "$SEGMENTS" --min-threads "$SEGMENTS" \
+    --gzip-max 0 \
+    >"$WORK_DIR/simplecached.log" 2>&1 &
+PIDS+=($!)
+sleep 0.5
+"$BIN_DIR/webproxy" -p "$PROXY_PORT" -t "$SEGMENTS" -n "$SEGMENTS" -z 1048576 \
+    -s 127.0.0.1:1 --log-level error \
+    >"$WORK_DIR/webproxy.log" 2>&1 &
+PIDS+=($!)
+sleep 0.5
+for pid in "${PIDS[@]}"; do
+    kill -0 "$pid" 2>/dev/null || fail "stand-ins did not start"
+done
+
+mkdir -p "$WORK_DIR/out"
+echo "[INFO] downloading $SIZE bytes whole"
+(cd "$WORK_DIR/out" && "$BIN_DIR/gfclient_download" -p "$PROXY_PORT" \
+    -w "$WORK_DIR/workload.txt" -n 1 --discard --verify "$WORK_DIR/manifest.txt" \
+    >>"$WORK_DIR/client.log" 2>&1) || fail "whole download did not match"
+
+echo "[INFO] downloading $SIZE bytes in $SEGMENTS segments"
+(cd "$WORK_DIR/out" && "$BIN_DIR/gfclient_download" -p "$PROXY_PORT" \
+    -w "$WORK_DIR/workload.txt" -n 1 -S "$SEGMENTS" --verify "$WORK_DIR/manifest.txt" \
+    >>"$WORK_DIR/client.log" 2>&1) || fail "segmented download did not match"
+[ "$(grep -c "1 files matched the manifest, 0 did not" "$WORK_DIR/client.log")" = 2 ] || \
+    fail "a download was not verified"
+[ "$(stat -c %s "$WORK_DIR/out$REQ_PATH-"*)" = "$SIZE" ] || \
+    fail "segmented download has the wrong length"
+
+echo "[INFO] large object test passed"
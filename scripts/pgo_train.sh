@@ -0,0 +1,104 @@
+#!/bin/bash
+#
+# Collects profiles for a profile guided build by running workload.txt
+# through webproxy and simplecached built with PGO=generate.  The cache
+# serves the files listed in locals.txt, the rest come from a local http
+# server standing in for the origin, so no network access is needed.
+#
+# usage: scripts/pgo_train.sh [binary dir]   (run from the source directory)
+#
+# ROUNDS requests per client thread and workload round (Default: 40)
+# PROXY_PORT, ORIGIN_PORT ports of the stand-ins (Default: 18888, 18080)
+
+set -u
+
+BIN_DIR=$(cd "${1:-.}" && pwd)
+SRC_DIR=$(pwd)
+ROUNDS=${ROUNDS:-40}
+PROXY_PORT=${PROXY_PORT:-18888}
+ORIGIN_PORT=${ORIGIN_PORT:-18080}
+
+for bin in webproxy simplecached gfclient_download; do
+    if [ ! -x "$BIN_DIR/$bin" ]; then
+        echo "[ERROR] $BIN_DIR/$bin not found, build with PGO=generate first" >&2
+        exit 1
+    fi
+done
+if [ ! -f workload.txt ] || [ ! -f locals.txt ]; then
+    echo "[ERROR] run from the source directory, workload.txt and locals.txt not found" >&2
+    exit 1
+fi
+if ! command -v python3 >/dev/null; then
+    echo "[ERROR] python3 is needed for the origin server stand-in" >&2
+    exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+PIDS=()
+KEEP_LOGS=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -TERM "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    if [ "$KEEP_LOGS" = 0 ]; then
+        rm -rf "$WORK_DIR"
+    fi
+}
+trap cleanup EXIT
+
+# the cache gets the entries of locals.txt whose files exist
+mkdir -p "$WORK_DIR/origin" "$WORK_DIR/out"
+while read -r path file; do
+    [ -f "$file" ] && echo "$path $SRC_DIR/$file"
+done < locals.txt > "$WORK_DIR/locals.txt"
+
+# files the cache does not have are served by the origin, sized by their
+# name when it is a number, missing ones (notthere*) stay missing
+while read -r path; do
+    [ -z "$path" ] && continue
+    grep -q "^$path " "$WORK_DIR/locals.txt" && continue
+    case "$(basename "$path")" in
+        notthere*) continue ;;
+    esac
+    size=$(basename "$path")
+    [[ "$size" =~ ^[0-9]+$ ]] || size=1024
+    mkdir -p "$WORK_DIR/origin$(dirname "$path")"
+    head -c "$size" /dev/urandom > "$WORK_DIR/origin$path"
+done < workload.txt
+
+(cd "$WORK_DIR/origin" && exec python3 -m http.server "$ORIGIN_PORT" --bind 127.0.0.1 >/dev/null 2>&1) &
+PIDS+=($!)
+
+# runs the workload against a fresh proxy started with the given options
+run_round() {
+    "$BIN_DIR/simplecached" -c "$WORK_DIR/locals.txt" -t 4 >>"$WORK_DIR/simplecached.log" 2>&1 &
+    local cache_pid=$!
+    sleep 0.5
+    "$BIN_DIR/webproxy" -p "$PROXY_PORT" -t 8 -n 8 -z 8192 -s "127.0.0.1:$ORIGIN_PORT" \
+        --stats-name pgo-train --trace-dir "$WORK_DIR" "$@" >>"$WORK_DIR/webproxy.log" 2>&1 &
+    local proxy_pid=$!
+    sleep 0.5
+    if ! kill -0 "$cache_pid" 2>/dev/null || ! kill -0 "$proxy_pid" 2>/dev/null; then
+        echo "[ERROR] stand-ins did not start, see the logs in $WORK_DIR" >&2
+        KEEP_LOGS=1
+        kill -TERM "$cache_pid" "$proxy_pid" 2>/dev/null
+        exit 1
+    fi
+
+    echo "[INFO] training round: webproxy $*"
+    (cd "$WORK_DIR/out" && "$BIN_DIR/gfclient_download" -p "$PROXY_PORT" -w "$SRC_DIR/workload.txt" \
+        -t 4 -n "$ROUNDS" >/dev/null 2>>"$WORK_DIR/client.log")
+    (cd "$WORK_DIR/out" && "$BIN_DIR/gfclient_download" -p "$PROXY_PORT" -w "$SRC_DIR/workload.txt" \
+        -t 4 -n "$ROUNDS" --gzip >/dev/null 2>>"$WORK_DIR/client.log")
+    rm -rf "$WORK_DIR/out"/*
+
+    # profiles are written as the processes exit
+    kill -TERM "$proxy_pid" "$cache_pid" 2>/dev/null
+    wait "$proxy_pid" "$cache_pid" 2>/dev/null
+}
+
+run_round
+run_round --async 2
+echo "[INFO] profiles collected"
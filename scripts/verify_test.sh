@@ -0,0 +1,91 @@
+#!/bin/bash
+#
+# Checks that gfclient_download --verify keeps the files that match the
+# manifest and removes the ones that do not.  simplecached serves two
+# files through webproxy, the manifest has the right digest of one and
+# a wrong digest of the other.  Both are downloaded whole, in segments
+# and through a multi handle.
+#
+# usage: scripts/verify_test.sh [binary dir]   (run from the source directory)
+#
+# PROXY_PORT   port of webproxy (Default: 18890)
+#
+# Exits with 1 if a mismatched file is left behind, a matching one is
+# missing or the client does not report the mismatch.
+
+set -u
+
+BIN_DIR=$(cd "${1:-.}" && pwd)
+PROXY_PORT=${PROXY_PORT:-18890}
+
+for bin in webproxy simplecached gfclient_download gfhashsum; do
+    if [ ! -x "$BIN_DIR/$bin" ]; then
+        echo "[ERROR] $BIN_DIR/$bin not found, build first" >&2
+        exit 1
+    fi
+done
+
+WORK_DIR=$(mktemp -d)
+PIDS=()
+KEEP_LOGS=0
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -TERM "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    if [ "$KEEP_LOGS" = 0 ]; then
+        rm -rf "$WORK_DIR"
+    fi
+}
+trap cleanup EXIT
+
+fail() {
+    echo "[ERROR] $1, see the logs in $WORK_DIR" >&2
+    KEEP_LOGS=1
+    exit 1
+}
+
+# large enough to be split into segments
+mkdir -p "$WORK_DIR/files"
+: > "$WORK_DIR/locals.txt"
+for name in good bad; do
+    head -c 1048576 /dev/urandom > "$WORK_DIR/files/$name.bin"
+    echo "/verify/$name.bin $WORK_DIR/files/$name.bin" >> "$WORK_DIR/locals.txt"
+    echo "/verify/$name.bin" >> "$WORK_DIR/workload.txt"
+done
+"$BIN_DIR/gfhashsum" "$WORK_DIR/files/good.bin" | awk '{ print $1, "/verify/good.bin" }' \
+    > "$WORK_DIR/manifest.txt" || fail "cannot hash the files"
+echo "0123456789abcdef /verify/bad.bin" >> "$WORK_DIR/manifest.txt"
+
+# every request is a cache hit, the origin is never asked
+"$BIN_DIR/simplecached" -c "$WORK_DIR/locals.txt" -t 2 \
+    >"$WORK_DIR/simplecached.log" 2>&1 &
+PIDS+=($!)
+sleep 0.5
+"$BIN_DIR/webproxy" -p "$PROXY_PORT" -t 2 -n 2 -z 65536 -s 127.0.0.1:1 --log-level error \
+    >"$WORK_DIR/webproxy.log" 2>&1 &
+PIDS+=($!)
+sleep 0.5
+for pid in "${PIDS[@]}"; do
+    kill -0 "$pid" 2>/dev/null || fail "stand-ins did not start"
+done
+
+for mode in "whole" "segmented -S 2" "multi --multi 2"; do
+    set -- $mode
+    name=$1
+    shift
+    echo "[INFO] verifying $name downloads"
+    mkdir -p "$WORK_DIR/out-$name"
+    (cd "$WORK_DIR/out-$name" && "$BIN_DIR/gfclient_download" -p "$PROXY_PORT" \
+        -w "$WORK_DIR/workload.txt" -n 2 "$@" --verify "$WORK_DIR/manifest.txt" \
+        >>"$WORK_DIR/client-$name.log" 2>&1) && fail "$name: the mismatch was not reported"
+    grep -q "1 files matched the manifest, 1 did not" "$WORK_DIR/client-$name.log" || \
+        fail "$name: the files were not verified"
+    ls "$WORK_DIR/out-$name/verify/good.bin-"* >/dev/null 2>&1 || \
+        fail "$name: the matching file was removed"
+    ls "$WORK_DIR/out-$name/verify/bad.bin-"* >/dev/null 2>&1 && \
+        fail "$name: the mismatched file was left behind"
+done
+
+echo "[INFO] verify test passed"
@@ -1,26 +1,32 @@
 //In case you want to implement the shared memory IPC as a library...
+#define _GNU_SOURCE
 #include <sys/msg.h>
 #include <sys/shm.h>
 #include <memory.h>
+#include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 
 #include "shm_channel.h"
+#include "gfaffinity.h"
+#include "gflog.h"
 
 #define SHM_MAIN_CHAN_C 1
 #define SHM_MAIN_CHAN_S 2
 #define SHM_MAIN_CHAN_OFST 2
 
+/* per segment client/server channels, interleaved so that the channels of
+ * segments with adjacent ids never overlap */
+#define SHM_SEG_CHAN(seg_id, chan) (2L * ((long)(seg_id) + SHM_MAIN_CHAN_OFST) + (chan))
+
 #define WAIT_TIME_SEC 2
 #define WAIT_TRYS 25
 
 #define SHM_MSG_WAIT 0
 #define SHM_MSG_NOWAIT 1
 
-static const int dbg = 0;
-static const int dbg_mque = 0;
 
 
 /************************/
@@ -30,6 +36,7 @@ unsigned short _num_mem_segs;
 size_t _mem_seg_sz;
 typedef struct _mem_seg {
     int seg_id;
+    int node;                   //NUMA node the segment memory is placed on
 //    size_t seg_sz;
 //    void *addr;
 } shm_mem_seg_t;
@@ -40,12 +47,22 @@ shm_mem_seg_t *_mem_segs;    //pointer to array of structures holding shared mem
 /* message queue stuff */
 key_t _mq_key = (key_t)99999;
 int _msqid_main;
+int (*_yield_func)(unsigned int nwaits) = NULL;
 
 typedef struct _shm_ctx {
     char hdr[15];
     char file_path[512];
-    size_t file_size;
+    int method;                 //SHM_MTHD_GET or SHM_MTHD_HEAD (no data transfer)
+    int has_rng;                //non-zero if only a byte range of the file is requested
+    size_t rng_off;             //offset of first requested byte
+    size_t rng_len;             //number of requested bytes, 0 through end of file
+    size_t file_size;           //bytes transferred, the encoded length if the file is sent encoded
+    int accept_enc;             //SHM_ENC_* encodings the client accepts
+    int encoding;               //SHM_ENC_* encoding the file is sent in
+    size_t dec_size;            //length of the file once decoded
+    uint64_t trace_id;          //trace id of the request the file is transferred for
     int mem_seg_id;
+    int mem_seg_node;           //NUMA node of the segment, lets the server run the transfer there
     size_t mem_seg_tot_sz;
     size_t mem_seg_used_sz;
     int err_stat;
@@ -58,9 +75,10 @@ typedef struct _msg_bfr {
 
 /*************************/
 /* function declarations */
-int shm_send_simple_msg(int msg_chan, char *msg_hdr);
-int shm_send_msg(int msg_chan, shm_context_t *shm_ctx);
-int shm_wait_for_msg(int msg_chan, char *msg_hdr, shm_msg_bfr_t *msg_bfr, int iwait);
+int shm_send_simple_msg(long msg_chan, char *msg_hdr);
+int shm_send_msg(long msg_chan, shm_context_t *shm_ctx);
+int shm_wait_for_msg(long msg_chan, char *msg_hdr, shm_msg_bfr_t *msg_bfr, int iwait);
+int shm_msgsnd(shm_msg_bfr_t *msg_bfr);
 
 
 /**********************************************/
@@ -85,6 +103,26 @@ char *shm_context_get_file_path(shm_context_t *ctx) {
     return ctx->file_path;
 }
 
+void shm_context_set_method(shm_context_t *ctx, int method) {
+    ctx->method = method;
+}
+
+int shm_context_get_method(shm_context_t *ctx) {
+    return ctx->method;
+}
+
+void shm_context_set_range(shm_context_t *ctx, size_t rng_off, size_t rng_len) {
+    ctx->has_rng = 1;
+    ctx->rng_off = rng_off;
+    ctx->rng_len = rng_len;
+}
+
+int shm_context_get_range(shm_context_t *ctx, size_t *rng_off, size_t *rng_len) {
+    if (rng_off != NULL) *rng_off = ctx->rng_off;
+    if (rng_len != NULL) *rng_len = ctx->rng_len;
+    return ctx->has_rng;
+}
+
 void shm_context_set_file_size(shm_context_t *ctx, size_t file_sz) {
     ctx->file_size = file_sz;
 }
@@ -93,10 +131,44 @@ size_t shm_context_get_file_size(shm_context_t *ctx) {
     return ctx->file_size;
 }
 
+void shm_context_set_accept_encoding(shm_context_t *ctx, int encodings) {
+    ctx->accept_enc = encodings;
+}
+
+int shm_context_get_accept_encoding(shm_context_t *ctx) {
+    return ctx->accept_enc;
+}
+
+void shm_context_set_encoding(shm_context_t *ctx, int encoding, size_t dec_size) {
+    ctx->encoding = encoding;
+    ctx->dec_size = dec_size;
+}
+
+int shm_context_get_encoding(shm_context_t *ctx, size_t *dec_size) {
+    if (dec_size != NULL) *dec_size = (ctx->encoding != SHM_ENC_IDENTITY) ? ctx->dec_size : ctx->file_size;
+    return ctx->encoding;
+}
+
+void shm_context_set_trace_id(shm_context_t *ctx, uint64_t trace_id) {
+    ctx->trace_id = trace_id;
+}
+
+uint64_t shm_context_get_trace_id(shm_context_t *ctx) {
+    return ctx->trace_id;
+}
+
 int shm_context_get_seg_id(shm_context_t *ctx) {
     return ctx->mem_seg_id;
 }
 
+void shm_context_set_seg_node(shm_context_t *ctx, int node) {
+    ctx->mem_seg_node = node;
+}
+
+int shm_context_get_seg_node(shm_context_t *ctx) {
+    return ctx->mem_seg_node;
+}
+
 size_t shm_context_get_seg_tot_sz(shm_context_t *ctx) {
     return ctx->mem_seg_tot_sz;
 }
@@ -125,13 +197,9 @@ int shm_context_get_error(shm_context_t *ctx) {
 int shm_init_msg_que() {
     /* try to create message queue) */
     int ret = 0;
-    if (dbg_mque) {
-        _msqid_main = msgget(_mq_key, 0666 | IPC_CREAT);
-    } else {
-        _msqid_main = msgget(_mq_key, 0666 | IPC_CREAT);
-    }
+    _msqid_main = msgget(_mq_key, 0666 | IPC_CREAT);
     if (_msqid_main == -1) {
-        perror("[ERROR] server - could not initialize message queue");
+        gflog_error("server - could not initialize message queue: %s", strerror(errno));
         ret = -1;
     }
     return ret;
@@ -141,31 +209,30 @@ int shm_destroy_msg_que() {
     /* perform any additional cleanup then destroy queue */
     int ret = msgctl(_msqid_main, IPC_RMID, NULL);
     if ( ret != 0) {
-        perror("[ERROR] could not destroy message queue");
+        gflog_error("could not destroy message queue: %s", strerror(errno));
     }
     return ret;
 }
 
 int shm_connect_to_msg_que() {
 
-    fprintf(stderr, "[INFO] client - attempting to connect to message queue ... \n");
+    gflog_info("client - attempting to connect to message queue ...");
 
     /* wait until queue is established by server */
     int try = 0;
     while (try < WAIT_TRYS) {
         _msqid_main = msgget(_mq_key, 0666 | 0);
-        fprintf(stderr, "[INFO] client - msg que id is %d\n", _msqid_main);
         if (_msqid_main < 0) {
-            fprintf(stderr, "                message queue not found trying again ...\n");
+            gflog_info("client - message queue not found, trying again ...");
             sleep(WAIT_TIME_SEC);
             try++;
         } else {
-            fprintf(stderr, "                SUCCESS\n");
+            gflog_info("client - connected to message queue %d", _msqid_main);
             break;
         }
     }
     if (try == WAIT_TRYS) {
-        fprintf(stderr, "[ERROR] client - tried %d times to connect to message queue, but not successful.\n", try);
+        gflog_error("client - tried %d times to connect to message queue, but not successful.", try);
         return -1;
     }
 
@@ -173,57 +240,90 @@ int shm_connect_to_msg_que() {
 
 }
 
-int shm_send_simple_msg(int msg_chan, char *msg_hdr) {
+int shm_send_simple_msg(long msg_chan, char *msg_hdr) {
     shm_context_t msg_data = {{0}};
     shm_msg_bfr_t msg_bfr = {0};
     strncpy(msg_data.hdr, msg_hdr, strlen(msg_hdr));
     msg_bfr.mtype = msg_chan;
     msg_bfr.msg_data = msg_data;
-    int ret = msgsnd(_msqid_main, &msg_bfr, sizeof(shm_context_t), 0);
+    int ret = shm_msgsnd(&msg_bfr);
     if (ret == -1) {
         return -1;
     }
     return 0;
 }
 
-int shm_send_msg(int msg_chan, shm_context_t *shm_ctx) {
+int shm_send_msg(long msg_chan, shm_context_t *shm_ctx) {
     shm_msg_bfr_t msg_bfr;
     msg_bfr.mtype = msg_chan;
     msg_bfr.msg_data = *shm_ctx;
-    int ret = msgsnd(_msqid_main, &msg_bfr, sizeof(shm_context_t), 0);
+    int ret = shm_msgsnd(&msg_bfr);
     if (ret == -1) {
         return -1;
     }
     return 0;
 }
 
-int shm_wait_for_msg(int msg_chan, char *msg_hdr, shm_msg_bfr_t *msg_bfr, int iwait) {
+void shm_set_yield_func(int (*yield_func)(unsigned int nwaits)) {
+    _yield_func = yield_func;
+}
+
+/* sends a message, yielding instead of blocking while the queue is full */
+int shm_msgsnd(shm_msg_bfr_t *msg_bfr) {
+    unsigned int nwaits = 0;
+    int can_yield = (_yield_func != NULL);
+    while (1) {
+        int ret = msgsnd(_msqid_main, msg_bfr, sizeof(shm_context_t), can_yield ? IPC_NOWAIT : 0);
+        if (ret == 0 || (errno != EINTR && errno != EAGAIN)) {
+            return ret;
+        }
+        if (errno == EAGAIN && _yield_func(nwaits++) != 0) {
+            can_yield = 0;
+        }
+    }
+}
+
+int shm_wait_for_msg(long msg_chan, char *msg_hdr, shm_msg_bfr_t *msg_bfr, int iwait) {
     ssize_t ret = 0;
-    if (dbg) fprintf(stderr, "INFO: Chan-%d, waiting to receive message with hdr: %s ... \n", msg_chan, msg_hdr);
+    gflog_debug("Chan-%ld, waiting to receive message with hdr: %s ...", msg_chan, msg_hdr);
     int wait = 0;
     if (iwait) wait = 1;
     int try = 0;
     try = 0;
+    unsigned int nyields = 0;
+    int can_yield = (!wait && _yield_func != NULL);
     while (try < WAIT_TRYS) {
-        ret = msgrcv(_msqid_main, msg_bfr, sizeof(shm_context_t), msg_chan, (IPC_NOWAIT*wait));
+        ret = msgrcv(_msqid_main, msg_bfr, sizeof(shm_context_t), msg_chan, can_yield ? IPC_NOWAIT : (IPC_NOWAIT*wait));
+        if (ret == -1 && errno == EINTR) {
+            continue; //interrupted by a signal such as the stats request
+        }
+        if (ret == -1 && errno == ENOMSG && can_yield) {
+            /* blocking waits yield until the message arrives, unless the
+             * caller cannot yield in which case they block after all */
+            if (_yield_func(nyields++) != 0) {
+                can_yield = 0;
+            }
+            continue;
+        }
         /* check message text for acknowledgment */
         if (ret == -1 && errno != ENOMSG && errno != EAGAIN) {
-            char *msg = NULL;
-            sprintf(msg, "[ERROR] Chan-%d, when trying to read message queue", msg_chan);
-            perror(msg);
+            gflog_error("Chan-%ld, when trying to read message queue: %s", msg_chan, strerror(errno));
+            return -1;
+        } else if ( (ret != -1) && (memcmp((*msg_bfr).msg_data.hdr, SHM_MSG_HDR_ABRT, strlen(SHM_MSG_HDR_ABRT)) == 0) ) {
+            gflog_debug("Chan-%ld, transfer aborted by other side", msg_chan);
             return -1;
         } else if ( (ret != -1) && (memcmp((*msg_bfr).msg_data.hdr, msg_hdr, strlen(msg_hdr)) != 0) ) {
-            fprintf(stderr, "[ERROR] Chan-%d, received message but with unexpected header %s\n", msg_chan, (*msg_bfr).msg_data.hdr);
+            gflog_error("Chan-%ld, received message but with unexpected header %s", msg_chan, (*msg_bfr).msg_data.hdr);
             return -1;
         } else if ( (ret != -1) && (memcmp((*msg_bfr).msg_data.hdr, msg_hdr, strlen(msg_hdr)) == 0) ) {
             break;
         }
-        if (dbg) fprintf(stderr, "INFO: Chan-%d, no message received, trying again ... \n", msg_chan);
+        gflog_debug("Chan-%ld, no message received, trying again ...", msg_chan);
         try++;
         sleep(WAIT_TIME_SEC);
     }
     if (try == WAIT_TRYS) {
-        if (dbg) fprintf(stderr, "ERROR: Chan-%d, tried %d times to wait for message, but never came.\n", try, msg_chan);
+        gflog_debug("Chan-%ld, tried %d times to wait for message, but never came.", msg_chan, try);
         return -1;
     }
     return 0;
@@ -232,14 +332,14 @@ int shm_wait_for_msg(int msg_chan, char *msg_hdr, shm_msg_bfr_t *msg_bfr, int iw
 /* NOT USED */
 int shm_client_handshake() {
 
-    if (dbg) fprintf(stderr, "[INFO] client establishing sync handshake\n");
+    gflog_debug("client establishing sync handshake");
 
     ssize_t ret = 0;
 
     /* send sync message to server */
     ret = shm_send_simple_msg(SHM_MAIN_CHAN_C, SHM_MSG_HDR_SYNC);
     if (ret == -1) {
-        perror("[ERROR] client - could not send handshake message\n.");
+        gflog_error("client - could not send handshake message: %s", strerror(errno));
         return -1;
     };
 
@@ -247,35 +347,35 @@ int shm_client_handshake() {
     shm_msg_bfr_t msg_bfr = {0};
     ret = shm_wait_for_msg(SHM_MAIN_CHAN_S, SHM_MSG_HDR_SAKNW, &msg_bfr, SHM_MSG_NOWAIT);
     if (ret == -1) {
-        perror("ERROR: client - never received acknowledge request from server\n.");
+        gflog_error("client - never received acknowledge request from server: %s", strerror(errno));
         return -1;
     };
 
     /* send acknowledge to server */
-    if (dbg) fprintf(stderr, "INFO: client sending acknowledge to server\n");
+    gflog_debug("client sending acknowledge to server");
     ret = shm_send_simple_msg(SHM_MAIN_CHAN_C, SHM_MSG_HDR_CAKNW);
     if (ret == -1) {
-        perror("[ERROR] client - could not send handshake acknowledge message\n.");
+        gflog_error("client - could not send handshake acknowledge message: %s", strerror(errno));
         return -1;
     };
 
-    if (dbg) fprintf(stderr, "INFO: successful handshake with server\n");
+    gflog_debug("successful handshake with server");
     return 0;
 
 }
 
 int shm_client_send_file_request(shm_context_t *shm_ctx) {
     int ret = 0;
-    strncpy(shm_ctx->hdr, SHM_MSG_HDR_RQST, strlen(SHM_MSG_HDR_RQST));
+    strcpy(shm_ctx->hdr, SHM_MSG_HDR_RQST);
     ret = shm_send_msg(SHM_MAIN_CHAN_C, shm_ctx);
     if (ret == -1) {
-        fprintf(stderr, "[ERROR] client - could not submit file request message\n.");
+        gflog_error("client - could not submit file request message");
         return -1;
     };
     shm_msg_bfr_t msg_bfr = {0}; //buffer to hold result
-    ret = shm_wait_for_msg(shm_ctx->mem_seg_id+SHM_MAIN_CHAN_S+SHM_MAIN_CHAN_OFST, SHM_MSG_HDR_RSPN, &msg_bfr, SHM_MSG_WAIT);
+    ret = shm_wait_for_msg(SHM_SEG_CHAN(shm_ctx->mem_seg_id, SHM_MAIN_CHAN_S), SHM_MSG_HDR_RSPN, &msg_bfr, SHM_MSG_WAIT);
     if (ret == -1) {
-        fprintf(stderr, "[ERROR] client - something went wrong tring to read server response.\n.");
+        gflog_error("client - something went wrong tring to read server response");
         return -1;
     };
     memcpy(shm_ctx, &(msg_bfr.msg_data), sizeof(shm_context_t));
@@ -284,24 +384,28 @@ int shm_client_send_file_request(shm_context_t *shm_ctx) {
 
 int shm_client_wait_for_ready(shm_context_t *shm_ctx) {
     shm_msg_bfr_t msg_bfr = {0};
-    int ret = shm_wait_for_msg(shm_ctx->mem_seg_id+SHM_MAIN_CHAN_S+SHM_MAIN_CHAN_OFST, SHM_MSG_HDR_RDY, &msg_bfr, SHM_MSG_WAIT);
+    int ret = shm_wait_for_msg(SHM_SEG_CHAN(shm_ctx->mem_seg_id, SHM_MAIN_CHAN_S), SHM_MSG_HDR_RDY, &msg_bfr, SHM_MSG_WAIT);
     if (ret == 0) {
         memcpy(shm_ctx, &(msg_bfr.msg_data), sizeof(shm_context_t));
     } else if (ret == -1) {
-        fprintf(stderr, "[ERROR] client - something went wrong trying to read ready response.\n.");
+        gflog_error("client - something went wrong trying to read ready response");
         return -1;
     }
     return ret;
 }
 
 int shm_client_send_acknowledge(shm_context_t *shm_ctx) {
-    return shm_send_simple_msg(shm_ctx->mem_seg_id+SHM_MAIN_CHAN_C+SHM_MAIN_CHAN_OFST, SHM_MSG_HDR_CAKNW);
+    return shm_send_simple_msg(SHM_SEG_CHAN(shm_ctx->mem_seg_id, SHM_MAIN_CHAN_C), SHM_MSG_HDR_CAKNW);
+}
+
+int shm_client_send_abort(shm_context_t *shm_ctx) {
+    return shm_send_simple_msg(SHM_SEG_CHAN(shm_ctx->mem_seg_id, SHM_MAIN_CHAN_C), SHM_MSG_HDR_ABRT);
 }
 
 /* NOT USED */
 int shm_server_handshake() {
 
-    if (dbg) fprintf(stderr, "[INFO] server establishing sync handshake\n");
+    gflog_debug("server establishing sync handshake");
 
     ssize_t ret = 0;
     shm_msg_bfr_t msg_bfr = {0};
@@ -309,26 +413,26 @@ int shm_server_handshake() {
     /* wait for sync message from client */
     ret = shm_wait_for_msg(SHM_MAIN_CHAN_C, SHM_MSG_HDR_SYNC, &msg_bfr, SHM_MSG_NOWAIT);
     if (ret == -1) {
-        perror("[ERROR] server - never received sync request from client\n.");
+        gflog_error("server - never received sync request from client: %s", strerror(errno));
         return -1;
     };
 
     /* send sync acknowledged message to client */
-    if (dbg) fprintf(stderr, "[INFO] server sending acknowledge message\n");
+    gflog_debug("server sending acknowledge message");
     ret = shm_send_simple_msg(SHM_MAIN_CHAN_S, SHM_MSG_HDR_SAKNW);
     if (ret == -1) {
-        perror("[ERROR] server - could not send acknowledge message from server\n.");
+        gflog_error("server - could not send acknowledge message from server: %s", strerror(errno));
         return -1;
     };
 
     /* wait for final acknowledgement from client */
     ret = shm_wait_for_msg(SHM_MAIN_CHAN_C, SHM_MSG_HDR_CAKNW, &msg_bfr, SHM_MSG_NOWAIT);
     if (ret == -1) {
-        perror("[ERROR] server - never received acknowledge from client\n.");
+        gflog_error("server - never received acknowledge from client: %s", strerror(errno));
         return -1;
     };
 
-    if (dbg) fprintf(stderr, "[INFO]] successful handshake with client\n");
+    gflog_debug("successful handshake with client");
     return 0;
 
 }
@@ -347,19 +451,19 @@ shm_context_t *shm_server_wait_for_file_request() {
 
 int shm_server_send_response(shm_context_t *shm_ctx) {
     strcpy(shm_ctx->hdr, SHM_MSG_HDR_RSPN);
-    return shm_send_msg(shm_ctx->mem_seg_id+SHM_MAIN_CHAN_S+SHM_MAIN_CHAN_OFST, shm_ctx);
+    return shm_send_msg(SHM_SEG_CHAN(shm_ctx->mem_seg_id, SHM_MAIN_CHAN_S), shm_ctx);
 }
 
 int shm_server_send_ready(shm_context_t *shm_ctx) {
     strcpy(shm_ctx->hdr, SHM_MSG_HDR_RDY);
-    return shm_send_msg(shm_ctx->mem_seg_id+SHM_MAIN_CHAN_S+SHM_MAIN_CHAN_OFST, shm_ctx);
+    return shm_send_msg(SHM_SEG_CHAN(shm_ctx->mem_seg_id, SHM_MAIN_CHAN_S), shm_ctx);
 }
 
 int shm_server_wait_for_acknowledge(shm_context_t *shm_ctx) {
     shm_msg_bfr_t msg_bfr = {0};
-    int ret = shm_wait_for_msg(shm_ctx->mem_seg_id+SHM_MAIN_CHAN_C+SHM_MAIN_CHAN_OFST, SHM_MSG_HDR_CAKNW, &msg_bfr, SHM_MSG_WAIT);
-    if (ret != 0) {
-        fprintf(stderr, "[Error] server - something went wrong trying to read acknowledge message.\n");
+    int ret = shm_wait_for_msg(SHM_SEG_CHAN(shm_ctx->mem_seg_id, SHM_MAIN_CHAN_C), SHM_MSG_HDR_CAKNW, &msg_bfr, SHM_MSG_WAIT);
+    if (ret != 0 && memcmp(msg_bfr.msg_data.hdr, SHM_MSG_HDR_ABRT, strlen(SHM_MSG_HDR_ABRT)) != 0) {
+        gflog_error("server - something went wrong trying to read acknowledge message");
     }
     return ret;
 }
@@ -383,21 +487,56 @@ int shm_init_mem_segs(unsigned short num_segs, size_t seg_sz) {
         /* connect to (and possibly create) the segment: */
         new_key = _mem_key_seed + (key_t)i;
         if ((shmid = shmget(new_key, seg_sz, 0666 | IPC_CREAT)) == -1) {
-            perror("[ERROR] could not create memory segment");
+            gflog_error("could not create memory segment: %s", strerror(errno));
             return -1;
         }
-        if (dbg) fprintf(stderr, "[INFO] new memory seg w id: %d\n", shmid);
+        gflog_debug("new memory seg w id: %d", shmid);
         _mem_segs[i].seg_id = shmid;
     }
     return ret;
 }
 
+int shm_place_mem_segs(int num_nodes) {
+
+    if (num_nodes < 1) {
+        num_nodes = 1;
+    }
+    for (int i = 0; i < _num_mem_segs; i++) {
+
+        /* spread the segments over the nodes, the memory policy is kept by
+         * the segment so pages touched here stay on the node for both
+         * processes */
+        int node = i % num_nodes;
+        void *addr = shm_attach_mem_seg(_mem_segs[i].seg_id);
+        if (addr == NULL) {
+            return -1;
+        }
+        int ret = gfaff_bind_mem(addr, _mem_seg_sz, node);
+        shm_detach_mem_seg(addr);
+        if (ret != 0) {
+            return -1;
+        }
+        _mem_segs[i].node = node;
+        gflog_debug("memory seg w id: %d placed on node %d", _mem_segs[i].seg_id, node);
+    }
+    return 0;
+}
+
+int shm_get_mem_seg_node(int mem_seg_id) {
+    for (int i = 0; i < _num_mem_segs; i++) {
+        if (_mem_segs[i].seg_id == mem_seg_id) {
+            return _mem_segs[i].node;
+        }
+    }
+    return 0;
+}
+
 int shm_destroy_mem_segs() {
     for (int i = 0; i < _num_mem_segs; i++) {
 
         /* TODO: need to check for existing locks and wait to proceed */
         if ( shmctl(_mem_segs[i].seg_id, IPC_RMID, NULL) != 0) {
-            perror("[ERROR] could not destroy shared memory segment");
+            gflog_error("could not destroy shared memory segment: %s", strerror(errno));
             return -1;
         }
     }
@@ -410,7 +549,7 @@ void *shm_attach_mem_seg(int mem_seg_id) {
     /* attach memory segment to address */
     void *new_addr = shmat(mem_seg_id, NULL, 0);
     if ( new_addr == (void *)-1) {
-        perror("[ERROR] could not attach to memory segment");
+        gflog_error("could not attach to memory segment: %s", strerror(errno));
         return NULL;
     }
     return new_addr;
@@ -420,7 +559,7 @@ int shm_detach_mem_seg(void *mem_seg_addr) {
     /* attach memory segment to address */
     int ret = shmdt(mem_seg_addr);
     if ( ret == -1) {
-        perror("[ERROR] could not detach to memory segment");
+        gflog_error("could not detach to memory segment: %s", strerror(errno));
         return -1;
     }
     return 0;
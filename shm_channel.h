@@ -1,6 +1,8 @@
 #ifndef _SHM_CHANNEL_H_
 #define _SHM_CHANNEL_H_
 
+#include <stdint.h>
+
 #define SHM_MSG_HDR_SYNC   "SYNC"
 #define SHM_MSG_HDR_SAKNW  "S_AKNW"
 #define SHM_MSG_HDR_CAKNW  "C_AKNW"
@@ -8,9 +10,18 @@
 #define SHM_MSG_HDR_RSPN   "RSPNS"
 #define SHM_MSG_HDR_RDY    "RDY"
 #define SHM_MSG_HDR_ERR    "ERR"
+#define SHM_MSG_HDR_ABRT   "ABRT"
 
 #define SHM_STAT_OK 200
 #define SHM_STAT_NOT_FOUND 404
+#define SHM_STAT_BAD_RANGE 416
+
+#define SHM_MTHD_GET 0
+#define SHM_MTHD_HEAD 1
+
+/* content encodings, accepted encodings are or'ed together */
+#define SHM_ENC_IDENTITY 0
+#define SHM_ENC_GZIP 1
 
 /**********************************************/
 /* MESSAGE CONTEXT STRUCTURE & FUNCTIONS      */
@@ -23,12 +34,42 @@ void shm_context_cleanup(shm_context_t *ctx);
 
 char *shm_context_get_file_path(shm_context_t *ctx);
 
+void shm_context_set_method(shm_context_t *ctx, int method);
+
+int shm_context_get_method(shm_context_t *ctx);
+
+/* rng_len of 0 requests the remainder of the file starting at rng_off */
+void shm_context_set_range(shm_context_t *ctx, size_t rng_off, size_t rng_len);
+
+int shm_context_get_range(shm_context_t *ctx, size_t *rng_off, size_t *rng_len);
+
 void shm_context_set_file_size(shm_context_t *ctx, size_t file_sz);
 
 size_t shm_context_get_file_size(shm_context_t *ctx);
 
+/* encodings the client accepts, the server may pick one of them */
+void shm_context_set_accept_encoding(shm_context_t *ctx, int encodings);
+
+int shm_context_get_accept_encoding(shm_context_t *ctx);
+
+/* set by the server when the file size it replies with is that of an
+ * encoded variant, dec_size is the length of the file once decoded */
+void shm_context_set_encoding(shm_context_t *ctx, int encoding, size_t dec_size);
+
+int shm_context_get_encoding(shm_context_t *ctx, size_t *dec_size);
+
+/* trace id of the request, lets the server record its events under it */
+void shm_context_set_trace_id(shm_context_t *ctx, uint64_t trace_id);
+
+uint64_t shm_context_get_trace_id(shm_context_t *ctx);
+
 int shm_context_get_seg_id(shm_context_t *ctx);
 
+/* NUMA node the client placed the memory segment on */
+void shm_context_set_seg_node(shm_context_t *ctx, int node);
+
+int shm_context_get_seg_node(shm_context_t *ctx);
+
 size_t shm_context_get_seg_tot_sz(shm_context_t *ctx);
 
 void shm_context_set_seg_used_sz(shm_context_t *ctx, size_t used_size);
@@ -67,6 +108,15 @@ int shm_destroy_msg_que();
  */
 int shm_connect_to_msg_que();
 
+/*
+ * Sets a function called in place of blocking while a message has not
+ * arrived yet or the queue is full, e.g. to run other work meanwhile.
+ * It is passed the number of times it was called for the same message
+ * and returns 0 once the operation may be retried, or -1 if the calling
+ * thread cannot yield, in which case the operation blocks after all.
+ */
+void shm_set_yield_func(int (*yield_func)(unsigned int nwaits));
+
 /*
  * send request for file to receive from cache
  *  message is sent on main message queue channel
@@ -81,9 +131,16 @@ int shm_client_send_file_request(shm_context_t *shm_ctx);
 int shm_client_wait_for_ready(shm_context_t *shm_ctx);
 int shm_client_send_acknowledge(shm_context_t *shm_ctx);
 
+/*
+ * Sent in place of an acknowledge to stop the server from transferring
+ * the remainder of the file, e.g. when the client connection was lost.
+ */
+int shm_client_send_abort(shm_context_t *shm_ctx);
+
 shm_context_t *shm_server_wait_for_file_request();
 int shm_server_send_response(shm_context_t *shm_ctx);
 int shm_server_send_ready(shm_context_t *shm_ctx);
+/* returns -1 on errors or if the client aborted the transfer */
 int shm_server_wait_for_acknowledge(shm_context_t *shm_ctx);
 
 
@@ -94,6 +151,16 @@ int shm_server_wait_for_acknowledge(shm_context_t *shm_ctx);
 int shm_init_mem_segs(unsigned short num_segs, size_t seg_sz);
 int shm_destroy_mem_segs();
 
+/*
+ * Places the memory segments round-robin on num_nodes NUMA nodes and
+ * faults their pages in there.  Must be called after shm_init_mem_segs
+ * by the component that created the segments.
+ */
+int shm_place_mem_segs(int num_nodes);
+
+/* node a segment was placed on by shm_place_mem_segs, 0 if not placed */
+int shm_get_mem_seg_node(int mem_seg_id);
+
 void *shm_attach_mem_seg(int mem_seg_id);
 int shm_detach_mem_seg(void *mem_seg_addr);
 
@@ -1,20 +1,53 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "steque.h"
 
 #define MAX_KEYLEN 256
 
+/* a gzip variant is only kept if it is at least 1/GZIP_MIN_SAVING smaller */
+#define GZIP_MIN_SAVING 16
+#define GZIP_CHUNK (64 * 1024)
+/* variants made at start pay off the slowest level, those made on demand
+ * use a faster one so they are ready sooner */
+#define GZIP_LEVEL_PRE Z_BEST_COMPRESSION
+#define GZIP_LEVEL_LAZY 6
+
+/* states of the gzip variant of an item */
+#define GZ_UNKNOWN 0	/* not compressed yet */
+#define GZ_READY 1
+#define GZ_NONE 2	/* does not compress well or is too large, only served as is */
+#define GZ_PENDING 3	/* queued for or being compressed by the gzip thread */
+
 typedef struct{
 	int fildes;
+	int gz_fildes;
+	int gz_state;
+	pthread_mutex_t gz_lock;
 	char key[MAX_KEYLEN];
 } item_t;
 
 static int nitems;
 static item_t *items;
 
+/* variants are made on demand by a thread of their own, so requests are
+ * served as is until their variant is ready */
+static size_t gz_max_len = 64 * 1024 * 1024;	/* larger files get no variant */
+static pthread_t gz_thd;
+static int gz_started = 0;
+static volatile int gz_stop = 0;
+static steque_t gz_que;
+static pthread_mutex_t gz_que_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gz_que_rdy = PTHREAD_COND_INITIALIZER;
+
 static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
 }
@@ -57,10 +90,18 @@ int simplecache_init(char *filename){
 
 	qsort(items, nitems, sizeof(item_t), _itemcmp);
 
+	/* the array no longer moves, the locks can live in it */
+	for(int i = 0; i < nitems; i++){
+		items[i].gz_fildes = -1;
+		items[i].gz_state = GZ_UNKNOWN;
+		pthread_mutex_init(&items[i].gz_lock, NULL);
+	}
+	steque_init(&gz_que);
+
 	return EXIT_SUCCESS;
 }
 
-int simplecache_get(char *key){
+static item_t *_itemfind(char *key){
 	int lo = 0;
 	int hi = nitems - 1;
 	int mid, cmp;
@@ -70,18 +111,194 @@ int simplecache_get(char *key){
 		cmp = strcmp(key,items[mid].key);
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
-			return items[mid].fildes;
-		} 
+		else return &items[mid];
+	}
+	return NULL;
+}
+
+int simplecache_get(char *key){
+	item_t *item = _itemfind(key);
+	if (item == NULL)
+		return -1;
+
+	lseek(item->fildes, 0, SEEK_SET);
+	return item->fildes;
+}
+
+/*
+ * Compresses the file into an anonymous memory backed file in gzip
+ * format at the given level.  Returns its descriptor and size, or -1 on
+ * errors or when the cache is destroyed meanwhile.
+ */
+static int _gzipfile(int fildes, int level, size_t *gz_len){
+	struct stat file_stat;
+	if (fstat(fildes, &file_stat) != 0)
+		return -1;
+
+	int gz_fildes = memfd_create("simplecache-gz", MFD_CLOEXEC);
+	if (gz_fildes < 0)
+		return -1;
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	/* 16 added to the window bits selects the gzip wrapper */
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+		close(gz_fildes);
+		return -1;
+	}
+
+	unsigned char *in = malloc(GZIP_CHUNK);
+	unsigned char *out = malloc(GZIP_CHUNK);
+	off_t off = 0;
+	int flush, err = 0;
+	do {
+		ssize_t nread = pread(fildes, in, GZIP_CHUNK, off);
+		if (nread < 0 || gz_stop){
+			err = 1;
+			break;
+		}
+		off += nread;
+		flush = (nread == 0 || off >= file_stat.st_size) ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = in;
+		zs.avail_in = (uInt) nread;
+		do {
+			zs.next_out = out;
+			zs.avail_out = GZIP_CHUNK;
+			deflate(&zs, flush);
+			size_t have = GZIP_CHUNK - zs.avail_out;
+			for (size_t written = 0; written < have && !err; ){
+				ssize_t n = write(gz_fildes, out + written, have - written);
+				if (n < 0)
+					err = 1;
+				else
+					written += n;
+			}
+		} while (zs.avail_out == 0 && !err);
+	} while (flush != Z_FINISH && !err);
+
+	*gz_len = zs.total_out;
+	deflateEnd(&zs);
+	free(in);
+	free(out);
+	if (err){
+		close(gz_fildes);
+		return -1;
+	}
+	return gz_fildes;
+}
+
+/* makes the variant of an item whose state is GZ_PENDING, the lock is
+ * only taken to publish it so requests are not held up meanwhile */
+static void _itemgzip(item_t *item, int level){
+	size_t gz_len;
+	struct stat file_stat;
+	int gz_state = GZ_NONE;
+	int gz_fildes = _gzipfile(item->fildes, level, &gz_len);
+
+	/* media that is compressed already would only grow */
+	if (gz_fildes >= 0 && fstat(item->fildes, &file_stat) == 0){
+		size_t file_len = (size_t) file_stat.st_size;
+		if (gz_len <= file_len - file_len / GZIP_MIN_SAVING)
+			gz_state = GZ_READY;
+	}
+	if (gz_state != GZ_READY && gz_fildes >= 0){
+		close(gz_fildes);
+		gz_fildes = -1;
+	}
+
+	pthread_mutex_lock(&item->gz_lock);
+	item->gz_fildes = gz_fildes;
+	item->gz_state = gz_state;
+	pthread_mutex_unlock(&item->gz_lock);
+}
+
+static void *_gzipworker(void *arg){
+	pthread_mutex_lock(&gz_que_lock);
+	while (!gz_stop){
+		if (steque_isempty(&gz_que)){
+			pthread_cond_wait(&gz_que_rdy, &gz_que_lock);
+			continue;
+		}
+		item_t *item = (item_t*) steque_pop(&gz_que);
+		pthread_mutex_unlock(&gz_que_lock);
+		_itemgzip(item, GZIP_LEVEL_LAZY);
+		pthread_mutex_lock(&gz_que_lock);
+	}
+	pthread_mutex_unlock(&gz_que_lock);
+	return NULL;
+}
+
+/* claims an item's variant for compressing if nobody has yet, returns 1
+ * if the caller is to make it.  Files over the limit never get one */
+static int _itemclaim(item_t *item){
+	struct stat file_stat;
+	if (item->gz_state != GZ_UNKNOWN)
+		return 0;
+	if (fstat(item->fildes, &file_stat) != 0 || (size_t) file_stat.st_size > gz_max_len){
+		item->gz_state = GZ_NONE;
+		return 0;
 	}
-	return -1;
+	item->gz_state = GZ_PENDING;
+	return 1;
+}
+
+int simplecache_get_gzip(char *key){
+	item_t *item = _itemfind(key);
+	if (item == NULL)
+		return -1;
+
+	pthread_mutex_lock(&item->gz_lock);
+	int claimed = _itemclaim(item);
+	int gz_fildes = item->gz_fildes;
+	pthread_mutex_unlock(&item->gz_lock);
+
+	if (claimed){
+		pthread_mutex_lock(&gz_que_lock);
+		if (!gz_started && pthread_create(&gz_thd, NULL, _gzipworker, NULL) == 0)
+			gz_started = 1;
+		steque_enqueue(&gz_que, item);
+		pthread_cond_signal(&gz_que_rdy);
+		pthread_mutex_unlock(&gz_que_lock);
+	}
+	return gz_fildes;
+}
+
+void simplecache_set_gzip_max(size_t max_len){
+	gz_max_len = max_len;
+}
+
+void simplecache_precompress(){
+	int i, nready = 0;
+	for(i = 0; i < nitems; i++){
+		pthread_mutex_lock(&items[i].gz_lock);
+		int claimed = _itemclaim(&items[i]);
+		pthread_mutex_unlock(&items[i].gz_lock);
+		if (claimed)
+			_itemgzip(&items[i], GZIP_LEVEL_PRE);
+		if (items[i].gz_state == GZ_READY)
+			nready++;
+	}
+	fprintf(stderr, "[INFO] compressed %d of %d cached files\n", nready, nitems);
 }
 
 void simplecache_destroy(){
 	int i;
-	for(i = 0; i < nitems; i++)
+
+	/* a file being compressed is given up */
+	pthread_mutex_lock(&gz_que_lock);
+	gz_stop = 1;
+	pthread_cond_signal(&gz_que_rdy);
+	pthread_mutex_unlock(&gz_que_lock);
+	if (gz_started)
+		pthread_join(gz_thd, NULL);
+	steque_destroy(&gz_que);
+
+	for(i = 0; i < nitems; i++){
 		close(items[i].fildes);
+		if (items[i].gz_fildes >= 0)
+			close(items[i].gz_fildes);
+		pthread_mutex_destroy(&items[i].gz_lock);
+	}
 	
 	free(items);
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef _SIMPLECACHE_H_
 #define _SIMPLECACHE_H_
 
+#include <stddef.h>
+
 /* 
  * Initializes the input cache given the information from
  * the provided file.  Each row of the file is assumed
@@ -16,6 +18,28 @@ int simplecache_init(char *filename);
  */
 int simplecache_get(char *key);
 
+/*
+ * Returns a file descriptor for a gzip compressed variant of the file
+ * associated with the input key.  The first call for a file queues it to
+ * be compressed in the background.  Returns -1 if the key is not cached,
+ * the variant is not ready yet, or the file is too large or does not
+ * compress well enough for the variant to be worth sending.  Reads of
+ * the descriptor must use pread, it is shared by all callers.
+ */
+int simplecache_get_gzip(char *key);
+
+/*
+ * Sets the size of the largest file a gzip variant is made of, variants
+ * are kept in memory (Default: 64 MiB).
+ */
+void simplecache_set_gzip_max(size_t max_len);
+
+/*
+ * Creates the gzip variants of all cached files up front, at the best
+ * compression level, instead of on the first request for each.
+ */
+void simplecache_precompress();
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
@@ -6,12 +8,16 @@
 #include <getopt.h>
 #include <pthread.h>
 #include <sys/stat.h>
-#include <sys/time.h>
-#include <asm/errno.h>
+#include <errno.h>
 
+#include "gfaffinity.h"
+#include "gflog.h"
+#include "gfstats.h"
+#include "gftrace.h"
 #include "shm_channel.h"
 #include "simplecache.h"
 #include "steque.h"
+#include "wrkpool.h"
 
 #define MAX_CACHE_REQUEST_LEN 256
 
@@ -19,29 +25,77 @@
 "usage:\n"                                                                    \
 "  simplecached [options]\n"                                                  \
 "options:\n"                                                                  \
-"  -t [thread_count]   Num worker threads (Default: 1, Range: 1-1000)\n"      \
+"  -t [thread_count]   Max worker threads (Default: 1, Range: 1-1000)\n"      \
 "  -c [cachedir]       Path to static files (Default: ./)\n"                  \
-"  -h                  Show this help message\n"
-
-static int dbg = 0;
-
-static steque_t *rqst_que;
-static pthread_mutex_t rqst_lock;
-static pthread_cond_t rqst_rdy;
-static int g_nthds = 0;
+"  -h                  Show this help message\n"                              \
+"  --min-threads [n]   Worker threads kept when idle (Default: 1)\n"         \
+"  --grow-wait [ms]    Queue wait above which workers are added (Default: 10)\n"\
+"  --idle-retire [ms]  Idle time after which extra workers exit (Default: 30000)\n"\
+"  --lane-threshold [bytes] Requests above this size use the large lane, 0 disables lanes (Default: 262144)\n"\
+"  --lane-weights [s,l]     Requests served from the small and large lane per round (Default: 4,1)\n"\
+"  --cpus [list]       Pin worker threads round-robin to cpus, e.g. 0-3 (Default: unpinned)\n"\
+"  --numa-follow       Move workers to the NUMA node of the segment they transfer through\n"\
+"  --precompress       Create gzip variants of all files at start instead of on first request\n"\
+"  --gzip-max [bytes]  Largest file a gzip variant is made of, 0 for none (Default: 67108864)\n"\
+"  --stats-name [name] Publish statistics for gfstat under this name (Default: simplecached)\n"\
+"  --trace-slow [ms]   Dump the trace of requests slower than this, 0 disables (Default: 0)\n"\
+"  --trace-dir [dir]   Directory trace dumps are written to, SIGUSR1 dumps all (Default: .)\n"\
+"  --log-level [level] Log error, warn, info or debug messages (Default: info)\n"
+
+static wrkpool_t *g_pool = NULL;
+static sigset_t g_sigs;             //signals handled by the signal thread
+static pthread_mutex_t g_stop_lock = PTHREAD_MUTEX_INITIALIZER;    //held while a request is handed to the pool
+static int g_stopping = 0;          //set on shutdown, no more requests are handed to the pool
+static __thread int tls_cur_node = -1;  //node a --numa-follow worker currently runs on
+static cpu_set_t g_cpus;            //cpus the worker threads are spread over
+static int g_pin = 0;
+static int g_numa_follow = 0;
+static size_t g_lane_thresh = 262144;   //requests above go on the large lane, 0 disables lanes
 
 /* forward declarations */
 static void _init_stuff();
 static void _cleanup_stuff();
-static void _sig_handler(int signo);
-static void handler_enqueue_rqst(shm_context_t *ctx);
-static void *handler_dequeue_rqsts(void *);
+static void _handle_signal(int signo);
+static void *_sig_thread(void *arg);
+static void handler_init_thd(int ithd, void *arg);
+static void handler_handle_rqst(void *item, void *arg);
+static int handler_classify(shm_context_t *ctx);
 static ssize_t handle_file_request(shm_context_t *ctx);
 
+/* long only options */
+enum {
+    OPT_MIN_THDS = 256,
+    OPT_GROW_WAIT,
+    OPT_IDLE_RETIRE,
+    OPT_LANE_THRESH,
+    OPT_LANE_WTS,
+    OPT_CPUS,
+    OPT_NUMA_FOLLOW,
+    OPT_PRECOMPRESS,
+    OPT_GZIP_MAX,
+    OPT_STATS_NAME,
+    OPT_TRACE_SLOW,
+    OPT_TRACE_DIR,
+    OPT_LOG_LEVEL
+};
+
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
     {"nthreads",           required_argument,      NULL,           't'},
     {"cachedir",           required_argument,      NULL,           'c'},
+    {"min-threads",        required_argument,      NULL,           OPT_MIN_THDS},
+    {"grow-wait",          required_argument,      NULL,           OPT_GROW_WAIT},
+    {"idle-retire",        required_argument,      NULL,           OPT_IDLE_RETIRE},
+    {"lane-threshold",     required_argument,      NULL,           OPT_LANE_THRESH},
+    {"lane-weights",       required_argument,      NULL,           OPT_LANE_WTS},
+    {"cpus",               required_argument,      NULL,           OPT_CPUS},
+    {"numa-follow",        no_argument,            NULL,           OPT_NUMA_FOLLOW},
+    {"precompress",        no_argument,            NULL,           OPT_PRECOMPRESS},
+    {"gzip-max",           required_argument,      NULL,           OPT_GZIP_MAX},
+    {"stats-name",         required_argument,      NULL,           OPT_STATS_NAME},
+    {"trace-slow",         required_argument,      NULL,           OPT_TRACE_SLOW},
+    {"trace-dir",          required_argument,      NULL,           OPT_TRACE_DIR},
+    {"log-level",          required_argument,      NULL,           OPT_LOG_LEVEL},
     {"help",               no_argument,            NULL,           'h'},
     {NULL,                 0,                      NULL,             0}
 };
@@ -52,8 +106,17 @@ void Usage() {
 
 int main(int argc, char **argv) {
     int nthreads = 1;
+    int min_threads = 1;
+    unsigned int grow_wait_ms = WRKPOOL_WAIT_TARGET_MS;
+    unsigned int idle_retire_ms = WRKPOOL_IDLE_TO_MS;
+    unsigned int lane_wts[2] = {4, 1};
     char *cachedir = "locals.txt";
-    char option_char;
+    int precompress = 0;
+    char *stats_name = "simplecached";
+    unsigned int trace_slow_ms = 0;
+    char *trace_dir = ".";
+    int log_level = GFLOG_INFO;
+    int option_char;
 
 
     while ((option_char = getopt_long(argc, argv, "t:c:h", gLongOptions, NULL)) != -1) {
@@ -64,6 +127,55 @@ int main(int argc, char **argv) {
             case 'c': //cache directory
                 cachedir = optarg;
                 break;
+            case OPT_MIN_THDS:
+                min_threads = atoi(optarg);
+                break;
+            case OPT_GROW_WAIT:
+                grow_wait_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_IDLE_RETIRE:
+                idle_retire_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_LANE_THRESH:
+                g_lane_thresh = (size_t) atol(optarg);
+                break;
+            case OPT_LANE_WTS:
+                if (sscanf(optarg, "%u,%u", &lane_wts[0], &lane_wts[1]) != 2) {
+                    fprintf(stderr, "[ERROR] lane weights must be given as small,large\n");
+                    exit(1);
+                }
+                break;
+            case OPT_CPUS:
+                if (gfaff_parse_cpus(optarg, &g_cpus) != 0) {
+                    fprintf(stderr, "[ERROR] invalid cpu list: %s\n", optarg);
+                    exit(1);
+                }
+                g_pin = 1;
+                break;
+            case OPT_NUMA_FOLLOW:
+                g_numa_follow = 1;
+                break;
+            case OPT_PRECOMPRESS:
+                precompress = 1;
+                break;
+            case OPT_GZIP_MAX:
+                simplecache_set_gzip_max((size_t) strtoull(optarg, NULL, 10));
+                break;
+            case OPT_STATS_NAME:
+                stats_name = optarg;
+                break;
+            case OPT_TRACE_SLOW:
+                trace_slow_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_TRACE_DIR:
+                trace_dir = optarg;
+                break;
+            case OPT_LOG_LEVEL:
+                if ((log_level = gflog_parse_level(optarg)) < 0) {
+                    fprintf(stderr,"[Error] log level must be error, warn, info or debug\n");
+                    exit(-1);
+                }
+                break;
             case 'h': // help
                 Usage();
                 exit(0);
@@ -74,51 +186,87 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (signal(SIGINT, _sig_handler) == SIG_ERR){
-        fprintf(stderr,"[Error] Can't catch SIGINT...exiting.\n");
-        exit(-1);
-    }
-
-    if (signal(SIGTERM, _sig_handler) == SIG_ERR){
-        fprintf(stderr,"[Error] Can't catch SIGTERM...exiting.\n");
+    /* signals are taken by a thread of their own, so what they trigger
+     * may take locks.  They are blocked before any other thread starts so
+     * all threads inherit the mask */
+    pthread_t sig_thd;
+    sigemptyset(&g_sigs);
+    sigaddset(&g_sigs, SIGINT);
+    sigaddset(&g_sigs, SIGTERM);
+    sigaddset(&g_sigs, SIGUSR1);
+    sigaddset(&g_sigs, SIGUSR2);
+    if (pthread_sigmask(SIG_BLOCK, &g_sigs, NULL) != 0
+        || pthread_create(&sig_thd, NULL, _sig_thread, NULL) != 0) {
+        fprintf(stderr,"[Error] Can't catch signals...exiting.\n");
         exit(-1);
     }
+    pthread_detach(sig_thd);
+    gflog_start(log_level);
 
     if ((nthreads < 1) || (nthreads>1024)) {
         nthreads = 1;
     }
-    g_nthds = nthreads;
 
     //fprintf(stderr, "[INFO] cache started\n");
 
     /* initialize stuff */
     _init_stuff();
 
+    /* publish statistics before any thread records them */
+    if (gfstats_open(stats_name) != 0) {
+        fprintf(stderr, "[ERROR] cannot publish statistics, they are kept private\n");
+    }
+    gftrace_set_slow((uint64_t) trace_slow_ms * 1000, trace_dir);
+
     /* Initializing the cache */
     simplecache_init(cachedir);
+    if (precompress) {
+        simplecache_precompress();
+    }
 
-    /* start worker threads */
-    if (dbg) fprintf(stderr, "[INFO] creating threads ... \n");
-    pthread_t thrds[nthreads];
-    for (int ithd = 0; ithd < nthreads; ithd++) {
-        int rc = pthread_create(&thrds[ithd], NULL, handler_dequeue_rqsts, (void*)&ithd);
-        if (rc) {
-            fprintf(stderr, "[ERROR] when attempting to create thread %i\n - %d", ithd, rc);
-            return 1;
-        }
+    /* start the worker pool, it grows up to nthreads while requests wait */
+    gflog_debug("creating threads ...");
+    g_pool = wrkpool_create(min_threads, nthreads, handler_handle_rqst, NULL);
+    if (g_pool == NULL) {
+        return 1;
+    }
+    wrkpool_set_targets(g_pool, grow_wait_ms, idle_retire_ms);
+    wrkpool_set_thd_init(g_pool, handler_init_thd);
+    if (g_lane_thresh > 0) {
+        wrkpool_set_lanes(g_pool, 2, lane_wts);
+    }
+    if (wrkpool_start(g_pool) != 0) {
+        return 1;
+    }
+
+    /* the main thread only receives requests, keep it within the cpu set */
+    if (g_pin) {
+        gfaff_pin_thread(pthread_self(), &g_cpus);
     }
 
     /* start handling requests via message queue*/
-    if (dbg) fprintf(stderr, "[INFO] server ready for requests\n");
+    gflog_debug("server ready for requests");
     while (1) {
 
-        /* wait for new request */
+        /* wait for new request, once shutting down the pool and queue
+         * may be gone and this thread waits for the process to exit */
         shm_context_t *rqst_ctx = shm_server_wait_for_file_request();
+        pthread_mutex_lock(&g_stop_lock);
+        if (g_stopping) {
+            pthread_mutex_unlock(&g_stop_lock);
+            free(rqst_ctx);
+            for (;;) {
+                pause();
+            }
+        }
         if (rqst_ctx == NULL) {
+            pthread_mutex_unlock(&g_stop_lock);
             fprintf(stderr, "[ERROR] something went wrong when waiting for message queue requests.\n");
+            continue;
         }
 
-        handler_enqueue_rqst(rqst_ctx);
+        wrkpool_submit_lane(g_pool, rqst_ctx, handler_classify(rqst_ctx));
+        pthread_mutex_unlock(&g_stop_lock);
     }
 
 }
@@ -126,26 +274,6 @@ int main(int argc, char **argv) {
 void _init_stuff() {
     /* Initialize global resources, ex: request queue, mutexes, condition vars, shm_channel */
 
-    int ret = 0;
-
-    ret = pthread_mutex_init(&rqst_lock, NULL);
-    if (ret) {
-        fprintf(stderr, "[ERROR] when attempting to create mutex\n");
-        exit(1);
-    }
-
-    ret = pthread_cond_init(&rqst_rdy, NULL);
-    if (ret) {
-        fprintf(stderr, "[ERROR] when attempting to create thread condition variable\n");
-        pthread_mutex_destroy(&rqst_lock);
-        exit(1);
-    }
-
-    /* setup request queue for worker threads */
-    rqst_que = (steque_t *)malloc(sizeof(steque_t));
-    bzero(rqst_que, sizeof(*rqst_que));
-    steque_init(rqst_que);
-
     /* create message queue for file transfer communication */
     if (shm_init_msg_que() != 0) {
         fprintf(stderr, "[ERROR] cannot create IPC message queue.\n");
@@ -156,7 +284,14 @@ void _init_stuff() {
 
 void _cleanup_stuff() {
 
+    if (g_pool != NULL) {
+        wrkpool_print_stats(g_pool, "simplecached worker");
+        wrkpool_destroy(g_pool);
+        g_pool = NULL;
+    }
+
     simplecache_destroy();
+    gfstats_close();
 
     /* check for any messages on the queue and if so need
      * to reply with shutting down message before
@@ -166,17 +301,29 @@ void _cleanup_stuff() {
         fprintf(stderr, "[ERROR] cannot destroy IPC message queue.\n");
         exit(1);
     }
+}
 
-    steque_destroy(rqst_que);
-    free(rqst_que);
-
-    pthread_mutex_destroy(&rqst_lock);
-    pthread_cond_destroy(&rqst_rdy);
+/* waits for the blocked signals and handles them in turn */
+void *_sig_thread(void *arg) {
+    int signo;
+    while (sigwait(&g_sigs, &signo) == 0) {
+        _handle_signal(signo);
+    }
+    return NULL;
 }
 
-void _sig_handler(int signo){
+void _handle_signal(int signo){
+    if (signo == SIGUSR1 && gftrace_dump(0) != 0) {
+        fprintf(stderr, "[ERROR] cannot write trace dump\n");
+    }
+    if (signo == SIGUSR2 && g_pool != NULL) {
+        wrkpool_print_stats(g_pool, "simplecached worker");
+    }
     if (signo == SIGINT || signo == SIGTERM){
         fprintf(stderr, "[WARN] webrpoxy received SIGINT or SIGTERM, cleaning up and closing\n");
+        pthread_mutex_lock(&g_stop_lock);
+        g_stopping = 1;
+        pthread_mutex_unlock(&g_stop_lock);
         _cleanup_stuff();
         exit(signo);
     }
@@ -186,76 +333,80 @@ void _sig_handler(int signo){
 /**************************************
  *shm_channel message queue management
  *************************************/
-//TODO: don't need a queue item for a single pointer
-typedef struct que_item {
-    shm_context_t *ctx;
-} que_item;
-
-que_item *create_que_item(shm_context_t *ctx) {
-    que_item *new_item = malloc(sizeof(que_item));
-    bzero(new_item, sizeof(*new_item));
-    new_item->ctx = ctx;
-    return new_item;
+/*
+ * Moves the calling worker onto the cpus of the node the request's segment
+ * lives on, restricted to the --cpus set when it shares cpus with the node.
+ */
+static void handler_follow_seg_node(shm_context_t *ctx, int *cur_node) {
+    int node = shm_context_get_seg_node(ctx);
+    if (node == *cur_node) {
+        return;
+    }
+    cpu_set_t node_cpus;
+    if (gfaff_node_cpus(node, &node_cpus) != 0) {
+        return;
+    }
+    if (g_pin) {
+        cpu_set_t both;
+        CPU_AND(&both, &node_cpus, &g_cpus);
+        if (CPU_COUNT(&both) > 0) {
+            node_cpus = both;
+        }
+    }
+    if (gfaff_pin_thread(pthread_self(), &node_cpus) == 0) {
+        *cur_node = node;
+    }
 }
 
-void destroy_que_item(que_item *item) {
-    free(item);
-    item = NULL;
-}
+/*
+ * Picks the lane of a request from the size of the file in the cache
+ * index, lane 1 for transfers above the threshold and lane 0 otherwise.
+ */
+int handler_classify(shm_context_t *ctx) {
 
-void handler_enqueue_rqst(shm_context_t *ctx) {
-    /* create package to add onto queue */
-    usleep(100 * (random() % g_nthds));
-    if (dbg) fprintf(stderr, "[INFO] Added request to queue\n");
-    que_item *qi = create_que_item(ctx);
-    pthread_mutex_lock(&rqst_lock);
-    steque_enqueue(rqst_que, qi);
-    pthread_cond_signal(&rqst_rdy);
-    pthread_mutex_unlock(&rqst_lock);
+    if (g_lane_thresh == 0 || shm_context_get_method(ctx) == SHM_MTHD_HEAD) {
+        return 0;
+    }
+    int fildes = simplecache_get(shm_context_get_file_path(ctx));
+    struct stat file_stat;
+    if (fildes < 0 || fstat(fildes, &file_stat) != 0) {
+        return 0;
+    }
+    size_t size = (size_t) file_stat.st_size;
+    size_t rng_off, rng_len;
+    if (shm_context_get_range(ctx, &rng_off, &rng_len)) {
+        size = (rng_off < size) ? size - rng_off : 0;
+        if (rng_len > 0 && rng_len < size) {
+            size = rng_len;
+        }
+    }
+    return (size > g_lane_thresh) ? 1 : 0;
 }
 
-void *handler_dequeue_rqsts(void *arg) {
-
-    int tid = *((int*)(arg));
-    if (dbg) fprintf(stderr, "[INFO] Thread %i is now handling request queue ...\n", tid);
-
-    /* setup thread time out for waiting */
-    struct timespec waittime;
-    struct timeval now;
-    int ret;
-
-    while (1) {
-        usleep(100 * (random() % g_nthds));
-
-        pthread_mutex_lock(&rqst_lock);
-        while (steque_isempty(rqst_que)) {
-
-            /* set absolute time to wait until */
-            gettimeofday(&now,NULL);
-            waittime.tv_sec = now.tv_sec + 1;
-            waittime.tv_nsec = 0;
-
-            ret = pthread_cond_timedwait(&rqst_rdy, &rqst_lock, &waittime);
-            if (ret == ETIMEDOUT) {
-                if (dbg) fprintf(stderr, "[INFO] Thread %i waiting timed out waiting for queued requests\n", tid);
-            }
-
-        }
-        if (dbg) fprintf(stderr, "[INFO] Thread %i dequeued request\n", tid);
-        que_item *qi = (que_item *) steque_pop(rqst_que);
-        pthread_cond_broadcast(&rqst_rdy);
-        pthread_mutex_unlock(&rqst_lock);
-
-        ssize_t byts_xfr = handle_file_request(qi->ctx);
-        if (byts_xfr != -1) {
-            if (dbg) fprintf(stderr, "[INFO] Thread %i transferred %zu bytes\n", tid, (size_t) byts_xfr);
-        } else {
-            if (dbg) fprintf(stderr, "[ERROR] Thread %i encountered error in handle_file_request\n", tid);
-        }
-        destroy_que_item(qi);
+void handler_init_thd(int ithd, void *arg) {
+    gflog_debug("Thread %i is now handling request queue ...", ithd);
+    if (g_pin) {
+        gfaff_pin_thread_cpu(pthread_self(), gfaff_cpu_at(&g_cpus, ithd));
+    }
+}
 
+void handler_handle_rqst(void *item, void *arg) {
+    shm_context_t *ctx = (shm_context_t *) item;
+    gfstats_record(GFSTAT_QUEUE, wrkpool_item_wait_us());
+    if (g_numa_follow) {
+        handler_follow_seg_node(ctx, &tls_cur_node);
+    }
+    uint64_t start_us = gfstats_now_us();
+    uint64_t trace_id = shm_context_get_trace_id(ctx);
+    ssize_t byts_xfr = handle_file_request(ctx);
+    gfstats_record_since(GFSTAT_REQUEST, start_us);
+    gftrace_finish(trace_id, start_us, (byts_xfr > 0) ? (uint64_t) byts_xfr : 0);
+    gfstats_count(GFSTAT_REQUESTS, 1);
+    if (byts_xfr != -1) {
+        gflog_debug("Thread transferred %zu bytes", (size_t) byts_xfr);
+    } else {
+        gflog_debug("Thread encountered error in handle_file_request");
     }
-    return NULL; //never gets here but for completeness
 }
 
 ssize_t handle_file_request(shm_context_t *ctx) {
@@ -267,63 +418,130 @@ ssize_t handle_file_request(shm_context_t *ctx) {
 
     if ( 0 > (fildes = simplecache_get(shm_context_get_file_path(ctx)))) {
         /* file not found */
-        fprintf(stderr, "[ERROR] server - could not get file descriptor from simplecache for file: %s\n", shm_context_get_file_path(ctx));
+        gflog_debug("server - %s is not in the cache", shm_context_get_file_path(ctx));
+        gfstats_count(GFSTAT_MISSES, 1);
+        gfstats_count(GFSTAT_NOT_FOUND, 1);
         shm_context_set_error(ctx, SHM_STAT_NOT_FOUND);
         shm_server_send_response(ctx);
         shm_context_cleanup(ctx);
         return -1;
     }
 
-    /* calculating file size and send ok */
-    file_len = lseek(fildes, 0, SEEK_END);
-    lseek(fildes, 0, SEEK_SET);
+    /* calculating file size and send ok, the descriptor is shared by all
+     * threads so the size is taken with fstat instead of seeking */
+    struct stat file_stat;
+    if (fstat(fildes, &file_stat) != 0) {
+        gflog_error("server - could not stat cached file: %s", strerror(errno));
+        shm_context_set_error(ctx, SHM_STAT_NOT_FOUND);
+        shm_server_send_response(ctx);
+        shm_context_cleanup(ctx);
+        return -1;
+    }
+    file_len = file_stat.st_size;
+    gfstats_count(GFSTAT_HITS, 1);
+
+    /* only transfer the requested range of the file, clamped to its end */
+    off_t file_off = 0;
+    size_t rng_off, rng_len;
+    if (shm_context_get_range(ctx, &rng_off, &rng_len)) {
+        if (rng_off > (size_t)file_len) {
+            gflog_debug("server - range starting at %zu is past the end of file: %s", rng_off, shm_context_get_file_path(ctx));
+            shm_context_set_error(ctx, SHM_STAT_BAD_RANGE);
+            shm_server_send_response(ctx);
+            shm_context_cleanup(ctx);
+            return -1;
+        }
+        file_off = (off_t)rng_off;
+        file_len -= file_off;
+        if (rng_len > 0 && rng_len < (size_t)file_len) {
+            file_len = (ssize_t)rng_len;
+        }
+    }
+
+    /* whole files are sent gzip compressed to clients accepting it, if
+     * the file compresses well */
+    if (shm_context_get_method(ctx) == SHM_MTHD_GET && !shm_context_get_range(ctx, NULL, NULL)
+        && (shm_context_get_accept_encoding(ctx) & SHM_ENC_GZIP)) {
+        int gz_fildes = simplecache_get_gzip(shm_context_get_file_path(ctx));
+        if (gz_fildes >= 0 && fstat(gz_fildes, &file_stat) == 0) {
+            shm_context_set_encoding(ctx, SHM_ENC_GZIP, (size_t)file_len);
+            fildes = gz_fildes;
+            file_len = file_stat.st_size;
+        }
+    }
+
     shm_context_set_error(ctx, SHM_STAT_OK);
     shm_context_set_file_size(ctx, (size_t)file_len);
     ret = shm_server_send_response(ctx);
+    gftrace_event(shm_context_get_trace_id(ctx), GFTRACE_RSPNS, (uint64_t) file_len);
     if (ret == -1) {
-        fprintf(stderr, "[ERROR] server - could not send ok response back to client\n");
+        gflog_error("server - could not send ok response back to client");
         shm_context_cleanup(ctx);
         return -1;
     }
 
+    /* head requests only need the file size, nothing to transfer */
+    if (shm_context_get_method(ctx) == SHM_MTHD_HEAD) {
+        shm_context_cleanup(ctx);
+        return 0;
+    }
+
     /* attach to shared memory segment */
     void *shm_addr = shm_attach_mem_seg(shm_context_get_seg_id(ctx));
     if (shm_addr == NULL) {
-        fprintf(stderr, "[ERROR] server - shared memory address should have existed but was not found.  Client may have closed.\n");
+        gflog_error("server - shared memory address should have existed but was not found.  Client may have closed.");
         shm_context_cleanup(ctx);
         return -1;
     }
 
-    int ret_val = 0;
+    ssize_t ret_val = 0;
 
     /* sending the file contents chunk by chunk. */
     bytes_transferred = 0;
     while (bytes_transferred < file_len) {
 
-        read_len = pread(fildes, buffer, shm_context_get_seg_tot_sz(ctx), bytes_transferred);
+        size_t read_sz = shm_context_get_seg_tot_sz(ctx);
+        if (read_sz > (size_t)(file_len - bytes_transferred)) {
+            read_sz = (size_t)(file_len - bytes_transferred);
+        }
+        read_len = pread(fildes, buffer, read_sz, file_off + bytes_transferred);
         if (read_len <= 0){
-            fprintf(stderr, "[ERROR] file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
+            gflog_error("server - file read error, %zd, %zd of %zd bytes: %s", read_len, bytes_transferred, file_len,
+                        read_len < 0 ? strerror(errno) : "unexpected end of file");
             ret_val = -1;
             break;
         }
 
         write_len = shm_write_mem_seg(shm_addr, buffer, (size_t)read_len);
         if (write_len != read_len){
-            fprintf(stderr, "[ERROR] handle_with_file write error");
+            gflog_error("server - could not write %zd bytes to the shared memory segment", read_len);
             ret_val = -1;
             break;
         }
 
         shm_context_set_seg_used_sz(ctx, (size_t)write_len);
         shm_server_send_ready(ctx);
-        shm_server_wait_for_acknowledge(ctx);
+        gftrace_event(shm_context_get_trace_id(ctx), GFTRACE_RDY, (uint64_t) write_len);
+        uint64_t ack_us = gfstats_now_us();
+        int ack = shm_server_wait_for_acknowledge(ctx);
+        gfstats_record_since(GFSTAT_ACK_WAIT, ack_us);
+        gftrace_span(shm_context_get_trace_id(ctx), GFTRACE_ACK, ack_us, (uint64_t) write_len);
+        if (ack != 0) {
+            /* client aborted or vanished, segment is no longer ours to fill */
+            gflog_error("server - transfer stopped after %zd of %zd bytes", bytes_transferred + write_len, file_len);
+            ret_val = -1;
+            break;
+        }
 
         bytes_transferred += write_len;
     }
 
     if (ret_val != -1) {
         ret_val = bytes_transferred;
+    } else {
+        gfstats_count(GFSTAT_ERRORS, 1);
     }
+    gfstats_count(GFSTAT_BYTES, (uint64_t) bytes_transferred);
     shm_detach_mem_seg(shm_addr);
     shm_context_cleanup(ctx);
 
@@ -7,6 +7,8 @@
 #include <unistd.h>
 #include <memory.h>
 
+#include "gfaffinity.h"
+#include "gflog.h"
 #include "gfserver.h"
 #include "shm_channel.h"
 
@@ -18,13 +20,70 @@
 "  -n [seg count]      Number of segments to use in communication with cache (Default: 1).\n"\
 "  -z [seg size]       The size (in bytes) of the segments (Default: 1024).\n"\
 "  -p [listen_port]    Listen port (Default: 8888)\n"                         \
-"  -t [thread_count]   Num worker threads (Default: 1, Range: 1-1000)\n"      \
+"  -t [thread_count]   Max worker threads (Default: 1, Range: 1-1000)\n"      \
 "  -s [server]         The server to connect to (Default: Udacity S3 instance)\n"\
 "  -h                  Show this help message\n"                              \
+"  --hdr-timeout [ms]  Deadline for receiving a request header (Default: 5000)\n"\
+"  --idle-timeout [ms] Deadline for progress on a connection (Default: 15000)\n"\
+"  --xfer-timeout [ms] Deadline for a whole request (Default: 600000)\n"     \
+"  --min-threads [n]   Worker threads kept when idle (Default: 1)\n"         \
+"  --grow-wait [ms]    Queue wait above which workers are added (Default: 10)\n"\
+"  --idle-retire [ms]  Idle time after which extra workers exit (Default: 30000)\n"\
+"  --lane-threshold [bytes] Requests expected above this size use the large lane, 0 disables lanes (Default: 262144)\n"\
+"  --lane-weights [s,l]     Requests served from the small and large lane per round (Default: 4,1)\n"\
+"  --small-segs [n]         Segments kept free for small lane requests (Default: seg count / 4)\n"\
+"  --client-rps [n]         New connections per second allowed per client address, 0 unlimited (Default: 0)\n"\
+"  --client-bps [bytes]     Response bytes per second allowed per client address, 0 unlimited (Default: 0)\n"\
+"  --unix-path [path]      Also listen on a unix domain socket for clients on this host (Default: none)\n"\
+"  --async [loops]          Run requests as coroutines on this many event loops instead of worker threads (Default: 0, off)\n"\
+"  --async-stack [bytes]    Stack size of each request coroutine (Default: 262144)\n"\
+"  --acceptor-cpus [list] Pin the accepting thread to cpus, e.g. 0-1 (Default: unpinned)\n"\
+"  --worker-cpus [list]   Pin worker threads round-robin to cpus, e.g. 2-7,10 (Default: unpinned)\n"\
+"  --numa                 Spread segments over NUMA nodes and prefer node local ones\n"\
+"  --nodelay [0|1]          Disable Nagle's algorithm on client connections (Default: 1)\n"\
+"  --sndbuf [bytes]         Socket send buffer size, 0 autotunes (Default: 0)\n"\
+"  --rcvbuf [bytes]         Socket receive buffer size, 0 autotunes (Default: 0)\n"\
+"  --notsent-lowat [bytes]  Unsent bytes queued per connection, 0 unlimited (Default: 2 * seg size, 16KiB-4MiB)\n"\
+"  --fastopen [qlen]        TCP Fast Open queue length, 0 disables (Default: 16)\n"\
+"  --busy-poll [us]         Busy poll the device queue on reads, 0 disables (Default: 0)\n"\
+"  --stats-name [name]      Publish statistics for gfstat under this name (Default: webproxy)\n"\
+"  --trace-slow [ms]        Dump the trace of requests slower than this, 0 disables (Default: 0)\n"\
+"  --trace-dir [dir]        Directory trace dumps are written to, SIGUSR1 dumps all (Default: .)\n"\
+"  --log-level [level]      Log error, warn, info or debug messages (Default: info)\n"\
 "special options:\n"                                                          \
 "  -d [drop_factor]    Drop connects if f*t pending requests (Default: 5).\n"
 
 
+/* long only options */
+enum {
+    OPT_HDR_TO = 256,
+    OPT_IDLE_TO,
+    OPT_XFR_TO,
+    OPT_MIN_THDS,
+    OPT_GROW_WAIT,
+    OPT_IDLE_RETIRE,
+    OPT_LANE_THRESH,
+    OPT_LANE_WTS,
+    OPT_SMALL_SEGS,
+    OPT_CLI_RPS,
+    OPT_CLI_BPS,
+    OPT_UNIX_PATH,
+    OPT_ASYNC,
+    OPT_ASYNC_STACK,
+    OPT_ACC_CPUS,
+    OPT_WRKR_CPUS,
+    OPT_NUMA,
+    OPT_SOCKOPT,
+    OPT_STATS_NAME,
+    OPT_TRACE_SLOW,
+    OPT_TRACE_DIR,
+    OPT_LOG_LEVEL
+};
+
+/* socket options given on the command line, applied over the defaults
+ * for the segment size */
+#define MAX_SOCKOPTS 16
+
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
         {"seg_count",     required_argument,      NULL,           'n'},
@@ -32,6 +91,33 @@ static struct option gLongOptions[] = {
         {"port",          required_argument,      NULL,           'p'},
         {"thread-count",  required_argument,      NULL,           't'},
         {"server",        required_argument,      NULL,           's'},
+        {"hdr-timeout",   required_argument,      NULL,           OPT_HDR_TO},
+        {"idle-timeout",  required_argument,      NULL,           OPT_IDLE_TO},
+        {"xfer-timeout",  required_argument,      NULL,           OPT_XFR_TO},
+        {"min-threads",   required_argument,      NULL,           OPT_MIN_THDS},
+        {"grow-wait",     required_argument,      NULL,           OPT_GROW_WAIT},
+        {"idle-retire",   required_argument,      NULL,           OPT_IDLE_RETIRE},
+        {"lane-threshold",required_argument,      NULL,           OPT_LANE_THRESH},
+        {"lane-weights",  required_argument,      NULL,           OPT_LANE_WTS},
+        {"small-segs",    required_argument,      NULL,           OPT_SMALL_SEGS},
+        {"client-rps",    required_argument,      NULL,           OPT_CLI_RPS},
+        {"client-bps",    required_argument,      NULL,           OPT_CLI_BPS},
+        {"unix-path",     required_argument,      NULL,           OPT_UNIX_PATH},
+        {"async",         required_argument,      NULL,           OPT_ASYNC},
+        {"async-stack",   required_argument,      NULL,           OPT_ASYNC_STACK},
+        {"acceptor-cpus", required_argument,      NULL,           OPT_ACC_CPUS},
+        {"worker-cpus",   required_argument,      NULL,           OPT_WRKR_CPUS},
+        {"numa",          no_argument,            NULL,           OPT_NUMA},
+        {"nodelay",       required_argument,      NULL,           OPT_SOCKOPT},
+        {"sndbuf",        required_argument,      NULL,           OPT_SOCKOPT},
+        {"rcvbuf",        required_argument,      NULL,           OPT_SOCKOPT},
+        {"notsent-lowat", required_argument,      NULL,           OPT_SOCKOPT},
+        {"fastopen",      required_argument,      NULL,           OPT_SOCKOPT},
+        {"busy-poll",     required_argument,      NULL,           OPT_SOCKOPT},
+        {"stats-name",    required_argument,      NULL,           OPT_STATS_NAME},
+        {"trace-slow",    required_argument,      NULL,           OPT_TRACE_SLOW},
+        {"trace-dir",     required_argument,      NULL,           OPT_TRACE_DIR},
+        {"log-level",     required_argument,      NULL,           OPT_LOG_LEVEL},
         {"help",          no_argument,            NULL,           'h'},
         {NULL,            0,                      NULL,             0}
 };
@@ -40,20 +126,26 @@ static struct option gLongOptions[] = {
 
 extern ssize_t handle_request(gfcontext_t *ctx, char *path, void* arg);
 extern void handler_enq_mem_seg(int *mem_seg_id);
+extern void handler_set_lanes(size_t threshold, int small_rsrv);
+extern int handler_classify(gfcontext_t *ctx, char *path, void *arg);
+extern int handler_shm_yield(unsigned int nwaits);
 extern steque_t *mem_seg_que;
 
 steque_t *mem_seg_que;
+int mem_seg_nnodes = 1;
 pthread_mutex_t mem_seg_lock;
 pthread_cond_t mem_seg_rdy;
 
 static gfserver_t gfs;
 static int *_mem_seg_ids;
 static size_t _n_mem_segs;
+static sigset_t g_sigs;             //signals handled by the signal thread
 
 /* forward declarations */
-static void _init_stuff(unsigned short num_segs, size_t seg_size);
+static void _init_stuff(unsigned short num_segs, size_t seg_size, int numa);
 static void _cleanup_stuff();
-static void _sig_handler(int signo);
+static void _handle_signal(int signo);
+static void *_sig_thread(void *arg);
 
 
 void Usage() {
@@ -67,9 +159,34 @@ int main(int argc, char **argv) {
     unsigned short port = 8888;
     unsigned short nworkerthreads = 1;
     char *server = "s3.amazonaws.com/content.udacity-data.com";
+    unsigned int hdr_to_ms = 5000;
+    unsigned int idle_to_ms = 15000;
+    unsigned int xfr_to_ms = 600000;
+    unsigned short min_threads = 1;
+    unsigned int grow_wait_ms = WRKPOOL_WAIT_TARGET_MS;
+    unsigned int idle_retire_ms = WRKPOOL_IDLE_TO_MS;
+    size_t lane_thresh = 262144;
+    unsigned int lane_wts[2] = {4, 1};
+    int small_segs = -1;
+    unsigned int cli_rps = 0;
+    size_t cli_bps = 0;
+    int nloops = 0;
+    char *unix_path = NULL;
+    size_t stack_sz = GFASYNC_STACK_SZ;
+    char *acc_cpus = NULL;
+    char *wrkr_cpus = NULL;
+    int numa = 0;
+    const char *sockopt_names[MAX_SOCKOPTS];
+    long sockopt_vals[MAX_SOCKOPTS];
+    int nsockopts = 0;
+    char *stats_name = "webproxy";
+    unsigned int trace_slow_ms = 0;
+    char *trace_dir = ".";
+    int log_level = GFLOG_INFO;
+    int long_idx = 0;
 
     /* Parse and set command line arguments */
-    while ((option_char = getopt_long(argc, argv, "n:z:p:t:s:h", gLongOptions, NULL)) != -1) {
+    while ((option_char = getopt_long(argc, argv, "n:z:p:t:s:h", gLongOptions, &long_idx)) != -1) {
         switch (option_char) {
             case 'n': // listen-port
                 seg_count = atoi(optarg);
@@ -86,6 +203,83 @@ int main(int argc, char **argv) {
             case 's': // server address
                 server = optarg;
                 break;
+            case OPT_HDR_TO:
+                hdr_to_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_IDLE_TO:
+                idle_to_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_XFR_TO:
+                xfr_to_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_MIN_THDS:
+                min_threads = atoi(optarg);
+                break;
+            case OPT_GROW_WAIT:
+                grow_wait_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_IDLE_RETIRE:
+                idle_retire_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_LANE_THRESH:
+                lane_thresh = (size_t) atol(optarg);
+                break;
+            case OPT_LANE_WTS:
+                if (sscanf(optarg, "%u,%u", &lane_wts[0], &lane_wts[1]) != 2) {
+                    fprintf(stderr, "[Error] lane weights must be given as small,large\n");
+                    exit(1);
+                }
+                break;
+            case OPT_SMALL_SEGS:
+                small_segs = atoi(optarg);
+                break;
+            case OPT_CLI_RPS:
+                cli_rps = (unsigned int) atoi(optarg);
+                break;
+            case OPT_CLI_BPS:
+                cli_bps = (size_t) atol(optarg);
+                break;
+            case OPT_UNIX_PATH:
+                unix_path = optarg;
+                break;
+            case OPT_ASYNC:
+                nloops = atoi(optarg);
+                break;
+            case OPT_ASYNC_STACK:
+                stack_sz = (size_t) atol(optarg);
+                break;
+            case OPT_ACC_CPUS:
+                acc_cpus = optarg;
+                break;
+            case OPT_WRKR_CPUS:
+                wrkr_cpus = optarg;
+                break;
+            case OPT_NUMA:
+                numa = 1;
+                break;
+            case OPT_SOCKOPT:
+                if (nsockopts == MAX_SOCKOPTS) {
+                    fprintf(stderr, "[Error] too many socket options\n");
+                    exit(1);
+                }
+                sockopt_names[nsockopts] = gLongOptions[long_idx].name;
+                sockopt_vals[nsockopts++] = atol(optarg);
+                break;
+            case OPT_STATS_NAME:
+                stats_name = optarg;
+                break;
+            case OPT_TRACE_SLOW:
+                trace_slow_ms = (unsigned int) atoi(optarg);
+                break;
+            case OPT_TRACE_DIR:
+                trace_dir = optarg;
+                break;
+            case OPT_LOG_LEVEL:
+                if ((log_level = gflog_parse_level(optarg)) < 0) {
+                    fprintf(stderr, "[Error] log level must be error, warn, info or debug\n");
+                    exit(1);
+                }
+                break;
             case 'h': // help
                 Usage();
                 exit(0);
@@ -101,15 +295,21 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (signal(SIGINT, _sig_handler) == SIG_ERR) {
-        fprintf(stderr, "[Error] Can't catch SIGINT...exiting.\n");
-        exit(1);
-    }
-
-    if (signal(SIGTERM, _sig_handler) == SIG_ERR) {
-        fprintf(stderr, "[Error] Can't catch SIGTERM...exiting.\n");
+    /* signals are taken by a thread of their own, so what they trigger
+     * may take locks.  They are blocked before any other thread starts so
+     * all threads inherit the mask */
+    pthread_t sig_thd;
+    sigemptyset(&g_sigs);
+    sigaddset(&g_sigs, SIGINT);
+    sigaddset(&g_sigs, SIGTERM);
+    sigaddset(&g_sigs, SIGUSR1);
+    sigaddset(&g_sigs, SIGUSR2);
+    if (pthread_sigmask(SIG_BLOCK, &g_sigs, NULL) != 0
+        || pthread_create(&sig_thd, NULL, _sig_thread, NULL) != 0) {
+        fprintf(stderr, "[Error] Can't catch signals...exiting.\n");
         exit(1);
     }
+    pthread_detach(sig_thd);
 
     if (!server) {
         fprintf(stderr, "[Error] Invalid (null) server name\n");
@@ -117,15 +317,58 @@ int main(int argc, char **argv) {
     }
 
     //fprintf(stderr, "[INFO] proxy started\n");
+    gflog_start(log_level);
 
-    _init_stuff(seg_count, seg_size);
+    /* publish statistics before any thread records them */
+    if (gfstats_open(stats_name) != 0) {
+        fprintf(stderr, "[ERROR] cannot publish statistics, they are kept private\n");
+    }
+    gftrace_set_slow((uint64_t) trace_slow_ms * 1000, trace_dir);
 
     /* initializing server */
     gfserver_init(&gfs, nworkerthreads);
+    if (gfserver_set_cpus(&gfs, acc_cpus, wrkr_cpus) != 0) {
+        exit(1);
+    }
+
+    _init_stuff(seg_count, seg_size, numa);
 
     /* setting options */
     gfserver_set_port(&gfs, port);
     gfserver_set_maxpending(&gfs, 10);
+    gfserver_set_unix_path(&gfs, unix_path);
+    gfserver_set_timeouts(&gfs, hdr_to_ms, idle_to_ms, xfr_to_ms);
+    gfserver_set_pool(&gfs, min_threads, grow_wait_ms, idle_retire_ms);
+    gfserver_set_client_limits(&gfs, cli_rps, cli_bps);
+
+    /* responses go out a segment at a time, so the unsent data limit
+     * follows the segment size */
+    gfsock_opts_t sock_opts;
+    gfsock_opts_default(&sock_opts, seg_size);
+    for (int i = 0; i < nsockopts; i++) {
+        gfsock_opts_set(&sock_opts, sockopt_names[i], sockopt_vals[i]);
+    }
+    gfserver_set_sockopts(&gfs, &sock_opts);
+
+    /* coroutines wait for the cache by polling the message queue, worker
+     * threads keep blocking in it */
+    if (nloops > 0) {
+        gfserver_set_async(&gfs, nloops, stack_sz);
+        shm_set_yield_func(handler_shm_yield);
+    }
+
+    /* small and large lanes keyed on recently seen file sizes, large
+     * requests never take the last segments so small ones keep flowing */
+    if (lane_thresh > 0) {
+        if (small_segs < 0) {
+            small_segs = seg_count / 4;
+        }
+        if (small_segs >= seg_count) {
+            small_segs = seg_count - 1;
+        }
+        handler_set_lanes(lane_thresh, small_segs);
+        gfserver_set_lanes(&gfs, 2, lane_wts, handler_classify);
+    }
 
     /* set handler callback and custom argument */
     gfserver_set_handler(&gfs, handle_request);
@@ -135,7 +378,7 @@ int main(int argc, char **argv) {
     gfserver_serve(&gfs);
 }
 
-void _init_stuff(unsigned short num_segs, size_t seg_size) {
+void _init_stuff(unsigned short num_segs, size_t seg_size, int numa) {
     /* Initialize global resources, ex: request queue, mutexes, condition vars,
      *  shm_channel */
 
@@ -162,15 +405,28 @@ void _init_stuff(unsigned short num_segs, size_t seg_size) {
         exit(1);
     }
 
-    /* setup memory segment queue to control mem seg usage by threads */
-    mem_seg_que = (steque_t *)malloc(sizeof(steque_t));
-    bzero(mem_seg_que, sizeof(*mem_seg_que));
-    steque_init(mem_seg_que);
+    /* place segments on the NUMA nodes, one queue per node lets workers
+     * pick segments close to the cpu they run on */
+    if (numa) {
+        mem_seg_nnodes = gfaff_num_nodes();
+        if (shm_place_mem_segs(mem_seg_nnodes) != 0) {
+            fprintf(stderr, "[ERROR] problem placing shared memory segments on NUMA nodes.\n");
+            shm_destroy_mem_segs();
+            pthread_mutex_destroy(&mem_seg_lock);
+            pthread_cond_destroy(&mem_seg_rdy);
+            exit(1);
+        }
+    }
+
+    /* setup memory segment queues to control mem seg usage by threads */
+    mem_seg_que = (steque_t *)calloc((size_t)mem_seg_nnodes, sizeof(steque_t));
+    for (int i = 0; i < mem_seg_nnodes; i++) {
+        steque_init(&mem_seg_que[i]);
+    }
 
     /* add shm initialized memory segments into
      * webproxy's mem seg queue */
     _mem_seg_ids = shm_get_mem_seg_ids(&_n_mem_segs);
-    steque_init(mem_seg_que);
     for (int i = 0; i < _n_mem_segs; i++) {
         handler_enq_mem_seg((_mem_seg_ids+i));
     }
@@ -191,7 +447,10 @@ void _cleanup_stuff() {
         exit(1);
     }
 
-    steque_destroy(mem_seg_que);
+    for (int i = 0; i < mem_seg_nnodes; i++) {
+        steque_destroy(&mem_seg_que[i]);
+    }
+    free(mem_seg_que);
     free(_mem_seg_ids);
     _n_mem_segs = 0;
 
@@ -200,11 +459,28 @@ void _cleanup_stuff() {
 
 }
 
-void _sig_handler(int signo){
+/* waits for the blocked signals and handles them in turn */
+void *_sig_thread(void *arg) {
+    int signo;
+    while (sigwait(&g_sigs, &signo) == 0) {
+        _handle_signal(signo);
+    }
+    return NULL;
+}
+
+void _handle_signal(int signo){
+    if (signo == SIGUSR1 && gftrace_dump(0) != 0) {
+        fprintf(stderr, "[ERROR] cannot write trace dump\n");
+    }
+    if (signo == SIGUSR2) {
+        gfserver_print_stats(&gfs);
+    }
     if (signo == SIGINT || signo == SIGTERM){
         fprintf(stderr, "[WARN] webrpoxy received SIGINT or SIGTERM, cleaning up and closing\n");
+        gfserver_print_stats(&gfs);
         gfserver_stop(&gfs);
         _cleanup_stuff();
+        gfstats_close();
         exit(signo);
     }
 }
@@ -1,53 +1,287 @@
+#include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "workload.h"
 
-static char *gWorkloadPathArray[100];
-static unsigned short int gUniqueWorkloadPaths = 0;
+/* the paths are NUL terminated one after another in an arena, indexed
+ * by gWorkloadPaths.  gWorkloadVals holds the weight of each path or for
+ * a trace its seconds after the first request */
+static char *gWorkloadArena = NULL;
+static char **gWorkloadPaths = NULL;
+static double *gWorkloadVals = NULL;
+static size_t gNumWorkloadPaths = 0;
+static int gIsTrace = 0;
 
-static pthread_mutex_t counter_mutex;
-static int counter = 0;
+static uint64_t counter = 0;
 static int mode = WORKLOAD_SEQ;
 
-int workload_init(char *workload_path) {
-  int i = 0;
-  char temp_buf[256];
+static double gZipfAlpha = 1.0;
+static double *gWorkloadCdf = NULL;   /* cumulative popularity of zipf and weighted modes */
+static double gTraceScale = 1.0;
+static double gTraceRound = 0;        /* seconds between two replays of a trace */
+
+static unsigned long gSeed = 1;
+static unsigned short gRng[3];
+static int gRngSeeded = 0;
+
+/* splits the next blank separated token off the line [*pos, end) */
+static const char *next_token(const char **pos, const char *end, size_t *len) {
+  const char *tok = *pos;
+  while (tok < end && isspace((unsigned char) *tok))
+    tok++;
+  const char *tok_end = tok;
+  while (tok_end < end && !isspace((unsigned char) *tok_end))
+    tok_end++;
+  *pos = tok_end;
+  *len = (size_t)(tok_end - tok);
+  return tok;
+}
+
+/* parses a token holding a number, which must be all of it */
+static int parse_number(const char *tok, size_t len, double *val) {
+  char num[64];
+  char *num_end;
+  if (len == 0 || len >= sizeof(num))
+    return -1;
+  memcpy(num, tok, len);
+  num[len] = '\0';
+  *val = strtod(num, &num_end);
+  return (*num_end == '\0') ? 0 : -1;
+}
 
-  FILE *file_handle;
+/*
+ * Parses the line [line, end) into entry n.  Returns 0 for blank and
+ * comment lines, 1 for an entry and -1 if it is malformed.
+ */
+static int parse_entry(const char *line, const char *end, size_t n, char **arena, int *timed) {
+  size_t len1, len2, len3;
+  const char *pos = line;
+  const char *tok1 = next_token(&pos, end, &len1);
+  const char *tok2 = next_token(&pos, end, &len2);
+  next_token(&pos, end, &len3);
+  if (len1 == 0 || tok1[0] == '#')
+    return 0;
+  if (len3 != 0)
+    return -1;
 
-  file_handle = fopen(workload_path, "r");
-  if (file_handle == NULL) {
-    fprintf(stderr, "cannot open workload file %s", workload_path);
+  /* a trace line is a time and a path, anything else a path with an
+   * optional weight, so paths need not start with a slash */
+  const char *path = tok1;
+  size_t path_len = len1;
+  double val;
+  *timed = (len2 != 0 && parse_number(tok1, len1, &gWorkloadVals[n]) == 0
+            && parse_number(tok2, len2, &val) != 0);
+  if (!*timed) {
+    gWorkloadVals[n] = 1.0;
+    if (len2 != 0 && (parse_number(tok2, len2, &gWorkloadVals[n]) != 0 || gWorkloadVals[n] < 0))
+      return -1;
+  } else {
+    path = tok2;
+    path_len = len2;
+  }
+
+  memcpy(*arena, path, path_len);
+  (*arena)[path_len] = '\0';
+  gWorkloadPaths[n] = *arena;
+  *arena += path_len + 1;
+  return 1;
+}
+
+int workload_init(char *workload_path) {
+  size_t nalloc = 0, ntimed = 0, nline = 0;
+  int fd;
+  struct stat st;
+
+  fd = open(workload_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "cannot open workload file %s\n", workload_path);
+    if (fd >= 0)
+      close(fd);
     return EXIT_FAILURE;
   }
 
-  while (fscanf(file_handle, "%s", temp_buf) != EOF)
-    gWorkloadPathArray[i++] = strdup(temp_buf);
+  /* the file is read through a mapping, its paths copied to the arena,
+   * which no path can outgrow as each is shorter than its line */
+  size_t size = (size_t) st.st_size;
+  const char *data = NULL;
+  if (size > 0) {
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "cannot map workload file %s\n", workload_path);
+      close(fd);
+      return EXIT_FAILURE;
+    }
+    madvise((void *) data, size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  gWorkloadArena = malloc(size + 1);
+  char *arena = gWorkloadArena;
 
-  gUniqueWorkloadPaths = i;
+  int ret = EXIT_SUCCESS;
+  const char *line = data;
+  const char *data_end = data + size;
+  while (line < data_end) {
+    const char *end = memchr(line, '\n', (size_t)(data_end - line));
+    if (end == NULL)
+      end = data_end;
+    nline++;
+    if (gNumWorkloadPaths == nalloc) {
+      nalloc = (nalloc == 0) ? 1024 : nalloc * 2;
+      gWorkloadPaths = realloc(gWorkloadPaths, nalloc * sizeof(char *));
+      gWorkloadVals = realloc(gWorkloadVals, nalloc * sizeof(double));
+    }
 
-  pthread_mutex_init(&counter_mutex, NULL);
+    int timed;
+    size_t n = gNumWorkloadPaths;
+    int rc = parse_entry(line, end, n, &arena, &timed);
+    line = end + 1;
+    if (rc < 0) {
+      fprintf(stderr, "malformed line %zu in workload file %s\n", nline, workload_path);
+      ret = EXIT_FAILURE;
+      break;
+    }
+    if (rc == 0)
+      continue;
+    if (timed && ntimed > 0 && gWorkloadVals[n] < gWorkloadVals[n - 1]) {
+      fprintf(stderr, "trace times go backwards on line %zu of workload file %s\n", nline, workload_path);
+      ret = EXIT_FAILURE;
+      break;
+    }
+    ntimed += timed;
+    gNumWorkloadPaths++;
+  }
+  if (data != NULL)
+    munmap((void *) data, size);
+  if (ret != EXIT_SUCCESS)
+    return ret;
+
+  if (gNumWorkloadPaths == 0 || (ntimed > 0 && ntimed != gNumWorkloadPaths)) {
+    fprintf(stderr, "workload file %s is empty or mixes trace and path lines\n", workload_path);
+    return EXIT_FAILURE;
+  }
 
-  fclose(file_handle);
+  /* trace times count from its first request, a replay starts over one
+   * average gap after the last */
+  if (ntimed > 0) {
+    gIsTrace = 1;
+    double first = gWorkloadVals[0];
+    for (size_t i = 0; i < gNumWorkloadPaths; i++)
+      gWorkloadVals[i] -= first;
+    gTraceRound = gWorkloadVals[gNumWorkloadPaths - 1];
+    if (gNumWorkloadPaths > 1)
+      gTraceRound += gTraceRound / (double)(gNumWorkloadPaths - 1);
+  }
 
   return EXIT_SUCCESS;
 }
 
-unsigned short int workload_num_unique_paths(){
-  return gUniqueWorkloadPaths;
+int workload_set_mode(int new_mode) {
+  if (new_mode == WORKLOAD_TRACE && !gIsTrace)
+    return -1;
+
+  /* zipf and weighted paths are picked by searching their cumulative
+   * popularity for a uniform random number */
+  if (new_mode == WORKLOAD_ZIPF || new_mode == WORKLOAD_WEIGHTED) {
+    double *cdf = malloc(gNumWorkloadPaths * sizeof(double));
+    double tot = 0;
+    for (size_t i = 0; i < gNumWorkloadPaths; i++) {
+      if (new_mode == WORKLOAD_ZIPF)
+        tot += 1.0 / pow((double)(i + 1), gZipfAlpha);
+      else
+        tot += gWorkloadVals[i];
+      cdf[i] = tot;
+    }
+    if (tot <= 0) {
+      free(cdf);
+      return -1;
+    }
+    for (size_t i = 0; i < gNumWorkloadPaths; i++)
+      cdf[i] /= tot;
+    free(gWorkloadCdf);
+    gWorkloadCdf = cdf;
+  }
+
+  mode = new_mode;
+  return 0;
+}
+
+void workload_set_zipf_alpha(double alpha) {
+  gZipfAlpha = alpha;
+}
+
+void workload_set_trace_scale(double scale) {
+  gTraceScale = scale;
+}
+
+void workload_set_seed(unsigned long seed) {
+  gSeed = seed;
+  gRngSeeded = 0;
+}
+
+static void workload_seed() {
+  /* mix the seed so neighbouring seeds give unrelated streams */
+  uint64_t x = (uint64_t) gSeed + 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  gRng[0] = (unsigned short) x;
+  gRng[1] = (unsigned short)(x >> 16);
+  gRng[2] = (unsigned short)(x >> 32);
+  gRngSeeded = 1;
+}
+
+static double workload_rand() {
+  if (!gRngSeeded)
+    workload_seed();
+  return erand48(gRng);
+}
+
+size_t workload_num_unique_paths(){
+  return gNumWorkloadPaths;
 }
 
 char* workload_get_path(){
+  return workload_get_timed_path(NULL);
+}
+
+char* workload_get_timed_path(double *at){
+  if (at != NULL)
+    *at = -1;
+
   if(mode == WORKLOAD_RND)
-    return gWorkloadPathArray[(int)(1.0 * gUniqueWorkloadPaths * rand()/(RAND_MAX+1.0))];
+    return gWorkloadPaths[(size_t)((double) gNumWorkloadPaths * workload_rand())];
 
-  pthread_mutex_lock(&counter_mutex);
-  counter++;
-  pthread_mutex_unlock(&counter_mutex);
+  if (mode == WORKLOAD_ZIPF || mode == WORKLOAD_WEIGHTED) {
+    double u = workload_rand();
+    size_t lo = 0, hi = gNumWorkloadPaths - 1;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (gWorkloadCdf[mid] > u)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    return gWorkloadPaths[lo];
+  }
+
+  uint64_t seq = __sync_fetch_and_add(&counter, 1);
 
-  return gWorkloadPathArray[counter % gUniqueWorkloadPaths];
+  if (mode == WORKLOAD_TRACE) {
+    uint64_t round = seq / gNumWorkloadPaths;
+    size_t i = (size_t)(seq % gNumWorkloadPaths);
+    if (at != NULL)
+      *at = (gWorkloadVals[i] + (double) round * gTraceRound) * gTraceScale;
+    return gWorkloadPaths[i];
+  }
 
-}
\ No newline at end of file
+  return gWorkloadPaths[(seq + 1) % gNumWorkloadPaths];
+
+}
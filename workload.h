@@ -1,12 +1,22 @@
 #ifndef __WORKLOAD_H__
 #define __WORKLOAD_H__
 
+#include <stddef.h>
+
 #define WORKLOAD_SEQ 0
 #define WORKLOAD_RND 1
+#define WORKLOAD_ZIPF 2
+#define WORKLOAD_WEIGHTED 3
+#define WORKLOAD_TRACE 4
 
-/* 
+/*
  * Opens the file associated with the input argument
- * and reads in a list of paths to request. 
+ * and reads in a list of paths to request, of any length
+ * and number.  Each line holds a path optionally followed
+ * by its weight, or for a trace the time in seconds the
+ * path was requested followed by the path.  A line is taken
+ * for a trace line when its first field is a number and the
+ * second is not.  Lines starting with # are skipped.
  */
 int workload_init(char *workload_path);
 
@@ -14,13 +24,38 @@ int workload_init(char *workload_path);
  * Sets the mode.  If WORKLOAD_SEQ, then workload getpath will
  * return the paths in sequence.  If WORKLOAD_RND, then
  * the paths will be chosen uniformly at random with replacement.
+ * WORKLOAD_ZIPF chooses them with Zipf popularity, the first
+ * path of the file being the most popular, and WORKLOAD_WEIGHTED
+ * in proportion to their weights.  WORKLOAD_TRACE returns the
+ * paths of a trace in sequence along with their times.  Returns
+ * -1 if the workload does not fit the mode.
  */
 int workload_set_mode(int mode);
 
 /*
- * Returns the number of unique paths in the workload
+ * Sets the exponent of Zipf popularity, used by the next
+ * workload_set_mode(WORKLOAD_ZIPF) (Default: 1.0).
+ */
+void workload_set_zipf_alpha(double alpha);
+
+/*
+ * Scales the times of a trace, 0.5 replays it twice as fast
+ * (Default: 1.0).
+ */
+void workload_set_trace_scale(double scale);
+
+/*
+ * Seeds the random number generator paths are picked with, so
+ * runs with the same seed choose the same paths (Default: 1).
+ * There is one generator, paths are meant to be picked from
+ * one thread.
+ */
+void workload_set_seed(unsigned long seed);
+
+/*
+ * Returns the number of paths in the workload
  */
-unsigned short int workload_num_unique_paths();
+size_t workload_num_unique_paths();
 
 /*
  * Returns a path from the workload.  Whether this is
@@ -29,4 +64,12 @@ unsigned short int workload_num_unique_paths();
  */
 char* workload_get_path();
 
-#endif
\ No newline at end of file
+/*
+ * Returns a path from the workload like workload_get_path and
+ * sets at to the scaled seconds after the start of the trace
+ * it is due, or to -1 unless replaying a trace.  A trace that
+ * runs out starts over after its last request.
+ */
+char* workload_get_timed_path(double *at);
+
+#endif
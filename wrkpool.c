@@ -0,0 +1,565 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "gflog.h"
+#include "steque.h"
+#include "wrkpool.h"
+
+#define FLOW_BUCKETS 1024
+
+
+static __thread uint64_t tls_wait_us = 0;   //queue wait of the item the worker is handling
+
+
+/*------------*/
+/* structures */
+
+typedef struct _wrkpool_item_t {
+    void *item;                   //caller's work item
+    uint64_t enq_us;              //monotonic time the item was queued
+    unsigned int cost;            //deficit round-robin cost of the item
+} wrkpool_item_t;
+
+/* queue of the items of one flow (e.g. client) on one lane, flows only
+ * exist while they have items queued */
+typedef struct _wrkpool_flow_t {
+    uint32_t key;
+    int lane;
+    steque_t que;                 //queued wrkpool_item_t
+    long deficit;                 //cost the flow may still dequeue this round
+    struct _wrkpool_flow_t *next; //next flow in hash bucket
+} wrkpool_flow_t;
+
+typedef struct _wrkpool_lane_t {
+    steque_t flows;               //flows with queued items in round-robin order
+    size_t nqueued;               //items queued over all flows of the lane
+    unsigned int weight;          //items taken from the lane per round
+    unsigned int credit;          //items left to take in the current round
+    wrkpool_lane_stats_t stats;
+    uint64_t wait_tot_us;
+} wrkpool_lane_t;
+
+struct _wrkpool_t {
+    wrkpool_func_t func;          //handles work items
+    void *arg;                    //argument to func and thd_init
+    wrkpool_thd_init_t thd_init;  //optional per thread setup
+    int min_thds;
+    int max_thds;
+    unsigned int wait_target_ms;  //queue wait above which the pool grows
+    unsigned int idle_to_ms;      //idle time after which extra threads retire
+    wrkpool_lane_t lanes[WRKPOOL_MAX_LANES];
+    int nlanes;
+    int cur_lane;                 //lane being served in the weighted round-robin
+    size_t nqueued;               //items queued over all lanes
+    unsigned int quantum;         //cost credited to a flow per round
+    wrkpool_flow_t *flow_tbl[FLOW_BUCKETS];
+    char *slots;                  //non-zero for thread slots in use
+    int nthds;
+    int nidle;                    //threads not handling an item, including starting ones
+    int running;                  //cleared by wrkpool_destroy
+    int destroyed;                //set once wrkpool_destroy no longer touches the pool
+    pthread_t mon_thd;            //grows the pool when queue wait exceeds the target
+    pthread_mutex_t lock;
+    pthread_cond_t work_rdy;      //signalled when items are queued
+    pthread_cond_t mon_cv;        //wakes the monitor
+    wrkpool_stats_t stats;
+    uint64_t wait_tot_us;
+};
+
+typedef struct _wrkpool_thd_arg_t {
+    wrkpool_t *pool;
+    int ithd;
+} wrkpool_thd_arg_t;
+
+
+/*************************/
+/* function declarations */
+
+static uint64_t wrkpool_now_us();
+static void wrkpool_abstime(struct timespec *ts, uint64_t at_us);
+static int wrkpool_spawn(wrkpool_t *pool);
+static void *wrkpool_worker(void *arg);
+static void *wrkpool_monitor(void *arg);
+static void wrkpool_free(wrkpool_t *pool);
+static wrkpool_item_t *wrkpool_pop(wrkpool_t *pool, int *lane);
+static wrkpool_item_t *wrkpool_oldest(wrkpool_t *pool);
+static wrkpool_flow_t *wrkpool_get_flow(wrkpool_t *pool, int lane, uint32_t key);
+static void wrkpool_drop_flow(wrkpool_t *pool, wrkpool_flow_t *flow);
+
+
+/*****************/
+/* API functions */
+
+wrkpool_t *wrkpool_create(int min_thds, int max_thds, wrkpool_func_t func, void *arg) {
+
+    if (max_thds < 1) {
+        max_thds = 1;
+    }
+    if (min_thds < 1) {
+        min_thds = 1;
+    }
+    if (min_thds > max_thds) {
+        min_thds = max_thds;
+    }
+
+    wrkpool_t *pool = malloc(sizeof(wrkpool_t));
+    bzero(pool, sizeof(*pool));
+    pool->func = func;
+    pool->arg = arg;
+    pool->min_thds = min_thds;
+    pool->max_thds = max_thds;
+    pool->wait_target_ms = WRKPOOL_WAIT_TARGET_MS;
+    pool->idle_to_ms = WRKPOOL_IDLE_TO_MS;
+    pool->slots = calloc((size_t)max_thds, sizeof(char));
+    pool->nlanes = 1;
+    pool->quantum = 1;
+    for (int i = 0; i < WRKPOOL_MAX_LANES; i++) {
+        steque_init(&pool->lanes[i].flows);
+        pool->lanes[i].weight = 1;
+        pool->lanes[i].credit = 1;
+    }
+
+    /* waits are measured against the monotonic clock */
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&pool->lock, NULL) != 0
+            || pthread_cond_init(&pool->work_rdy, &cattr) != 0
+            || pthread_cond_init(&pool->mon_cv, &cattr) != 0) {
+        gflog_error("when attempting to create worker pool locks");
+        pthread_condattr_destroy(&cattr);
+        free(pool->slots);
+        free(pool);
+        return NULL;
+    }
+    pthread_condattr_destroy(&cattr);
+    return pool;
+}
+
+void wrkpool_set_targets(wrkpool_t *pool, unsigned int wait_target_ms, unsigned int idle_to_ms) {
+    pool->wait_target_ms = wait_target_ms;
+    pool->idle_to_ms = idle_to_ms;
+}
+
+int wrkpool_set_lanes(wrkpool_t *pool, int nlanes, const unsigned int *weights) {
+    if (nlanes < 1 || nlanes > WRKPOOL_MAX_LANES) {
+        return -1;
+    }
+    pool->nlanes = nlanes;
+    for (int i = 0; i < nlanes; i++) {
+        pool->lanes[i].weight = (weights != NULL && weights[i] > 0) ? weights[i] : 1;
+        pool->lanes[i].credit = pool->lanes[i].weight;
+    }
+    return 0;
+}
+
+void wrkpool_set_quantum(wrkpool_t *pool, unsigned int quantum) {
+    pool->quantum = (quantum > 0) ? quantum : 1;
+}
+
+void wrkpool_set_thd_init(wrkpool_t *pool, wrkpool_thd_init_t init) {
+    pool->thd_init = init;
+}
+
+int wrkpool_start(wrkpool_t *pool) {
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = 1;
+    for (int i = 0; i < pool->min_thds; i++) {
+        if (wrkpool_spawn(pool) != 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    int rc = pthread_create(&pool->mon_thd, NULL, wrkpool_monitor, pool);
+    if (rc) {
+        gflog_error("when attempting to create worker pool monitor thread - %d", rc);
+        return -1;
+    }
+    return 0;
+}
+
+void wrkpool_submit(wrkpool_t *pool, void *item) {
+    wrkpool_submit_lane(pool, item, 0);
+}
+
+void wrkpool_submit_lane(wrkpool_t *pool, void *item, int lane) {
+    wrkpool_submit_flow(pool, item, lane, 0, 1);
+}
+
+void wrkpool_submit_flow(wrkpool_t *pool, void *item, int lane, uint32_t flow, unsigned int cost) {
+
+    wrkpool_item_t *qi = malloc(sizeof(wrkpool_item_t));
+    qi->item = item;
+    qi->enq_us = wrkpool_now_us();
+    qi->cost = cost;
+
+    pthread_mutex_lock(&pool->lock);
+    if (lane < 0 || lane >= pool->nlanes) {
+        lane = pool->nlanes - 1;
+    }
+    wrkpool_flow_t *f = wrkpool_get_flow(pool, lane, flow);
+    steque_enqueue(&f->que, qi);
+    pool->lanes[lane].nqueued++;
+    pool->nqueued++;
+    if (pool->nidle > 0) {
+        pthread_cond_signal(&pool->work_rdy);
+    } else {
+        /* every worker is busy, let the monitor time the wait */
+        pthread_cond_signal(&pool->mon_cv);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+uint64_t wrkpool_item_wait_us() {
+    return tls_wait_us;
+}
+
+void wrkpool_get_stats(wrkpool_t *pool, wrkpool_stats_t *stats) {
+    pthread_mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    stats->nthds = pool->nthds;
+    stats->nidle = pool->nidle;
+    stats->qlen = pool->nqueued;
+    stats->wait_avg_us = (pool->stats.nitems > 0) ? pool->wait_tot_us / pool->stats.nitems : 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int wrkpool_get_lane_stats(wrkpool_t *pool, int lane, wrkpool_lane_stats_t *stats) {
+    pthread_mutex_lock(&pool->lock);
+    if (lane < 0 || lane >= pool->nlanes) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    wrkpool_lane_t *l = &pool->lanes[lane];
+    *stats = l->stats;
+    stats->qlen = l->nqueued;
+    stats->nflows = (size_t) steque_size(&l->flows);
+    stats->wait_avg_us = (l->stats.nitems > 0) ? l->wait_tot_us / l->stats.nitems : 0;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+void wrkpool_print_stats(wrkpool_t *pool, const char *name) {
+    wrkpool_stats_t stats;
+    wrkpool_get_stats(pool, &stats);
+    fprintf(stderr, "[INFO] %s pool: threads %d (idle %d, peak %d, grown %lu, retired %lu), "
+                    "queued %zu, handled %lu, queue wait avg %lu us max %lu us\n",
+            name, stats.nthds, stats.nidle, stats.peak_thds, stats.ngrown, stats.nretired,
+            stats.qlen, stats.nitems, (unsigned long) stats.wait_avg_us, (unsigned long) stats.wait_max_us);
+
+    wrkpool_lane_stats_t lstats;
+    for (int lane = 0; pool->nlanes > 1 && wrkpool_get_lane_stats(pool, lane, &lstats) == 0; lane++) {
+        fprintf(stderr, "[INFO] %s pool lane %d: queued %zu from %zu flows, handled %lu, queue wait avg %lu us max %lu us\n",
+                name, lane, lstats.qlen, lstats.nflows, lstats.nitems, (unsigned long) lstats.wait_avg_us, (unsigned long) lstats.wait_max_us);
+    }
+}
+
+void wrkpool_destroy(wrkpool_t *pool) {
+
+    pthread_mutex_lock(&pool->lock);
+    int was_running = pool->running;
+    pool->running = 0;
+    pthread_cond_broadcast(&pool->work_rdy);
+    pthread_cond_signal(&pool->mon_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (was_running) {
+        pthread_join(pool->mon_thd, NULL);
+    }
+
+    /* busy workers may still be handling an item, the last one to exit
+     * frees the pool */
+    pthread_mutex_lock(&pool->lock);
+    for (int lane = 0; lane < pool->nlanes; lane++) {
+        steque_t *flows = &pool->lanes[lane].flows;
+        while (!steque_isempty(flows)) {
+            wrkpool_flow_t *f = (wrkpool_flow_t *) steque_front(flows);
+            while (!steque_isempty(&f->que)) {
+                free(steque_pop(&f->que));
+            }
+            wrkpool_drop_flow(pool, f);
+        }
+        pool->lanes[lane].nqueued = 0;
+    }
+    pool->nqueued = 0;
+    pool->destroyed = 1;
+    int nthds = pool->nthds;
+    pthread_mutex_unlock(&pool->lock);
+    if (nthds == 0) {
+        wrkpool_free(pool);
+    }
+}
+
+
+/*********************/
+/* private functions */
+
+uint64_t wrkpool_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void wrkpool_abstime(struct timespec *ts, uint64_t at_us) {
+    ts->tv_sec = (time_t)(at_us / 1000000);
+    ts->tv_nsec = (long)(at_us % 1000000) * 1000;
+}
+
+void wrkpool_free(wrkpool_t *pool) {
+    for (int lane = 0; lane < WRKPOOL_MAX_LANES; lane++) {
+        steque_destroy(&pool->lanes[lane].flows);
+    }
+    pthread_cond_destroy(&pool->work_rdy);
+    pthread_cond_destroy(&pool->mon_cv);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->slots);
+    free(pool);
+}
+
+/* returns the flow of key on lane, creating and activating it if it has
+ * no queued items; must be called with the pool locked */
+wrkpool_flow_t *wrkpool_get_flow(wrkpool_t *pool, int lane, uint32_t key) {
+    unsigned int bkt = (key * 2654435761u + (unsigned int)lane) % FLOW_BUCKETS;
+    wrkpool_flow_t *f;
+    for (f = pool->flow_tbl[bkt]; f != NULL; f = f->next) {
+        if (f->key == key && f->lane == lane) {
+            return f;
+        }
+    }
+    f = malloc(sizeof(wrkpool_flow_t));
+    bzero(f, sizeof(*f));
+    f->key = key;
+    f->lane = lane;
+    steque_init(&f->que);
+    f->next = pool->flow_tbl[bkt];
+    pool->flow_tbl[bkt] = f;
+    steque_enqueue(&pool->lanes[lane].flows, f);
+    return f;
+}
+
+/* removes an empty flow, which must be at the front of its lane's round,
+ * must be called with the pool locked */
+void wrkpool_drop_flow(wrkpool_t *pool, wrkpool_flow_t *flow) {
+    unsigned int bkt = (flow->key * 2654435761u + (unsigned int)flow->lane) % FLOW_BUCKETS;
+    wrkpool_flow_t **pf = &pool->flow_tbl[bkt];
+    while (*pf != flow) {
+        pf = &(*pf)->next;
+    }
+    *pf = flow->next;
+    steque_pop(&pool->lanes[flow->lane].flows);
+    steque_destroy(&flow->que);
+    free(flow);
+}
+
+/* takes the next item by weighted round-robin over the lanes, each lane
+ * gives up to its weight in items before the next one is served.  Within
+ * a lane flows are served by deficit round-robin, a flow at the front of
+ * the round dequeues while its deficit covers the cost of its next item,
+ * otherwise it is credited a quantum and moves to the back.  Must be
+ * called with the pool locked and at least one item queued */
+wrkpool_item_t *wrkpool_pop(wrkpool_t *pool, int *lane) {
+
+    wrkpool_lane_t *l;
+    while (1) {
+        l = &pool->lanes[pool->cur_lane];
+        if (l->nqueued > 0 && l->credit > 0) {
+            l->credit--;
+            break;
+        }
+        l->credit = l->weight;
+        pool->cur_lane = (pool->cur_lane + 1) % pool->nlanes;
+    }
+    *lane = pool->cur_lane;
+
+    while (1) {
+        wrkpool_flow_t *f = (wrkpool_flow_t *) steque_front(&l->flows);
+        wrkpool_item_t *qi = (wrkpool_item_t *) steque_front(&f->que);
+        if (f->deficit >= (long) qi->cost) {
+            steque_pop(&f->que);
+            f->deficit -= qi->cost;
+            l->nqueued--;
+            pool->nqueued--;
+            if (steque_isempty(&f->que)) {
+                wrkpool_drop_flow(pool, f);
+            }
+            return qi;
+        }
+        f->deficit += pool->quantum;
+        steque_cycle(&l->flows);
+    }
+}
+
+/* oldest item at the head of any flow, must be called with the pool locked */
+wrkpool_item_t *wrkpool_oldest(wrkpool_t *pool) {
+    wrkpool_item_t *oldest = NULL;
+    for (int lane = 0; lane < pool->nlanes; lane++) {
+        steque_t *flows = &pool->lanes[lane].flows;
+        int nflows = steque_size(flows);
+        for (int i = 0; i < nflows; i++) {
+            wrkpool_flow_t *f = (wrkpool_flow_t *) steque_front(flows);
+            wrkpool_item_t *head = (wrkpool_item_t *) steque_front(&f->que);
+            if (oldest == NULL || head->enq_us < oldest->enq_us) {
+                oldest = head;
+            }
+            steque_cycle(flows);
+        }
+    }
+    return oldest;
+}
+
+/* must be called with the pool locked */
+int wrkpool_spawn(wrkpool_t *pool) {
+
+    int ithd = 0;
+    while (ithd < pool->max_thds && pool->slots[ithd]) {
+        ithd++;
+    }
+    if (ithd == pool->max_thds) {
+        return -1;
+    }
+
+    wrkpool_thd_arg_t *targ = malloc(sizeof(wrkpool_thd_arg_t));
+    targ->pool = pool;
+    targ->ithd = ithd;
+
+    pthread_t thd;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&thd, &attr, wrkpool_worker, targ);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        gflog_error("when attempting to create worker thread %i - %d", ithd, rc);
+        free(targ);
+        return -1;
+    }
+
+    /* a starting thread counts as idle so the monitor does not spawn
+     * another one for the same queued item */
+    pool->slots[ithd] = 1;
+    pool->nthds++;
+    pool->nidle++;
+    if (pool->nthds > pool->stats.peak_thds) {
+        pool->stats.peak_thds = pool->nthds;
+    }
+    gflog_debug("worker pool started thread %i, %i threads", ithd, pool->nthds);
+    return 0;
+}
+
+void *wrkpool_worker(void *arg) {
+
+    wrkpool_thd_arg_t *targ = (wrkpool_thd_arg_t *) arg;
+    wrkpool_t *pool = targ->pool;
+    int ithd = targ->ithd;
+    free(targ);
+
+    if (pool->thd_init != NULL) {
+        pool->thd_init(ithd, pool->arg);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running) {
+
+        /* threads above the minimum wait for work only up to the idle
+         * timeout, the others sleep until work arrives */
+        int retire = 0;
+        while ((pool->nqueued == 0) && pool->running) {
+            if (pool->nthds > pool->min_thds) {
+                struct timespec until;
+                wrkpool_abstime(&until, wrkpool_now_us() + (uint64_t) pool->idle_to_ms * 1000);
+                int ret = pthread_cond_timedwait(&pool->work_rdy, &pool->lock, &until);
+                if (ret == ETIMEDOUT && (pool->nqueued == 0) && pool->nthds > pool->min_thds) {
+                    retire = 1;
+                    break;
+                }
+            } else {
+                pthread_cond_wait(&pool->work_rdy, &pool->lock);
+            }
+        }
+        if (retire) {
+            pool->stats.nretired++;
+            gflog_debug("worker pool retiring idle thread %i", ithd);
+            break;
+        }
+        if (!pool->running) {
+            break;
+        }
+
+        int lane;
+        wrkpool_item_t *qi = wrkpool_pop(pool, &lane);
+        uint64_t wait_us = wrkpool_now_us() - qi->enq_us;
+        pool->nidle--;
+        pool->stats.nitems++;
+        pool->wait_tot_us += wait_us;
+        if (wait_us > pool->stats.wait_max_us) {
+            pool->stats.wait_max_us = wait_us;
+        }
+        wrkpool_lane_t *l = &pool->lanes[lane];
+        l->stats.nitems++;
+        l->wait_tot_us += wait_us;
+        if (wait_us > l->stats.wait_max_us) {
+            l->stats.wait_max_us = wait_us;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        tls_wait_us = wait_us;
+        pool->func(qi->item, pool->arg);
+        free(qi);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->nidle++;
+    }
+
+    pool->slots[ithd] = 0;
+    pool->nthds--;
+    pool->nidle--;
+    int last = (pool->destroyed && pool->nthds == 0);
+    pthread_cond_signal(&pool->mon_cv);
+    pthread_mutex_unlock(&pool->lock);
+
+    /* the pool was destroyed while this thread was busy */
+    if (last) {
+        wrkpool_free(pool);
+    }
+    return NULL;
+}
+
+void *wrkpool_monitor(void *arg) {
+
+    wrkpool_t *pool = (wrkpool_t *) arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running) {
+
+        /* nothing to do while a worker can take the next item */
+        if ((pool->nqueued == 0) || pool->nidle > 0 || pool->nthds >= pool->max_thds) {
+            pthread_cond_wait(&pool->mon_cv, &pool->lock);
+            continue;
+        }
+
+        /* grow once the oldest item has waited past the target */
+        wrkpool_item_t *head = wrkpool_oldest(pool);
+        uint64_t grow_at = head->enq_us + (uint64_t) pool->wait_target_ms * 1000;
+        if (wrkpool_now_us() >= grow_at) {
+            if (wrkpool_spawn(pool) == 0) {
+                pool->stats.ngrown++;
+                continue;
+            }
+
+            /* retry a failed thread creation one target later */
+            grow_at = wrkpool_now_us() + (uint64_t) pool->wait_target_ms * 1000 + 1000;
+        }
+        struct timespec until;
+        wrkpool_abstime(&until, grow_at);
+        pthread_cond_timedwait(&pool->mon_cv, &pool->lock, &until);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
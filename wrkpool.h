@@ -0,0 +1,138 @@
+#ifndef __WRKPOOL_H__
+#define __WRKPOOL_H__
+
+/*
+ * wrkpool is an elastic pool of worker threads draining FIFO queues of
+ * work items.  The pool starts with min_thds threads.  When the oldest
+ * queued item has waited longer than the wait target and no worker is
+ * idle, another thread is added, up to max_thds.  Threads above min_thds
+ * that stay idle for the idle timeout retire.  Idle workers block on a
+ * condition variable and are only woken by new work or their timeout.
+ *
+ * Items can be queued on up to WRKPOOL_MAX_LANES lanes, e.g. by expected
+ * transfer size.  Workers serve the lanes by weighted round-robin, taking
+ * up to a lane's weight in items before moving to the next lane, so a
+ * burst on one lane cannot hold back the others.  Within a lane items
+ * belong to flows, e.g. one per client, that are served by deficit
+ * round-robin so a single busy flow cannot monopolize the workers.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRKPOOL_WAIT_TARGET_MS 10
+#define WRKPOOL_IDLE_TO_MS 30000
+#define WRKPOOL_MAX_LANES 8
+
+/* handles one work item, called from a worker thread */
+typedef void (*wrkpool_func_t)(void *item, void *arg);
+
+/* called by each new worker thread before it handles its first item,
+ * ithd is the lowest slot in [0, max_thds) not used by another thread */
+typedef void (*wrkpool_thd_init_t)(int ithd, void *arg);
+
+typedef struct _wrkpool_t wrkpool_t;
+
+typedef struct _wrkpool_lane_stats_t {
+    size_t qlen;                  //items waiting in the lane
+    size_t nflows;                //flows with items waiting in the lane
+    unsigned long nitems;         //items dequeued from the lane so far
+    uint64_t wait_avg_us;         //mean time items spent queued in the lane
+    uint64_t wait_max_us;         //longest time an item spent queued in the lane
+} wrkpool_lane_stats_t;
+
+typedef struct _wrkpool_stats_t {
+    int nthds;                    //current number of worker threads
+    int nidle;                    //workers waiting for work
+    int peak_thds;                //largest number of workers so far
+    size_t qlen;                  //items waiting in the queue
+    unsigned long nitems;         //items dequeued so far
+    unsigned long ngrown;         //threads added beyond the minimum
+    unsigned long nretired;       //threads retired after idling
+    uint64_t wait_avg_us;         //mean time items spent queued
+    uint64_t wait_max_us;         //longest time an item spent queued
+} wrkpool_stats_t;
+
+/*
+ * Creates a pool that handles items with func.  No threads are started
+ * until wrkpool_start is called.  Returns NULL on failure.
+ */
+wrkpool_t *wrkpool_create(int min_thds, int max_thds, wrkpool_func_t func, void *arg);
+
+/*
+ * Sets the queue wait above which the pool grows and the idle time after
+ * which threads above the minimum retire.  Must be called before
+ * wrkpool_start.
+ */
+void wrkpool_set_targets(wrkpool_t *pool, unsigned int wait_target_ms, unsigned int idle_to_ms);
+
+/*
+ * Sets the number of lanes and their weights, weights of 0 count as 1.
+ * Must be called before wrkpool_start.  Returns -1 if nlanes is out of
+ * range.
+ */
+int wrkpool_set_lanes(wrkpool_t *pool, int nlanes, const unsigned int *weights);
+
+/*
+ * Sets the cost credited to a flow each time its turn comes around in
+ * deficit round-robin (Default: 1).  Must be called before wrkpool_start.
+ */
+void wrkpool_set_quantum(wrkpool_t *pool, unsigned int quantum);
+
+/*
+ * Sets a function run by each new worker thread, e.g. to pin it to a cpu.
+ * Must be called before wrkpool_start.
+ */
+void wrkpool_set_thd_init(wrkpool_t *pool, wrkpool_thd_init_t init);
+
+/*
+ * Starts the minimum number of workers.  Returns 0 on success.
+ */
+int wrkpool_start(wrkpool_t *pool);
+
+/*
+ * Queues an item for the workers on lane 0.
+ */
+void wrkpool_submit(wrkpool_t *pool, void *item);
+
+/*
+ * Queues an item on the lane, lanes out of range map to the last lane.
+ */
+void wrkpool_submit_lane(wrkpool_t *pool, void *item, int lane);
+
+/*
+ * Queues an item of the flow on the lane.  The cost is charged against
+ * the flow's deficit when the item is dequeued, a cost of 1 for every item
+ * serves the flows of a lane round-robin.
+ */
+void wrkpool_submit_flow(wrkpool_t *pool, void *item, int lane, uint32_t flow, unsigned int cost);
+
+/*
+ * Returns the time in microseconds the item the calling worker is
+ * handling spent queued, 0 outside of workers.
+ */
+uint64_t wrkpool_item_wait_us();
+
+/*
+ * Provides a snapshot of the pool size and queue wait statistics.
+ */
+void wrkpool_get_stats(wrkpool_t *pool, wrkpool_stats_t *stats);
+
+/*
+ * Provides a snapshot of the queue wait statistics of one lane.  Returns
+ * -1 if the lane does not exist.
+ */
+int wrkpool_get_lane_stats(wrkpool_t *pool, int lane, wrkpool_lane_stats_t *stats);
+
+/*
+ * Prints the statistics to stderr, prefixed with name.
+ */
+void wrkpool_print_stats(wrkpool_t *pool, const char *name);
+
+/*
+ * Stops the workers once they finish their current item and frees the
+ * pool.  Items still queued are dropped without being handled.
+ */
+void wrkpool_destroy(wrkpool_t *pool);
+
+#endif